@@ -0,0 +1,348 @@
+"""End-to-end throughput benchmark.
+
+Runs the simulated-camera daemon (make sim) through its real readout,
+storage, D-Bus and HTTP paths and measures what it sustains. Every point of
+the sweep starts a fresh daemon with its own data directory, starts an
+acquisition at the given frame rate and, while it runs, has the given
+number of clients fetch the newest spectrum alternately with get_data and
+from the HTTP /data route. Results are written as JSON and compared with a
+stored baseline; any regression beyond the tolerances makes the run fail,
+and so does a run without a baseline to compare with, or a point whose
+clients saw errors or never got a spectrum over D-Bus or HTTP.
+
+Needs a session bus to itself, so it is run under dbus-run-session:
+
+    make bench                       # sweep, compare with bench/baseline.json
+    make bench-baseline              # sweep, store the result as the baseline
+    make bench BENCH_ARGS="--rates 100,1000 --clients 0,8 --duration 20"
+"""
+import argparse
+import http.client
+import itertools
+import json
+import os
+import pathlib
+import platform
+import shutil
+import signal
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+from gi.repository import Gio, GLib
+
+BENCH_DIR = pathlib.Path(__file__).resolve().parent
+REPO_DIR = BENCH_DIR.parent
+BUS_NAME = 'hodr.server.Control'
+OBJECT_PATH = '/hodr/server/Control'
+ACQ_MODE_RUN_TILL_ABORT = 5
+HTTP_PORT = 18080
+
+# Result key: (direction, relative tolerance, absolute slack). A result is a
+# regression if it is worse than the baseline by more than both.
+CHECKS = {
+    'frames_per_second': ('higher', 0.05, 0.0),
+    'drop_rate': ('lower', 0.0, 0.001),
+    'notify_latency_ms.p99': ('lower', 0.25, 1.0),
+    'get_data_latency_ms.p99': ('lower', 0.25, 1.0),
+    'http_data_latency_ms.p99': ('lower', 0.25, 2.0),
+    'cpu_percent': ('lower', 0.25, 2.0),
+    'rss_mb': ('lower', 0.20, 2.0),
+}
+
+
+def percentiles(values):
+    if not values:
+        return None
+    values = sorted(values)
+
+    def at(q):
+        return values[min(len(values) - 1, int(q * len(values)))]
+    return {'p50': at(0.5), 'p90': at(0.9), 'p99': at(0.99), 'max': values[-1], 'count': len(values)}
+
+
+def process_times(pid):
+    """User plus system CPU seconds used by a process so far."""
+    fields = pathlib.Path(f'/proc/{pid}/stat').read_text().rsplit(')', 1)[1].split()
+    return (int(fields[11]) + int(fields[12])) / os.sysconf('SC_CLK_TCK')
+
+
+def peak_rss_mb(pid):
+    for line in pathlib.Path(f'/proc/{pid}/status').read_text().splitlines():
+        if line.startswith('VmHWM:'):
+            return int(line.split()[1]) / 1024
+    return None
+
+
+class Daemon:
+    """One hodr_sim process with its own data directory."""
+
+    def __init__(self, binary, width, kernels, work_dir, log):
+        env = dict(os.environ, HODR_SIM_WIDTH=str(width), HODR_SIM_READOUT_MS='0.05', HODR_KERNELS=kernels,
+                   HODR_SIM_BUFFER='1024', HODR_DATA_DIR=str(work_dir / 'data'), HODR_LOG_LEVEL='WARN')
+        (work_dir / 'data').mkdir(parents=True)
+        self.process = subprocess.Popen([str(binary)], cwd=work_dir, env=env, stdout=log, stderr=log)
+
+    def stop(self):
+        if self.process.poll() is None:
+            self.process.send_signal(signal.SIGTERM)
+            try:
+                self.process.wait(timeout=20)
+            except subprocess.TimeoutExpired:
+                self.process.kill()
+                self.process.wait()
+
+
+def wait_for_name(bus, timeout=20):
+    deadline = time.monotonic() + timeout
+    while time.monotonic() < deadline:
+        owner = bus.call_sync('org.freedesktop.DBus', '/org/freedesktop/DBus', 'org.freedesktop.DBus',
+                              'NameHasOwner', GLib.Variant('(s)', (BUS_NAME,)), GLib.VariantType('(b)'),
+                              Gio.DBusCallFlags.NONE, -1, None).unpack()[0]
+        if owner:
+            return
+        time.sleep(0.05)
+    raise RuntimeError(f'{BUS_NAME} did not appear on the bus')
+
+
+def wait_for_http(port, timeout=20):
+    deadline = time.monotonic() + timeout
+    while time.monotonic() < deadline:
+        try:
+            connection = http.client.HTTPConnection('127.0.0.1', port, timeout=1)
+            connection.request('GET', '/number_spectra')
+            connection.getresponse().read()
+            return
+        except OSError:
+            time.sleep(0.1)
+    raise RuntimeError('HTTP server did not start')
+
+
+def get_property(proxy, name):
+    """Current value of a daemon property, fetched rather than cached."""
+    return proxy.call_sync('org.freedesktop.DBus.Properties.Get', GLib.Variant('(ss)', (BUS_NAME, name)),
+                           Gio.DBusCallFlags.NONE, -1, None).unpack()[0]
+
+
+def client(proxy, port, stop, get_data_ms, http_ms, errors):
+    """Fetch the newest spectrum over D-Bus and over HTTP in turn."""
+    connection = http.client.HTTPConnection('127.0.0.1', port, timeout=10)
+    while not stop.is_set():
+        start = time.perf_counter()
+        try:
+            proxy.call_sync('get_data', GLib.Variant('(i)', (-1,)), Gio.DBusCallFlags.NONE, 10000, None)
+            get_data_ms.append((time.perf_counter() - start) * 1e3)
+        except GLib.Error:
+            errors.append('get_data')
+        start = time.perf_counter()
+        try:
+            connection.request('GET', '/data?limit=1&format=int32')
+            response = connection.getresponse()
+            response.read()
+            if response.status == 200:
+                http_ms.append((time.perf_counter() - start) * 1e3)
+            else:
+                errors.append(f'http {response.status}')
+        except (OSError, http.client.HTTPException):
+            errors.append('http')
+            connection.close()
+            connection = http.client.HTTPConnection('127.0.0.1', port, timeout=10)
+
+
+def run_point(args, rate, width, duration, clients, kernels, work_dir):
+    """Benchmark one point of the sweep, returns its results."""
+    log = open(work_dir / 'daemon.log', 'w')
+    daemon = Daemon(args.daemon, width, '' if kernels == 'auto' else kernels, work_dir, log)
+    server = None
+    loop = GLib.MainLoop()
+    bus = Gio.bus_get_sync(Gio.BusType.SESSION, None)
+    subscription = None
+    try:
+        wait_for_name(bus)
+        proxy = Gio.DBusProxy.new_sync(bus, Gio.DBusProxyFlags.NONE, None, BUS_NAME, OBJECT_PATH, BUS_NAME, None)
+        server = subprocess.Popen([sys.executable, 'server.py'], cwd=REPO_DIR / 'server',
+                                  env=dict(os.environ, HODR_HTTP_PORT=str(args.port)), stdout=log, stderr=log)
+        wait_for_http(args.port)
+
+        notify_ms = []
+
+        def on_signal(connection, sender, path, interface, name, parameters):
+            timestamp_ns = parameters.unpack()[2]
+            notify_ms.append((time.time_ns() - timestamp_ns) / 1e6)  # Capture to NewSpectrum
+        subscription = bus.signal_subscribe(None, BUS_NAME, 'NewSpectrum', OBJECT_PATH, None, Gio.DBusSignalFlags.NONE, on_signal)
+        threading.Thread(target=loop.run, daemon=True).start()
+
+        stop = threading.Event()
+        get_data_ms, http_ms, errors = [], [], []
+        threads = [threading.Thread(target=client, args=(proxy, args.port, stop, get_data_ms, http_ms, errors))
+                   for _ in range(clients)]
+
+        pid = daemon.process.pid
+        spectra_before = get_property(proxy, 'numberSpectra')
+        cpu_before = process_times(pid)
+        interval = 1.0 / rate
+        proxy.call_sync('start_acquisition', GLib.Variant('(dduu)', (interval / 2, interval, ACQ_MODE_RUN_TILL_ABORT, 0)),
+                        Gio.DBusCallFlags.NONE, -1, None)
+        start = time.monotonic()
+        for thread in threads:
+            thread.start()
+        time.sleep(duration)
+        proxy.call_sync('stop_acquisition', None, Gio.DBusCallFlags.NONE, -1, None)
+        elapsed = time.monotonic() - start
+        stop.set()
+        for thread in threads:
+            thread.join()
+        cpu = process_times(pid) - cpu_before
+        time.sleep(0.5)  # Let the writer commit the tail of the run
+
+        histograms, counters = proxy.call_sync('get_metrics', None, Gio.DBusCallFlags.NONE, -1, None).unpack()
+        spectra = get_property(proxy, 'numberSpectra') - spectra_before
+        dropped = counters.get('dropped_frames', 0)
+        taken = spectra + dropped
+        return {
+            'rate': rate, 'width': width, 'duration': duration, 'clients': clients, 'kernels': kernels,
+            'elapsed_s': elapsed,
+            'spectra': spectra,
+            'frames_per_second': spectra / elapsed,
+            'drop_rate': dropped / taken if taken else 0.0,
+            'ring_failed_claims': counters.get('ring_failed_claims', 0),
+            'ring_high_water': counters.get('ring_high_water', 0),
+            'notify_latency_ms': percentiles(notify_ms),
+            'get_data_latency_ms': percentiles(get_data_ms),
+            'http_data_latency_ms': percentiles(http_ms),
+            'client_errors': len(errors),
+            'cpu_percent': 100 * cpu / elapsed,
+            'rss_mb': peak_rss_mb(pid),
+            'stages_us': {name: {'count': count, 'mean': sum_ns / count / 1e3 if count else 0,
+                                 'p50': p50 / 1e3, 'p99': p99 / 1e3, 'max': max_ns / 1e3}
+                          for name, count, sum_ns, max_ns, p50, p90, p99, p999 in histograms},
+        }
+    finally:
+        if subscription is not None:
+            bus.signal_unsubscribe(subscription)
+        loop.quit()
+        if server is not None:
+            server.terminate()
+            server.wait()
+        daemon.stop()
+        log.close()
+
+
+def point_name(result):
+    name = f"rate={result['rate']:g},width={result['width']},duration={result['duration']:g},clients={result['clients']}"
+    return name if result.get('kernels', 'auto') == 'auto' else f"{name},kernels={result['kernels']}"
+
+
+def lookup(result, key):
+    for part in key.split('.'):
+        if result is None:
+            return None
+        result = result.get(part)
+    return result
+
+
+def compare(results, baseline, scale):
+    """Regressions of results against baseline, as printable lines."""
+    regressions = []
+    base_points = {point_name(point): point for point in baseline['points']}
+    for result in results['points']:
+        base = base_points.get(point_name(result))
+        if base is None:
+            print(f"{point_name(result)}: not in the baseline")
+            continue
+        for key, (better, relative, absolute) in CHECKS.items():
+            value, expected = lookup(result, key), lookup(base, key)
+            if value is None or expected is None:
+                continue
+            slack = max(abs(expected) * relative, absolute) * scale
+            worse = expected - value if better == 'higher' else value - expected
+            if worse > slack:
+                regressions.append(f"{point_name(result)}: {key} {value:.4g}, baseline {expected:.4g}")
+    return regressions
+
+
+def client_failures(results):
+    """Points whose clients did not measure what they were meant to, as
+    printable lines."""
+    failures = []
+    for result in results['points']:
+        if result['clients'] == 0:
+            continue
+        if result['client_errors']:
+            failures.append(f"{point_name(result)}: {result['client_errors']} client errors")
+        for key in ('get_data_latency_ms', 'http_data_latency_ms'):
+            if result[key] is None:
+                failures.append(f"{point_name(result)}: no {key.rsplit('_', 2)[0]} samples")
+    return failures
+
+
+def parse_list(kind):
+    return lambda text: [kind(value) for value in text.split(',')]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('--daemon', type=pathlib.Path, default=REPO_DIR / 'hodr_sim', help='hodr_sim binary')
+    parser.add_argument('--rates', type=parse_list(float), default=[50, 500], help='frame rates, frames/s')
+    parser.add_argument('--widths', type=parse_list(int), default=[1024, 2048], help='detector widths, pixels')
+    parser.add_argument('--durations', type=parse_list(float), default=[10], help='run lengths, seconds')
+    parser.add_argument('--clients', type=parse_list(int), default=[0, 4], help='concurrent client counts')
+    parser.add_argument('--kernels', type=parse_list(str), default=['auto'],
+                        help='frame kernel versions (auto, scalar, sse2, avx2, avx512), compared through the auto_exposure stage')
+    parser.add_argument('--port', type=int, default=HTTP_PORT, help='port for the HTTP server under test')
+    parser.add_argument('--output', type=pathlib.Path, default=BENCH_DIR / 'results.json')
+    parser.add_argument('--baseline', type=pathlib.Path, default=BENCH_DIR / 'baseline.json')
+    parser.add_argument('--update-baseline', action='store_true', help='store the results as the new baseline')
+    parser.add_argument('--tolerance', type=float, default=1.0, help='scale every regression tolerance')
+    parser.add_argument('--keep', action='store_true', help='keep the data directories and logs')
+    args = parser.parse_args()
+
+    if not args.daemon.exists():
+        sys.exit(f"{args.daemon} not found, build it with make sim")
+    if 'DBUS_SESSION_BUS_ADDRESS' not in os.environ:
+        sys.exit("No session bus, run under dbus-run-session")
+    if not args.update_baseline and not args.baseline.exists():
+        # Checked before the sweep, a run that cannot be compared is a failure
+        sys.exit(f"No baseline at {args.baseline}, run make bench-baseline on the reference machine to store one")
+
+    work_root = pathlib.Path(tempfile.mkdtemp(prefix='hodr-bench-'))
+    results = {'host': platform.node(), 'machine': platform.machine(), 'cpus': os.cpu_count(),
+               'time': time.strftime('%Y-%m-%dT%H:%M:%S'), 'points': []}
+    try:
+        sweep = itertools.product(args.rates, args.widths, args.durations, args.clients, args.kernels)
+        for n, (rate, width, duration, clients, kernels) in enumerate(sweep):
+            result = run_point(args, rate, width, duration, clients, kernels, work_root / f'point{n}')
+            results['points'].append(result)
+            notify = result['notify_latency_ms'] or {}
+            print(f"{point_name(result)}: {result['frames_per_second']:.1f} frames/s, drop rate {result['drop_rate']:.4f}, "
+                  f"notify p99 {notify.get('p99', float('nan')):.2f} ms, cpu {result['cpu_percent']:.1f}%, rss {result['rss_mb']:.1f} MB",
+                  flush=True)
+    finally:
+        if args.keep:
+            print(f"Work files kept in {work_root}")
+        else:
+            shutil.rmtree(work_root, ignore_errors=True)
+
+    args.output.write_text(json.dumps(results, indent=2) + '\n')
+    print(f"Results written to {args.output}")
+    failures = client_failures(results)
+    for line in failures:
+        print(f"FAILED {line}")
+    if failures:
+        sys.exit(1)  # Also keeps such a run from becoming the baseline
+    if args.update_baseline:
+        args.baseline.write_text(json.dumps(results, indent=2) + '\n')
+        print(f"Baseline updated: {args.baseline}")
+        return
+    regressions = compare(results, json.loads(args.baseline.read_text()), args.tolerance)
+    for line in regressions:
+        print(f"REGRESSION {line}")
+    if regressions:
+        sys.exit(1)
+    print("No regressions against the baseline")
+
+
+if __name__ == '__main__':
+    main()
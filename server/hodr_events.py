@@ -0,0 +1,129 @@
+"""Fan-out of daemon notifications to any number of web clients.
+
+One subscription to the NewSpectrum and StateChanged signals of the daemon
+(see src/dbus_intro.xml) feeds every connected browser. Each event is built
+and serialised once and handed to the clients' queues, so the load on the
+daemon does not depend on the number of viewers.
+"""
+import json
+import queue
+import threading
+
+from gi.repository import Gio, GLib
+
+import hodr_shm
+import hodr_store
+
+CLIENT_QUEUE_LENGTH = 16  # Events buffered for a slow client before the oldest are dropped
+
+
+class EventHub:
+    def __init__(self):
+        self._lock = threading.Lock()
+        self._clients = set()
+        self._last = {}  # Most recent event of each name, replayed to new clients
+
+    def subscribe(self):
+        """A queue of (name, data) events for a new client, primed with the latest of each."""
+        q = queue.Queue(CLIENT_QUEUE_LENGTH)
+        with self._lock:
+            for event in self._last.values():
+                q.put_nowait(event)
+            self._clients.add(q)
+        return q
+
+    def unsubscribe(self, q):
+        with self._lock:
+            self._clients.discard(q)
+
+    def publish(self, name, payload):
+        event = (name, json.dumps(payload))
+        with self._lock:
+            self._last[name] = event
+            clients = list(self._clients)
+        for q in clients:
+            while True:
+                try:
+                    q.put_nowait(event)
+                    break
+                except queue.Full:
+                    try:
+                        q.get_nowait()  # A client that cannot keep up only misses old events
+                    except queue.Empty:
+                        pass
+
+
+class DaemonEvents:
+    """Subscribes to the daemon and publishes 'spectrum' and 'status' events
+    to a hub. Signals are dispatched by a GLib main loop on its own thread,
+    which also keeps the cached properties of proxy up to date."""
+
+    def __init__(self, connection, proxy, hub):
+        self.connection = connection
+        self.proxy = proxy
+        self.hub = hub
+        self.shared_ring = None
+        self._loop = GLib.MainLoop()
+
+    def start(self):
+        for signal, callback in (('NewSpectrum', self._on_new_spectrum), ('StateChanged', self._on_state_changed)):
+            self.connection.signal_subscribe('hodr.server.Control', 'hodr.server.Control', signal,
+                                             '/hodr/server/Control', None, Gio.DBusSignalFlags.NONE,
+                                             callback)
+        self.proxy.connect('g-properties-changed', lambda *args: self.publish_status())
+        self.publish_status()
+        threading.Thread(target=self._loop.run, name='dbus-events', daemon=True).start()
+
+    def status(self):
+        def cached(name):
+            value = self.proxy.get_cached_property(name)
+            return value.unpack() if value is not None else None
+        return {
+            'power_status': "ON" if cached('active') else "OFF",
+            'temperature': cached('Temperature'),
+            'target_temperature': cached('TargetTemperature'),
+            'temperature_status': cached('TemperatureStatus'),
+            'number_spectra': cached('numberSpectra'),
+            'acquisition_status': cached('acquisitionStatus'),
+        }
+
+    def publish_status(self):
+        self.hub.publish('status', self.status())
+
+    def _on_state_changed(self, connection, sender, path, interface, signal, parameters):
+        self.publish_status()
+
+    def _read_shared(self, frame, spectrum_id):
+        """Pixels of a spectrum from the shared-memory ring, or None if it is gone or unavailable."""
+        try:
+            if self.shared_ring is None:
+                self.shared_ring = hodr_shm.SharedRing.from_proxy(self.proxy)
+            spectrum = self.shared_ring.read(frame)
+        except (GLib.Error, OSError, ValueError) as e:
+            print(f"Shared spectrum ring unavailable: {e}")
+            self.shared_ring = None
+            return None
+        if spectrum is None or spectrum.spectrum_id != spectrum_id:
+            return None
+        return spectrum.data.tolist()
+
+    def _on_new_spectrum(self, connection, sender, path, interface, signal, parameters):
+        first_id, last_id, timestamp_ns, exposure_time, temperature, shared_frame = parameters.unpack()
+        data = self._read_shared(shared_frame, last_id)
+        timestamp = hodr_store.format_timestamp(timestamp_ns)
+        if data is None:
+            try:
+                result = self.proxy.call_sync('get_data', GLib.Variant('(i)', (last_id,)), Gio.DBusCallFlags.NONE, -1, None)
+                timestamp, exposure_time, temperature, data = result.unpack()[0]
+            except GLib.Error as e:
+                print(f"Could not read spectrum {last_id}: {e}")
+                return
+        self.hub.publish('spectrum', {
+            'spectrum_id': last_id,
+            'first_id': first_id,
+            'number_spectra': last_id + 1,
+            'timestamp': timestamp,
+            'integration_time': exposure_time,
+            'temperature': temperature,
+            'data': data,
+        })
@@ -0,0 +1,210 @@
+"""numpy bindings to libhodr-store, the C reader of data files (see src/reader.h).
+
+Build the library with make lib. A data file is mapped once and walked in
+place by the C reader, which checks every record. The pixels of a spectrum are
+a numpy array over the mapping rather than a copy, unless they are packed and
+have to be decoded. The arrays keep the mapping alive after the file is
+closed; writing to them only changes this process's copy.
+
+Spectra are hodr_store.Spectrum objects with numpy arrays where hodr_store
+has array.array ones, so the two read interchangeably. Without the library or
+numpy, available() is False and hodr_store is used instead.
+"""
+import ctypes
+import ctypes.util
+import mmap
+import os
+import hodr_store
+
+try:
+    import numpy as np
+except ImportError:
+    np = None
+
+LIB_NAME = 'libhodr-store.so'
+
+PIXEL_DTYPES = {hodr_store.ENCODING_INT32: '<i4', hodr_store.ENCODING_UINT16: '<u2'}
+OUTPUT_DTYPES = {'i': '<i4', 'H': '<u2'}  # The array typecodes of server.py
+
+
+class FileHeader(ctypes.Structure):
+    _fields_ = [('magic', ctypes.c_char * 8), ('version', ctypes.c_uint32), ('headerSize', ctypes.c_uint32),
+                ('xpixels', ctypes.c_uint32), ('flags', ctypes.c_uint32), ('createdNs', ctypes.c_int64)]
+
+
+class RecordHeader(ctypes.Structure):
+    _fields_ = [('magic', ctypes.c_uint32), ('spectrumID', ctypes.c_uint32), ('timestampNs', ctypes.c_int64),
+                ('exposureTime', ctypes.c_float), ('temperature', ctypes.c_float), ('npixels', ctypes.c_uint32),
+                ('encoding', ctypes.c_uint8), ('flags', ctypes.c_uint8), ('coadded', ctypes.c_uint16),
+                ('payloadBytes', ctypes.c_uint32), ('checksum', ctypes.c_uint32)]
+
+
+class Reader(ctypes.Structure):
+    _fields_ = [('map', ctypes.c_void_p), ('size', ctypes.c_size_t), ('header', FileHeader),
+                ('indexMap', ctypes.c_void_p), ('indexSize', ctypes.c_size_t),
+                ('firstSpectrumID', ctypes.c_uint32), ('indexCount', ctypes.c_uint32), ('owned', ctypes.c_bool)]
+
+
+class Record(ctypes.Structure):
+    _fields_ = [('header', RecordHeader), ('payload', ctypes.c_void_p), ('offset', ctypes.c_uint64)]
+
+
+def _load():
+    """The library from HODR_STORE_LIB, the top of the repository or the
+    system library path, None if it is not built."""
+    candidates = [os.environ.get('HODR_STORE_LIB'),
+                  os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', LIB_NAME),
+                  ctypes.util.find_library('hodr-store')]
+    for path in candidates:
+        if not path:
+            continue
+        try:
+            lib = ctypes.CDLL(path)
+        except OSError:
+            continue
+        lib.reader_attach.argtypes = [ctypes.POINTER(Reader), ctypes.c_void_p, ctypes.c_size_t]
+        lib.reader_next.argtypes = [ctypes.POINTER(Reader), ctypes.POINTER(ctypes.c_uint64), ctypes.POINTER(Record)]
+        lib.reader_decode.argtypes = [ctypes.POINTER(Record), ctypes.c_void_p, ctypes.c_size_t]
+        return lib
+    return None
+
+
+_lib = _load() if np is not None else None
+
+
+def available():
+    return _lib is not None
+
+
+class DataFile:
+    """A data file mapped as it is when opened, read with libhodr-store."""
+
+    def __init__(self, path):
+        with open(path, 'rb') as f:
+            try:
+                # A private mapping, ctypes only hands out pointers to writable buffers
+                self._map = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_COPY)
+            except ValueError:
+                raise ValueError("Not a HODR data file")  # Empty file
+        self._anchor = ctypes.c_char.from_buffer(self._map)
+        self._reader = Reader()
+        if _lib.reader_attach(ctypes.byref(self._reader), ctypes.addressof(self._anchor), len(self._map)) != 0:
+            self.close()
+            raise ValueError("Not a HODR data file")
+
+    def close(self):
+        self._anchor = None
+        try:
+            self._map.close()
+        except BufferError:
+            pass  # Arrays still use it, unmapped with the last of them
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    def records(self, offset=0):
+        """Every record from offset, 0 for the first, in order: Spectrum
+        objects and Gap objects for gap markers."""
+        cursor = ctypes.c_uint64(offset)
+        record = Record()
+        while True:
+            found = _lib.reader_next(ctypes.byref(self._reader), ctypes.byref(cursor), ctypes.byref(record))
+            if found == 0:
+                return  # End of the file or a partially written record
+            if found < 0:
+                raise ValueError(f"Corrupt record at offset {cursor.value}")
+            yield self._record(record)
+
+    def _record(self, record):
+        header = record.header
+        start = record.offset + ctypes.sizeof(RecordHeader)
+        if header.flags & hodr_store.RECORD_GAP:
+            missing, = hodr_store.GAP_PAYLOAD.unpack_from(self._map, start)
+            return hodr_store.Gap(header.spectrumID, header.timestampNs, missing)
+        npixels = header.npixels
+        if header.encoding == hodr_store.ENCODING_PACKED:
+            data = np.empty(npixels, dtype=np.int32)
+            if _lib.reader_decode(ctypes.byref(record), data.ctypes.data, npixels) < 0:
+                raise ValueError(f"Corrupt packed spectrum {header.spectrumID}")
+            nblocks = (npixels + hodr_store.PACK_BLOCK - 1) // hodr_store.PACK_BLOCK
+            end = start + nblocks + 16 * sum(self._map[start:start + nblocks])
+        elif header.encoding in PIXEL_DTYPES:
+            data = np.frombuffer(self._map, dtype=PIXEL_DTYPES[header.encoding], count=npixels, offset=start)
+            end = start + data.nbytes
+        else:
+            raise ValueError(f"Unknown spectrum encoding {header.encoding}")
+
+        # The optional sections in the order of hodr_store.read_record()
+        noise = raw = grid = resampled = None
+        if header.flags & hodr_store.RECORD_COADDED:
+            noise = np.frombuffer(self._map, dtype='<f4', count=npixels, offset=end)
+            end += noise.nbytes
+        if header.flags & hodr_store.RECORD_WITH_RAW:
+            raw = np.frombuffer(self._map, dtype='<i4', count=npixels, offset=end)
+            end += raw.nbytes
+        if header.flags & hodr_store.RECORD_RESAMPLED:
+            grid_start, step, points = hodr_store.GRID_HEADER.unpack_from(self._map, end)
+            grid = (grid_start, step)
+            resampled = np.frombuffer(self._map, dtype='<f4', count=points, offset=end + hodr_store.GRID_HEADER.size)
+        coadded = header.coadded if header.flags & hodr_store.RECORD_COADDED else 0
+        return hodr_store.Spectrum(header.spectrumID, header.timestampNs, header.exposureTime, header.temperature,
+                                   header.flags, data, coadded, noise, raw, grid, resampled)
+
+
+def iter_spectra(path):
+    with DataFile(path) as data_file:
+        for record in data_file.records():
+            if isinstance(record, hodr_store.Spectrum):
+                yield record
+
+
+def iter_range(path, first_id, stop_id):
+    """Spectra first_id up to stop_id (exclusive), see hodr_store.iter_range()."""
+    with hodr_store.Index(hodr_store.index_path(path)) as index:
+        first_id = max(first_id, index.first_id)
+        stop_id = min(stop_id, index.end_id)
+        if first_id >= stop_id:
+            return
+        offset = index.entry(first_id)[0]
+    with DataFile(path) as data_file:
+        for record in data_file.records(offset):
+            if record.spectrum_id >= stop_id:
+                return
+            if isinstance(record, hodr_store.Spectrum):
+                yield record
+
+
+def iter_partitions(partitions, first_id, stop_id, start_ns=None, end_ns=None):
+    """Spectra of the partitions in a range, see hodr_store.iter_partitions()."""
+    for partition in partitions:
+        low, high = first_id, stop_id
+        if start_ns is not None or end_ns is not None:
+            with hodr_store.Index(hodr_store.index_path(partition.path)) as index:
+                if start_ns is not None:
+                    low = max(low, index.find_time(start_ns))
+                if end_ns is not None:
+                    high = min(high, index.find_time(end_ns))
+        yield from iter_range(partition.path, low, high)
+
+
+def decimate(data, factor):
+    """Minimum and maximum of every factor pixels, interleaved, as server.py
+    decimates them."""
+    blocks = len(data) // factor
+    whole = data[:blocks * factor].reshape(blocks, factor)
+    pairs = np.stack([whole.min(axis=1), whole.max(axis=1)], axis=1).ravel()
+    if blocks * factor < len(data):
+        tail = data[blocks * factor:]
+        pairs = np.concatenate([pairs, [tail.min(), tail.max()]])
+    return pairs
+
+
+def pixel_bytes(data, typecode):
+    """Pixels as little-endian bytes of an array typecode, 'i' or 'H',
+    saturated to the range of uint16."""
+    if typecode == 'H':
+        data = np.clip(data, 0, 0xFFFF)
+    return data.astype(OUTPUT_DTYPES[typecode]).tobytes()
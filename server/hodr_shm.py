@@ -0,0 +1,121 @@
+"""Reader for the shared-memory spectrum ring of the HODR daemon (see src/shm.h).
+
+The daemon hands out a read-only memfd through the get_shared_ring D-Bus
+method. It is mapped once; new spectra are then read straight from the
+mapping without any D-Bus traffic.
+"""
+import array
+import mmap
+import os
+import struct
+import sys
+import time
+
+SHM_MAGIC = b'HODRSHM\0'
+
+SHM_HEADER = struct.Struct('<8sIIIIII')  # Up to head
+HEAD_OFFSET = 32
+SHM_SLOT = struct.Struct('<QQIIqffB')
+SEQUENCE = struct.Struct('<Q')
+
+
+class SharedSpectrum:
+    __slots__ = ('frame', 'spectrum_id', 'timestamp_ns', 'exposure_time', 'temperature', 'flags', 'data')
+
+    def __init__(self, frame, spectrum_id, timestamp_ns, exposure_time, temperature, flags, data):
+        self.frame = frame
+        self.spectrum_id = spectrum_id
+        self.timestamp_ns = timestamp_ns
+        self.exposure_time = exposure_time
+        self.temperature = temperature
+        self.flags = flags
+        self.data = data
+
+    @property
+    def timestamp(self):
+        return time.strftime('%Y-%m-%dT%H:%M:%S', time.localtime(self.timestamp_ns // 1_000_000_000))
+
+
+class SharedRing:
+    def __init__(self, fd):
+        """Map the ring from a descriptor handed out by get_shared_ring. Takes ownership of fd."""
+        try:
+            size = os.fstat(fd).st_size
+            self._map = mmap.mmap(fd, size, mmap.MAP_SHARED, mmap.PROT_READ)
+        finally:
+            os.close(fd)
+        magic, version, header_size, slot_count, slot_size, npixels, _ = SHM_HEADER.unpack_from(self._map, 0)
+        if magic != SHM_MAGIC:
+            raise ValueError("Not a HODR shared spectrum ring")
+        self.version = version
+        self.header_size = header_size
+        self.slot_count = slot_count
+        self.slot_size = slot_size
+        self.npixels = npixels
+        self._view = memoryview(self._map)
+        self.next_frame = self.head()  # Only spectra published from now on
+
+    @classmethod
+    def from_proxy(cls, proxy):
+        """Fetch the descriptor from a Gio.DBusProxy of hodr.server.Control."""
+        from gi.repository import Gio
+        result, fd_list = proxy.call_with_unix_fd_list_sync('get_shared_ring', None, Gio.DBusCallFlags.NONE, -1, None, None)
+        return cls(fd_list.get(result.unpack()[0]))
+
+    def close(self):
+        self._view.release()
+        self._map.close()
+
+    def head(self):
+        """One past the newest frame published. Frame n is spectrum first_id + n
+        of the acquisition session, so frame numbers can be matched with the
+        shared_frame of the NewSpectrum signal."""
+        return SEQUENCE.unpack_from(self._map, HEAD_OFFSET)[0]
+
+    def read(self, frame):
+        """Copy out frame, or None if it is not in the ring (not yet published or overwritten)."""
+        offset = self.header_size + (frame % self.slot_count) * self.slot_size
+        expected = 2 * (frame + 1)
+        if SEQUENCE.unpack_from(self._map, offset)[0] != expected:
+            return None
+        _, slot_frame, spectrum_id, npixels, timestamp_ns, exposure_time, temperature, flags = SHM_SLOT.unpack_from(self._map, offset)
+        pixels_offset = offset + 64
+        data = array.array('i')
+        data.frombytes(self._view[pixels_offset:pixels_offset + 4 * min(npixels, self.npixels)])
+        if SEQUENCE.unpack_from(self._map, offset)[0] != expected:
+            return None  # Overwritten while we copied it
+        if sys.byteorder != 'little':
+            data.byteswap()
+        return SharedSpectrum(slot_frame, spectrum_id, timestamp_ns, exposure_time, temperature, flags, data)
+
+    def latest(self):
+        """The most recent spectrum, or None if nothing has been published."""
+        while True:
+            head = self.head()
+            if head == 0:
+                return None
+            spectrum = self.read(head - 1)
+            if spectrum is not None:
+                return spectrum
+
+    def poll(self):
+        """Spectra published since the last poll. Skips any that were overwritten
+        before they were read, check spectrum_id for continuity."""
+        head = self.head()
+        start = max(self.next_frame, head - self.slot_count)
+        spectra = [s for s in (self.read(frame) for frame in range(start, head)) if s is not None]
+        self.next_frame = head
+        return spectra
+
+
+if __name__ == '__main__':
+    from gi.repository import Gio
+    bus = Gio.bus_get_sync(Gio.BusType.SESSION, None)
+    proxy = Gio.DBusProxy.new_sync(bus, Gio.DBusProxyFlags.NONE, None, 'hodr.server.Control',
+                                   '/hodr/server/Control', 'hodr.server.Control', None)
+    ring = SharedRing.from_proxy(proxy)
+    print(f"Mapped {ring.slot_count} slots of {ring.npixels} pixels", file=sys.stderr)
+    while True:
+        for spectrum in ring.poll():
+            print(f"{spectrum.spectrum_id} {spectrum.timestamp} {spectrum.exposure_time:.6f} max={max(spectrum.data)}")
+        time.sleep(0.05)
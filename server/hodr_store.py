@@ -0,0 +1,401 @@
+"""Reader for the HODR binary spectrum store (see src/store.h)."""
+import array
+import mmap
+import os
+import struct
+import sys
+import time
+
+STORE_MAGIC = b'HODRSPEC'
+RECORD_MAGIC = 0x43455053
+INDEX_MAGIC = b'HODRIDX\0'
+MANIFEST_MAGIC = b'HODRMAN\0'
+MANIFEST_NAME = 'partitions.manifest'
+
+ENCODING_INT32 = 0
+ENCODING_UINT16 = 1
+ENCODING_PACKED = 2
+
+FILE_PACKED = 0x01
+
+PACK_BLOCK = 128  # Values per packed block, see src/codec.h
+
+RECORD_TEMP_STABILIZED = 0x01
+RECORD_GAP = 0x02
+RECORD_COADDED = 0x04
+RECORD_DARK_SUBTRACTED = 0x08
+RECORD_FLAT_FIELDED = 0x10
+RECORD_HOT_PIXELS = 0x20
+RECORD_WITH_RAW = 0x40
+RECORD_RESAMPLED = 0x80
+
+PIXEL_SIZES = {ENCODING_INT32: 4, ENCODING_UINT16: 2}
+
+FILE_HEADER = struct.Struct('<8sIIIIq')
+RECORD_HEADER = struct.Struct('<IIqffIBBHII')
+GAP_PAYLOAD = struct.Struct('<Q')
+GRID_HEADER = struct.Struct('<ddI4x')
+INDEX_HEADER = struct.Struct('<8sIII12x')
+INDEX_ENTRY = struct.Struct('<Qq')
+MANIFEST_HEADER = struct.Struct('<8sII16x')
+MANIFEST_ENTRY = struct.Struct('<64sIIqqQ')
+
+
+def format_timestamp(timestamp_ns):
+    """Local time in the ISO format used by the legacy CSV files."""
+    return time.strftime('%Y-%m-%dT%H:%M:%S', time.localtime(timestamp_ns // 1_000_000_000))
+
+
+class Spectrum:
+    """One stored spectrum. A co-added one is the mean of coadded frames and
+    has the standard error of each pixel in noise; otherwise coadded is 0 and
+    noise is None. A corrected one stored with RECORD_WITH_RAW has the pixels
+    as read from the camera in raw. One stored with RECORD_RESAMPLED has the
+    start and step in nm of its wavelength grid in grid and the spectrum on
+    that grid in resampled, NaN beyond the detector."""
+    __slots__ = ('spectrum_id', 'timestamp_ns', 'exposure_time', 'temperature', 'flags', 'data',
+                 'coadded', 'noise', 'raw', 'grid', 'resampled')
+
+    def __init__(self, spectrum_id, timestamp_ns, exposure_time, temperature, flags, data,
+                 coadded=0, noise=None, raw=None, grid=None, resampled=None):
+        self.spectrum_id = spectrum_id
+        self.timestamp_ns = timestamp_ns
+        self.exposure_time = exposure_time
+        self.temperature = temperature
+        self.flags = flags
+        self.data = data
+        self.coadded = coadded
+        self.noise = noise
+        self.raw = raw
+        self.grid = grid
+        self.resampled = resampled
+
+    @property
+    def wavelengths(self):
+        """Wavelengths in nm of the resampled points, None if not resampled."""
+        if self.grid is None:
+            return None
+        start, step = self.grid
+        return [start + i * step for i in range(len(self.resampled))]
+
+    @property
+    def timestamp(self):
+        return format_timestamp(self.timestamp_ns)
+
+    def csv_line(self):
+        values = ','.join(str(v) for v in self.data)
+        return f"{self.timestamp},{self.exposure_time:.9f},{self.temperature:.2f},{values}"
+
+
+class Gap:
+    """Frames lost before spectrum_id."""
+    __slots__ = ('spectrum_id', 'timestamp_ns', 'missing_frames')
+
+    def __init__(self, spectrum_id, timestamp_ns, missing_frames):
+        self.spectrum_id = spectrum_id
+        self.timestamp_ns = timestamp_ns
+        self.missing_frames = missing_frames
+
+
+def _from_little_endian(typecode, raw):
+    data = array.array(typecode)
+    data.frombytes(raw)
+    if sys.byteorder != 'little':
+        data.byteswap()
+    return data
+
+
+def packed_size(payload, npixels):
+    """Bytes the packed pixels take at the start of payload."""
+    nblocks = (npixels + PACK_BLOCK - 1) // PACK_BLOCK
+    if len(payload) < nblocks or max(payload[:nblocks], default=0) > 32:
+        raise ValueError("Corrupt packed spectrum")
+    size = nblocks + 16 * sum(payload[:nblocks])
+    if size > len(payload):
+        raise ValueError("Corrupt packed spectrum")
+    return size
+
+
+def decode_packed(payload, npixels):
+    """Pixels of a spectrum packed by src/codec.c: per block of 128, zigzag
+    encoded differences from the left neighbour, bit field k of lane i % 4
+    holding value i = 4 * k + lane."""
+    packed_size(payload, npixels)
+    nblocks = (npixels + PACK_BLOCK - 1) // PACK_BLOCK
+    values = array.array('I')
+    previous = 0
+    at = nblocks
+    for block in range(nblocks):
+        bits = payload[block]
+        words = _from_little_endian('I', payload[at:at + 16 * bits])
+        at += 16 * bits
+        mask = (1 << bits) - 1
+        lanes = [sum(words[w * 4 + lane] << (32 * w) for w in range(bits)) for lane in range(4)]
+        for i in range(min(PACK_BLOCK, npixels - block * PACK_BLOCK)):
+            residual = (lanes[i % 4] >> (i // 4 * bits)) & mask
+            previous = (previous + ((residual >> 1) ^ -(residual & 1))) & 0xFFFFFFFF
+            values.append(previous)
+    return array.array('i', values.tobytes())
+
+
+def decode_payload(encoding, payload, npixels=None):
+    if encoding == ENCODING_UINT16:
+        return _from_little_endian('H', payload)
+    if encoding == ENCODING_INT32:
+        return _from_little_endian('i', payload)
+    if encoding == ENCODING_PACKED:
+        return decode_packed(payload, npixels)
+    raise ValueError(f"Unknown spectrum encoding {encoding}")
+
+
+def read_file_header(f):
+    raw = f.read(FILE_HEADER.size)
+    if len(raw) < FILE_HEADER.size:
+        raise ValueError("Not a HODR data file")
+    magic, version, header_size, xpixels, flags, created_ns = FILE_HEADER.unpack(raw)
+    if magic != STORE_MAGIC:
+        raise ValueError("Not a HODR data file")
+    return {'version': version, 'header_size': header_size, 'xpixels': xpixels,
+            'flags': flags, 'created_ns': created_ns}
+
+
+def read_record(f):
+    """Read the record at the current position, or None at the end of the file.
+    Returns a Spectrum, or a Gap for gap markers."""
+    raw = f.read(RECORD_HEADER.size)
+    if len(raw) < RECORD_HEADER.size:
+        return None
+    (magic, spectrum_id, timestamp_ns, exposure_time, temperature, npixels,
+     encoding, flags, coadded, payload_bytes, _) = RECORD_HEADER.unpack(raw)
+    if magic != RECORD_MAGIC:
+        raise ValueError(f"Corrupt record header at offset {f.tell() - RECORD_HEADER.size}")
+    payload = f.read(payload_bytes)
+    if len(payload) < payload_bytes:
+        return None  # Partially written record
+    if flags & RECORD_GAP:
+        return Gap(spectrum_id, timestamp_ns, GAP_PAYLOAD.unpack(payload)[0])
+    if not flags & (RECORD_COADDED | RECORD_WITH_RAW | RECORD_RESAMPLED):
+        return Spectrum(spectrum_id, timestamp_ns, exposure_time, temperature, flags,
+                        decode_payload(encoding, payload, npixels))
+    # Pixels, then the noise of a co-added spectrum, then the raw pixels of a
+    # corrected one, then the resampled spectrum
+    if encoding == ENCODING_PACKED:
+        end = packed_size(payload, npixels)
+    else:
+        end = npixels * PIXEL_SIZES.get(encoding, 0)
+    data = decode_payload(encoding, payload[:end], npixels)
+    noise = raw = grid = resampled = None
+    if flags & RECORD_COADDED:
+        noise = _from_little_endian('f', payload[end:end + 4 * npixels])
+        end += 4 * npixels
+    if flags & RECORD_WITH_RAW:
+        raw = _from_little_endian('i', payload[end:end + 4 * npixels])
+        end += 4 * npixels
+    if flags & RECORD_RESAMPLED:
+        start, step, points = GRID_HEADER.unpack_from(payload, end)
+        end += GRID_HEADER.size
+        grid = (start, step)
+        resampled = _from_little_endian('f', payload[end:end + 4 * points])
+    return Spectrum(spectrum_id, timestamp_ns, exposure_time, temperature, flags, data,
+                    coadded if flags & RECORD_COADDED else 0, noise, raw, grid, resampled)
+
+
+def iter_records(path):
+    """Every record of a data file in order, spectra and gap markers."""
+    with open(path, 'rb') as f:
+        header = read_file_header(f)
+        f.seek(header['header_size'])
+        while True:
+            record = read_record(f)
+            if record is None:
+                return
+            yield record
+
+
+def iter_spectra(path):
+    for record in iter_records(path):
+        if isinstance(record, Spectrum):
+            yield record
+
+
+def index_path(path):
+    return path + '.idx'
+
+
+class Index:
+    """The index sidecar of a data file: record offset and timestamp of every
+    spectrum, at a fixed position per spectrum ID."""
+
+    def __init__(self, path):
+        with open(path, 'rb') as f:
+            try:
+                self._map = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+            except ValueError:
+                raise ValueError("Not a HODR index file")  # Empty file
+        magic, version, entry_size, first_id = INDEX_HEADER.unpack_from(self._map, 0)
+        if magic != INDEX_MAGIC or entry_size != INDEX_ENTRY.size:
+            self._map.close()
+            raise ValueError("Not a HODR index file")
+        self.first_id = first_id
+        self.count = (len(self._map) - INDEX_HEADER.size) // INDEX_ENTRY.size  # Ignores a partly written entry
+
+    def close(self):
+        self._map.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    @property
+    def end_id(self):
+        """One past the last indexed spectrum ID."""
+        return self.first_id + self.count
+
+    def entry(self, spectrum_id):
+        """(offset, timestamp_ns) of a spectrum."""
+        return INDEX_ENTRY.unpack_from(self._map, INDEX_HEADER.size + (spectrum_id - self.first_id) * INDEX_ENTRY.size)
+
+    def find_time(self, timestamp_ns):
+        """First spectrum ID taken at or after timestamp_ns, end_id if there is none.
+        Spectra are stored in capture order, so this is a binary search."""
+        low, high = self.first_id, self.end_id
+        while low < high:
+            middle = (low + high) // 2
+            if self.entry(middle)[1] < timestamp_ns:
+                low = middle + 1
+            else:
+                high = middle
+        return low
+
+
+def iter_range(path, first_id, stop_id):
+    """Spectra first_id up to stop_id (exclusive), found through the index so
+    that only the requested records are read."""
+    with Index(index_path(path)) as index:
+        first_id = max(first_id, index.first_id)
+        stop_id = min(stop_id, index.end_id)
+        if first_id >= stop_id:
+            return
+        offset = index.entry(first_id)[0]
+    with open(path, 'rb') as f:
+        f.seek(offset)
+        while True:
+            record = read_record(f)
+            if record is None or record.spectrum_id >= stop_id:
+                return
+            if isinstance(record, Spectrum):
+                yield record
+
+
+def manifest_path(directory):
+    return os.path.join(directory, MANIFEST_NAME)
+
+
+class Partition:
+    """A data file of a partitioned archive, from its manifest entry."""
+    __slots__ = ('path', 'first_id', 'end_id', 'first_ns', 'last_ns', 'size')
+
+    def __init__(self, path, first_id, end_id, first_ns, last_ns, size):
+        self.path = path
+        self.first_id = first_id
+        self.end_id = end_id  # One past the last spectrum ID
+        self.first_ns = first_ns
+        self.last_ns = last_ns
+        self.size = size
+
+
+class Manifest:
+    """The partitions of a data directory in spectrum ID order. The entry of
+    the partition being written may lag its files by a write."""
+
+    def __init__(self, path):
+        with open(path, 'rb') as f:
+            raw = f.read()
+        if len(raw) < MANIFEST_HEADER.size:
+            raise ValueError("Not a HODR manifest")
+        magic, version, entry_size = MANIFEST_HEADER.unpack_from(raw, 0)
+        if magic != MANIFEST_MAGIC or entry_size != MANIFEST_ENTRY.size:
+            raise ValueError("Not a HODR manifest")
+        directory = os.path.dirname(path)
+        self.partitions = []
+        for offset in range(MANIFEST_HEADER.size, len(raw) - MANIFEST_ENTRY.size + 1, MANIFEST_ENTRY.size):
+            name, first_id, end_id, first_ns, last_ns, size = MANIFEST_ENTRY.unpack_from(raw, offset)
+            name = name.split(b'\0', 1)[0].decode()
+            self.partitions.append(Partition(os.path.join(directory, name), first_id, end_id, first_ns, last_ns, size))
+
+    def select(self, first_id=0, stop_id=2**32, start_ns=None, end_ns=None):
+        """Partitions that may hold spectra first_id up to stop_id (exclusive)
+        taken from start_ns up to end_ns (exclusive). The newest partition may
+        have grown past its entry, so only its start is checked."""
+        selected = []
+        for n, partition in enumerate(self.partitions):
+            empty = partition.end_id == partition.first_id
+            if partition.first_id >= stop_id or (end_ns is not None and not empty and partition.first_ns >= end_ns):
+                break
+            growing = n == len(self.partitions) - 1
+            if not growing and (empty or partition.end_id <= first_id or (start_ns is not None and partition.last_ns < start_ns)):
+                continue
+            selected.append(partition)
+        return selected
+
+
+def iter_partitions(partitions, first_id, stop_id, start_ns=None, end_ns=None):
+    """Spectra first_id up to stop_id (exclusive) taken from start_ns up to
+    end_ns (exclusive), read from each of the partitions in turn through its
+    index."""
+    for partition in partitions:
+        low, high = first_id, stop_id
+        if start_ns is not None or end_ns is not None:
+            with Index(index_path(partition.path)) as index:
+                if start_ns is not None:
+                    low = max(low, index.find_time(start_ns))
+                if end_ns is not None:
+                    high = min(high, index.find_time(end_ns))
+        yield from iter_range(partition.path, low, high)
+
+
+class Query:
+    """Spectra taken from start_ns up to end_ns (exclusive) with an exposure
+    time from min_exposure to max_exposure seconds and, if stabilized_only,
+    taken with the temperature stabilized. None leaves a bound open. The
+    daemon's query_spectra method takes the same filters."""
+    __slots__ = ('start_ns', 'end_ns', 'min_exposure', 'max_exposure', 'stabilized_only')
+
+    def __init__(self, start_ns=None, end_ns=None, min_exposure=None, max_exposure=None, stabilized_only=False):
+        self.start_ns = start_ns
+        self.end_ns = end_ns
+        self.min_exposure = min_exposure
+        self.max_exposure = max_exposure
+        self.stabilized_only = stabilized_only
+
+    def matches(self, spectrum):
+        if self.min_exposure is not None and spectrum.exposure_time < self.min_exposure:
+            return False
+        if self.max_exposure is not None and spectrum.exposure_time > self.max_exposure:
+            return False
+        return not self.stabilized_only or bool(spectrum.flags & RECORD_TEMP_STABILIZED)
+
+    def run(self, partitions, first_id=0, read=iter_partitions):
+        """Matching spectra from first_id on, one at a time. The index of
+        every partition gives the start of the range, the records are then
+        read in order until its end, so memory does not grow with the range.
+        read is iter_partitions() of hodr_store or of hodr_lib."""
+        for spectrum in read(partitions, first_id, 2**32, self.start_ns, self.end_ns):
+            if self.matches(spectrum):
+                yield spectrum
+
+
+def to_csv(path, out):
+    """Write a data file in the legacy CSV format, one spectrum per line."""
+    for spectrum in iter_spectra(path):
+        out.write(spectrum.csv_line())
+        out.write('\n')
+
+
+if __name__ == '__main__':
+    if len(sys.argv) != 2:
+        print(f"Usage: {sys.argv[0]} DATA_FILE > data.csv", file=sys.stderr)
+        sys.exit(1)
+    to_csv(sys.argv[1], sys.stdout)
@@ -1,7 +1,20 @@
-from http.server import HTTPServer, BaseHTTPRequestHandler
+from http.server import ThreadingHTTPServer, BaseHTTPRequestHandler
 from gi.repository import Gio, GLib
 import json
+import os
+import array
+import datetime
+import hashlib
+import itertools
 import pathlib
+import queue
+import struct
+import sys
+from urllib.parse import urlsplit, parse_qsl
+import hodr_store
+import hodr_lib
+import hodr_shm
+import hodr_events
 session_bus = Gio.bus_get_sync(Gio.BusType.SESSION, None)
 
 
@@ -12,6 +25,117 @@ proxy= Gio.DBusProxy.new_sync(session_bus, Gio.DBusProxyFlags.NONE, None,
 
 script_dir = __file__.rsplit('/', 1)[0]
 
+shared_ring = None  # Mapped on first use, the live view reads from it without D-Bus calls
+
+event_hub = hodr_events.EventHub()  # Every /events client reads from the one daemon subscription
+daemon_events = hodr_events.DaemonEvents(session_bus, proxy, event_hub)
+
+EVENTS_KEEPALIVE = 15  # Seconds between comments on an idle /events stream
+
+DATA_MAGIC = b'HODRDATA'
+DATA_HEADER = struct.Struct('<8sIIIII4x')  # magic, version, count, npixels, encoding, decimation
+DATA_RECORD = struct.Struct('<qIffI')      # timestamp_ns, spectrum_id, exposure_time, temperature, flags
+DATA_ENCODINGS = {'int32': (hodr_store.ENCODING_INT32, 'i'), 'uint16': (hodr_store.ENCODING_UINT16, 'H')}
+
+METRICS_LOCKS = {'lock', 'data_file_lock'}  # Histograms of lock waits, the others time readout stages
+METRICS_QUANTILES = ('0.5', '0.9', '0.99', '0.999')
+METRICS_GAUGES = {'ring_high_water'}        # Counters that can go down
+
+
+def parse_time(value):
+    """ns since the Unix epoch, from an integer or an ISO 8601 local time."""
+    try:
+        return int(value)
+    except ValueError:
+        return int(datetime.datetime.fromisoformat(value).timestamp() * 1_000_000_000)
+
+
+def decimate(data, factor):
+    """Minimum and maximum of every factor pixels, so that peaks survive
+    when a spectrum is drawn narrower than it is."""
+    if factor <= 1:
+        return data
+    if hasattr(data, 'reshape'):  # numpy, from hodr_lib
+        return hodr_lib.decimate(data, factor)
+    result = array.array('i')
+    for i in range(0, len(data), factor):
+        block = data[i:i + factor]
+        result.append(min(block))
+        result.append(max(block))
+    return result
+
+
+def data_csv(spectra, pixels):
+    npixels = len(pixels[0]) if pixels else 0
+    lines = ["number, timestamp, integration_time, temperature," + ','.join(str(i) for i in range(npixels))]
+    for spectrum, values in zip(spectra, pixels):
+        lines.append(f"{spectrum.timestamp},{spectrum.exposure_time:.9f},{spectrum.temperature:.2f},"
+                     + ','.join(str(v) for v in values))
+    return '\n'.join(lines) + '\n'
+
+
+def data_binary(spectra, pixels, data_format, factor):
+    encoding, typecode = DATA_ENCODINGS[data_format]
+    npixels = len(pixels[0]) if pixels else 0
+    parts = [DATA_HEADER.pack(DATA_MAGIC, 1, len(spectra), npixels, encoding, factor)]
+    parts.extend(DATA_RECORD.pack(s.timestamp_ns, s.spectrum_id, s.exposure_time, s.temperature, s.flags) for s in spectra)
+    for values in pixels:
+        if hasattr(values, 'astype'):  # numpy, from hodr_lib
+            parts.append(hodr_lib.pixel_bytes(values, typecode))
+            continue
+        if typecode == 'H':
+            values = [min(max(v, 0), 0xFFFF) for v in values]  # Saturate, uint16 halves the transfer
+        out = array.array(typecode, values)
+        if sys.byteorder != 'little':
+            out.byteswap()
+        parts.append(out.tobytes())
+    return b''.join(parts)
+
+
+def metrics_text(histograms, counters):
+    """The daemon's get_metrics reply in the Prometheus text format. The
+    histograms become summaries, cumulative since the daemon started."""
+    families = {
+        'hodr_stage_seconds': ('stage', 'Time spent in each stage of frame readout and storage.'),
+        'hodr_lock_wait_seconds': ('lock', 'Time spent waiting for a daemon mutex.'),
+    }
+    lines = []
+    for family, (label, help_text) in families.items():
+        lines.append(f"# HELP {family} {help_text}")
+        lines.append(f"# TYPE {family} summary")
+        for name, count, sum_ns, max_ns, *quantiles in histograms:
+            if (family == 'hodr_lock_wait_seconds') != (name in METRICS_LOCKS):
+                continue
+            for quantile, value_ns in zip(METRICS_QUANTILES, quantiles):
+                lines.append(f'{family}{{{label}="{name}",quantile="{quantile}"}} {value_ns / 1e9:.9f}')
+            lines.append(f'{family}_sum{{{label}="{name}"}} {sum_ns / 1e9:.9f}')
+            lines.append(f'{family}_count{{{label}="{name}"}} {count}')
+        lines.append(f"# TYPE {family}_max gauge")
+        for name, count, sum_ns, max_ns, *quantiles in histograms:
+            if (family == 'hodr_lock_wait_seconds') == (name in METRICS_LOCKS):
+                lines.append(f'{family}_max{{{label}="{name}"}} {max_ns / 1e9:.9f}')
+    for name, value in sorted(counters.items()):
+        if name in METRICS_GAUGES:
+            lines.append(f"# TYPE hodr_{name} gauge")
+            lines.append(f"hodr_{name} {value}")
+        else:
+            lines.append(f"# TYPE hodr_{name}_total counter")
+            lines.append(f"hodr_{name}_total {value}")
+    return '\n'.join(lines) + '\n'
+
+
+def latest_shared_spectrum():
+    """Most recent spectrum from the daemon's shared-memory ring, or None if it is unavailable."""
+    global shared_ring
+    try:
+        if shared_ring is None:
+            shared_ring = hodr_shm.SharedRing.from_proxy(proxy)
+        return shared_ring.latest()
+    except (GLib.Error, OSError, ValueError) as e:
+        print(f"Shared spectrum ring unavailable: {e}")
+        shared_ring = None
+        return None
+
 
 class RequestHandler(BaseHTTPRequestHandler):
 
@@ -21,18 +145,15 @@ class RequestHandler(BaseHTTPRequestHandler):
     def do_GET(self):
 
         self.content_type = 'text/html'
-        global proxy
-        proxy= Gio.DBusProxy.new_sync(session_bus, Gio.DBusProxyFlags.NONE, None,
-                                'hodr.server.Control',
-                                '/hodr/server/Control',
-                                'hodr.server.Control', None)
-        
-        
-
+        url = urlsplit(self.path)
+        query = dict(parse_qsl(url.query))
 
         print(f"Received request for: {self.path}")
         if self.path == '/' or self.path == '/index.html':
             self.serve_index()
+        elif self.path == '/events':
+            print("Serving event stream")
+            self.serve_events()
         elif self.path == '/favicon.ico':
             self.content_type = 'image/x-icon'
             print("Serving favicon.ico")
@@ -65,9 +186,14 @@ class RequestHandler(BaseHTTPRequestHandler):
         elif self.path == '/data_ready':
             print("Checking if data is ready")
             self.serve_data_ready()
-        elif self.path == '/data':
+        elif url.path == '/data':
             print("Serving data")
-            self.serve_data()
+            self.serve_data(query)
+        elif url.path == '/query':
+            print("Serving query")
+            self.serve_query(query)
+        elif self.path == '/metrics':
+            self.serve_metrics()
         elif self.path == '/number_spectra':
             print("Serving number of spectra")
             self.serve_number_spectra()
@@ -99,6 +225,27 @@ class RequestHandler(BaseHTTPRequestHandler):
             self.wfile.write(f.read()
                              )
             
+    def serve_events(self):
+        """Server-sent events: a 'status' event whenever the daemon state
+        changes and a 'spectrum' event, with the pixels, for every new spectrum."""
+        self.send_response(200)
+        self.send_header('Content-type', 'text/event-stream')
+        self.send_header('Cache-Control', 'no-cache')
+        self.end_headers()
+        events = event_hub.subscribe()
+        try:
+            while True:
+                try:
+                    name, data = events.get(timeout=EVENTS_KEEPALIVE)
+                    self.wfile.write(f"event: {name}\ndata: {data}\n\n".encode('utf-8'))
+                except queue.Empty:
+                    self.wfile.write(b': keepalive\n\n')  # Lets the server notice a client that went away
+                self.wfile.flush()
+        except (BrokenPipeError, ConnectionResetError):
+            print("Event stream client disconnected")
+        finally:
+            event_hub.unsubscribe(events)
+
     def serve_status(self):
         self.send_response(200)
         self.send_header('Content-type', 'text/plain')
@@ -218,50 +365,196 @@ class RequestHandler(BaseHTTPRequestHandler):
         proxy.call_sync('deactivate', None, Gio.DBusCallFlags.NONE, -1, None)
         self.wfile.write(b'Device deactivated successfully\n')
 
-    def serve_data(self):
+    def serve_metrics(self):
+        try:
+            histograms, counters = proxy.call_sync('get_metrics', None, Gio.DBusCallFlags.NONE, -1, None).unpack()
+        except GLib.Error as e:
+            self.send_error(503, f"Metrics unavailable: {e.message}")
+            return
+        body = metrics_text(histograms, counters).encode('utf-8')
         self.send_response(200)
-        self.send_header('Content-type', 'application/json')
+        self.send_header('Content-type', 'text/plain; version=0.0.4')
+        self.send_header('Content-Length', str(len(body)))
         self.end_headers()
-        print("Serving data file")
+        self.wfile.write(body)
+
+    def serve_data(self, query):
+        """Spectra from the data files.
+
+        Query parameters, all optional:
+          from, to       spectrum ID range, to is exclusive
+          since          only spectra after this ID, for incremental fetches
+          start, end     capture time range, ns since the Unix epoch or ISO 8601 local time
+          limit          most spectra returned
+          decimate       keep the minimum and maximum of every this many pixels
+          format         csv (default), int32 or uint16; binary is also chosen
+                         by Accept: application/octet-stream
+
+        The binary formats are a DATA_HEADER, a DATA_RECORD per spectrum and
+        then the pixels of every spectrum in order, all little-endian.
+        X-Last-Spectrum-ID gives the last ID returned, to pass as since next
+        time. Responses carry an ETag that changes when the data files grow.
+
+        The partition manifest next to the data file picks the data files the
+        range can be in, only those are opened. Without a manifest only the
+        data file itself is read. They are read with libhodr-store when it is
+        built, see hodr_lib.
+        """
         data_file = proxy.get_cached_property('dataPath')
-        print(f"Data file path: {data_file}")
-        data_file_str = str(data_file).strip("'").strip('"')
-        data_file_str = f"../{data_file_str}"  # Ensure the path is relative to the script directory
-
+        data_file_str = data_file.unpack() if data_file is not None else ''
+        if not data_file_str:
+            print("Data file path is empty")
+            self.send_error(404, 'Data path is empty')
+            return
+        data_file_str = os.path.join(script_dir, '..', data_file_str)  # Relative to the repository, absolute paths are kept
         if not pathlib.Path(data_file_str).exists():
             print(f"Data file does not exist: {data_file_str}")
             self.send_error(404, 'Data file does not exist')
             return
-        if not data_file_str:
-            print("Data file path is empty")
-            self.send_error(404, 'Data path is empty')
+
+        try:
+            first_id = int(query.get('from', 0))
+            stop_id = int(query.get('to', 2**32))
+            if 'since' in query:
+                first_id = max(first_id, int(query['since']) + 1)
+            limit = int(query['limit']) if 'limit' in query else None
+            factor = max(int(query.get('decimate', 1)), 1)
+            start_ns = parse_time(query['start']) if 'start' in query else None
+            end_ns = parse_time(query['end']) if 'end' in query else None
+        except ValueError as e:
+            self.send_error(400, f'Invalid query: {e}')
             return
+        data_format = query.get('format')
+        if data_format is None:
+            data_format = 'int32' if 'application/octet-stream' in self.headers.get('Accept', '') else 'csv'
+        if data_format not in ('csv', 'int32', 'uint16'):
+            self.send_error(400, f'Unknown format {data_format}')
+            return
+
+        manifest_file = hodr_store.manifest_path(os.path.dirname(data_file_str))
         try:
-            header_str = "number, timestamp, integration_time, temperature,"
-            file_str = ""
-            with open(data_file_str, 'r') as f:
-                file_str = f.read()
+            if pathlib.Path(manifest_file).exists():
+                partitions = hodr_store.Manifest(manifest_file).select(first_id, stop_id, start_ns, end_ns)
+            else:
+                partitions = [hodr_store.Partition(data_file_str, 0, 2**32, 0, 0, 0)]  # From before the manifest
+            sizes = [(partition.path, pathlib.Path(partition.path).stat().st_size) for partition in partitions]
+        except (OSError, ValueError) as e:
+            print(f"Error reading partition manifest: {e}")
+            self.send_error(500, 'Error reading partition manifest')
+            return
 
-            split_file_str = file_str.split('\n')[0].split(',')[4:]  # Skip the first line (header)
-            for i, field in enumerate(split_file_str):
-                if field.strip():
-                    header_str += f"{i},"
-            header_str = header_str.rstrip(',') + '\n'  # Remove trailing comma and add newline
-            file_str = header_str + file_str
+        # The result only changes when spectra are appended
+        etag = '"' + hashlib.sha1(f"{sizes}:{sorted(query.items())}:{data_format}".encode()).hexdigest()[:20] + '"'
+        if etag in self.headers.get('If-None-Match', ''):
+            self.send_response(304)
+            self.send_header('ETag', etag)
+            self.end_headers()
+            return
 
-            print(f"Data file content: {file_str[:100]}...")  # Print first 100 characters for debugging
-            self.wfile.write(file_str.encode('utf-8'))
-        except FileNotFoundError:
-            print(f"Data file not found: {data_file_str}")
-            self.send_error(404, 'Data file not found')
-        except json.JSONDecodeError:
-            print("Error decoding JSON data")
-            self.send_error(500, 'Error decoding JSON data')
+        try:
+            store = hodr_lib if hodr_lib.available() else hodr_store
+            found = store.iter_partitions(partitions, first_id, stop_id, start_ns, end_ns)
+            spectra = list(itertools.islice(found, max(limit, 0)) if limit is not None else found)
+        except (OSError, ValueError) as e:
+            print(f"Error reading data file: {e}")
+            self.send_error(500, 'Error reading data file')
+            return
 
+        pixels = [decimate(spectrum.data, factor) for spectrum in spectra]
+        if data_format == 'csv':
+            body = data_csv(spectra, pixels).encode('utf-8')
+            content_type = 'text/csv'
+        else:
+            body = data_binary(spectra, pixels, data_format, factor)
+            content_type = 'application/octet-stream'
 
+        print(f"Serving {len(spectra)} spectra from {len(partitions)} data files as {data_format}, {len(body)} bytes")
+        self.send_response(200)
+        self.send_header('Content-type', content_type)
+        self.send_header('Content-Length', str(len(body)))
+        self.send_header('ETag', etag)
+        self.send_header('Cache-Control', 'no-cache')
+        if spectra:
+            self.send_header('X-Last-Spectrum-ID', str(spectra[-1].spectrum_id))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def serve_query(self, query):
+        """Spectra of a time range that pass the filters, streamed as CSV in
+        the format of /data while they are read, so memory stays bounded
+        however long the range is.
+
+        Query parameters:
+          start, end     capture time range, ns since the Unix epoch or ISO 8601
+                         local time; start is required, end is exclusive
+          min_exposure, max_exposure
+                         exposure time range in seconds
+          stabilized     1 for only spectra taken with the temperature stabilized
+          from           skip spectrum IDs before this one
+          decimate       keep the minimum and maximum of every this many pixels
+
+        The response has no length and ends when the connection closes.
+        """
+        data_file = proxy.get_cached_property('dataPath')
+        data_file_str = data_file.unpack() if data_file is not None else ''
+        if not data_file_str:
+            self.send_error(404, 'Data path is empty')
+            return
+        data_file_str = os.path.join(script_dir, '..', data_file_str)  # Relative to the repository, absolute paths are kept
 
-    
+        try:
+            if 'start' not in query:
+                raise ValueError('start is required')
+            search = hodr_store.Query(
+                start_ns=parse_time(query['start']),
+                end_ns=parse_time(query['end']) if 'end' in query else None,
+                min_exposure=float(query['min_exposure']) if 'min_exposure' in query else None,
+                max_exposure=float(query['max_exposure']) if 'max_exposure' in query else None,
+                stabilized_only=query.get('stabilized', '0') not in ('', '0', 'false'))
+            first_id = int(query.get('from', 0))
+            factor = max(int(query.get('decimate', 1)), 1)
+        except ValueError as e:
+            self.send_error(400, f'Invalid query: {e}')
+            return
+
+        manifest_file = hodr_store.manifest_path(os.path.dirname(data_file_str))
+        try:
+            if pathlib.Path(manifest_file).exists():
+                partitions = hodr_store.Manifest(manifest_file).select(first_id, 2**32, search.start_ns, search.end_ns)
+            elif pathlib.Path(data_file_str).exists():
+                partitions = [hodr_store.Partition(data_file_str, 0, 2**32, 0, 0, 0)]  # From before the manifest
+            else:
+                self.send_error(404, 'Data file does not exist')
+                return
+        except (OSError, ValueError) as e:
+            print(f"Error reading partition manifest: {e}")
+            self.send_error(500, 'Error reading partition manifest')
+            return
 
+        store = hodr_lib if hodr_lib.available() else hodr_store
+        self.send_response(200)
+        self.send_header('Content-type', 'text/csv')
+        self.send_header('Cache-Control', 'no-cache')
+        self.send_header('Connection', 'close')
+        self.end_headers()
+        count = 0
+        try:
+            header_written = False
+            for spectrum in search.run(partitions, first_id, store.iter_partitions):
+                values = decimate(spectrum.data, factor)
+                if not header_written:
+                    self.wfile.write(("number, timestamp, integration_time, temperature,"
+                                      + ','.join(str(i) for i in range(len(values))) + '\n').encode('utf-8'))
+                    header_written = True
+                self.wfile.write((f"{spectrum.timestamp},{spectrum.exposure_time:.9f},{spectrum.temperature:.2f},"
+                                  + ','.join(str(v) for v in values) + '\n').encode('utf-8'))
+                count += 1
+        except (BrokenPipeError, ConnectionResetError):
+            print("Query client disconnected")
+        except (OSError, ValueError) as e:
+            print(f"Error reading data file: {e}")  # Headers are sent, the stream just ends
+        self.close_connection = True
+        print(f"Streamed {count} spectra from {len(partitions)} data files")
 
     def do_POST(self):
         # Handle POST requests if needed
@@ -363,9 +656,24 @@ class RequestHandler(BaseHTTPRequestHandler):
                 return
             print(f"Retrieving spectrum with ID: {spectrum_id}")
 
+            if spectrum_id < 0:
+                latest = latest_shared_spectrum()
+                if latest is not None:
+                    response_data = {
+                        'timestamp': latest.timestamp,
+                        'integration_time': latest.exposure_time,
+                        'temperature': latest.temperature,
+                        'data': latest.data.tolist()
+                    }
+                    self.send_response(200)
+                    self.send_header('Content-type', 'application/json')
+                    self.end_headers()
+                    self.wfile.write(json.dumps(response_data).encode('utf-8'))
+                    return
+
             spectrum_id_variant = GLib.Variant.new_int32(spectrum_id)
             
-            spectrum = proxy.call_sync('get_data', None, Gio.DBusCallFlags.NONE, -1, None)
+            spectrum = proxy.call_sync('get_data', GLib.Variant.new_tuple(spectrum_id_variant), Gio.DBusCallFlags.NONE, -1, None)
             if spectrum is None:
                 self.send_error(404, 'Spectrum not found')
                 return
@@ -386,8 +694,11 @@ class RequestHandler(BaseHTTPRequestHandler):
         
 
 def main():
-    server = HTTPServer(('0.0.0.0', 8080), RequestHandler)  # Replace None with your handler class
-    print("Starting server on http://localhost:8080")
+    port = int(os.environ.get('HODR_HTTP_PORT', 8080))
+    daemon_events.start()  # Also keeps the cached properties of proxy current
+    server = ThreadingHTTPServer(('0.0.0.0', port), RequestHandler)  # Event streams stay open, so each client gets a thread
+    server.daemon_threads = True
+    print(f"Starting server on http://localhost:{port}")
     server.serve_forever()
 
 if __name__ == '__main__':
@@ -0,0 +1,95 @@
+#include "coadd.h"
+#include "kernels.h"
+#include "log.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+int coadd_init(HODR_Coadd_t *coadd, size_t npixels)
+{
+    memset(coadd, 0, sizeof(*coadd));
+    coadd->frames = 1;
+    coadd->npixels = npixels;
+    coadd->sums = calloc(npixels, sizeof(int64_t));
+    coadd->sumSquares = calloc(npixels, sizeof(uint64_t));
+    if (coadd->sums == NULL || coadd->sumSquares == NULL)
+    {
+        log_error("Failed to allocate co-adding accumulators of %zu pixels", npixels);
+        coadd_free(coadd);
+        return -1;
+    }
+    return 0;
+}
+
+void coadd_free(HODR_Coadd_t *coadd)
+{
+    free(coadd->sums);
+    free(coadd->sumSquares);
+    coadd->sums = NULL;
+    coadd->sumSquares = NULL;
+    coadd->count = 0;
+}
+
+// Accumulate one frame. The metadata is kept from the first frame of each
+// spectrum, the flags are those all the frames share.
+void coadd_add(HODR_Coadd_t *coadd, const int32_t *data, int64_t timestampNs, float exposureTime, float temperature, uint8_t flags)
+{
+    if (coadd->count == 0)
+    {
+        coadd->timestampNs = timestampNs;
+        coadd->exposureTime = exposureTime;
+        coadd->temperature = temperature;
+        coadd->flags = flags;
+    }
+    coadd->flags &= flags;
+    kernels_accumulate(coadd->sums, coadd->sumSquares, data, coadd->npixels);
+    coadd->count++;
+}
+
+// Drop the frames accumulated so far
+void coadd_reset(HODR_Coadd_t *coadd)
+{
+    memset(coadd->sums, 0, coadd->npixels * sizeof(int64_t));
+    memset(coadd->sumSquares, 0, coadd->npixels * sizeof(uint64_t));
+    coadd->count = 0;
+}
+
+// Write the mean of the frames accumulated so far without rounding or
+// starting over, for masters built from many frames
+void coadd_mean(const HODR_Coadd_t *coadd, float *mean)
+{
+    for (size_t i = 0; i < coadd->npixels; i++)
+    {
+        mean[i] = coadd->count > 0 ? (float)((double)coadd->sums[i] / coadd->count) : 0.0f;
+    }
+}
+
+// Write the rounded mean of the frames accumulated so far and the standard
+// error of that mean, then start over. A single frame has no noise estimate
+// and gets 0. Returns the number of frames averaged, 0 if there were none.
+unsigned int coadd_finish(HODR_Coadd_t *coadd, int32_t *mean, float *noise)
+{
+    unsigned int n = coadd->count;
+    if (n == 0)
+    {
+        return 0;
+    }
+    for (size_t i = 0; i < coadd->npixels; i++)
+    {
+        int64_t sum = coadd->sums[i];
+        mean[i] = (int32_t)(sum >= 0 ? (sum + n / 2) / n : -((-sum + n / 2) / n));
+        if (n > 1)
+        {
+            // sum * sum can overflow 64 bits, so the variance is taken in double
+            double average = (double)sum / n;
+            double variance = ((double)coadd->sumSquares[i] - average * (double)sum) / (n - 1);
+            noise[i] = variance > 0 ? (float)sqrt(variance / n) : 0.0f;
+        }
+        else
+        {
+            noise[i] = 0;
+        }
+    }
+    coadd_reset(coadd);
+    return n;
+}
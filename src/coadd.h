@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Frame co-adding.
+//
+// Sums consecutive frames pixel by pixel into 64-bit accumulators, with the
+// sum of squares alongside, and turns them into one averaged spectrum and
+// the standard error of each of its pixels. The camera digitises at most 16
+// bits, so the sum of squares of up to COADD_MAX_FRAMES frames stays far
+// below 64 bits.
+
+#define COADD_MAX_FRAMES UINT16_MAX
+
+typedef struct {
+    unsigned int frames;   // Frames per co-added spectrum, 1 when co-adding is off
+    unsigned int count;    // Frames accumulated so far
+    size_t npixels;
+    int64_t *sums;
+    uint64_t *sumSquares;
+    int64_t timestampNs;   // Of the first frame accumulated
+    float exposureTime;    // Of the first frame accumulated, seconds
+    float temperature;     // Of the first frame accumulated, degrees Celsius
+    uint8_t flags;         // HODR_RECORD_* flags every frame accumulated had
+} HODR_Coadd_t;
+
+int coadd_init(HODR_Coadd_t *coadd, size_t npixels);
+void coadd_free(HODR_Coadd_t *coadd);
+void coadd_add(HODR_Coadd_t *coadd, const int32_t *data, int64_t timestampNs, float exposureTime, float temperature, uint8_t flags);
+void coadd_reset(HODR_Coadd_t *coadd);
+void coadd_mean(const HODR_Coadd_t *coadd, float *mean);
+unsigned int coadd_finish(HODR_Coadd_t *coadd, int32_t *mean, float *noise);
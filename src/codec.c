@@ -0,0 +1,83 @@
+#include "codec.h"
+#include <string.h>
+
+// Encode npixels of data into out, which must hold CODEC_MAX_BYTES(npixels).
+// Returns the encoded size.
+size_t codec_encode(void *out, const int32_t *data, size_t npixels)
+{
+    size_t nblocks = CODEC_BLOCKS(npixels);
+    uint8_t *widths = out;
+    uint8_t *packed = widths + nblocks;
+    uint32_t residuals[CODEC_BLOCK];
+    uint32_t previous = 0;
+    for (size_t block = 0; block < nblocks; block++)
+    {
+        const int32_t *in = data + block * CODEC_BLOCK;
+        size_t count = npixels - block * CODEC_BLOCK < CODEC_BLOCK ? npixels - block * CODEC_BLOCK : CODEC_BLOCK;
+        uint32_t used = 0;
+        for (size_t i = 0; i < count; i++)
+        {
+            uint32_t delta = (uint32_t)in[i] - previous; // Wraps, the decoder wraps back
+            previous = (uint32_t)in[i];
+            residuals[i] = (delta << 1) ^ (uint32_t)((int32_t)delta >> 31);
+            used |= residuals[i];
+        }
+        memset(residuals + count, 0, (CODEC_BLOCK - count) * sizeof(uint32_t));
+        unsigned bits = used == 0 ? 0 : 32 - (unsigned)__builtin_clz(used);
+        widths[block] = (uint8_t)bits;
+        kernels_pack(packed, residuals, bits);
+        packed += KERNELS_PACKED_BYTES(bits);
+    }
+    return (size_t)(packed - (uint8_t *)out);
+}
+
+// Size of the encoded spectrum of npixels at the start of the size bytes at
+// in, or -1 if it is corrupt or does not fit
+ssize_t codec_size(const void *in, size_t size, size_t npixels)
+{
+    size_t nblocks = CODEC_BLOCKS(npixels);
+    if (size < nblocks)
+    {
+        return -1;
+    }
+    const uint8_t *widths = in;
+    size_t total = nblocks;
+    for (size_t block = 0; block < nblocks; block++)
+    {
+        if (widths[block] > 32)
+        {
+            return -1;
+        }
+        total += KERNELS_PACKED_BYTES(widths[block]);
+    }
+    return total <= size ? (ssize_t)total : -1;
+}
+
+// Decode npixels from the size bytes at in. Returns the bytes the encoded
+// spectrum takes, or -1 if it is corrupt or truncated.
+ssize_t codec_decode(int32_t *data, size_t npixels, const void *in, size_t size)
+{
+    ssize_t encoded = codec_size(in, size, npixels);
+    if (encoded < 0)
+    {
+        return -1;
+    }
+    size_t nblocks = CODEC_BLOCKS(npixels);
+    const uint8_t *widths = in;
+    const uint8_t *packed = widths + nblocks;
+    uint32_t residuals[CODEC_BLOCK];
+    uint32_t previous = 0;
+    for (size_t block = 0; block < nblocks; block++)
+    {
+        int32_t *out = data + block * CODEC_BLOCK;
+        size_t count = npixels - block * CODEC_BLOCK < CODEC_BLOCK ? npixels - block * CODEC_BLOCK : CODEC_BLOCK;
+        kernels_unpack(residuals, packed, widths[block]);
+        packed += KERNELS_PACKED_BYTES(widths[block]);
+        for (size_t i = 0; i < count; i++)
+        {
+            previous += (residuals[i] >> 1) ^ (0u - (residuals[i] & 1));
+            out[i] = (int32_t)previous;
+        }
+    }
+    return encoded;
+}
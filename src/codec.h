@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include "kernels.h"
+
+// Lossless spectrum codec.
+//
+// Every pixel is predicted by its left neighbour, the first by zero. The
+// prediction errors are zigzag encoded, so that small errors of either sign
+// become small unsigned values, and packed in blocks of CODEC_BLOCK values at
+// the fewest bits that hold the largest value of the block; the last block is
+// padded with zeros. An encoded spectrum is one width byte per block followed
+// by the packed blocks, KERNELS_PACKED_BYTES(width) bytes each, in the
+// interleaved layout of kernels_pack().
+//
+// Spectra are encoded independently of each other, so any one of them can be
+// decoded from its record alone.
+
+#define CODEC_BLOCK KERNELS_PACK_VALUES
+#define CODEC_BLOCKS(npixels) (((size_t)(npixels) + CODEC_BLOCK - 1) / CODEC_BLOCK)
+#define CODEC_MAX_BYTES(npixels) (CODEC_BLOCKS(npixels) * (1 + KERNELS_PACKED_BYTES(32))) // Largest encoding, of 32-bit noise
+
+size_t codec_encode(void *out, const int32_t *data, size_t npixels);
+ssize_t codec_decode(int32_t *data, size_t npixels, const void *in, size_t size);
+ssize_t codec_size(const void *in, size_t size, size_t npixels);
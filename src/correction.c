@@ -0,0 +1,411 @@
+#include "correction.h"
+#include "kernels.h"
+#include "store.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static int64_t wallClockNs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static void darkPath(const HODR_Correction_t *correction, int slot, char *buffer, size_t bufferSize)
+{
+    snprintf(buffer, bufferSize, "%s/dark-%02d.cal", correction->directory, slot);
+}
+
+// Write a calibration file through a temporary, so a crash leaves either the
+// old master or the new one
+int correction_writeCalibration(const char *path, HODR_CalibrationHeader_t *header, const void *values, size_t valueSize)
+{
+    memcpy(header->magic, CORRECTION_MAGIC, sizeof(header->magic));
+    header->version = CORRECTION_VERSION;
+    header->createdNs = header->createdNs != 0 ? header->createdNs : wallClockNs();
+
+    char temporary[300];
+    snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+    int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        log_error("Error creating calibration file %s: %s", temporary, strerror(errno));
+        return -1;
+    }
+    size_t bytes = header->count * valueSize;
+    bool written = write(fd, header, sizeof(*header)) == (ssize_t)sizeof(*header) &&
+                   write(fd, values, bytes) == (ssize_t)bytes && fsync(fd) == 0;
+    close(fd);
+    if (!written || rename(temporary, path) != 0)
+    {
+        log_error("Error writing calibration file %s: %s", path, strerror(errno));
+        unlink(temporary);
+        return -1;
+    }
+    return 0;
+}
+
+// Read a calibration file of the given kind into a newly allocated array of
+// header->count values. Returns NULL if there is no usable file.
+void *correction_readCalibration(const char *path, HODR_CalibrationKind_t kind, size_t npixels, HODR_CalibrationHeader_t *header, size_t valueSize)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return NULL; // Not captured yet
+    }
+    void *values = NULL;
+    if (read(fd, header, sizeof(*header)) != (ssize_t)sizeof(*header) || memcmp(header->magic, CORRECTION_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != CORRECTION_VERSION || header->kind != kind)
+    {
+        log_warn("Ignoring calibration file %s: not a HODR calibration file of the expected kind.", path);
+    }
+    else if (header->npixels != npixels || ((kind == CORRECTION_DARK || kind == CORRECTION_FLAT) && header->count != npixels) || header->count > npixels)
+    {
+        log_warn("Ignoring calibration file %s: taken with %u pixels, detector has %zu.", path, header->npixels, npixels);
+    }
+    else if ((values = malloc(header->count * valueSize + 1)) != NULL &&
+             read(fd, values, header->count * valueSize) != (ssize_t)(header->count * valueSize))
+    {
+        log_warn("Ignoring truncated calibration file %s.", path);
+        free(values);
+        values = NULL;
+    }
+    close(fd);
+    return values;
+}
+
+// Rebuild the list of pixels to replace from the hot pixels and the pixels
+// the flat field gives no gain
+static void updateRepair(HODR_Correction_t *correction)
+{
+    memset(correction->masked, 0, correction->npixels);
+    for (size_t i = 0; i < correction->nhotPixels; i++)
+    {
+        correction->masked[correction->hotPixels[i]] = 1;
+    }
+    correction->nrepair = 0;
+    for (size_t i = 0; i < correction->npixels; i++)
+    {
+        if (correction->gain[i] == 0)
+        {
+            correction->masked[i] = 1;
+        }
+        if (correction->masked[i])
+        {
+            correction->repair[correction->nrepair++] = (uint32_t)i;
+        }
+    }
+}
+
+static void loadMasters(HODR_Correction_t *correction)
+{
+    char path[300];
+    HODR_CalibrationHeader_t header;
+    for (int slot = 0; slot < CORRECTION_MAX_DARKS; slot++)
+    {
+        darkPath(correction, slot, path, sizeof(path));
+        float *data = correction_readCalibration(path, CORRECTION_DARK, correction->npixels, &header, sizeof(float));
+        if (data != NULL)
+        {
+            correction->darks[slot] = (HODR_Dark_t){
+                .exposureTime = header.exposureTime,
+                .temperature = header.temperature,
+                .frames = header.frames,
+                .createdNs = header.createdNs,
+                .data = data,
+            };
+            log_info("Loaded master dark %d: %.6f s at %.1f C, %u frames.", slot, header.exposureTime, header.temperature, header.frames);
+        }
+    }
+
+    snprintf(path, sizeof(path), "%s/flat.cal", correction->directory);
+    float *flat = correction_readCalibration(path, CORRECTION_FLAT, correction->npixels, &header, sizeof(float));
+    if (flat != NULL)
+    {
+        memcpy(correction->gain, flat, correction->npixels * sizeof(float)); // Stored as the gains, ready to use
+        correction->haveFlat = true;
+        free(flat);
+        log_info("Loaded flat field.");
+    }
+
+    snprintf(path, sizeof(path), "%s/hotpixels.cal", correction->directory);
+    uint32_t *hotPixels = correction_readCalibration(path, CORRECTION_HOT_PIXELS, correction->npixels, &header, sizeof(uint32_t));
+    if (hotPixels != NULL)
+    {
+        size_t count = 0;
+        for (uint32_t i = 0; i < header.count; i++)
+        {
+            if (hotPixels[i] < correction->npixels)
+            {
+                hotPixels[count++] = hotPixels[i];
+            }
+        }
+        correction->hotPixels = hotPixels;
+        correction->nhotPixels = count;
+        log_info("Loaded %zu hot pixels.", count);
+    }
+    updateRepair(correction);
+}
+
+// Set up an empty correction for npixels and load the masters kept in
+// directory, creating it if needed. Returns 0 or -1 on error.
+int correction_init(HODR_Correction_t *correction, size_t npixels, const char *directory)
+{
+    memset(correction, 0, sizeof(*correction));
+    correction->npixels = npixels;
+    correction->output = CORRECTION_OUTPUT_RAW;
+    snprintf(correction->directory, sizeof(correction->directory), "%s", directory);
+    correction->gain = malloc(npixels * sizeof(float));
+    correction->masked = calloc(npixels, 1);
+    correction->repair = malloc(npixels * sizeof(uint32_t));
+    if (correction->gain == NULL || correction->masked == NULL || correction->repair == NULL)
+    {
+        log_error("Failed to allocate correction of %zu pixels.", npixels);
+        correction_free(correction);
+        return -1;
+    }
+    for (size_t i = 0; i < npixels; i++)
+    {
+        correction->gain[i] = 1.0f;
+    }
+    if (mkdir(directory, 0755) != 0 && errno != EEXIST)
+    {
+        log_warn("Cannot create calibration directory %s: %s", directory, strerror(errno));
+    }
+    loadMasters(correction);
+    return 0;
+}
+
+void correction_free(HODR_Correction_t *correction)
+{
+    for (int slot = 0; slot < CORRECTION_MAX_DARKS; slot++)
+    {
+        free(correction->darks[slot].data);
+        correction->darks[slot].data = NULL;
+    }
+    free(correction->gain);
+    free(correction->hotPixels);
+    free(correction->masked);
+    free(correction->repair);
+    correction->gain = NULL;
+    correction->hotPixels = NULL;
+    correction->masked = NULL;
+    correction->repair = NULL;
+    correction->nhotPixels = 0;
+    correction->nrepair = 0;
+}
+
+static bool darkMatches(const HODR_Dark_t *dark, float exposureTime, float temperature)
+{
+    return dark->data != NULL && fabsf(dark->exposureTime - exposureTime) <= CORRECTION_EXPOSURE_TOLERANCE * exposureTime &&
+           fabsf(dark->temperature - temperature) <= CORRECTION_TEMPERATURE_TOLERANCE;
+}
+
+// The master dark taken at exposureTime closest to temperature, NULL if none
+// is within the tolerances
+const HODR_Dark_t *correction_findDark(const HODR_Correction_t *correction, float exposureTime, float temperature)
+{
+    const HODR_Dark_t *best = NULL;
+    for (int slot = 0; slot < CORRECTION_MAX_DARKS; slot++)
+    {
+        const HODR_Dark_t *dark = &correction->darks[slot];
+        if (darkMatches(dark, exposureTime, temperature) &&
+            (best == NULL || fabsf(dark->temperature - temperature) < fabsf(best->temperature - temperature)))
+        {
+            best = dark;
+        }
+    }
+    return best;
+}
+
+// Keep a new master dark and save it. It replaces the dark it matches, or
+// else a free entry, or else the oldest. Returns 0 or -1 on error.
+int correction_addDark(HODR_Correction_t *correction, const float *dark, uint32_t frames, float exposureTime, float temperature)
+{
+    int slot = -1;
+    for (int i = 0; i < CORRECTION_MAX_DARKS && slot < 0; i++)
+    {
+        slot = darkMatches(&correction->darks[i], exposureTime, temperature) ? i : -1;
+    }
+    for (int i = 0; i < CORRECTION_MAX_DARKS && slot < 0; i++)
+    {
+        slot = correction->darks[i].data == NULL ? i : -1;
+    }
+    if (slot < 0)
+    {
+        slot = 0;
+        for (int i = 1; i < CORRECTION_MAX_DARKS; i++)
+        {
+            slot = correction->darks[i].createdNs < correction->darks[slot].createdNs ? i : slot;
+        }
+    }
+
+    HODR_Dark_t *entry = &correction->darks[slot];
+    if (entry->data == NULL && (entry->data = malloc(correction->npixels * sizeof(float))) == NULL)
+    {
+        log_error("Failed to allocate master dark.");
+        return -1;
+    }
+    memcpy(entry->data, dark, correction->npixels * sizeof(float));
+    entry->exposureTime = exposureTime;
+    entry->temperature = temperature;
+    entry->frames = frames;
+    entry->createdNs = wallClockNs();
+
+    char path[300];
+    darkPath(correction, slot, path, sizeof(path));
+    HODR_CalibrationHeader_t header = {
+        .kind = CORRECTION_DARK,
+        .npixels = (uint32_t)correction->npixels,
+        .count = (uint32_t)correction->npixels,
+        .frames = frames,
+        .exposureTime = exposureTime,
+        .temperature = temperature,
+        .createdNs = entry->createdNs,
+    };
+    return correction_writeCalibration(path, &header, entry->data, sizeof(float));
+}
+
+// Set the flat field, the detector response of each pixel, and save the
+// gains it gives. Pixels with no response are treated as dead. Returns 0, or
+// -1 if the flat does not fit the detector or cannot be saved.
+int correction_setFlat(HODR_Correction_t *correction, const double *flat, size_t npixels)
+{
+    if (npixels != correction->npixels)
+    {
+        log_warn("Flat field has %zu pixels, detector has %zu.", npixels, correction->npixels);
+        return -1;
+    }
+    double sum = 0;
+    size_t good = 0;
+    for (size_t i = 0; i < npixels; i++)
+    {
+        if (flat[i] > 0)
+        {
+            sum += flat[i];
+            good++;
+        }
+    }
+    if (good == 0)
+    {
+        log_warn("Flat field has no pixel with a response.");
+        return -1;
+    }
+    double mean = sum / (double)good;
+    for (size_t i = 0; i < npixels; i++)
+    {
+        correction->gain[i] = flat[i] > 0 ? (float)(mean / flat[i]) : 0.0f; // Divisions done once here, the frames only multiply
+    }
+    correction->haveFlat = true;
+    updateRepair(correction);
+
+    char path[300];
+    snprintf(path, sizeof(path), "%s/flat.cal", correction->directory);
+    HODR_CalibrationHeader_t header = {.kind = CORRECTION_FLAT, .npixels = (uint32_t)npixels, .count = (uint32_t)npixels};
+    return correction_writeCalibration(path, &header, correction->gain, sizeof(float));
+}
+
+// Set the hot pixels and save them. Returns 0, or -1 if a pixel is off the
+// detector or they cannot be saved.
+int correction_setHotPixels(HODR_Correction_t *correction, const uint32_t *pixels, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        if (pixels[i] >= correction->npixels)
+        {
+            log_warn("Hot pixel %u is off the %zu pixel detector.", pixels[i], correction->npixels);
+            return -1;
+        }
+    }
+    uint32_t *copy = malloc(count * sizeof(uint32_t) + 1);
+    if (copy == NULL)
+    {
+        return -1;
+    }
+    memcpy(copy, pixels, count * sizeof(uint32_t));
+    free(correction->hotPixels);
+    correction->hotPixels = copy;
+    correction->nhotPixels = count;
+    updateRepair(correction);
+
+    char path[300];
+    snprintf(path, sizeof(path), "%s/hotpixels.cal", correction->directory);
+    HODR_CalibrationHeader_t header = {.kind = CORRECTION_HOT_PIXELS, .npixels = (uint32_t)correction->npixels, .count = (uint32_t)count};
+    return correction_writeCalibration(path, &header, copy, sizeof(uint32_t));
+}
+
+// Replace each masked pixel by the mean of the nearest unmasked pixel on
+// either side, or by the one there is at the edges
+static void repairPixels(const HODR_Correction_t *correction, int32_t *data, float *noise)
+{
+    size_t n = correction->npixels;
+    for (size_t r = 0; r < correction->nrepair; r++)
+    {
+        size_t i = correction->repair[r];
+        size_t left = i, right = i;
+        while (left > 0 && correction->masked[left])
+        {
+            left--;
+        }
+        while (right < n - 1 && correction->masked[right])
+        {
+            right++;
+        }
+        bool haveLeft = !correction->masked[left], haveRight = !correction->masked[right];
+        if (haveLeft && haveRight)
+        {
+            data[i] = (int32_t)(((int64_t)data[left] + data[right]) / 2);
+            if (noise != NULL)
+            {
+                noise[i] = 0.5f * sqrtf(noise[left] * noise[left] + noise[right] * noise[right]);
+            }
+        }
+        else if (haveLeft || haveRight)
+        {
+            size_t from = haveLeft ? left : right;
+            data[i] = data[from];
+            if (noise != NULL)
+            {
+                noise[i] = noise[from];
+            }
+        }
+    }
+}
+
+// Correct one spectrum in place: subtract the matching master dark, apply
+// the flat field and repair the masked pixels. noise, if not NULL, is scaled
+// by the same gains. Returns the HODR_RECORD_* flags of the steps applied, 0
+// if no master dark matches and the spectrum was left as it was.
+uint8_t correction_apply(const HODR_Correction_t *correction, int32_t *data, float *noise, float exposureTime, float temperature)
+{
+    const HODR_Dark_t *dark = correction_findDark(correction, exposureTime, temperature);
+    if (dark == NULL)
+    {
+        return 0;
+    }
+    kernels_correct(data, data, dark->data, correction->gain, correction->npixels);
+    uint8_t applied = HODR_RECORD_DARK_SUBTRACTED;
+    if (correction->haveFlat)
+    {
+        applied |= HODR_RECORD_FLAT_FIELDED;
+        for (size_t i = 0; noise != NULL && i < correction->npixels; i++)
+        {
+            noise[i] *= correction->gain[i];
+        }
+    }
+    if (correction->nrepair > 0)
+    {
+        repairPixels(correction, data, noise);
+        applied |= HODR_RECORD_HOT_PIXELS;
+    }
+    return applied;
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// Dark, flat-field and hot-pixel correction.
+//
+// Applied to every spectrum before it is published, so storage and the live
+// consumers all see the corrected pixels. A spectrum is corrected with the
+// master dark taken at its exposure time and the nearest temperature, then
+// multiplied by the reciprocal of the flat field, normalised to a mean of
+// one, in a single vector pass. Hot pixels, and pixels the flat field says
+// are dead, are then replaced by the mean of their nearest good neighbours.
+// A spectrum no master dark matches is left as it was read.
+//
+// Masters are kept as calibration files in a directory of their own and
+// loaded at startup: dark-NN.cal, flat.cal and hotpixels.cal, each a
+// HODR_CalibrationHeader_t followed by count values: the mean dark counts,
+// the reciprocal gains and the hot pixel indices, as float32, float32 and
+// uint32. Callers serialise every call.
+
+#define CORRECTION_MAGIC "HODRCAL"
+#define CORRECTION_VERSION 1
+#define CORRECTION_MAX_DARKS 16
+#define CORRECTION_EXPOSURE_TOLERANCE 0.01f   // Relative exposure difference a dark still matches
+#define CORRECTION_TEMPERATURE_TOLERANCE 2.0f // Degrees Celsius a dark still matches
+
+typedef enum {
+    CORRECTION_OUTPUT_RAW = 0,       // Store spectra as read, correction off
+    CORRECTION_OUTPUT_CORRECTED = 1, // Store corrected spectra only
+    CORRECTION_OUTPUT_BOTH = 2,      // Store corrected spectra with the raw pixels alongside
+} HODR_CorrectionOutput_t;
+
+typedef enum {
+    CORRECTION_DARK = 0,
+    CORRECTION_FLAT = 1,
+    CORRECTION_HOT_PIXELS = 2,
+    CORRECTION_WAVELENGTH = 3, // Pixel to wavelength polynomial, see wavelength.h
+} HODR_CalibrationKind_t;
+
+typedef struct {
+    char magic[8];      // CORRECTION_MAGIC
+    uint32_t version;   // CORRECTION_VERSION
+    uint32_t kind;      // HODR_CalibrationKind_t
+    uint32_t npixels;   // Detector width the master was taken with
+    uint32_t count;     // Values that follow
+    uint32_t frames;    // Frames averaged into a dark
+    float exposureTime; // Seconds, darks only
+    float temperature;  // Degrees Celsius, darks only
+    uint32_t reserved;
+    int64_t createdNs;  // Creation time, ns since the Unix epoch
+} HODR_CalibrationHeader_t;
+
+_Static_assert(sizeof(HODR_CalibrationHeader_t) == 48, "HODR_CalibrationHeader_t must be 48 bytes");
+
+typedef struct {
+    float exposureTime; // Seconds
+    float temperature;  // Degrees Celsius
+    uint32_t frames;    // Frames averaged
+    int64_t createdNs;  // ns since the Unix epoch
+    float *data;        // Mean dark counts per pixel, NULL for a free entry
+} HODR_Dark_t;
+
+typedef struct {
+    size_t npixels;
+    char directory[256];
+    HODR_CorrectionOutput_t output;
+    HODR_Dark_t darks[CORRECTION_MAX_DARKS];
+    bool haveFlat;
+    float *gain;          // Reciprocal of the normalised flat field, 1 without one, 0 for dead pixels
+    uint32_t *hotPixels;  // Hot pixels as configured
+    size_t nhotPixels;
+    uint8_t *masked;      // Pixels replaced by their neighbours: hot or dead
+    uint32_t *repair;     // Indices of the masked pixels, ascending
+    size_t nrepair;
+} HODR_Correction_t;
+
+int correction_init(HODR_Correction_t *correction, size_t npixels, const char *directory);
+void correction_free(HODR_Correction_t *correction);
+
+int correction_writeCalibration(const char *path, HODR_CalibrationHeader_t *header, const void *values, size_t valueSize);
+void *correction_readCalibration(const char *path, HODR_CalibrationKind_t kind, size_t npixels, HODR_CalibrationHeader_t *header, size_t valueSize);
+
+int correction_addDark(HODR_Correction_t *correction, const float *dark, uint32_t frames, float exposureTime, float temperature);
+int correction_setFlat(HODR_Correction_t *correction, const double *flat, size_t npixels);
+int correction_setHotPixels(HODR_Correction_t *correction, const uint32_t *pixels, size_t count);
+const HODR_Dark_t *correction_findDark(const HODR_Correction_t *correction, float exposureTime, float temperature);
+uint8_t correction_apply(const HODR_Correction_t *correction, int32_t *data, float *noise, float exposureTime, float temperature);
@@ -0,0 +1,65 @@
+#include "exposure.h"
+#include "kernels.h"
+#include <math.h>
+
+void exposure_setTarget(HODR_AutoExposure_t *controller, unsigned int target)
+{
+    controller->target = target;
+    controller->proposal = 0; // The next frame proposes a time for the new target
+}
+
+static float clampTime(float time)
+{
+    return time < EXPOSURE_MIN_TIME ? EXPOSURE_MIN_TIME : time > EXPOSURE_MAX_TIME ? EXPOSURE_MAX_TIME : time;
+}
+
+// Take in one frame taken with exposureTime. Returns the integration time to
+// use from the next series, or 0 if the current one is close enough.
+float exposure_update(HODR_AutoExposure_t *controller, float exposureTime, const int32_t *data, size_t npixels)
+{
+    if (controller->target == 0 || npixels == 0 || exposureTime <= 0)
+    {
+        return 0;
+    }
+
+    int32_t peak, offset; // The darkest pixel stands in for the bias level
+    kernels_minMax(data, npixels, &offset, &peak);
+    uint32_t saturated = (uint32_t)kernels_countAtLeast(data, npixels, EXPOSURE_SATURATION);
+    controller->peak = peak;
+    controller->saturated = saturated;
+
+    if (saturated > 0)
+    {
+        // Only a lower bound on the rate: aim below the target as if the peak
+        // were just saturated, by more the wider the saturation. Not damped,
+        // undershooting is safe and the next frame sees the true peak.
+        controller->rate = 0;
+        float headroom = (float)((int32_t)controller->target - offset) / (float)(EXPOSURE_SATURATION - offset);
+        float desired = exposureTime * (headroom > 0 ? headroom : 0) * 0.5f / (1.0f + log2f((float)saturated));
+        controller->proposal = clampTime(desired);
+        return controller->proposal;
+    }
+
+    float rate = (float)(peak - offset) / exposureTime;
+    if (rate <= 0)
+    {
+        return controller->proposal; // A flat frame says nothing about the signal
+    }
+    controller->rate = controller->rate == 0 ? rate : controller->rate + EXPOSURE_SMOOTHING * (rate - controller->rate);
+
+    float predicted = (float)offset + controller->rate * exposureTime;
+    float error = predicted / (float)controller->target;
+    if (error > 1.0f - EXPOSURE_DEADBAND && error < 1.0f + EXPOSURE_DEADBAND)
+    {
+        controller->proposal = 0;
+        return 0;
+    }
+    float signal = (float)controller->target - (float)offset;
+    float desired = signal > 0 ? signal / controller->rate : EXPOSURE_MIN_TIME; // Below the bias level, as dark as possible
+
+    // Damped step in log time, so the response is the same for a factor of
+    // two either way
+    float next = exposureTime * powf(clampTime(desired) / exposureTime, EXPOSURE_DAMPING);
+    controller->proposal = clampTime(next);
+    return controller->proposal;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// Auto-exposure controller.
+//
+// Predicts the integration time that brings the brightest pixel to the
+// target from the frames as they stream past, instead of restarting the
+// acquisition to try values out. Each frame gives an estimate of the signal
+// rate at the peak, (peak - offset) / exposure, which holds whatever
+// integration time the frame was taken with; the estimates are smoothed
+// over recent frames and the step towards the predicted time is damped so
+// the controller settles without overshooting. A saturated frame only gives
+// a lower bound on the rate, so it cuts the time by a factor that grows
+// with the number of saturated pixels.
+//
+// The controller only proposes a time. Changing the exposure needs the
+// camera idle, so the caller applies the proposal at the next series
+// boundary and no frame is thrown away; run till abort is run as
+// back-to-back series to have such boundaries.
+
+#define EXPOSURE_SATURATION 65534     // Counts at or above this are saturated
+#define EXPOSURE_MIN_TIME 1e-5f       // Seconds
+#define EXPOSURE_MAX_TIME 600.0f      // Seconds
+#define EXPOSURE_SMOOTHING 0.3f       // Weight of each new rate estimate
+#define EXPOSURE_DAMPING 0.7f         // Fraction of the step, in log time, taken at once
+#define EXPOSURE_DEADBAND 0.05f       // Relative error from the target that is left alone
+
+typedef struct {
+    unsigned int target; // Target peak counts, 0 when auto-exposure is off
+    float rate;          // Smoothed peak signal rate, counts per second, 0 when unknown
+    float proposal;      // Integration time to apply at the next boundary, 0 for none
+    uint32_t saturated;  // Saturated pixels in the last frame
+    int32_t peak;        // Peak counts in the last frame
+} HODR_AutoExposure_t;
+
+void exposure_setTarget(HODR_AutoExposure_t *controller, unsigned int target);
+float exposure_update(HODR_AutoExposure_t *controller, float exposureTime, const int32_t *data, size_t npixels);
@@ -1,5 +1,6 @@
 #include "hodr.h"
 #include "atmcdLXd.h"
+#include "log.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -21,12 +22,12 @@ unsigned int hodr_init(HODR_Config_t *config, char *andorPath, const char *outFi
     cfg.OUT_FILE[sizeof(cfg.OUT_FILE) - 1] = '\0'; // Ensure null termination
 
     // Initialize the Andor SDK
-    printf("Initializing Andor SDK with path: %s\n", andorPath);
+    log_info("Initializing Andor SDK with path: %s", andorPath);
 
     int result = Initialize(andorPath);
     if (result != DRV_SUCCESS)
     {
-        fprintf(stderr, "Failed to initialize Andor SDK: %d\n", result);
+        log_error("Failed to initialize Andor SDK: %d", result);
         return result; // Error
     }
 
@@ -58,7 +59,7 @@ unsigned int hodr_init(HODR_Config_t *config, char *andorPath, const char *outFi
     hodr_setExposureTime(cfg.INTEGRATION_TIME); // Set integration time
     hodr_setReadMode(cfg.READ_MODE);
     hodr_setShutter(cfg.SHUTTER_TYPE, cfg.SHUTTER_MODE, 0, 0); // Set shutter to fully auto mode
-    printf("Andor SDK initialized successfully.\n");
+    log_info("Andor SDK initialized successfully.");
 
     config = &cfg; // Update the provided configuration pointer
     return DRV_SUCCESS; // Success
@@ -69,10 +70,10 @@ unsigned int hodr_deinit()
     unsigned int result = ShutDown();
     if (result != DRV_SUCCESS)
     {
-        fprintf(stderr, "Failed to shut down Andor SDK: %d\n", result);
+        log_error("Failed to shut down Andor SDK: %d", result);
         return result; // Error
     }
-    printf("Andor SDK shut down successfully.\n");
+    log_info("Andor SDK shut down successfully.");
     return DRV_SUCCESS; // Success
 }
 
@@ -82,7 +83,7 @@ unsigned int hodr_getDetectorSize(int *xpixels, int *ypixels)
     unsigned int result = GetDetector(&x, &y);
     if (result != DRV_SUCCESS)
     {
-        fprintf(stderr, "Failed to get detector size: %d\n", result);
+        log_error("Failed to get detector size: %d", result);
         return -1; // Error
     }
     *xpixels = (int)x;
@@ -97,7 +98,7 @@ unsigned int hodr_setCoolerMode(bool mode)
         unsigned int result = CoolerON();
         if (result != DRV_SUCCESS)
         {
-            fprintf(stderr, "Failed to turn on cooler: %d\n", result);
+            log_error("Failed to turn on cooler: %d", result);
             return -1; // Error
         }
     }
@@ -106,7 +107,7 @@ unsigned int hodr_setCoolerMode(bool mode)
         unsigned int result = CoolerOFF();
         if (result != DRV_SUCCESS)
         {
-            fprintf(stderr, "Failed to turn off cooler: %d\n", result);
+            log_error("Failed to turn off cooler: %d", result);
             return -1; // Error
         }
     }
@@ -128,7 +129,7 @@ unsigned int hodr_getCurrentTemperatureInt(int *temperature)
     unsigned int result = GetTemperature(&temp);
     if (result != DRV_SUCCESS)
     {
-        fprintf(stderr, "Failed to get current temperature: %d\n", result);
+        log_error("Failed to get current temperature: %d", result);
         return result; // Error
     }
     *temperature = temp;
@@ -155,7 +156,7 @@ unsigned int hodr_getTemperatureRange(int *minTemp, int *maxTemp)
     unsigned int result = GetTemperatureRange(minTemp, maxTemp);
     if (result != DRV_SUCCESS)
     {
-        fprintf(stderr, "Failed to get temperature range: %d\n", result);
+        log_error("Failed to get temperature range: %d", result);
     }
     return result;
 }
@@ -165,7 +166,7 @@ unsigned int hodr_setTargetTemperature(int targetTemp)
     unsigned int result = SetTemperature(targetTemp);
     if (result != DRV_SUCCESS)
     {
-        fprintf(stderr, "Failed to set target temperature: %d\n", result);
+        log_error("Failed to set target temperature: %d", result);
     }
     return result;
 }
@@ -175,7 +176,7 @@ unsigned int hodr_setAcquisitionMode(int mode)
     unsigned int result = SetAcquisitionMode(mode);
     if (result != DRV_SUCCESS)
     {
-        fprintf(stderr, "Failed to set acquisition mode: %d\n", result);
+        log_error("Failed to set acquisition mode: %d", result);
     }
 
     hodr_setKineticCycleTime(cfg.INTERVAL);    // Ensure kinetic cycle time is set after changing acquisition mode
@@ -189,7 +190,7 @@ unsigned int hodr_setKineticCycleTime(float time)
     unsigned int result = SetKineticCycleTime(time);
     if (result != DRV_SUCCESS)
     {
-        fprintf(stderr, "Failed to set kinetic cycle time: %d\n", result);
+        log_error("Failed to set kinetic cycle time: %d", result);
     }
     return result;
 }
@@ -199,7 +200,7 @@ unsigned int hodr_setNumberKinetics(int number)
     unsigned int result = SetNumberKinetics(number);
     if (result != DRV_SUCCESS)
     {
-        fprintf(stderr, "Failed to set number of kinetics: %d\n", result);
+        log_error("Failed to set number of kinetics: %d", result);
     }
 
     cfg.SERIES_LENGTH = number; // Update configuration
@@ -211,7 +212,7 @@ unsigned int hodr_setReadMode(int mode)
     unsigned int result = SetReadMode(mode);
     if (result != DRV_SUCCESS)
     {
-        fprintf(stderr, "Failed to set read mode: %d\n", result);
+        log_error("Failed to set read mode: %d", result);
     }
 
     cfg.READ_MODE = mode; // Update configuration
@@ -223,10 +224,11 @@ unsigned int hodr_setShutter(int type, int mode, int closingTime, int openingTim
     unsigned int result = SetShutter(type, mode, closingTime, openingTime);
     if (result != DRV_SUCCESS)
     {
-        fprintf(stderr, "Failed to set shutter: %d\n", result);
+        log_error("Failed to set shutter: %d", result);
     }
 
     cfg.SHUTTER_TYPE = type; // Update configuration
+    cfg.SHUTTER_MODE = mode;
     return result;
 }
 
@@ -235,7 +237,7 @@ unsigned int hodr_setNumberAccumulations(int number)
     unsigned int result = SetNumberAccumulations(number);
     if (result != DRV_SUCCESS)
     {
-        fprintf(stderr, "Failed to set number of accumulations: %d\n", result);
+        log_error("Failed to set number of accumulations: %d", result);
     }
 
     cfg.NUMBER_ACCUMULATIONS = number; // Update configuration
@@ -246,7 +248,7 @@ unsigned int hodr_setExposureTime(float exposureTime)
     unsigned int result = SetExposureTime(exposureTime);
     if (result != DRV_SUCCESS)
     {
-        fprintf(stderr, "Failed to set exposure time: %d\n", result);
+        log_error("Failed to set exposure time: %d", result);
     }
     return result;
 }
@@ -256,13 +258,13 @@ unsigned int hodr_changeExposureTimeDuringSeries(float exposureTime, float *kine
     unsigned int result = AbortAcquisition();
     if (result != DRV_SUCCESS)
     {
-        fprintf(stderr, "Failed to abort acquisition before changing exposure time.\n");
+        log_error("Failed to abort acquisition before changing exposure time.");
         return result; // Error
     }
     result = SetExposureTime(exposureTime);
     if (result != DRV_SUCCESS)
     {
-        fprintf(stderr, "Failed to change exposure time during series: %d\n", result);
+        log_error("Failed to change exposure time during series: %d", result);
         return result; // Error
     }
 
@@ -275,7 +277,7 @@ unsigned int hodr_changeExposureTimeDuringSeries(float exposureTime, float *kine
     result = StartAcquisition(); // Restart acquisition after changing exposure time
     if (result != DRV_SUCCESS)
     {
-        fprintf(stderr, "Failed to restart acquisition after changing exposure time: %d\n", result);
+        log_error("Failed to restart acquisition after changing exposure time: %d", result);
         return result; // Error
     }
 
@@ -293,7 +295,7 @@ unsigned int hodr_startAcquisition()
     cfg.ACQ_FLAG = 0; // Reset acquisition flag
     if (result != DRV_SUCCESS)
     {
-        fprintf(stderr, "Failed to start acquisition: %d\n", result);
+        log_error("Failed to start acquisition: %d", result);
     }
 
     return result;
@@ -321,7 +323,7 @@ unsigned int hodr_getStatus(int *status)
     unsigned int result = GetStatus(status);
     if (result != DRV_SUCCESS)
     {
-        fprintf(stderr, "Failed to get status: %d\n", result);
+        log_error("Failed to get status: %d", result);
     }
     return result;
 }
@@ -335,7 +337,7 @@ unsigned int hodr_getAcquiredData(int32_t *data, size_t size)
     {
         char acq_err_buffer[256];
         hodr_getDataAcquisitionStatusString(result, acq_err_buffer, sizeof(acq_err_buffer));
-        fprintf(stderr, "Failed to get acquired data: ERROR %d - %s\n", result, acq_err_buffer);
+        log_error("Failed to get acquired data: ERROR %d - %s", result, acq_err_buffer);
         return result; // Error
     }
     cfg.NUMBER_ACQUISITIONS++; // Increment the number of acquisitions in the configuration
@@ -345,12 +347,15 @@ unsigned int hodr_getAcquiredData(int32_t *data, size_t size)
 
 unsigned int hodr_getImages(int32_t firstNewImageIndex, int32_t lastNewImageIndex, int32_t *data, size_t size, int32_t *validFirst, int32_t *validLast)
 {
-    unsigned int result = GetImages(firstNewImageIndex, lastNewImageIndex, data, size, validFirst, validLast);
+    long first = 0, last = 0; // The SDK reports image indices as long
+    unsigned int result = GetImages(firstNewImageIndex, lastNewImageIndex, data, size, &first, &last);
+    *validFirst = (int32_t)first;
+    *validLast = (int32_t)last;
     if (result != DRV_SUCCESS)
     {
-        fprintf(stderr, "Failed to get images: %d\n", result);
+        log_errorEvery(1000, "Failed to get images: %d", result);
     }
-    return DRV_SUCCESS; // Success
+    return result;
 }
 
 unsigned int hodr_getMostRecentImage(int32_t *data, size_t size)
@@ -358,7 +363,7 @@ unsigned int hodr_getMostRecentImage(int32_t *data, size_t size)
     unsigned int result = GetMostRecentImage(data, size);
     if (result != DRV_SUCCESS)
     {
-        fprintf(stderr, "Failed to get most recent image: %d\n", result);
+        log_errorEvery(1000, "Failed to get most recent image: %d", result);
     }
     return result;
 }
@@ -368,7 +373,7 @@ unsigned int hodr_getAcquisitionTimings(float *exposureTime, float *kineticCycle
     unsigned int result = GetAcquisitionTimings(exposureTime, kineticCycleTime, readoutTime);
     if (result != DRV_SUCCESS)
     {
-        fprintf(stderr, "Failed to get acquisition timings: %d\n", result);
+        log_errorEvery(1000, "Failed to get acquisition timings: %d", result);
         return result; // Error
     }
     return DRV_SUCCESS; // Success
@@ -378,7 +383,7 @@ unsigned int hodr_abortAcquisition()
     unsigned int result = AbortAcquisition();
     if (result != DRV_SUCCESS)
     {
-        fprintf(stderr, "Failed to abort acquisition: %d\n", result);
+        log_error("Failed to abort acquisition: %d", result);
     }
     return result;
 }
@@ -388,7 +393,7 @@ unsigned int hodr_shutDown()
     unsigned int result = ShutDown();
     if (result != DRV_SUCCESS)
     {
-        fprintf(stderr, "Failed to shut down Andor SDK: %d\n", result);
+        log_error("Failed to shut down Andor SDK: %d", result);
         return result; // Error
     }
     return DRV_SUCCESS; // Success
@@ -472,6 +477,11 @@ unsigned int hodr_getAcquisitionMode()
     return cfg.ACQUISITION_MODE; // Return the current acquisition mode
 }
 
+int hodr_getNumberKinetics()
+{
+    return cfg.SERIES_LENGTH; // Return the number of frames in a kinetic series
+}
+
 unsigned int hodr_getReadMode()
 {
     return cfg.READ_MODE; // Return the current read mode
@@ -481,21 +491,41 @@ unsigned int hodr_getShutterType()
     return cfg.SHUTTER_TYPE; // Return the current shutter type
 }
 
+unsigned int hodr_getShutterMode()
+{
+    return cfg.SHUTTER_MODE; // Return the current shutter mode
+}
+
 unsigned int hodr_getNumberNewImages(int32_t *firstNewImageIndex, int32_t *lastNewImageIndex)
 {
-    unsigned int result = GetNumberNewImages(firstNewImageIndex, lastNewImageIndex);
+    long first = 0, last = 0; // The SDK reports image indices as long
+    unsigned int result = GetNumberNewImages(&first, &last);
+    *firstNewImageIndex = (int32_t)first;
+    *lastNewImageIndex = (int32_t)last;
+    if (result != DRV_SUCCESS && result != DRV_NO_NEW_DATA) // No new data just means the buffer has been drained
+    {
+        log_errorEvery(1000, "Failed to get number of new images: %d", result);
+    }
+    return result;
+}
+
+unsigned int hodr_getTotalNumberImagesAcquired(int32_t *index)
+{
+    long total = 0; // Index of the newest image of the current acquisition
+    unsigned int result = GetTotalNumberImagesAcquired(&total);
+    *index = (int32_t)total;
     if (result != DRV_SUCCESS)
     {
-        fprintf(stderr, "Failed to get number of new images: %d\n", result);
+        log_errorEvery(1000, "Failed to get total number of images acquired: %d", result);
     }
-    return result; // Success
+    return result;
 }
 
 unsigned int hodr_getOutFile(char *outFile, size_t size)
 {
     if (size < sizeof(cfg.OUT_FILE))
     {
-        fprintf(stderr, "Buffer size is too small for output file path\n");
+        log_error("Buffer size is too small for output file path");
         return -1; // Error
     }
     strncpy(outFile, cfg.OUT_FILE, size);
@@ -506,7 +536,7 @@ unsigned int hodr_setOutFile(const char *outFile)
 {
     if (strlen(outFile) >= sizeof(cfg.OUT_FILE))
     {
-        fprintf(stderr, "Output file path is too long\n");
+        log_error("Output file path is too long");
         return -1; // Error
     }
     strncpy(cfg.OUT_FILE, outFile, sizeof(cfg.OUT_FILE) - 1);
@@ -15,28 +15,60 @@
 #include <pthread.h>
 #include <semaphore.h>
 #include <gio/gio.h>
+#include <gio/gunixfdlist.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include "control.h"
+#include "store.h"
+#include "writer.h"
+#include "ring.h"
+#include "shm.h"
+#include "log.h"
+#include "metrics.h"
+#include "exposure.h"
+#include "kernels.h"
+#include "coadd.h"
+#include "correction.h"
+#include "wavelength.h"
+#include "query.h"
 
 #define SHUTTER_TYP_OPEN_LOW 0
 #define SHUTTER_TYP_OPEN_HIGH 1
 #define SHUTTER_MODE_FULLY_AUTO 0
 #define READ_MODE_FVB 0
+#define ACQ_MODE_KINETICS 3      // Series of a set number of frames
+#define ACQ_MODE_RUN_TILL_ABORT 5 // Frames until aborted
+#define MAX_FRAME_GAPS 32         // Most recent frame gaps published on D-Bus
+#define MAX_SPECTRA_BATCH 1024    // Most spectra returned by one get_spectra call
+#define SHARED_RING_LENGTH 256    // Spectra kept in the shared-memory ring for local clients
+#define NOTIFY_INTERVAL_MS 20     // Shortest time between two NewSpectrum signals
+
+typedef struct {
+    uint32_t spectrumID;    // Spectrum stored after the gap
+    uint64_t missingFrames; // Frames the camera took that were never stored
+} HODR_FrameGap_t;
+#define FRAME_RING_LENGTH 1024  // Spectra buffered between processing and the consumers
+#define READOUT_RING_LENGTH 256 // Raw frames buffered between readout and processing
+#define RAW_DARK 0              // coadded of a raw frame taken for a master dark
+#define CHAINED_SERIES_SECS 1.0f // Length of each series of a chained run-till-abort acquisition
 
 pthread_mutex_t lock;
 pthread_mutex_t endThreadLock;
-pthread_mutex_t dataFileLock;        // Mutex for data file operations
 pthread_mutex_t acquisitionLoopLock; // Mutex for acquisition loop operations
 bool endThread = false;              // Flag to signal the command thread to end
 
-unsigned int targetIntensity = 0; // Target intensity for the acquisition
+atomic_uint targetIntensity = 0; // Target intensity for the acquisition, 0 turns auto-exposure off
+float pendingExposure = 0;        // Auto-exposure time waiting for the next series boundary, 0 for none
+float appliedExposure = 0;        // Auto-exposure time applied since the last db_notify, 0 for none
+_Atomic float exposureInEffect = 0; // Time auto-exposure last set, frames taken with another are not used, 0 for any
+bool chainingSeries = false;      // Run-till-abort runs as back-to-back kinetic series, so auto-exposure can apply times
+int chainRestoreSeriesLength;     // Series length to go back to once chaining stops
 
 char andorFile[256] = "../miniforge3/pkgs/andor2-sdk-2.104.30064-0/etc/andor/";
-char outFile[256]; // Output file for data
+char outFile[320]; // Data file at startup, the writer moves on to a new one every day
+uint32_t dataFileFlags = 0; // HODR_FILE_* of a new data file, an existing one keeps its own
+uint64_t maxPartitionBytes = 0; // Size at which the writer starts a new data file, 0 for daily files only
 
-int countLines();
-int createDataFile(char *directory, char *filename);
-int appendToFile(const char *filename, int spectrumID, float *exposureTime, double *temperature, const int32_t *data, size_t size);
 int readCommandThread(void *arg);
 static void dbusOnNameAcquired(GDBusConnection *connection, const gchar *name, gpointer user_data);
 
@@ -45,7 +77,22 @@ static gboolean db_deactivateHodr(Control *control, GDBusMethodInvocation *invoc
 static gboolean db_resetHodr(Control *control, GDBusMethodInvocation *invocation, gpointer user_data);
 static gboolean db_setTemperature(Control *control, GDBusMethodInvocation *invocation, gint32 value, gpointer user_data);
 static gboolean db_getTemperature(gpointer control);
-static gboolean db_updateNCaptures(gpointer control);
+static gboolean db_notify(gpointer user_data);
+static gboolean db_watchAcquisition(gpointer user_data);
+static void requestNotify();
+static void updateAcquisitionStatus();
+static void applyPendingExposure();
+static void startNextSeries();
+static void restoreRunTillAbort();
+static int chainedSeriesFrames();
+static void finishDarkCapture();
+static void drainNewFrames();
+static void endSeries(uint16_t darkFramesWanted);
+static GVariant *masterDarksVariant();
+static GVariant *wavelengthCoefficientsVariant();
+static void setActive(Control *control, gboolean active);
+static void onSpectraCommitted(uint32_t committed);
+static GVariant *frameGapsVariant();
 static gboolean db_setIntegrationTime(Control *control, GDBusMethodInvocation *invocation, gdouble int_time, gpointer user_data);
 static gboolean db_stopLive(Control *control, GDBusMethodInvocation *invocation, gpointer user_data);
 static gboolean db_exitMainLoop(Control *control, GDBusMethodInvocation *invocation, gpointer user_data);
@@ -53,11 +100,27 @@ static gboolean db_startAcquisition(Control *control, GDBusMethodInvocation *inv
 static gboolean db_setAcquisitionMode(Control *control, GDBusMethodInvocation *invocation, guint32 mode, gpointer user_data);
 static gboolean db_stopAcquisition(Control *control, GDBusMethodInvocation *invocation, gpointer user_data);
 static gboolean db_setInterval(Control *control, GDBusMethodInvocation *invocation, gdouble interval, gpointer user_data);
-static gboolean db_getLastSpectrum(Control *control, GDBusMethodInvocation *invocation, gpointer user_data);
+static gboolean db_getSpectrum(Control *control, GDBusMethodInvocation *invocation, gint spectrum_id, gpointer user_data);
+static gboolean db_getSpectra(Control *control, GDBusMethodInvocation *invocation, guint first, guint count, gpointer user_data);
+static gboolean db_querySpectra(Control *control, GDBusMethodInvocation *invocation, gint64 start_ns, gint64 end_ns, gdouble min_exposure, gdouble max_exposure, gboolean stabilized_only, guint from_id, guint count, gpointer user_data);
+static gboolean db_getSharedRing(Control *control, GDBusMethodInvocation *invocation, GUnixFDList *fd_list, gpointer user_data);
 static gboolean db_setTargetIntensity(Control *control, GDBusMethodInvocation *invocation, guint intensity, gpointer user_data);
+static gboolean db_setCsvExport(Control *control, GDBusMethodInvocation *invocation, gboolean enable, gpointer user_data);
+static gboolean db_getMetrics(Control *control, GDBusMethodInvocation *invocation, gpointer user_data);
+static gboolean db_setCoadd(Control *control, GDBusMethodInvocation *invocation, guint frames, gpointer user_data);
+static gboolean db_captureDark(Control *control, GDBusMethodInvocation *invocation, guint frames, gpointer user_data);
+static gboolean db_setFlat(Control *control, GDBusMethodInvocation *invocation, GVariant *flat, gpointer user_data);
+static gboolean db_setHotPixels(Control *control, GDBusMethodInvocation *invocation, GVariant *pixels, gpointer user_data);
+static gboolean db_setCorrectionOutput(Control *control, GDBusMethodInvocation *invocation, guint output, gpointer user_data);
+static gboolean db_setWavelengthCalibration(Control *control, GDBusMethodInvocation *invocation, GVariant *coefficients, gpointer user_data);
+static gboolean db_setWavelengthGrid(Control *control, GDBusMethodInvocation *invocation, gdouble start, gdouble step, guint points, gpointer user_data);
 // static gboolean db_getData(Control *control, GDBusMethodInvocation *invocation, gint ref, gpointer user_data);
 
 void *handleAcquisitionLoop();
+void *handleAutoExposure();
+void *handleLiveFrames();
+void *handleSharedRing();
+void *handleProcessing();
 
 char dataDir[256] = "../candor_data"; // Directory for data files
 
@@ -66,11 +129,54 @@ double lastTargetTemperature = 0.0; // Last target temperature set
 int lastTemperatureStatus = 0;      // Last temperature status read from the device
 
 uint32_t nTriggeredSpectra = 0; // Number of triggered spectra
-uint32_t nCapturedSpectra = 0;  // Number of captured spectra
+uint32_t nCapturedSpectra = 0;  // Number of captured spectra, written ones are counted by the writer
+uint32_t firstSpectrumID = 0;   // ID of the first frame published to the ring
+
+HODR_Ring_t readoutRing;                  // Raw frames handed from readout to processing
+HODR_RingConsumer_t *processingConsumer;  // Co-adds, corrects and resamples raw frames into frameRing
+HODR_Ring_t frameRing;                    // Spectra handed from processing to storage, D-Bus and auto-exposure
+HODR_RingConsumer_t *exposureConsumer;    // Lossy, auto-exposure only needs the newest frame
+HODR_RingConsumer_t *liveConsumer;        // Lossy, keeps latestFrame up to date
+HODR_RingConsumer_t *sharedConsumer;      // Lossy, copies frames into sharedRing
+HODR_Shm_t sharedRing;                    // Shared-memory ring handed to local clients
+pthread_mutex_t latestFrameLock;          // Mutex for latestFrame
+HODR_FrameSlot_t latestFrame;             // Newest frame copied out of the ring, served by get_data
+bool haveLatestFrame = false;             // Set once latestFrame holds a frame
+
+int32_t nextImageIndex = 1;                // SDK index of the next frame expected from the current acquisition
+bool seriesEndPending = false;             // The end of a series is still to be handed to processing
+uint16_t seriesEndDarkFrames = 0;          // Frames the dark capture that ended asked for, 0 after other series
+pthread_mutex_t gapLock;                   // Guards droppedFrames and the gap list, updated by processing
+uint64_t droppedFrames = 0;                // Frames the camera took that never reached the ring
+uint64_t nFrameGaps = 0;                   // Gaps in the frame sequence so far
+HODR_FrameGap_t frameGaps[MAX_FRAME_GAPS]; // Most recent gaps, gap n is at n % MAX_FRAME_GAPS
+
+unsigned int coaddFrames = 1; // Frames co-added per spectrum in kinetic series, readout tags each frame with it
+HODR_Coadd_t coadd;           // Frames summed into the next co-added spectrum, processing only
+uint32_t coaddGapBefore = 0;  // Frames lost before the next spectrum, processing only
+uint64_t mergedFrames = 0;    // Frames folded into co-added spectra besides the first of each
+
+HODR_Correction_t correction;      // Master darks, flat field and hot pixels applied to every spectrum
+pthread_mutex_t calibrationLock;   // Held to change correction or wavelength or use them outside lock
+HODR_Coadd_t darkFrames;           // Frames of the dark being captured, processing only
+bool capturingDark = false;        // A dark capture series is running, its frames are not stored
+unsigned int darkFramesWanted = 0; // Frames the dark capture asked for
+int darkRestoreMode;               // Acquisition mode to go back to after the dark capture
+int darkRestoreShutterMode;        // Shutter mode to go back to after the dark capture
+atomic_bool darksChanged = false;  // The master darks changed since the last db_notify
+
+HODR_Wavelength_t wavelength; // Pixel to wavelength calibration and the grid spectra are resampled to
 
 int xpixels, ypixels; // Detector size
 GMainLoop *loop;
 
+Control *notifyControl = NULL;         // Exported control object, only used from the main loop
+atomic_bool notifyPending = false;     // A db_notify call is scheduled
+atomic_int acquisitionStatus = -1;     // Last status read from the SDK, -1 before the first read
+uint32_t notifiedSpectra = 0;          // Spectra announced with NewSpectrum so far, main loop only
+int64_t lastNotifyNs = 0;              // Monotonic time of the last db_notify run, main loop only
+guint acquisitionWatch = 0;            // Source of db_watchAcquisition while acquiring, main loop only
+
 guint dataWaitFunctionRef;
 
 HODR_Config_t *hodr_cfg; // Pointer to HODR configuration structure
@@ -78,6 +184,10 @@ HODR_Config_t *hodr_cfg; // Pointer to HODR configuration structure
 bool andorActive = false; // Flag to indicate if Andor SDK is active
 
 pthread_t acqThread;
+pthread_t exposureThread;
+pthread_t liveThread;
+pthread_t sharedThread;
+pthread_t processingThread;
 
 void signalHandler(int signal)
 {
@@ -95,70 +205,156 @@ void signalHandler(int signal)
 
 int main()
 {
+    log_init(); // Everything logged from here on is written by the log thread
+    kernels_init(); // Pick the frame kernels for this CPU before any frame arrives
 
     pthread_mutex_init(&lock, NULL);                // Initialize the mutex
     pthread_mutex_init(&endThreadLock, NULL);       // Initialize the end thread mutex
-    pthread_mutex_init(&dataFileLock, NULL);        // Initialize the data file mutex
     pthread_mutex_init(&acquisitionLoopLock, NULL); // Initialize the acquisition loop mutex
+    pthread_mutex_init(&latestFrameLock, NULL);     // Initialize the latest frame mutex
+    pthread_mutex_init(&calibrationLock, NULL);     // Initialize the calibration mutex
+    pthread_mutex_init(&gapLock, NULL);             // Initialize the frame gap mutex
 
     if (hodr_init(hodr_cfg, andorFile, outFile, true) != DRV_SUCCESS)
     {
-        fprintf(stderr, "Failed to initialize HODR.\n");
+        log_error("Failed to initialize HODR.");
         return EXIT_FAILURE; // Initialization failed
     }
 
     andorActive = true; // Set Andor SDK active flag
 
-    int dataFileLength = createDataFile(dataDir, outFile); // Create data file
-    if (dataFileLength < 0)
+    hodr_getDetectorSize(&xpixels, &ypixels); // Get detector size, needed for the data file header
+
+    const char *dataDirOverride = getenv("HODR_DATA_DIR"); // Lets benchmarks and tests keep their files apart
+    if (dataDirOverride != NULL && dataDirOverride[0] != '\0')
+    {
+        snprintf(dataDir, sizeof(dataDir), "%s", dataDirOverride);
+    }
+    const char *storeCodec = getenv("HODR_STORE_CODEC"); // "packed" compresses new data files, for small storage
+    if (storeCodec != NULL && strcmp(storeCodec, "packed") == 0)
+    {
+        dataFileFlags |= HODR_FILE_PACKED;
+    }
+    const char *partitionSize = getenv("HODR_PARTITION_MB"); // Also start a new data file once one reaches this size
+    if (partitionSize != NULL && partitionSize[0] != '\0')
+    {
+        maxPartitionBytes = strtoull(partitionSize, NULL, 10) * 1024 * 1024;
+    }
+
+    if (ring_init(&readoutRing, READOUT_RING_LENGTH, (size_t)xpixels) != 0 || ring_init(&frameRing, FRAME_RING_LENGTH, (size_t)xpixels) != 0)
+    {
+        log_error("Failed to allocate frame ring.");
+        return EXIT_FAILURE;
+    }
+    if (coadd_init(&coadd, (size_t)xpixels) != 0 || coadd_init(&darkFrames, (size_t)xpixels) != 0)
+    {
+        log_error("Failed to allocate co-adding buffers.");
+        return EXIT_FAILURE;
+    }
+    char calibrationDir[300];
+    snprintf(calibrationDir, sizeof(calibrationDir), "%s/calibration", dataDir); // Masters outlive the data files
+    if (correction_init(&correction, (size_t)xpixels, calibrationDir) != 0)
+    {
+        log_error("Failed to set up spectrum correction.");
+        return EXIT_FAILURE;
+    }
+    if (wavelength_init(&wavelength, (size_t)xpixels, calibrationDir) != 0)
+    {
+        log_error("Failed to set up wavelength calibration.");
+        return EXIT_FAILURE;
+    }
+
+    processingConsumer = ring_addConsumer(&readoutRing, "processing", false); // Every raw frame is processed
+    if (processingConsumer == NULL)
+    {
+        log_error("Failed to register the frame processing consumer.");
+        return EXIT_FAILURE;
+    }
+
+    writer_setCommitCallback(onSpectraCommitted); // Spectra are announced once they are on disk
+    if (writer_start(&frameRing, dataDir, (uint32_t)xpixels, dataFileFlags, maxPartitionBytes) != 0)
+    {
+        log_error("Failed to start data file writer.");
+        return EXIT_FAILURE;
+    }
+    nCapturedSpectra = writer_committedSpectra(); // Spectrum IDs continue from the existing data files
+    firstSpectrumID = nCapturedSpectra;
+    writer_dataPath(outFile, sizeof(outFile));
+
+    // Every consumer is registered before readout starts publishing
+    exposureConsumer = ring_addConsumer(&frameRing, "auto-exposure", true);
+    liveConsumer = ring_addConsumer(&frameRing, "dbus", true);
+    sharedConsumer = ring_addConsumer(&frameRing, "shared memory", true);
+    latestFrame.data = calloc((size_t)xpixels, sizeof(int32_t));
+    if (exposureConsumer == NULL || liveConsumer == NULL || sharedConsumer == NULL || latestFrame.data == NULL)
+    {
+        log_error("Failed to register frame ring consumers.");
+        return EXIT_FAILURE;
+    }
+    if (shm_create(&sharedRing, SHARED_RING_LENGTH, (uint32_t)xpixels) != 0)
     {
-        fprintf(stderr, "Failed to create data file.\n");
-        return EXIT_FAILURE; // File creation failed
+        log_error("Failed to create shared spectrum ring.");
+        return EXIT_FAILURE;
     }
+    pthread_create(&exposureThread, NULL, handleAutoExposure, NULL); // Create a thread for auto-exposure
+    pthread_create(&liveThread, NULL, handleLiveFrames, NULL);       // Create a thread for the live frame cache
+    pthread_create(&sharedThread, NULL, handleSharedRing, NULL);     // Create a thread for the shared-memory ring
+    pthread_create(&processingThread, NULL, handleProcessing, NULL); // Create a thread for correcting and resampling frames
 
     signal(SIGTERM, signalHandler); // Register signal handler for SIGINT
     signal(SIGINT, signalHandler);  // Register signal handler for SIGTERM
     hodr_setCoolerMode(true);       // Turn on the cooler
 
-    hodr_getDetectorSize(&xpixels, &ypixels); // Get detector size
-
     float currentTemp;
     hodr_getCurrentTemperatureFloat(&currentTemp); // Get current temperature
 
     int minTemp, maxTemp;
     hodr_getTemperatureRange(&minTemp, &maxTemp); // Get temperature range
 
-    printf("HODR initialized successfully.\n");
-    printf("Starting D-Bus server...\n");
+    log_info("HODR initialized successfully.");
+    log_info("Starting D-Bus server...");
     loop = g_main_loop_new(NULL, FALSE);
     if (loop == NULL)
     {
-        fprintf(stderr, "Failed to create GMainLoop.\n");
+        log_error("Failed to create GMainLoop.");
         return EXIT_FAILURE; // Loop creation failed
     }
 
     g_bus_own_name(G_BUS_TYPE_SESSION, "hodr.server.Control", G_BUS_NAME_OWNER_FLAGS_NONE, NULL, dbusOnNameAcquired, NULL, NULL, NULL);
-    printf("D-Bus server started successfully.\n");
-    printf("Waiting for D-Bus name acquisition...\n");
+    log_info("D-Bus server started successfully.");
+    log_info("Waiting for D-Bus name acquisition...");
     g_main_loop_run(loop); // Start the main loop
 
-    printf("Command thread finished.\n");
+    log_info("Command thread finished.");
     CancelWait();
 
     // pthread_join(acqThread, NULL); // Wait for the acquisition thread to finish
     //  Clean up and shut down the Andor SDK
-    AbortAcquisition(); // Abort acquisition if needed
+    AbortAcquisition();        // Abort acquisition if needed
+    ring_close(&readoutRing);  // Stop readout publishing and let processing finish the raw frames
+    pthread_join(processingThread, NULL);
+    ring_close(&frameRing);    // Stop publishing and wake the consumers
+    writer_stop();             // Flush frames still in the ring to the data file
+    pthread_join(exposureThread, NULL);
+    pthread_join(liveThread, NULL);
+    pthread_join(sharedThread, NULL);
+    shm_destroy(&sharedRing); // Clients keep their own mappings
+    log_info("Frame ring: %lu frames published, %lu failed claims, high water %lu.",
+           (unsigned long)ring_head(&frameRing), (unsigned long)ring_failedClaims(&frameRing), (unsigned long)ring_highWater(&frameRing));
+    log_info("Frames: %lu taken by the camera, %lu dropped in %lu gaps, %u spectra in the data file.",
+           (unsigned long)(ring_head(&frameRing) + mergedFrames + droppedFrames), (unsigned long)droppedFrames, (unsigned long)nFrameGaps, writer_committedSpectra());
 
     CoolerOFF(); // Turn off the cooler
 
     ShutDown();
-    printf("Andor SDK shut down successfully.\n");
+    log_info("Andor SDK shut down successfully.");
+    log_stop();
     return EXIT_SUCCESS;
 }
 
 static void dbusOnNameAcquired(GDBusConnection *connection, const gchar *name, gpointer)
 {
-    printf("D-Bus name '%s' acquired successfully.\n", name);
+    log_info("D-Bus name '%s' acquired successfully.", name);
     Control *control = control_skeleton_new();                                                         // Create a new Control skeleton
     g_signal_connect(control, "handle-reset", G_CALLBACK(db_resetHodr), NULL);                         // Connect the signal for resetting HODR
     g_signal_connect(control, "handle-activate", G_CALLBACK(db_activateHodr), NULL);                   // Connect the signal for activating HODR
@@ -171,20 +367,44 @@ static void dbusOnNameAcquired(GDBusConnection *connection, const gchar *name, g
     g_signal_connect(control, "handle-set_target_intensity", G_CALLBACK(db_setTargetIntensity), NULL); // Connect the signal for setting target intensity
     g_signal_connect(control, "handle-set_interval", G_CALLBACK(db_setInterval), NULL);                // Connect the signal for setting interval
     g_signal_connect(control, "handle-stop_live", G_CALLBACK(db_stopLive), NULL);                      // Connect the signal for stopping live mode
-    g_signal_connect(control, "handle-get_data", G_CALLBACK(db_getLastSpectrum), NULL);                // Connect the signal for getting data
+    g_signal_connect(control, "handle-get_data", G_CALLBACK(db_getSpectrum), NULL);                    // Connect the signal for getting data
+    g_signal_connect(control, "handle-get_spectra", G_CALLBACK(db_getSpectra), NULL);                  // Connect the signal for getting a batch of spectra
+    g_signal_connect(control, "handle-query_spectra", G_CALLBACK(db_querySpectra), NULL);              // Connect the signal for querying spectra by time
+    g_signal_connect(control, "handle-get_shared_ring", G_CALLBACK(db_getSharedRing), NULL);           // Connect the signal for handing out the shared-memory ring
     g_signal_connect(control, "handle-exit", G_CALLBACK(db_exitMainLoop), NULL);                       // Connect the signal for exiting the application
+    g_signal_connect(control, "handle-set_csv_export", G_CALLBACK(db_setCsvExport), NULL);             // Connect the signal for toggling CSV export
+    g_signal_connect(control, "handle-get_metrics", G_CALLBACK(db_getMetrics), NULL);                  // Connect the signal for getting latency metrics
+    g_signal_connect(control, "handle-set_coadd", G_CALLBACK(db_setCoadd), NULL);                      // Connect the signal for setting the frames co-added per spectrum
+    g_signal_connect(control, "handle-capture_dark", G_CALLBACK(db_captureDark), NULL);                // Connect the signal for capturing a master dark
+    g_signal_connect(control, "handle-set_flat", G_CALLBACK(db_setFlat), NULL);                        // Connect the signal for setting the flat field
+    g_signal_connect(control, "handle-set_hot_pixels", G_CALLBACK(db_setHotPixels), NULL);             // Connect the signal for setting the hot pixels
+    g_signal_connect(control, "handle-set_correction_output", G_CALLBACK(db_setCorrectionOutput), NULL); // Connect the signal for choosing what is stored
+    g_signal_connect(control, "handle-set_wavelength_calibration", G_CALLBACK(db_setWavelengthCalibration), NULL); // Connect the signal for setting the wavelength calibration
+    g_signal_connect(control, "handle-set_wavelength_grid", G_CALLBACK(db_setWavelengthGrid), NULL);   // Connect the signal for setting the resampling grid
 
     pthread_create(&acqThread, NULL, handleAcquisitionLoop, NULL); // Create a thread for handling acquisition loop
     control_set_live(control, TRUE);                               // Initialize live status to TRUE
     control_set_active(control, TRUE);                             // Set the control object as active
-    int nSpectra = countLines();
-    if (nSpectra >= 0)
-        nCapturedSpectra = (uint32_t)nSpectra;
-    control_set_number_spectra(control, nCapturedSpectra);                 // Initialize number of spectra to 0
+    control_set_number_spectra(control, writer_committedSpectra());      // Initialize number of spectra from the data file
     control_set_data_path(control, outFile);                       // Set the data path in the control object
-    printf("D-Bus name acquired successfully.\n");
+    control_set_csv_export(control, writer_getCsvExport());        // Set the CSV export flag in the control object
+    control_set_coadd_frames(control, coaddFrames);                // Set the frames co-added per spectrum in the control object
+    control_set_correction_output(control, correction.output);     // Set what is stored of the corrected spectra in the control object
+    control_set_master_darks(control, masterDarksVariant());       // Set the master darks loaded at startup in the control object
+    control_set_wavelength_coefficients(control, wavelengthCoefficientsVariant()); // Set the wavelength calibration loaded at startup in the control object
+    control_set_wavelength_grid(control, g_variant_new("(ddu)", wavelength.gridStart, wavelength.gridStep, wavelength.gridPoints)); // Set the resampling grid in the control object
+    control_set_ring_failed_claims(control, ring_failedClaims(&frameRing)); // Set the frame ring failed claim count in the control object
+    control_set_ring_high_water(control, ring_highWater(&frameRing)); // Set the frame ring high-water mark in the control object
+    control_set_dropped_frames(control, droppedFrames);              // Set the dropped frame count in the control object
+    control_set_frame_gaps(control, frameGapsVariant());             // Set the recent frame gaps in the control object
+    notifiedSpectra = writer_committedSpectra();                     // Only spectra committed from now on are announced
+    notifyControl = control;
+    metrics_lock(&lock, METRIC_LOCK_WAIT);
+    updateAcquisitionStatus(); // Initial status, changes are picked up where they happen
+    pthread_mutex_unlock(&lock);
+    log_info("D-Bus name acquired successfully.");
     g_timeout_add_seconds(1, db_getTemperature, control);                                                           // Schedule next temperature check
-    g_timeout_add_seconds(1, db_updateNCaptures, control);                                                          // Schedule next update of number of captures
+    requestNotify();                                                                                                // Publish the acquisition status and counters
     g_dbus_interface_skeleton_export(G_DBUS_INTERFACE_SKELETON(control), connection, "/hodr/server/Control", NULL); // Export the control interface on D-Bus
 }
 
@@ -193,18 +413,18 @@ static gboolean db_activateHodr(Control *control, GDBusMethodInvocation *invocat
     if (andorActive) // Check if Andor SDK is already active
     {
         control_complete_activate(control, invocation, TRUE); // Complete the D-Bus method invocation with success
-        control_set_active(control, TRUE);                    // Set the control object as active
+        setActive(control, TRUE);                             // Set the control object as active
         return TRUE;                                          // HODR is already active
     }
-    pthread_mutex_lock(&lock); // Lock the mutex to ensure thread safety
-    printf("Activating HODR...\n");
+    metrics_lock(&lock, METRIC_LOCK_WAIT); // Lock the mutex to ensure thread safety
+    log_info("Activating HODR...");
     unsigned int result = hodr_init(hodr_cfg, andorFile, outFile, false); // Initialize HODR
     if (result == DRV_SUCCESS)
     {
         andorActive = true;                                   // Set Andor SDK active flag to TRUE
-        control_set_active(control, TRUE);                    // Set the control object as active
+        setActive(control, TRUE);                             // Set the control object as active
         control_complete_activate(control, invocation, TRUE); // Complete the D-Bus method invocation with success
-        printf("HODR activated successfully.\n");
+        log_info("HODR activated successfully.");
     }
     hodr_setCoolerMode(true); // Turn on the cooler
 
@@ -224,11 +444,11 @@ static gboolean db_deactivateHodr(Control *control, GDBusMethodInvocation *invoc
     if (!andorActive) // Check if Andor SDK is not active
     {
         control_complete_deactivate(control, invocation, TRUE); // Complete the D-Bus method invocation with success
-        control_set_active(control, FALSE);                     // Set the control object as inactive
+        setActive(control, FALSE);                              // Set the control object as inactive
         return TRUE;                                            // HODR is not active
     }
-    pthread_mutex_lock(&lock); // Lock the mutex to ensure thread safety
-    printf("Deactivating HODR...\n");
+    metrics_lock(&lock, METRIC_LOCK_WAIT); // Lock the mutex to ensure thread safety
+    log_info("Deactivating HODR...");
     CancelWait();                        // Cancel any ongoing wait operations
     AbortAcquisition();                  // Abort any ongoing acquisition
     unsigned int result = hodr_deinit(); // Deinitialize HODR
@@ -240,16 +460,16 @@ static gboolean db_deactivateHodr(Control *control, GDBusMethodInvocation *invoc
     }
     andorActive = false;                                    // Set Andor SDK active flag to FALSE
     control_complete_deactivate(control, invocation, TRUE); // Complete the D-Bus method invocation
-    control_set_active(control, FALSE);                     // Set the control object as inactive
+    setActive(control, FALSE);                              // Set the control object as inactive
     pthread_mutex_unlock(&lock);                            // Unlock the mutex after deactivating HODR
-    printf("HODR deactivated successfully.\n");
+    log_info("HODR deactivated successfully.");
     return TRUE; // Successfully deactivated HODR
 }
 
 static gboolean db_resetHodr(Control *control, GDBusMethodInvocation *invocation, gpointer)
 {
-    pthread_mutex_lock(&lock); // Lock the mutex to ensure thread safety
-    printf("Resetting HODR...\n");
+    metrics_lock(&lock, METRIC_LOCK_WAIT); // Lock the mutex to ensure thread safety
+    log_info("Resetting HODR...");
     if (andorActive)
     {
         CancelWait();                        // Cancel any ongoing wait operations
@@ -261,8 +481,8 @@ static gboolean db_resetHodr(Control *control, GDBusMethodInvocation *invocation
             pthread_mutex_unlock(&lock);                        // Unlock the mutex before returning
             return FALSE;                                       // Error resetting HODR
         }
-        andorActive = false;                // Set Andor SDK active flag to FALSE
-        control_set_active(control, FALSE); // Set the control object as inactive
+        andorActive = false;       // Set Andor SDK active flag to FALSE
+        setActive(control, FALSE); // Set the control object as inactive
     }
 
     unsigned int initResult = hodr_init(hodr_cfg, andorFile, outFile, true); // Reinitialize HODR
@@ -277,14 +497,14 @@ static gboolean db_resetHodr(Control *control, GDBusMethodInvocation *invocation
 
     pthread_mutex_unlock(&lock);                       // Unlock the mutex after resetting HODR
     control_complete_reset(control, invocation, TRUE); // Complete the D-Bus method invocation with success
-    control_set_active(control, TRUE);                 // Set the control object as active
+    setActive(control, TRUE);                          // Set the control object as active
     return TRUE;                                       // Successfully reset HODR
 }
 
 static gboolean db_exitMainLoop(Control *control, GDBusMethodInvocation *invocation, gpointer)
 {
-    pthread_mutex_lock(&lock); // Lock the mutex to ensure thread safety
-    printf("Exiting main loop...\n");
+    metrics_lock(&lock, METRIC_LOCK_WAIT); // Lock the mutex to ensure thread safety
+    log_info("Exiting main loop...");
     g_main_loop_quit(loop); // Quit the main loop
     // g_dbus_method_invocation_return_value(invocation, NULL); // Return success response
     control_complete_exit(control, invocation); // Complete the D-Bus method invocation
@@ -298,46 +518,300 @@ static gboolean db_stopLive(Control *control, GDBusMethodInvocation *invocation,
     if (live)
     {
         control_set_live(control, FALSE);                        // Set live status to FALSE
+        control_emit_state_changed(control, "Live", g_variant_new_boolean(FALSE));
         g_dbus_method_invocation_return_value(invocation, NULL); // Return success response
-        printf("Live mode stopped successfully.\n");
+        log_info("Live mode stopped successfully.");
     }
     else
     {
         g_dbus_method_invocation_return_error(invocation, G_IO_ERROR, G_IO_ERROR_FAILED, "Live mode is not active."); // Return error if live mode is not active
-        printf("Live mode was not active.\n");
+        log_info("Live mode was not active.");
     }
     return TRUE; // Successfully stopped live mode
 }
 
-static gboolean db_updateNCaptures(gpointer control)
+// Most recent frame gaps, oldest first, as a(ut) of the spectrum after the gap
+// and the number of frames missing. Called with gapLock held.
+static GVariant *frameGapsVariant()
 {
-    if (!andorActive) // Check if Andor SDK is active
+    GVariantBuilder builder;
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a(ut)"));
+    uint64_t first = nFrameGaps > MAX_FRAME_GAPS ? nFrameGaps - MAX_FRAME_GAPS : 0;
+    for (uint64_t n = first; n < nFrameGaps; n++)
     {
-        printf("Andor SDK is not active. Skipping update of number of captures.\n");
-        return TRUE; // Do not update if Andor SDK is not active
+        HODR_FrameGap_t *gap = &frameGaps[n % MAX_FRAME_GAPS];
+        g_variant_builder_add(&builder, "(ut)", gap->spectrumID, (guint64)gap->missingFrames);
     }
-    pthread_mutex_lock(&lock); // Lock the mutex to ensure thread safety
+    return g_variant_builder_end(&builder);
+}
+
+// Master darks as (exposure time, temperature, frames, created ns since the epoch)
+static GVariant *masterDarksVariant()
+{
+    GVariantBuilder builder;
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a(ddux)"));
+    for (int i = 0; i < CORRECTION_MAX_DARKS; i++)
+    {
+        HODR_Dark_t *dark = &correction.darks[i];
+        if (dark->data != NULL)
+        {
+            g_variant_builder_add(&builder, "(ddux)", (double)dark->exposureTime, (double)dark->temperature, dark->frames, (gint64)dark->createdNs);
+        }
+    }
+    return g_variant_builder_end(&builder);
+}
+
+// Wavelength calibration coefficients, lowest order first, empty if uncalibrated
+static GVariant *wavelengthCoefficientsVariant()
+{
+    return g_variant_new_fixed_array(G_VARIANT_TYPE_DOUBLE, wavelength.coefficients, wavelength.ncoefficients, sizeof(double));
+}
+
+// Set the active property, and announce it if it changed
+static void setActive(Control *control, gboolean active)
+{
+    if (control_get_active(control) != active)
+    {
+        control_set_active(control, active);
+        control_emit_state_changed(control, "active", g_variant_new_boolean(active));
+    }
+}
+
+// Read the acquisition status from the SDK and schedule a notification if it
+// changed. Called with lock held.
+static void updateAcquisitionStatus()
+{
     int status;
-    unsigned int result = hodr_getStatus(&status); // Get the current status of HODR
-    if (result == DRV_SUCCESS)
+    if (GetStatus(&status) != DRV_SUCCESS)
+    {
+        return; // Not initialised, keep the last known status
+    }
+    int previous = atomic_exchange(&acquisitionStatus, status);
+    if (previous != status)
+    {
+        requestNotify();
+    }
+    if (status != DRV_ACQUIRING && capturingDark)
+    {
+        finishDarkCapture();
+    }
+    else if (status != DRV_ACQUIRING && previous == DRV_ACQUIRING)
+    {
+        unsigned int mode = hodr_getAcquisitionMode();
+        if (mode == ACQ_MODE_KINETICS || mode == ACQ_MODE_RUN_TILL_ABORT)
+        {
+            drainNewFrames(); // The last frames of the series may still be waiting
+        }
+        endSeries(0); // A series that ends part way through a spectrum stores what it has
+    }
+    if (status != DRV_ACQUIRING)
+    {
+        applyPendingExposure(); // Between series, the exposure can change without losing a frame
+    }
+    if (status != DRV_ACQUIRING && previous == DRV_ACQUIRING && chainingSeries)
+    {
+        startNextSeries();
+    }
+}
+
+// Set the integration time auto-exposure asked for. The camera must be idle,
+// so it is only called between series, with lock held.
+static void applyPendingExposure()
+{
+    float exposureTime = pendingExposure;
+    if (exposureTime <= 0 || capturingDark)
+    {
+        return;
+    }
+    pendingExposure = 0;
+    if (hodr_setExposureTime(exposureTime) != DRV_SUCCESS)
+    {
+        return; // Logged, the next frames propose a time again
+    }
+    float kineticCycleTime, readoutTime, actualTime;
+    hodr_getAcquisitionTimings(&actualTime, &kineticCycleTime, &readoutTime);
+    atomic_store(&exposureInEffect, actualTime); // Frames report the time the camera rounded to
+    log_debug("Auto-exposure: integration time set to %.6f seconds.", exposureTime);
+    appliedExposure = exposureTime;
+    requestNotify();
+}
+
+// Frames in each series of a chained run-till-abort acquisition: about
+// CHAINED_SERIES_SECS worth, and a whole number of co-added spectra so
+// none is cut short at a series end. Called with lock held.
+static int chainedSeriesFrames()
+{
+    float exposureTime, kineticCycleTime, readoutTime;
+    hodr_getAcquisitionTimings(&exposureTime, &kineticCycleTime, &readoutTime);
+    unsigned int frames = kineticCycleTime > 0 ? (unsigned int)(CHAINED_SERIES_SECS / kineticCycleTime) : 1;
+    frames = (frames + coaddFrames - 1) / coaddFrames * coaddFrames;
+    return frames < coaddFrames ? (int)coaddFrames : (int)frames;
+}
+
+// Start the next series of a chained run-till-abort acquisition, once the
+// last one has been read and any new integration time set. Frames the
+// readout ring had no room for are lost with the new series, they are
+// counted as a gap before its first frame. Called with lock held.
+static void startNextSeries()
+{
+    int32_t first, last, left = 0;
+    if (hodr_getNumberNewImages(&first, &last) == DRV_SUCCESS && first <= last)
+    {
+        left = last - first + 1;
+        log_warn("Readout ring full at the end of a series, %d frames lost.", left);
+    }
+    hodr_setNumberKinetics(chainedSeriesFrames());
+    unsigned int result = hodr_startAcquisition();
+    nextImageIndex = 1 - left; // The SDK numbers the images of each series from 1
+    if (result != DRV_SUCCESS)
+    {
+        chainingSeries = false; // Logged, the acquisition ends here
+        restoreRunTillAbort();
+        return;
+    }
+    updateAcquisitionStatus();
+}
+
+// Put plain run-till-abort back once a chained acquisition has stopped.
+// Called with lock held.
+static void restoreRunTillAbort()
+{
+    hodr_setNumberKinetics(chainRestoreSeriesLength); // Passed on to the SDK again by the mode change
+    hodr_setAcquisitionMode(ACQ_MODE_RUN_TILL_ABORT);
+}
+
+// Called from the writer thread after each batch reaches the disk
+static void onSpectraCommitted(uint32_t)
+{
+    requestNotify();
+}
+
+static int64_t monotonicNs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// Schedule db_notify on the main loop. Safe from any thread; requests made
+// before it runs are coalesced into one.
+static void requestNotify()
+{
+    if (!atomic_exchange(&notifyPending, true))
+    {
+        g_idle_add(db_notify, NULL);
+    }
+}
+
+// Announce what changed since the last run: NewSpectrum for the spectra
+// committed since, StateChanged for the acquisition status, and the counters
+// clients used to poll for. Runs at most every NOTIFY_INTERVAL_MS.
+static gboolean db_notify(gpointer)
+{
+    int64_t now = monotonicNs();
+    int64_t wait = lastNotifyNs + (int64_t)NOTIFY_INTERVAL_MS * 1000000LL - now;
+    if (wait > 0)
+    {
+        g_timeout_add((guint)((wait + 999999) / 1000000), db_notify, NULL); // Still pending, later requests join this run
+        return G_SOURCE_REMOVE;
+    }
+    lastNotifyNs = now;
+    atomic_store(&notifyPending, false); // Anything changing from here on schedules another run
+
+    Control *control = notifyControl;
+    if (control == NULL)
+    {
+        return G_SOURCE_REMOVE; // Picked up by the run scheduled when the name is acquired
+    }
+
+    uint32_t committed = writer_committedSpectra();
+    HODR_RecordHeader_t last;
+    if (committed > notifiedSpectra && writer_lastCommitted(&last))
+    {
+        control_emit_new_spectrum(control, notifiedSpectra, last.spectrumID, last.timestampNs, last.exposureTime, last.temperature,
+                                  (guint64)(last.spectrumID - firstSpectrumID));
+        notifiedSpectra = last.spectrumID + 1;
+        control_set_number_spectra(control, committed); // Update the number of written spectra in the control object
+    }
+
+    int status = atomic_load(&acquisitionStatus);
+    if (status >= 0 && status != control_get_acquisition_status(control))
     {
         control_set_acquisition_status(control, status); // Set the acquisition status in the control object
+        control_emit_state_changed(control, "acquisitionStatus", g_variant_new_int32(status));
     }
-    control_set_number_spectra(control, nCapturedSpectra); // Update the number of captured spectra in the control object
-    pthread_mutex_unlock(&lock);                           // Unlock the mutex after updating
-    return TRUE;                                           // Successfully updated number of captures
+    if (status == DRV_ACQUIRING && acquisitionWatch == 0)
+    {
+        acquisitionWatch = g_timeout_add_seconds(1, db_watchAcquisition, NULL); // Catches the end of an acquisition that has no frame
+    }
+
+    char dataPath[sizeof(outFile)];
+    writer_dataPath(dataPath, sizeof(dataPath));
+    if (strcmp(dataPath, control_get_data_path(control)) != 0)
+    {
+        control_set_data_path(control, dataPath); // The writer has started a new data file
+        control_emit_state_changed(control, "dataPath", g_variant_new_string(dataPath));
+    }
+
+    control_set_ring_failed_claims(control, ring_failedClaims(&frameRing)); // Update the frame ring failed claim count
+    control_set_ring_high_water(control, ring_highWater(&frameRing)); // Update the frame ring high-water mark
+    pthread_mutex_lock(&gapLock); // Processing records the gaps
+    control_set_dropped_frames(control, droppedFrames); // Update the dropped frame count
+    static uint64_t publishedGaps = 0;
+    if (nFrameGaps != publishedGaps) // Only rebuild the gap list when it has changed
+    {
+        control_set_frame_gaps(control, frameGapsVariant());
+        publishedGaps = nFrameGaps;
+    }
+    pthread_mutex_unlock(&gapLock);
+    metrics_lock(&lock, METRIC_LOCK_WAIT);
+    if (appliedExposure > 0)
+    {
+        control_set_integration_time_secs(control, appliedExposure); // Auto-exposure changed the integration time
+        control_emit_state_changed(control, "IntegrationTimeSecs", g_variant_new_double(appliedExposure));
+        appliedExposure = 0;
+    }
+    pthread_mutex_unlock(&lock);
+    if (atomic_exchange(&darksChanged, false))
+    {
+        pthread_mutex_lock(&calibrationLock); // Processing may be adding a dark
+        GVariant *darks = masterDarksVariant();
+        pthread_mutex_unlock(&calibrationLock);
+        control_set_master_darks(control, darks);
+        control_emit_state_changed(control, "masterDarks", darks);
+    }
+    return G_SOURCE_REMOVE;
+}
+
+// Poll the acquisition status once a second while acquiring. Every other
+// status change is caught where it happens.
+static gboolean db_watchAcquisition(gpointer)
+{
+    if (andorActive)
+    {
+        metrics_lock(&lock, METRIC_LOCK_WAIT);
+        updateAcquisitionStatus();
+        pthread_mutex_unlock(&lock);
+    }
+    if (!andorActive || atomic_load(&acquisitionStatus) != DRV_ACQUIRING)
+    {
+        acquisitionWatch = 0;
+        requestNotify(); // Publish the final status
+        return G_SOURCE_REMOVE;
+    }
+    return G_SOURCE_CONTINUE;
 }
 
 static gboolean db_setIntegrationTime(Control *control, GDBusMethodInvocation *invocation, gdouble int_time, gpointer)
 {
     if (!andorActive) // Check if Andor SDK is active
     {
-        printf("Andor SDK is not active. Not setting integration time.\n");
+        log_info("Andor SDK is not active. Not setting integration time.");
         control_complete_set_integration_time(control, invocation, FALSE); // Complete the D-Bus method invocation with failure
         return TRUE;                                                       // Do not update if Andor SDK is not active
     }
-    printf("Setting integration time to %.9f seconds...\n", int_time);
-    pthread_mutex_lock(&lock); // Lock the mutex to ensure thread safety
+    log_info("Setting integration time to %.9f seconds...", int_time);
+    metrics_lock(&lock, METRIC_LOCK_WAIT); // Lock the mutex to ensure thread safety
 
     if (int_time <= 0)
     {
@@ -355,13 +829,14 @@ static gboolean db_setIntegrationTime(Control *control, GDBusMethodInvocation *i
         {
 
             control_complete_set_integration_time(control, invocation, FALSE); // Complete the D-Bus method invocation with failure
-            printf("Failed to set integration time: %d\n", result);
+            log_error("Failed to set integration time: %d", result);
             pthread_mutex_unlock(&lock); // Unlock the mutex before returning
             return TRUE;                 // Error setting integration time
         }
     }
+    atomic_store(&exposureInEffect, 0);                               // Auto-exposure takes every frame from the new time on
     control_complete_set_integration_time(control, invocation, TRUE); // Complete the D-Bus method invocation with success
-    printf("Integration time set to %.9f seconds successfully.\n", int_time);
+    log_info("Integration time set to %.9f seconds successfully.", int_time);
     pthread_mutex_unlock(&lock); // Unlock the mutex after setting the integration time
     return TRUE;                 // Successfully set integration time
 }
@@ -371,12 +846,12 @@ static gboolean db_setInterval(Control *control, GDBusMethodInvocation *invocati
 
     if (!andorActive) // Check if Andor SDK is active
     {
-        printf("Andor SDK is not active. Not setting interval.\n");
+        log_info("Andor SDK is not active. Not setting interval.");
         control_complete_set_interval(control, invocation, FALSE); // Complete the D-Bus method invocation with failure
         return FALSE;                                              // Do not update if Andor SDK is not active
     }
-    printf("Setting interval to %.5f seconds...\n", (float)interval);
-    pthread_mutex_lock(&lock); // Lock the mutex to ensure thread safety
+    log_info("Setting interval to %.5f seconds...", (float)interval);
+    metrics_lock(&lock, METRIC_LOCK_WAIT); // Lock the mutex to ensure thread safety
 
     if (interval <= 0)
     {
@@ -389,12 +864,12 @@ static gboolean db_setInterval(Control *control, GDBusMethodInvocation *invocati
     if (result != DRV_SUCCESS)
     {
         control_complete_set_interval(control, invocation, FALSE); // Complete the D-Bus method invocation
-        printf("Failed to set interval: %d\n", result);
+        log_error("Failed to set interval: %d", result);
         pthread_mutex_unlock(&lock); // Unlock the mutex before returning
         return FALSE;                // Error setting interval
     }
     control_complete_set_interval(control, invocation, TRUE); // Complete the D-Bus method invocation
-    printf("Interval set to %.5f seconds successfully.\n", (float)interval);
+    log_info("Interval set to %.5f seconds successfully.", (float)interval);
     pthread_mutex_unlock(&lock); // Unlock the mutex after setting the interval
     return TRUE;                 // Successfully set interval
 }
@@ -403,13 +878,13 @@ static gboolean db_setAcquisitionMode(Control *control, GDBusMethodInvocation *i
 
     if (!andorActive) // Check if Andor SDK is active
     {
-        printf("Andor SDK is not active. Not setting acquisition mode.\n");
+        log_info("Andor SDK is not active. Not setting acquisition mode.");
         control_complete_set_acquisition_mode(control, invocation, FALSE); // Complete the D-Bus method invocation with failure
         return FALSE;                                                      // Do not update if Andor SDK is not active
     }
 
-    printf("Setting acquisition mode to %d...\n", mode);
-    pthread_mutex_lock(&lock); // Lock the mutex to ensure thread safety
+    log_info("Setting acquisition mode to %d...", mode);
+    metrics_lock(&lock, METRIC_LOCK_WAIT); // Lock the mutex to ensure thread safety
     if (mode > 5)              // Assuming valid modes are 0, 1, and 2
     {
         g_dbus_method_invocation_return_error(invocation, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "Invalid acquisition mode: %d", mode);
@@ -420,7 +895,7 @@ static gboolean db_setAcquisitionMode(Control *control, GDBusMethodInvocation *i
     hodr_setAcquisitionMode((int)mode);                               // Set the acquisition mode in HODR
     control_complete_set_acquisition_mode(control, invocation, TRUE); // Set the acquisition mode in the control object
 
-    printf("Acquisition mode set to %d successfully.\n", mode);
+    log_info("Acquisition mode set to %d successfully.", mode);
     pthread_mutex_unlock(&lock); // Unlock the mutex after setting acquisition mode
     return TRUE;                 // Successfully set acquisition mode
 }
@@ -430,41 +905,239 @@ static gboolean db_setTargetIntensity(Control *control, GDBusMethodInvocation *i
 
     if (!andorActive) // Check if Andor SDK is active
     {
-        printf("Andor SDK is not active. Not setting target intensity.\n");
+        log_info("Andor SDK is not active. Not setting target intensity.");
         control_complete_set_target_intensity(control, invocation, FALSE); // Complete the D-Bus method invocation with failure
         return TRUE;                                                       // Do not update if Andor SDK is not active
     }
 
-    printf("Setting target intensity to %u...\n", intensity);
-    printf("Waiting to acquire lock for setting target intensity...\n");
-    pthread_mutex_lock(&lock); // Lock the mutex to ensure thread safety
-    printf("Acquired lock for setting target intensity.\n");
-    targetIntensity = intensity; // Set the target intensity
+    log_info("Setting target intensity to %u...", intensity);
+    log_debug("Waiting to acquire lock for setting target intensity...");
+    metrics_lock(&lock, METRIC_LOCK_WAIT); // Lock the mutex to ensure thread safety
+    log_debug("Acquired lock for setting target intensity.");
+    atomic_store(&targetIntensity, intensity); // Picked up by auto-exposure with the next frame
+    if (intensity == 0)
+    {
+        pendingExposure = 0; // Auto-exposure off, drop what it asked for
+    }
 
     control_set_target_intensity(control, intensity); // Set the target intensity in the control object
-    printf("Target intensity set to %u in control object.\n", intensity);
+    log_debug("Target intensity set to %u in control object.", intensity);
     control_complete_set_target_intensity(control, invocation, TRUE); // Complete the D-Bus method invocation with success
-    printf("Target intensity set to %d successfully.\n", intensity);
+    log_info("Target intensity set to %d successfully.", intensity);
     pthread_mutex_unlock(&lock); // Unlock the mutex after setting target intensity
     return TRUE;                 // Successfully set target intensity
 }
 
+static gboolean db_setCsvExport(Control *control, GDBusMethodInvocation *invocation, gboolean enable, gpointer)
+{
+    writer_setCsvExport(enable); // Picked up by the writer from its next batch
+
+    control_set_csv_export(control, enable);                  // Set the CSV export flag in the control object
+    control_complete_set_csv_export(control, invocation, TRUE); // Complete the D-Bus method invocation with success
+    log_info("CSV export %s. CSV file next to %s", enable ? "enabled" : "disabled", control_get_data_path(control));
+    return TRUE;
+}
+
+static gboolean db_setCoadd(Control *control, GDBusMethodInvocation *invocation, guint frames, gpointer)
+{
+    if (frames == 0 || frames > COADD_MAX_FRAMES)
+    {
+        log_warn("Cannot co-add %u frames, expected 1 to %u.", frames, COADD_MAX_FRAMES);
+        control_complete_set_coadd(control, invocation, FALSE); // Complete the D-Bus method invocation with failure
+        return TRUE;
+    }
+
+    metrics_lock(&lock, METRIC_LOCK_WAIT); // Lock the mutex to ensure thread safety
+    coaddFrames = frames;                  // Processing ends the spectrum it has when the count changes
+    pthread_mutex_unlock(&lock);
+
+    control_set_coadd_frames(control, frames);                  // Set the frames co-added per spectrum in the control object
+    control_complete_set_coadd(control, invocation, TRUE);      // Complete the D-Bus method invocation with success
+    log_info("Co-adding %u frames per spectrum.", frames);
+    return TRUE;
+}
+
+// Take frames dark frames at the current integration time with the shutter
+// closed and keep their mean as the master dark for that time and the
+// current temperature. Returns once the series has started; masterDarks
+// changes when it is done.
+static gboolean db_captureDark(Control *control, GDBusMethodInvocation *invocation, guint frames, gpointer)
+{
+    if (!andorActive || frames == 0 || frames > COADD_MAX_FRAMES)
+    {
+        log_warn("Cannot capture a dark of %u frames.", frames);
+        control_complete_capture_dark(control, invocation, FALSE); // Complete the D-Bus method invocation with failure
+        return TRUE;
+    }
+
+    metrics_lock(&lock, METRIC_LOCK_WAIT); // Lock the mutex to ensure thread safety
+    if (capturingDark || atomic_load(&acquisitionStatus) == DRV_ACQUIRING)
+    {
+        log_warn("Cannot capture a dark while acquiring.");
+        pthread_mutex_unlock(&lock);
+        control_complete_capture_dark(control, invocation, FALSE);
+        return TRUE;
+    }
+
+    darkRestoreMode = (int)hodr_getAcquisitionMode();
+    darkRestoreShutterMode = (int)hodr_getShutterMode();
+    hodr_setShutter((int)hodr_getShutterType(), SHUTTER_MODE_CLOSED, 0, 0);
+    hodr_setAcquisitionMode(ACQ_MODE_KINETICS);
+    hodr_setNumberKinetics((int)frames);
+    darkFramesWanted = frames;
+
+    unsigned int result = hodr_startAcquisition();
+    nextImageIndex = 1; // The SDK numbers the images of each acquisition from 1
+    if (result != DRV_SUCCESS)
+    {
+        log_error("Failed to start dark capture: %d", result);
+        hodr_setShutter((int)hodr_getShutterType(), darkRestoreShutterMode, 0, 0);
+        hodr_setAcquisitionMode(darkRestoreMode);
+        pthread_mutex_unlock(&lock);
+        control_complete_capture_dark(control, invocation, FALSE);
+        return TRUE;
+    }
+    capturingDark = true;
+    updateAcquisitionStatus();
+    pthread_mutex_unlock(&lock);
+
+    log_info("Capturing a master dark of %u frames.", frames);
+    control_complete_capture_dark(control, invocation, TRUE); // Complete the D-Bus method invocation with success
+    return TRUE;
+}
+
+static gboolean db_setFlat(Control *control, GDBusMethodInvocation *invocation, GVariant *flat, gpointer)
+{
+    gsize npixels;
+    const gdouble *values = g_variant_get_fixed_array(flat, &npixels, sizeof(gdouble));
+
+    pthread_mutex_lock(&calibrationLock); // Processing may be correcting a frame
+    int result = correction_setFlat(&correction, values, npixels);
+    pthread_mutex_unlock(&calibrationLock);
+
+    control_complete_set_flat(control, invocation, result == 0); // Complete the D-Bus method invocation
+    if (result == 0)
+    {
+        log_info("Flat field set.");
+    }
+    return TRUE;
+}
+
+static gboolean db_setHotPixels(Control *control, GDBusMethodInvocation *invocation, GVariant *pixels, gpointer)
+{
+    gsize count;
+    const guint32 *values = g_variant_get_fixed_array(pixels, &count, sizeof(guint32));
+
+    pthread_mutex_lock(&calibrationLock); // Processing may be correcting a frame
+    int result = correction_setHotPixels(&correction, values, count);
+    pthread_mutex_unlock(&calibrationLock);
+
+    control_complete_set_hot_pixels(control, invocation, result == 0); // Complete the D-Bus method invocation
+    if (result == 0)
+    {
+        log_info("%zu hot pixels set.", (size_t)count);
+    }
+    return TRUE;
+}
+
+static gboolean db_setCorrectionOutput(Control *control, GDBusMethodInvocation *invocation, guint output, gpointer)
+{
+    if (output > CORRECTION_OUTPUT_BOTH)
+    {
+        log_warn("Unknown correction output %u.", output);
+        control_complete_set_correction_output(control, invocation, FALSE); // Complete the D-Bus method invocation with failure
+        return TRUE;
+    }
+
+    pthread_mutex_lock(&calibrationLock);                // Processing may be correcting a frame
+    correction.output = (HODR_CorrectionOutput_t)output; // Applies from the next spectrum processed
+    pthread_mutex_unlock(&calibrationLock);
+
+    control_set_correction_output(control, output);                     // Set what is stored in the control object
+    control_complete_set_correction_output(control, invocation, TRUE); // Complete the D-Bus method invocation with success
+    log_info("Correction output set to %u.", output);
+    return TRUE;
+}
+
+static gboolean db_setWavelengthCalibration(Control *control, GDBusMethodInvocation *invocation, GVariant *coefficients, gpointer)
+{
+    gsize ncoefficients;
+    const gdouble *values = g_variant_get_fixed_array(coefficients, &ncoefficients, sizeof(gdouble));
+
+    pthread_mutex_lock(&calibrationLock); // Processing may be resampling a frame
+    int result = wavelength_setCalibration(&wavelength, values, ncoefficients);
+    GVariant *current = wavelengthCoefficientsVariant();
+    pthread_mutex_unlock(&calibrationLock);
+
+    control_set_wavelength_coefficients(control, current);                        // Set the wavelength calibration in the control object
+    control_complete_set_wavelength_calibration(control, invocation, result == 0); // Complete the D-Bus method invocation
+    if (result == 0)
+    {
+        log_info("Wavelength calibration set: %zu coefficients.", (size_t)ncoefficients);
+    }
+    return TRUE;
+}
+
+static gboolean db_setWavelengthGrid(Control *control, GDBusMethodInvocation *invocation, gdouble start, gdouble step, guint points, gpointer)
+{
+    pthread_mutex_lock(&calibrationLock);                             // Processing may be resampling a frame
+    int result = wavelength_setGrid(&wavelength, start, step, points); // Applies from the next spectrum processed
+    pthread_mutex_unlock(&calibrationLock);
+
+    if (result == 0)
+    {
+        control_set_wavelength_grid(control, g_variant_new("(ddu)", start, step, points)); // Set the resampling grid in the control object
+        log_info("Wavelength grid set: %u points of %g nm from %g nm.", points, step, start);
+    }
+    control_complete_set_wavelength_grid(control, invocation, result == 0); // Complete the D-Bus method invocation
+    return TRUE;
+}
+
+static gboolean db_getMetrics(Control *control, GDBusMethodInvocation *invocation, gpointer)
+{
+    GVariantBuilder histograms;
+    g_variant_builder_init(&histograms, G_VARIANT_TYPE("a(stttttttt)"));
+    for (int i = 0; i < METRIC_COUNT; i++)
+    {
+        HODR_Histogram_t *histogram = &metrics_histograms[i];
+        g_variant_builder_add(&histograms, "(stttttttt)", histogram->name,
+                              (guint64)atomic_load(&histogram->count), (guint64)atomic_load(&histogram->sumNs), (guint64)atomic_load(&histogram->maxNs),
+                              (guint64)metrics_percentile(i, 0.5), (guint64)metrics_percentile(i, 0.9),
+                              (guint64)metrics_percentile(i, 0.99), (guint64)metrics_percentile(i, 0.999));
+    }
+
+    pthread_mutex_lock(&gapLock); // droppedFrames is updated by processing
+    uint64_t dropped = droppedFrames;
+    pthread_mutex_unlock(&gapLock);
+
+    GVariantBuilder counters;
+    g_variant_builder_init(&counters, G_VARIANT_TYPE("a{st}"));
+    g_variant_builder_add(&counters, "{st}", "frames", (guint64)ring_head(&frameRing));
+    g_variant_builder_add(&counters, "{st}", "dropped_frames", (guint64)dropped);
+    g_variant_builder_add(&counters, "{st}", "ring_failed_claims", (guint64)ring_failedClaims(&frameRing));
+    g_variant_builder_add(&counters, "{st}", "ring_high_water", (guint64)ring_highWater(&frameRing));
+    g_variant_builder_add(&counters, "{st}", "committed_spectra", (guint64)writer_committedSpectra());
+
+    control_complete_get_metrics(control, invocation, g_variant_builder_end(&histograms), g_variant_builder_end(&counters));
+    return TRUE;
+}
+
 static gboolean db_getTemperature(gpointer control)
 {
 
     if (!andorActive) // Check if Andor SDK is active
     {
-        printf("Andor SDK is not active. Not getting temperature.\n");
+        log_debugEvery(60000, "Andor SDK is not active. Not getting temperature.");
         return TRUE; // Do not update if Andor SDK is not active
     }
-    pthread_mutex_lock(&lock); // Lock the mutex to ensure thread safety
+    metrics_lock(&lock, METRIC_LOCK_WAIT); // Lock the mutex to ensure thread safety
     float currentTemp, targetTemp;
 
     unsigned int result = hodr_getCurrentTemperatureAndTargetTemperature(&currentTemp, &targetTemp); // Get current and target temperatures
 
     if (result != DRV_SUCCESS)
     {
-        fprintf(stderr, "Failed to get current temperature: %d\n", result);
+        log_error("Failed to get current temperature: %d", result);
         pthread_mutex_unlock(&lock); // Unlock the mutex before returning
         return TRUE;                 // Error getting temperature
     }
@@ -478,17 +1151,21 @@ static gboolean db_getTemperature(gpointer control)
     if (currentTempDouble != lastTemperature ||
         targetTempDouble != lastTargetTemperature || tempStatus != lastTemperatureStatus) // Check if temperatures or status have changed
     {
+        bool statusChanged = tempStatus != lastTemperatureStatus;
         char tempStatusString[64];                                         // Buffer for temperature status string
         hodr_getTemperatureStatusString(tempStatus, tempStatusString, 64); // Get temperature status string
-        printf("Current Temperature: %.2f, Target Temperature: %.2f, Status: %s\n", currentTempDouble, targetTempDouble, tempStatusString);
+        log_info("Current Temperature: %.2f, Target Temperature: %.2f, Status: %s", currentTempDouble, targetTempDouble, tempStatusString);
         lastTargetTemperature = targetTempDouble; // Update last target temperature
         lastTemperature = currentTempDouble;      // Update last temperature
         lastTemperatureStatus = tempStatus;       // Update last temperature status
-        fflush(stdout);                           // Flush stdout to ensure immediate output
 
         control_set_target_temperature(control, targetTempDouble); // Set target temperature in the control object
         control_set_temperature(control, currentTempDouble);       // Set current temperature in the control object
         control_set_temperature_status(control, tempStatusString); // Set temperature status in the control object
+        if (statusChanged)
+        {
+            control_emit_state_changed(control, "TemperatureStatus", g_variant_new_string(tempStatusString));
+        }
     }
 
     pthread_mutex_unlock(&lock); // Unlock the mutex after getting temperature
@@ -498,7 +1175,7 @@ static gboolean db_getTemperature(gpointer control)
 
     if (!live)
     {
-        printf("Live mode is not active. Stopping temperature updates.\n");
+        log_info("Live mode is not active. Stopping temperature updates.");
         return FALSE;
     }
 
@@ -510,13 +1187,13 @@ static gboolean db_setTemperature(Control *control, GDBusMethodInvocation *invoc
 
     if (!andorActive) // Check if Andor SDK is active
     {
-        printf("Andor SDK is not active. Not setting temperature.\n");
+        log_info("Andor SDK is not active. Not setting temperature.");
         g_dbus_method_invocation_return_error(invocation, G_IO_ERROR, G_IO_ERROR_FAILED, "Andor SDK is not active.");
         return FALSE; // Do not update if Andor SDK is not active
     }
 
     // get lock to ensure thread safety
-    pthread_mutex_lock(&lock); // Lock the mutex to ensure thread safety
+    metrics_lock(&lock, METRIC_LOCK_WAIT); // Lock the mutex to ensure thread safety
     // cast unsigned guint to int
 
     if (value < -120 || value > 20)
@@ -538,7 +1215,7 @@ static gboolean db_setTemperature(Control *control, GDBusMethodInvocation *invoc
     control_set_temperature_status(control, tempStatusString);                 // Set the temperature status in the control object
 
     control_complete_set_temperature(control, invocation, TRUE); // Complete the D-Bus method invocation
-    printf("Target Temperature set to %.2f successfully.\n", targetTemp);
+    log_info("Target Temperature set to %.2f successfully.", targetTemp);
     pthread_mutex_unlock(&lock); // Unlock the mutex after setting temperature
     return TRUE;                 // Successfully set temperature
 }
@@ -548,21 +1225,33 @@ static gboolean db_startAcquisition(Control *control, GDBusMethodInvocation *inv
 
     if (!andorActive) // Check if Andor SDK is active
     {
-        printf("Andor SDK is not active. Not starting acquisition.\n");
+        log_info("Andor SDK is not active. Not starting acquisition.");
 
         control_complete_start_acquisition(control, invocation, 0); // Complete the D-Bus method invocation with failure
         return TRUE;                                                // Do not start acquisition if Andor SDK is not active
     }
-    printf("Starting acquisition with integration time: %.9f seconds\n", integration_time);
-    printf("Waiting to acquire lock for starting acquisition...\n");
-    pthread_mutex_lock(&lock); // Lock the mutex to ensure thread safety
-    printf("Acquired lock for starting acquisition.\n");
+    log_info("Starting acquisition with integration time: %.9f seconds", integration_time);
+    log_debug("Waiting to acquire lock for starting acquisition...");
+    metrics_lock(&lock, METRIC_LOCK_WAIT); // Lock the mutex to ensure thread safety
+    log_debug("Acquired lock for starting acquisition.");
+    if (capturingDark)
+    {
+        g_dbus_method_invocation_return_error(invocation, G_IO_ERROR, G_IO_ERROR_BUSY, "A dark capture is running");
+        pthread_mutex_unlock(&lock);
+        return TRUE; // Completed with the error
+    }
 
     if (integration_time > 0)
     {
-        printf("Setting exposure time to %.9f seconds.\n", integration_time);
+        log_info("Setting exposure time to %.9f seconds.", integration_time);
         hodr_setExposureTime(integration_time);                       // Set exposure time in seconds
         control_set_integration_time_secs(control, integration_time); // Set integration time in the control object
+        pendingExposure = 0;                                          // Auto-exposure starts over from the requested time
+        atomic_store(&exposureInEffect, 0);
+    }
+    else
+    {
+        applyPendingExposure(); // A proposal made after the last series ended
     }
 
     if (mode > 5) // Assuming valid modes are 0, 1, and 2
@@ -579,444 +1268,808 @@ static gboolean db_startAcquisition(Control *control, GDBusMethodInvocation *inv
 
     if (interval_time >= 0)
     {
-        printf("Setting kinetic cycle time to %.2f seconds.\n", interval_time);
+        log_info("Setting kinetic cycle time to %.2f seconds.", interval_time);
         hodr_setKineticCycleTime(interval_time); // Set kinetic cycle time in seconds
     }
 
     if (number > 0)
     {
-        printf("Setting number of captures to %d.\n", number);
+        log_info("Setting number of captures to %d.", number);
         hodr_setNumberKinetics(number); // Set the number of accumulations in HODR
         // control_set_number_spectra(control, (uint32_t)number); // Set the number of accumulations in the control object
     }
 
-    printf("Starting acquisition...\n");
+    bool chained = hodr_getAcquisitionMode() == ACQ_MODE_RUN_TILL_ABORT && atomic_load(&targetIntensity) > 0;
+    if (chained)
+    {
+        // Auto-exposure can only change the time between series, so run till
+        // abort as back-to-back kinetic series and apply its times in between
+        log_info("Running till abort as chained series for auto-exposure.");
+        chainRestoreSeriesLength = hodr_getNumberKinetics();
+        hodr_setAcquisitionMode(ACQ_MODE_KINETICS);
+        hodr_setNumberKinetics(chainedSeriesFrames());
+    }
+
+    log_info("Starting acquisition...");
 
     unsigned int result = hodr_startAcquisition(); // Start acquisition in HODR
+    nextImageIndex = 1;                            // The SDK numbers the images of each acquisition from 1
     if (result != DRV_SUCCESS)
     {
-        fprintf(stderr, "Failed to start acquisition: %d\n", result);
+        if (chained)
+        {
+            restoreRunTillAbort();
+        }
+        log_error("Failed to start acquisition: %d", result);
         g_dbus_method_invocation_return_error(invocation, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to start acquisition: %d", result);
         pthread_mutex_unlock(&lock); // Unlock the mutex before returning
-        printf("Unlocked mutex after failed acquisition start.\n");
-        fflush(stdout);
+        log_debug("Unlocked mutex after failed acquisition start.");
         return FALSE; // Failed to start acquisition
     }
 
-    printf("Acquisition started successfully.\n");
+    log_info("Acquisition started successfully.");
+    chainingSeries = chained;
+    updateAcquisitionStatus();
 
     // hodr_startAcquisitionOnceTemperatureStabilized(); // Start acquisition once temperature is stabilized
     //  generate a new spectrum ID
-    uint32_t spectrumID = nTriggeredSpectra++; // Increment the captured spectra count to generate a new spectrum ID
+    // The first spectrum of this acquisition will be stored under the next spectrum ID
+    uint32_t spectrumID = firstSpectrumID + (uint32_t)ring_head(&frameRing);
+    nTriggeredSpectra++;
 
     pthread_mutex_unlock(&lock); // Unlock the mutex after starting acquisition
-    printf("Unlocked mutex after starting acquisition.\n");
-    printf("New spectrum ID generated: %u\n", spectrumID);
+    log_debug("Unlocked mutex after starting acquisition.");
+    log_info("New spectrum ID generated: %u", spectrumID);
 
     control_complete_start_acquisition(control, invocation, spectrumID); // Complete the D-Bus method invocation
 
-    // printf("Data waiting loop started with function reference: %u\n", dataWaitFunctionRef);
-    // printf("Initiated data waiting loop.\n");
+    // log_info("Data waiting loop started with function reference: %u", dataWaitFunctionRef);
+    // log_info("Initiated data waiting loop.");
     return TRUE; // Successfully started acquisition
 }
 
 static gboolean db_stopAcquisition(Control *control, GDBusMethodInvocation *invocation, gpointer)
 {
-    printf("Stopping acquisition...\n");
-    pthread_mutex_lock(&lock); // Lock the mutex to ensure thread safety
-    printf("Acquired lock for stopping acquisition.\n");
+    log_info("Stopping acquisition...");
+    metrics_lock(&lock, METRIC_LOCK_WAIT); // Lock the mutex to ensure thread safety
+    log_debug("Acquired lock for stopping acquisition.");
+    bool chained = chainingSeries;
+    chainingSeries = false;                        // The series ending now is the last
     unsigned int result = hodr_abortAcquisition(); // Abort acquisition in HODR
     if (result != DRV_SUCCESS)
     {
-        fprintf(stderr, "Failed to abort acquisition: %d\n", result);
+        chainingSeries = chained;
+        log_error("Failed to abort acquisition: %d", result);
         g_dbus_method_invocation_return_error(invocation, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to abort acquisition: %d", result);
         pthread_mutex_unlock(&lock); // Unlock the mutex before returning
         return FALSE;                // Failed to abort acquisition
     }
 
-    printf("Acquisition aborted successfully.\n");
+    log_info("Acquisition aborted successfully.");
+    updateAcquisitionStatus();
+    if (chained)
+    {
+        restoreRunTillAbort();
+    }
     control_complete_stop_acquisition(control, invocation); // Complete the D-Bus method invocation
     pthread_mutex_unlock(&lock);                            // Unlock the mutex after aborting acquisition
-    printf("Unlocked mutex after stopping acquisition.\n");
+    log_debug("Unlocked mutex after stopping acquisition.");
     return TRUE; // Successfully stopped acquisition
 }
 
-static gboolean db_getLastSpectrum(Control *control, GDBusMethodInvocation *invocation, gpointer)
+// Wrap npixels of data in an ai variant without copying them. Takes
+// ownership of data, which must come from g_malloc().
+static GVariant *pixelArrayVariant(int32_t *data, size_t npixels)
 {
-    printf("Requesting last captured spectrum data...\n");
+    GBytes *bytes = g_bytes_new_take(data, npixels * sizeof(int32_t));
+    GVariant *array = g_variant_new_from_bytes(G_VARIANT_TYPE("ai"), bytes, TRUE);
+    g_bytes_unref(bytes);
+    return array;
+}
 
-    if (nCapturedSpectra == 0)
-    {
-        g_dbus_method_invocation_return_error(invocation, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "No spectra captured yet.");
+// Build the (sddai) reply of get_data around an ai variant of the pixels
+static GVariant *spectrumVariant(int64_t timestampNs, float exposureTime, float temperature, GVariant *pixels)
+{
+    char timeString[64];
+    store_formatTimestamp(timestampNs, timeString, sizeof(timeString));
+    return g_variant_new("(sdd@ai)", timeString, (double)exposureTime, (double)temperature, pixels);
+}
 
-        return FALSE; // No spectra captured yet
+static gboolean db_getSpectrum(Control *control, GDBusMethodInvocation *invocation, gint spectrum_id, gpointer)
+{
+    if (spectrum_id < 0)
+    {
+        // The most recent frame comes straight from the ring, it may not be on disk yet
+        pthread_mutex_lock(&latestFrameLock);
+        if (haveLatestFrame)
+        {
+            int32_t *data = g_memdup2(latestFrame.data, latestFrame.npixels * sizeof(int32_t));
+            GVariant *pixels = pixelArrayVariant(data, latestFrame.npixels);
+            GVariant *response = spectrumVariant(latestFrame.timestampNs, latestFrame.exposureTime, latestFrame.temperature, pixels);
+            pthread_mutex_unlock(&latestFrameLock);
+            control_complete_get_data(control, invocation, response);
+            return TRUE;
+        }
+        pthread_mutex_unlock(&latestFrameLock);
     }
 
-    // Get last line from the data file
-
-    printf("Waiting to acquire lock for reading data file...\n");
-    fflush(stdout);
-    pthread_mutex_lock(&dataFileLock); // Lock the mutex for data file operations
-    printf("Acquired lock for reading data file.\n");
-    fflush(stdout);
-
-    FILE *file = fopen(outFile, "r");
-    if (file == NULL)
+    uint32_t nSpectra = writer_committedSpectra();
+    if (nSpectra == 0)
     {
-        g_dbus_method_invocation_return_error(invocation, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to open data file: %s", outFile);
-        pthread_mutex_unlock(&dataFileLock); // Unlock the mutex before returning
-        pthread_mutex_unlock(&lock);         // Unlock the main lock before returning
-        printf("Failed to open data file: %s\n", outFile);
-        printf("Unlocked mutex after failed file open.\n");
-        fflush(stdout);
-        return FALSE; // Error opening data file
+        g_dbus_method_invocation_return_error(invocation, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "No spectra captured yet.");
+        return TRUE; // Completed with the error
     }
-
-    char line[8192];     // Buffer for reading lines from the file
-    char nextLine[8192]; // Buffer for the next line
-    int nLines = 0;      // Counter for the number of lines read
-    while (fgets(line, sizeof(line), file) != NULL)
+    if (spectrum_id < 0)
     {
-        nLines++; // Increment the line counter
-        // Store the current line in nextLine
-        strncpy(nextLine, line, sizeof(nextLine) - 1);
-        nextLine[sizeof(nextLine) - 1] = '\0'; // Ensure null termination
+        spectrum_id = (gint)nSpectra - 1; // Negative IDs request the most recent spectrum
+    }
+    else if ((uint32_t)spectrum_id >= nSpectra)
+    {
+        g_dbus_method_invocation_return_error(invocation, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "Spectrum %d has not been captured yet.", spectrum_id);
+        return TRUE; // Completed with the error
     }
 
-    fclose(file);                        // Close the file after reading
-    pthread_mutex_unlock(&dataFileLock); // Unlock the mutex after reading the data file
-    printf("Unlocked mutex after reading data file.\n");
-    printf("Read %d lines from the data file.\n", nLines); // Log the number of lines read
-    fflush(stdout);
-
-    // second token is timestamp, convert from string to unix timestamp
-    printf("Parsing timestamp...\n");
-
-    // First token is spectrum ID, ignore it
-    char token[64];
-
-    //char *firstToken = strtok(line, ","); // Get the first token (spectrum ID)
-    // if (firstToken == NULL)
-    // {
-    //     g_dbus_method_invocation_return_error(invocation, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "Failed to parse spectrum ID from data file.");
-    //     printf("Failed to parse spectrum ID from data file.\n");
-    //     return FALSE; // Error parsing spectrum ID
-    // }
-
-    char *timeToken = strtok(line, ",");
-
-    printf("Time token: %s\n", timeToken); // Log the time token
-    strcpy(token, timeToken);              // Copy the token to a buffer
-
-    double exposureTimeDouble;
-
-    // third token is exposure time as float.
-    printf("Parsing exposure time...\n");
-    // convert from string to float then multiply by 1e9 to convert to nanoseconds
-    char *exposureTimetoken = strtok(NULL, ",");
-    strcpy(token, exposureTimetoken); // Copy the token to a buffer
+    // One index read gives the record offset, one record read gives the spectrum
+    HODR_RecordHeader_t header;
+    int32_t *data = g_new(int32_t, xpixels);
+    int dataCount = writer_readSpectrum((uint32_t)spectrum_id, &header, data, (size_t)xpixels);
 
-    exposureTimeDouble = atof(token);
+    if (dataCount < 0)
+    {
+        g_free(data);
+        g_dbus_method_invocation_return_error(invocation, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "Spectrum %d not found in %s", spectrum_id, dataDir);
+        return TRUE; // Completed with the error
+    }
 
-    printf("Exposure time parsed: %.5f seconds\n", exposureTimeDouble); // Log the parsed exposure time
+    GVariant *response = spectrumVariant(header.timestampNs, header.exposureTime, header.temperature, pixelArrayVariant(data, (size_t)dataCount));
+    control_complete_get_data(control, invocation, response); // Complete the D-Bus method invocation with the GVariant
 
-    printf("Parsing temperature...\n");
-    double temperatureDouble;
+    return TRUE; // Successfully returned the spectrum data
+}
 
-    // fourth token is temperature as float
-    char *temperatureToken = strtok(NULL, ",");
+// Return up to count spectra from first on in one reply. The pixels of all
+// spectra are one flat ai of npixels per spectrum, alongside per-spectrum
+// timestamps (ns since the Unix epoch), exposure times and temperatures.
+static gboolean db_getSpectra(Control *control, GDBusMethodInvocation *invocation, guint first, guint count, gpointer)
+{
+    if (count == 0)
+    {
+        g_dbus_method_invocation_return_error(invocation, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "No spectra requested.");
+        return TRUE;
+    }
+    if (count > MAX_SPECTRA_BATCH)
+    {
+        count = MAX_SPECTRA_BATCH; // Clients page through larger ranges
+    }
 
-    printf("Temperature token: %s\n", temperatureToken); // Log the temperature token
-    strcpy(token, temperatureToken);                     // Copy the token to a buffer
+    HODR_RecordHeader_t *headers = g_new(HODR_RecordHeader_t, count);
+    int32_t *data = g_new(int32_t, (size_t)count * (size_t)xpixels);
+    long n = writer_readSpectra(first, count, headers, data, (size_t)xpixels); // One index read and one data read for the batch
+    if (n <= 0)
+    {
+        g_free(headers);
+        g_free(data);
+        g_dbus_method_invocation_return_error(invocation, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "Spectrum %u not found in %s", first, dataDir);
+        return TRUE;
+    }
 
-    temperatureDouble = atof(token);
-    printf("Temperature parsed: %.2f degrees Celsius\n", temperatureDouble); // Log the parsed temperature
+    gint64 timestamps[n];
+    gdouble exposureTimes[n], temperatures[n];
+    for (long i = 0; i < n; i++)
+    {
+        timestamps[i] = headers[i].timestampNs;
+        exposureTimes[i] = headers[i].exposureTime;
+        temperatures[i] = headers[i].temperature;
+    }
+    g_free(headers);
+
+    control_complete_get_spectra(control, invocation, (guint)xpixels,
+                                 g_variant_new_fixed_array(G_VARIANT_TYPE_INT64, timestamps, (gsize)n, sizeof(gint64)),
+                                 g_variant_new_fixed_array(G_VARIANT_TYPE_DOUBLE, exposureTimes, (gsize)n, sizeof(gdouble)),
+                                 g_variant_new_fixed_array(G_VARIANT_TYPE_DOUBLE, temperatures, (gsize)n, sizeof(gdouble)),
+                                 pixelArrayVariant(data, (size_t)n * (size_t)xpixels));
+    return TRUE;
+}
 
-    printf("Initializing GVariant builder...\n");
-    GVariantBuilder *builder;
-    builder = g_variant_builder_new(G_VARIANT_TYPE("ai")); // Create a new GVariant builder for an array of integers
+// Spectra of a time range passing the query filters, see query.h. A call
+// scans a bounded stretch of the data files and returns what matched there;
+// the client resumes from next_id until complete.
+static gboolean db_querySpectra(Control *control, GDBusMethodInvocation *invocation, gint64 start_ns, gint64 end_ns, gdouble min_exposure,
+                                gdouble max_exposure, gboolean stabilized_only, guint from_id, guint count, gpointer)
+{
+    if (count == 0)
+    {
+        g_dbus_method_invocation_return_error(invocation, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "No spectra requested.");
+        return TRUE;
+    }
+    if (count > MAX_SPECTRA_BATCH)
+    {
+        count = MAX_SPECTRA_BATCH;
+    }
+    HODR_Query_t query = {
+        .startNs = start_ns,
+        .endNs = end_ns > 0 ? end_ns : INT64_MAX,
+        .minExposure = (float)min_exposure,
+        .maxExposure = (float)max_exposure,
+        .stabilizedOnly = stabilized_only,
+    };
+    if (query_begin(&query, from_id) != 0)
+    {
+        g_dbus_method_invocation_return_error(invocation, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "No data files in %s", dataDir);
+        return TRUE;
+    }
 
-    printf("Parsing data values...\n");
-    // remaining tokens are data values, split by comma
+    HODR_RecordHeader_t *headers = g_new(HODR_RecordHeader_t, count);
+    int32_t *data = g_new(int32_t, (size_t)count * (size_t)xpixels);
+    long n = query_run(&query, count, headers, data, (size_t)xpixels);
+    if (n < 0)
+    {
+        n = 0;
+    }
 
-    // int32_t dataArray[xpixels]; // Array to hold data values
-    // int dataArrayCount = 0; // Count of data values
+    guint32 ids[n + 1]; // Not zero length
+    gint64 timestamps[n + 1];
+    gdouble exposureTimes[n + 1], temperatures[n + 1];
+    for (long i = 0; i < n; i++)
+    {
+        ids[i] = headers[i].spectrumID;
+        timestamps[i] = headers[i].timestampNs;
+        exposureTimes[i] = headers[i].exposureTime;
+        temperatures[i] = headers[i].temperature;
+    }
+    g_free(headers);
+
+    control_complete_query_spectra(control, invocation, (guint)xpixels,
+                                   g_variant_new_fixed_array(G_VARIANT_TYPE_UINT32, ids, (gsize)n, sizeof(guint32)),
+                                   g_variant_new_fixed_array(G_VARIANT_TYPE_INT64, timestamps, (gsize)n, sizeof(gint64)),
+                                   g_variant_new_fixed_array(G_VARIANT_TYPE_DOUBLE, exposureTimes, (gsize)n, sizeof(gdouble)),
+                                   g_variant_new_fixed_array(G_VARIANT_TYPE_DOUBLE, temperatures, (gsize)n, sizeof(gdouble)),
+                                   pixelArrayVariant(data, (size_t)n * (size_t)xpixels), query.nextID, query.done);
+    return TRUE;
+}
 
-    // Get the rest of the line and split by comma
-    char *dataToken;
-    int dataCount = 0; // Count of data values
-    while ((dataToken = strtok(NULL, ",")) != NULL)
+// Hand a read-only descriptor of the shared-memory spectrum ring to a local
+// client, see shm.h for its layout
+static gboolean db_getSharedRing(Control *control, GDBusMethodInvocation *invocation, GUnixFDList *, gpointer)
+{
+    int fd = shm_clientFd(&sharedRing);
+    if (fd < 0)
     {
-        dataCount++;                                    // Increment the data count
-        int32_t dataValue = (int32_t)atoi(dataToken);   // Convert the token to an integer
-        g_variant_builder_add(builder, "i", dataValue); // Add the integer to the GVariant builder
+        g_dbus_method_invocation_return_error(invocation, G_IO_ERROR, G_IO_ERROR_FAILED, "Shared spectrum ring is not available.");
+        return TRUE;
     }
+    GUnixFDList *fdList = g_unix_fd_list_new_from_array(&fd, 1); // Takes ownership of fd
+    control_complete_get_shared_ring(control, invocation, fdList, g_variant_new_handle(0));
+    g_object_unref(fdList);
+    return TRUE;
+}
 
-    printf("Parsed %d data values.\n", dataCount); // Log the number of data values parsed
+// Auto-exposure consumer of the frame ring. Feeds the newest frame to the
+// controller and only hands its proposal over; readout applies it between
+// series, or between frames of a run-till-abort series.
+void *handleAutoExposure()
+{
+    HODR_FrameSlot_t frame = {.data = calloc((size_t)xpixels, sizeof(int32_t))};
+    HODR_AutoExposure_t controller = {0};
+    float lastProposal = 0;
+    if (frame.data == NULL)
+    {
+        log_error("Failed to allocate auto-exposure frame.");
+        return NULL;
+    }
 
-    // g_dbus_method_invocation_return_value(invocation, value); // Return the GVariant as the response
+    while (ring_wait(&frameRing, exposureConsumer) > 0)
+    {
+        unsigned int target = atomic_load(&targetIntensity);
+        if (target != controller.target)
+        {
+            exposure_setTarget(&controller, target);
+        }
+        if (!ring_readLatest(&frameRing, exposureConsumer, &frame) || target == 0)
+        {
+            continue;
+        }
+        float inEffect = atomic_load(&exposureInEffect);
+        if (inEffect > 0 && frame.exposureTime != inEffect)
+        {
+            continue; // Taken before the last time was applied, it would ask for the same step again
+        }
+        uint64_t start = metrics_nowNs();
+        float proposal = exposure_update(&controller, frame.exposureTime, frame.data, frame.npixels);
+        metrics_since(METRIC_AUTO_EXPOSURE, start);
+        if (proposal == 0 && lastProposal == 0)
+        {
+            continue; // On target, nothing to hand over
+        }
+        lastProposal = proposal;
 
-    printf("Creating response GVariant...\n");
-    GVariant *response;
-    response = g_variant_new("(sddai)", timeToken, exposureTimeDouble, temperatureDouble, builder); // Create a response GVariant with timestamp, exposure time, temperature, and data array
+        metrics_lock(&lock, METRIC_LOCK_WAIT);
+        pendingExposure = proposal; // Applied at the next series boundary
+        pthread_mutex_unlock(&lock);
+    }
+    free(frame.data);
+    return NULL;
+}
 
-    printf("Completing D-Bus method invocation...\n");
-    control_complete_get_data(control, invocation, response); // Complete the D-Bus method invocation with the GVariant
+// D-Bus consumer of the frame ring. Keeps latestFrame as the newest frame so
+// the live view never touches the data file.
+void *handleLiveFrames()
+{
+    int32_t *spare = calloc((size_t)xpixels, sizeof(int32_t));
+    if (spare == NULL)
+    {
+        log_error("Failed to allocate live frame.");
+        return NULL;
+    }
 
-    return TRUE; // Successfully returned the last spectrum data
+    HODR_FrameSlot_t frame = {.data = spare};
+    while (ring_wait(&frameRing, liveConsumer) > 0)
+    {
+        if (!ring_readLatest(&frameRing, liveConsumer, &frame))
+        {
+            continue;
+        }
+        pthread_mutex_lock(&latestFrameLock);
+        int32_t *previous = latestFrame.data;
+        latestFrame = frame; // Swap buffers rather than copy the pixels again
+        frame.data = previous;
+        haveLatestFrame = true;
+        pthread_mutex_unlock(&latestFrameLock);
+    }
+    free(frame.data);
+    return NULL;
 }
 
-int createDataFile(char *directory, char *filename)
+// Shared-memory consumer of the frame ring. Copies every frame it keeps up
+// with straight into the next slot of sharedRing.
+void *handleSharedRing()
 {
+    HODR_FrameSlot_t frame;
+    while (ring_wait(&frameRing, sharedConsumer) > 0)
+    {
+        // The next frame is the consumer's cursor, shm_publish() moves the pixels if it was overwritten
+        frame.data = shm_beginWrite(&sharedRing, atomic_load(&sharedConsumer->cursor));
+        while (ring_readNext(&frameRing, sharedConsumer, &frame))
+        {
+            shm_publish(&sharedRing, &frame);
+            frame.data = shm_beginWrite(&sharedRing, atomic_load(&sharedConsumer->cursor));
+        }
+    }
+    return NULL;
+}
 
-    time_t current_time;
-    struct tm *time_info;
-    char timeString[64]; // space for "YYYY-MM-DD_HH-MM-SS_andor.csv\0"
+// Frames the camera took before the one at SDK index imageIndex that were
+// never read. Called with lock held, for every frame read in order.
+static uint32_t framesSkippedBefore(int32_t imageIndex)
+{
+    uint32_t skipped = imageIndex > nextImageIndex ? (uint32_t)(imageIndex - nextImageIndex) : 0;
+    nextImageIndex = imageIndex + 1;
+    return skipped;
+}
 
-    time(&current_time);
-    time_info = localtime(&current_time);
+// Correct a filled slot in place as correction.output asks, keeping the raw
+// pixels alongside if both are stored. Called with calibrationLock held.
+static void correctSlot(HODR_FrameSlot_t *slot)
+{
+    if (correction.output == CORRECTION_OUTPUT_RAW)
+    {
+        return;
+    }
+    uint64_t start = metrics_nowNs();
+    if (correction.output == CORRECTION_OUTPUT_BOTH)
+    {
+        memcpy(slot->raw, slot->data, frameRing.npixels * sizeof(int32_t));
+    }
+    float *noise = slot->flags & HODR_RECORD_COADDED ? slot->noise : NULL;
+    uint8_t applied = correction_apply(&correction, slot->data, noise, slot->exposureTime, slot->temperature);
+    if (applied == 0)
+    {
+        log_warnEvery(1000, "No master dark for %.6f seconds at %.1f C, spectrum %u stored uncorrected.", slot->exposureTime, slot->temperature, slot->spectrumID);
+        return;
+    }
+    slot->flags |= applied | (correction.output == CORRECTION_OUTPUT_BOTH ? HODR_RECORD_WITH_RAW : 0);
+    metrics_since(METRIC_CORRECTION, start);
+}
 
-    strftime(timeString, sizeof(timeString), "%Y-%m-%d_andor.csv", time_info);
+// Resample a corrected slot to the wavelength grid, if there is one. Called
+// with calibrationLock held.
+static void resampleSlot(HODR_FrameSlot_t *slot)
+{
+    if (!wavelength_resampling(&wavelength))
+    {
+        return;
+    }
+    uint64_t start = metrics_nowNs();
+    slot->gridPoints = wavelength_resample(&wavelength, slot->data, slot->resampled);
+    slot->gridStart = wavelength.gridStart;
+    slot->gridStep = wavelength.gridStep;
+    slot->flags |= HODR_RECORD_RESAMPLED;
+    metrics_since(METRIC_RESAMPLE, start);
+}
 
-    // // fill filename with zeroes
-    // memset(filename, 0, sizeof(filename));
+// Number a filled slot, correct and resample it and publish it. gapBefore
+// frames lost before it are counted as dropped and marked as a gap. Called
+// from processing with calibrationLock held.
+static void publishSlot(HODR_FrameSlot_t *slot, uint32_t gapBefore)
+{
+    slot->spectrumID = firstSpectrumID + (uint32_t)slot->frame;
+    slot->gapBefore = gapBefore;
+    slot->npixels = (uint32_t)frameRing.npixels;
+    if (gapBefore > 0)
+    {
+        pthread_mutex_lock(&gapLock);
+        frameGaps[nFrameGaps % MAX_FRAME_GAPS] = (HODR_FrameGap_t){.spectrumID = slot->spectrumID, .missingFrames = gapBefore};
+        nFrameGaps++;
+        droppedFrames += gapBefore;
+        uint64_t dropped = droppedFrames;
+        pthread_mutex_unlock(&gapLock);
+        log_warnEvery(1000, "Frame gap: %u frames lost before spectrum %u (%lu dropped so far).", gapBefore, slot->spectrumID, (unsigned long)dropped);
+    }
+    correctSlot(slot);
+    resampleSlot(slot);
+    ring_publish(&frameRing, slot);
+    nCapturedSpectra++;
+}
 
-    sprintf(filename, "%s/%s", directory, timeString);
+// Publish the mean of the frames co-added so far into a claimed slot.
+// Called from processing with calibrationLock held.
+static void publishCoadd(HODR_FrameSlot_t *slot)
+{
+    slot->timestampNs = coadd.timestampNs;
+    slot->exposureTime = coadd.exposureTime;
+    slot->temperature = coadd.temperature;
+    slot->flags = coadd.flags | HODR_RECORD_COADDED;
+    slot->coadded = (uint16_t)coadd_finish(&coadd, slot->data, slot->noise);
+    mergedFrames += slot->coadded - 1u;
+    publishSlot(slot, coaddGapBefore);
+    coaddGapBefore = 0;
+}
 
-    int filepathLength = strlen(filename);
-    FILE *file = fopen(filename, "a");
-    if (file == NULL)
+// Publish the frames co-added so far, if there are any. Returns false if the
+// frame ring is full, they are kept for the next try. Called from processing
+// with calibrationLock held.
+static bool flushCoadd()
+{
+    if (coadd.count == 0)
     {
-        fprintf(stderr, "Error creating file %s: %s\n", filename, strerror(errno));
-        return -1; // Error creating file
+        return true;
     }
-
-    return filepathLength; // Return the length of the file path
+    HODR_FrameSlot_t *slot = ring_claim(&frameRing);
+    if (slot == NULL)
+    {
+        return false;
+    }
+    publishCoadd(slot);
+    return true;
 }
 
-int countLines() {
-    pthread_mutex_lock(&dataFileLock); // Lock the mutex for data file operations#
-    FILE *file = fopen(outFile, "r");
-    size_t buffSize = 65536;
-    char buf[buffSize];
-    int counter = 0;
-    for (;;)
+// End of a dark capture that asked for wanted frames: average its frames
+// into a master dark, unless it was stopped early. Called from processing
+// with calibrationLock held.
+static void makeMasterDark(unsigned int wanted)
+{
+    float *mean = malloc(darkFrames.npixels * sizeof(float));
+    if (darkFrames.count < wanted || mean == NULL)
+    {
+        log_warn("Dark capture ended after %u of %u frames, discarded.", darkFrames.count, wanted);
+    }
+    else
     {
-        size_t res = fread(buf, 1, buffSize, file);
-        if (ferror(file))
+        coadd_mean(&darkFrames, mean);
+        int result = correction_addDark(&correction, mean, darkFrames.count, darkFrames.exposureTime, darkFrames.temperature);
+        if (result == 0)
         {
-            pthread_mutex_unlock(&dataFileLock); // unLock the mutex for data file operations
-            return -1;
+            log_info("Master dark captured: %u frames of %.6f seconds at %.1f C.", darkFrames.count, darkFrames.exposureTime, darkFrames.temperature);
         }
+        atomic_store(&darksChanged, true);
+        requestNotify();
+    }
+    free(mean);
+    coadd_reset(&darkFrames);
+}
 
-        int i;
-        for (i = 0; i < res; i++)
+// Turn one raw frame from readout into spectra. Frames are summed while their
+// coadded asks for more than one; a gap or a new count ends the spectrum
+// early, so each one only averages consecutive frames taken alike. Returns
+// false if the frame ring is full, the frame is then offered again. Called
+// from processing with calibrationLock held.
+static bool processFrame(HODR_FrameSlot_t *raw)
+{
+    if (raw->npixels == 0) // End of a series
+    {
+        if (!flushCoadd())
         {
-            if (buf[i]== '\n')
-            {
-                counter++;
-            }
+            return false;
         }
-
-        if (feof(file))
+        if (raw->coadded > 0)
         {
-            break;
+            makeMasterDark(raw->coadded);
         }
+        return true;
+    }
+    if (raw->coadded == RAW_DARK)
+    {
+        coadd_add(&darkFrames, raw->data, raw->timestampNs, raw->exposureTime, raw->temperature, 0); // Dark frames only go into the master
+        return true;
+    }
+    if (raw->gapBefore > 0 || raw->coadded != coadd.frames)
+    {
+        if (!flushCoadd())
+        {
+            return false;
+        }
+        coaddGapBefore += raw->gapBefore;
+        raw->gapBefore = 0; // Counted, a retry must not count it again
+        coadd.frames = raw->coadded;
+    }
 
+    HODR_FrameSlot_t *slot = NULL;
+    if (coadd.count + 1 >= coadd.frames) // This frame completes a spectrum
+    {
+        slot = ring_claim(&frameRing);
+        if (slot == NULL)
+        {
+            return false;
+        }
+    }
+    if (coadd.frames == 1)
+    {
+        memcpy(slot->data, raw->data, frameRing.npixels * sizeof(int32_t));
+        slot->timestampNs = raw->timestampNs;
+        slot->exposureTime = raw->exposureTime;
+        slot->temperature = raw->temperature;
+        slot->flags = raw->flags;
+        slot->coadded = 0;
+        publishSlot(slot, coaddGapBefore);
+        coaddGapBefore = 0;
+        return true;
     }
-    pthread_mutex_unlock(&dataFileLock); // unLock the mutex for data file operations
-    return counter;
+    coadd_add(&coadd, raw->data, raw->timestampNs, raw->exposureTime, raw->temperature, raw->flags);
+    if (slot != NULL)
+    {
+        publishCoadd(slot);
+    }
+    return true;
 }
 
-int appendToFile(const char *filename, int spectrumID, float *exposureTime, double *temperature, const int32_t *data, size_t size)
+// Processing thread, the consumer of the readout ring and the producer of the
+// frame ring. Co-adds, corrects and resamples the raw frames readout read, so
+// readout only ever copies frames out of the camera. While the frame ring is
+// full, raw frames wait in the readout ring and then in the camera buffer.
+void *handleProcessing()
 {
-
-    pthread_mutex_lock(&dataFileLock); // Lock the mutex to ensure thread safety for file operations
-    FILE *file = fopen(filename, "a");
-    if (file == NULL)
+    size_t available;
+    while ((available = ring_wait(&readoutRing, processingConsumer)) > 0)
     {
-        fprintf(stderr, "Error opening file %s for appending.\n", filename);
-        return -1;
+        size_t done = 0;
+        pthread_mutex_lock(&calibrationLock);
+        while (done < available && processFrame(ring_peek(&readoutRing, processingConsumer, done)))
+        {
+            done++;
+        }
+        pthread_mutex_unlock(&calibrationLock);
+        if (done < available && ring_closed(&readoutRing))
+        {
+            log_error("Frame ring full, discarding %zu unprocessed frames.", available - done);
+            done = available;
+        }
+        ring_release(&readoutRing, processingConsumer, done);
+        if (done < available)
+        {
+            log_warnEvery(1000, "Frame ring full, %zu frames wait for processing (%lu failed claims so far).",
+                    available - done, (unsigned long)ring_failedClaims(&frameRing));
+            struct timespec retry = {.tv_nsec = 1000000}; // Storage frees slots batch by batch
+            nanosleep(&retry, NULL);
+        }
     }
+    return NULL;
+}
 
-    printf("Appending data to file %s...\n", filename);
-    time_t current_time;
-    struct tm *time_info;
-    char timeString[64]; // space for "HH:MM:SS\0"
+static uint8_t temperatureFlags()
+{
+    return lastTemperatureStatus == DRV_TEMP_STABILIZED ? HODR_RECORD_TEMP_STABILIZED : 0;
+}
 
-    time(&current_time);
-    // subtract the exposure time from the current time to get the timestamp
-    // current_time -= (time_t)(*exposureTime * 1000000000);
-    time_info = localtime(&current_time);
+// Stamp a claimed raw slot with the frame metadata and hand it to processing.
+// coadded is the number of frames to co-add it with, or RAW_DARK. imageIndex
+// is the SDK index of the frame, any frames skipped since the last one read
+// are passed on as a gap. Called with lock held.
+static void publishFrame(HODR_FrameSlot_t *slot, int64_t timestampNs, float exposureTime, int32_t imageIndex, uint16_t coadded)
+{
+    slot->timestampNs = timestampNs;
+    slot->exposureTime = exposureTime;
+    slot->temperature = (float)lastTemperature;
+    slot->flags = temperatureFlags();
+    slot->coadded = coadded;
+    slot->gapBefore = coadded == RAW_DARK ? 0 : framesSkippedBefore(imageIndex); // A dark that is short of frames is discarded anyway
+    slot->npixels = (uint32_t)readoutRing.npixels;
+    ring_publish(&readoutRing, slot);
+}
 
-    strftime(timeString, sizeof(timeString), "%Y-%m-%dT%H:%M:%S", time_info);
-    // fprintf(file, "%d,", spectrumID);      // Write spectrum ID
-    fprintf(file, "%s,", timeString);      // Write timestamp
-    fprintf(file, "%.9f,", *exposureTime); // Write exposure time
-    fprintf(file, "%.2f,", *temperature);  // Write temperature
-    for (size_t i = 0; i < size; i++)
+// Publish the pending end of a series to processing as a slot without pixels.
+// Returns false if the readout ring is full, later frames then wait behind
+// it. Called with lock held.
+static bool publishSeriesEnd()
+{
+    if (!seriesEndPending)
     {
-        fprintf(file, "%d", data[i]);
-        if (i < size - 1)
-        {
-            fprintf(file, ",");
-        }
+        return true;
     }
-    fprintf(file, "\n"); // New line after each data set
-
-    printf("Data appended successfully.\n");
-    fflush(file); // Ensure data is written to file
-    fclose(file);
-    pthread_mutex_unlock(&dataFileLock); // Unlock the mutex after file operations
+    HODR_FrameSlot_t *slot = ring_claim(&readoutRing);
+    if (slot == NULL)
+    {
+        log_warnEvery(1000, "Readout ring full, end of series held back (%lu failed claims so far).", (unsigned long)ring_failedClaims(&readoutRing));
+        return false;
+    }
+    slot->npixels = 0;
+    slot->coadded = seriesEndDarkFrames;
+    slot->gapBefore = 0;
+    ring_publish(&readoutRing, slot);
+    seriesEndPending = false;
+    return true;
+}
 
-    printf("Unlocked mutex after appending data to file.\n");
-    return 0;
+// Tell processing a series has ended, after its last frames: it stores what
+// it has co-added, and after a dark capture of darkFramesWanted frames makes
+// the master dark. Called with lock held.
+static void endSeries(uint16_t darkFramesWanted)
+{
+    if (!seriesEndPending || darkFramesWanted > 0) // A held back dark end stays one
+    {
+        seriesEndDarkFrames = darkFramesWanted;
+    }
+    seriesEndPending = true;
+    publishSeriesEnd();
 }
 
-void adjustIntegrationTime(unsigned int targetIntensity, float exposureTime, int32_t *data, size_t size, unsigned int attemptLimit)
+static int64_t nowNs()
 {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
 
-    int32_t maxIntensity; // Variable to hold the maximum intensity found in the data
+// Read the most recent frame into the readout ring. Used outside kinetic
+// series, where there is only ever one new frame. Called with lock held.
+static void readMostRecentFrame()
+{
+    HODR_FrameSlot_t *slot = publishSeriesEnd() ? ring_claim(&readoutRing) : NULL;
+    if (slot == NULL)
+    {
+        log_warnEvery(1000, "Readout ring full, frame skipped (%lu failed claims so far).", (unsigned long)ring_failedClaims(&readoutRing));
+        requestNotify();
+        return; // The frame stays in the camera buffer, the next read picks up the newest
+    }
 
-    while (true)
+    uint64_t start = metrics_nowNs();
+    unsigned int result = hodr_getMostRecentImage(slot->data, readoutRing.npixels); // Read the frame straight into the ring slot
+    metrics_since(METRIC_READOUT, start);
+    if (result != DRV_SUCCESS)
     {
+        log_errorEvery(1000, "Error getting images: %d", result);
+        return; // The slot is claimed again by the next read
+    }
 
-        if (targetIntensity == 0)
-        {
-            printf("Target intensity is not set or invalid. Skipping adjustment of integration time.\n");
-            return; // Do not adjust if target intensity is not set or invalid
-        }
+    int32_t imageIndex;
+    if (hodr_getTotalNumberImagesAcquired(&imageIndex) != DRV_SUCCESS)
+    {
+        imageIndex = nextImageIndex; // Without an index assume nothing was missed
+    }
 
-        printf("Adjusting integration time based on target intensity: %d\n", targetIntensity);
-        maxIntensity = data[0]; // Initialize max intensity with the first data point
-        for (size_t i = 1; i < size; i++)
-        {
-            if (data[i] > maxIntensity)
-            {
-                maxIntensity = data[i]; // Update max intensity if current data is greater
-            }
-        }
+    float exposureTime, kineticCycleTime, readoutTime;
+    start = metrics_nowNs();
+    hodr_getAcquisitionTimings(&exposureTime, &kineticCycleTime, &readoutTime); // Get acquisition timings
+    metrics_since(METRIC_TIMINGS, start);
+    publishFrame(slot, nowNs(), exposureTime, imageIndex, 1);
+}
 
-        printf("Max intensity from data: %d\n", maxIntensity);
-        float newIntegrationTime = exposureTime; // Initialize new integration time with the current exposure time
-        if (maxIntensity >= 65534)
-        {
-            newIntegrationTime *= 0.5; // Reduce integration time by half if max intensity is too high
-            printf("Max intensity too high, reducing integration time to %.6f seconds\n", newIntegrationTime);
-        }
-        else
+// Read every frame the camera has taken since the last read into the readout
+// ring, tagged for a master dark while capturing one and with the co-adding
+// count otherwise. Each contiguous run of free slots is filled with one
+// GetImages call, so frames that arrive while processing is busy are not
+// lost. Called with lock held.
+static void drainNewFrames()
+{
+    float exposureTime, kineticCycleTime, readoutTime;
+    uint64_t start = metrics_nowNs();
+    hodr_getAcquisitionTimings(&exposureTime, &kineticCycleTime, &readoutTime); // Get acquisition timings
+    metrics_since(METRIC_TIMINGS, start);
+    int64_t readNs = nowNs();
+    uint16_t coadded = capturingDark ? RAW_DARK : (uint16_t)coaddFrames;
+
+    int32_t first, last;
+    while (hodr_getNumberNewImages(&first, &last) == DRV_SUCCESS && first <= last)
+    {
+        size_t count;
+        HODR_FrameSlot_t *slots = publishSeriesEnd() ? ring_claimMany(&readoutRing, (size_t)(last - first + 1), &count) : NULL;
+        if (slots == NULL)
         {
-
-            float ratio = (float)maxIntensity / (float)targetIntensity; // Calculate ratio of max intensity to target intensity
-            if (ratio > 0.95 && ratio < 1.05)
-            {
-                printf("Max intensity is within 10%% of target intensity, keeping current integration time: %.6f seconds\n", newIntegrationTime);
-                return; // If max intensity is within 10% of target intensity, keep the current integration time
-            }
-            newIntegrationTime = exposureTime * ((float)targetIntensity / (float)maxIntensity); // Adjust integration time based on target intensity
-            printf("Adjusted integration time based on target intensity: %.6f seconds\n", newIntegrationTime);
+            log_warnEvery(1000, "Readout ring full, %d frames left in the camera buffer (%lu failed claims so far).",
+                    last - first + 1, (unsigned long)ring_failedClaims(&readoutRing));
+            requestNotify();
+            return; // Picked up by the next drain unless the camera overwrites them first
         }
 
-        hodr_abortAcquisition();
-        unsigned int result = hodr_setExposureTime(newIntegrationTime); // Set the new exposure time in HODR
-
-        result = hodr_startAcquisition(); // Restart acquisition with the new exposure time
+        int32_t validFirst, validLast;
+        start = metrics_nowNs();
+        unsigned int result = hodr_getImages(first, first + (int32_t)count - 1, slots[0].data, count * readoutRing.npixels, &validFirst, &validLast);
+        metrics_since(METRIC_READOUT, start);
         if (result != DRV_SUCCESS)
         {
-            fprintf(stderr, "Failed to restart acquisition with new integration time: %d\n", result);
-        }
-
-        if (attemptLimit-- == 0) // Check if attempt limit is reached
-        {
-            printf("Attempt limit reached. Stopping adjustment of integration time.\n");
-            return; // Stop adjusting if attempt limit is reached
+            return; // The slots are claimed again by the next read
         }
 
-        result = WaitForAcquisition(); // Wait for acquisition to finish before checking again
-        if (result != DRV_SUCCESS)
+        for (int32_t i = validFirst; i <= validLast; i++)
         {
-            fprintf(stderr, "Error waiting for acquisition: %d\n", result);
-            return; // Error waiting for acquisition
+            // Frames come in one cycle apart, the newest one was read out just now
+            int64_t timestampNs = readNs - (int64_t)((double)(last - i) * kineticCycleTime * 1e9);
+            publishFrame(&slots[i - validFirst], timestampNs, exposureTime, i, coadded);
         }
-        result = hodr_getMostRecentImage(data, (size_t)xpixels); // Get the most recent image acquired
-        float kineticCycleTime, readoutTime;
-        hodr_getAcquisitionTimings(&exposureTime, &kineticCycleTime, &readoutTime); // Get acquisition timings
     }
 }
 
+// End of a dark capture series: hand its last frames to processing, which
+// makes the master dark, and put the shutter and acquisition mode back.
+// Called with lock held.
+static void finishDarkCapture()
+{
+    drainNewFrames(); // The last frames may still be waiting
+    capturingDark = false;
+    hodr_setShutter((int)hodr_getShutterType(), darkRestoreShutterMode, 0, 0);
+    hodr_setAcquisitionMode(darkRestoreMode);
+    endSeries((uint16_t)darkFramesWanted);
+}
+
+// Readout thread, the producer of the readout ring. It only copies new frames
+// into ring slots and goes back to waiting; co-adding, dark capture and
+// everything else is done by processing and the frame ring consumers.
 void *handleAcquisitionLoop() // Function to handle the acquisition loop
 {
 
     if (!andorActive) // Check if Andor SDK is active
     {
-        fprintf(stderr, "Andor SDK is not active. Cannot handle acquisition loop.\n");
+        log_error("Andor SDK is not active. Cannot handle acquisition loop.");
         return NULL; // Do not proceed if Andor SDK is not active
     }
-    unsigned int result;
     unsigned int acquisitionStatus = 0; // Variable to hold acquisition status
-    printf("Handling acquisition loop...\n");
+    log_info("Handling acquisition loop...");
 
     while (true)
     {
         if (!andorActive) // Check if Andor SDK is still active
         {
-            printf("Andor SDK is not active. Exiting acquisition loop.\n");
+            log_info("Andor SDK is not active. Exiting acquisition loop.");
             break; // Exit the loop if Andor SDK is not active
         }
-        printf("Waiting for next acquisition to finish...\n");
+        uint64_t waitStart = metrics_nowNs();
         acquisitionStatus = WaitForAcquisition(); // Start waiting for acquisition data
+        metrics_since(METRIC_WAIT, waitStart);
 
         if (!andorActive) // Check if Andor SDK is still active after waiting
         {
-            printf("Andor SDK is not active. Exiting acquisition loop.\n");
+            log_info("Andor SDK is not active. Exiting acquisition loop.");
             break; // Exit the loop if Andor SDK is not active
         }
         if (acquisitionStatus != DRV_SUCCESS)
         {
-            fprintf(stderr, "Acquisition Wait cancelled.\n");
+            log_warn("Acquisition Wait cancelled.");
             return NULL; // Error waiting for acquisition
         }
-        printf("Acquisition finished.\n");
-        printf("Num spectra triggered: %d\n", nTriggeredSpectra);
-        printf("Num spectra captured: %d\n", nCapturedSpectra);
-        printf("Acquisition %d complete.\n", nCapturedSpectra);
 
-        printf("Waiting to acquire lock for processing acquired data...\n");
-        pthread_mutex_lock(&lock); // Lock the mutex to ensure thread safety
-        printf("Acq. %d: Acquired lock for processing acquired data.\n", nCapturedSpectra);
-
-        int32_t data[xpixels]; // Array to hold the acquired data
-
-        result = hodr_getMostRecentImage(data, (size_t)xpixels); // Get the most recent image acquired
-
-        if (result != DRV_SUCCESS)
+        metrics_lock(&lock, METRIC_LOCK_WAIT); // Lock the mutex to ensure thread safety
+        uint64_t frameStart = metrics_nowNs();
+        unsigned int mode = hodr_getAcquisitionMode();
+        if (mode == ACQ_MODE_KINETICS || mode == ACQ_MODE_RUN_TILL_ABORT) // Dark captures are kinetic series too
         {
-            fprintf(stderr, "Error getting images: %d\n", result);
-            pthread_mutex_unlock(&lock); // Unlock the mutex before returning
-            continue;                    // Skip to the next iteration if there was an error
+            drainNewFrames(); // Several frames may have arrived since the last wait
         }
-
-        printf("Acq. %d: Acquired data for spectrum. Result: %d\n", nCapturedSpectra, result);
-        float exposureTime, kineticCycleTime, readoutTime;
-        hodr_getAcquisitionTimings(&exposureTime, &kineticCycleTime, &readoutTime); // Get acquisition timings
-        printf("Acq. %d: Acquisition timings - Exposure: %.6f, Kinetic Cycle: %.6f, Readout: %.6f\n", nCapturedSpectra, exposureTime, kineticCycleTime, readoutTime);
-
-        printf("Acq. %d: Last temperature: %.2f\n", nCapturedSpectra, lastTemperature); // Log the last temperature
-
-        printf("Target intensity: %d\n", targetIntensity); // Log the target intensity
-        if (targetIntensity > 0)
+        else
         {
-            printf("Acq. %d: Target intensity: %d at integration time %.5fs\n", nCapturedSpectra - 1, targetIntensity, exposureTime); // Log the target intensity
-
-            adjustIntegrationTime(targetIntensity, exposureTime, data, xpixels, 5); // Adjust integration time based on target intensity
+            readMostRecentFrame();
         }
-
-        hodr_getAcquisitionTimings(&exposureTime, &kineticCycleTime, &readoutTime);                         // Get acquisition timings
-        result = appendToFile(outFile, nCapturedSpectra++, &exposureTime, &lastTemperature, data, xpixels); // Append data to output file
-
-        printf("Data appended to file. Result: %d, N captured spectra: %d\n", result, nCapturedSpectra);
+        updateAcquisitionStatus();   // Catches the end of a series as soon as its last frame is in
+        metrics_since(METRIC_FRAME, frameStart);
         pthread_mutex_unlock(&lock); // Unlock the mutex after processing
-        printf("Acq. %d: Unlocked mutex after processing acquired data.\n", nCapturedSpectra - 1);
     }
 
     return NULL; // Return NULL to indicate the thread has finished
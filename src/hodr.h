@@ -7,6 +7,7 @@
 #define SHUTTER_TYP_OPEN_LOW 0
 #define SHUTTER_TYP_OPEN_HIGH 1
 #define SHUTTER_MODE_FULLY_AUTO 0
+#define SHUTTER_MODE_CLOSED 2
 #define READ_MODE_FVB 0
 
 
@@ -57,6 +58,7 @@ unsigned int hodr_getStatus(int *status);
 unsigned int hodr_getAcquiredData(int32_t *data, size_t size);
 unsigned int hodr_getDataAcquisitionStatusString(int status, char *buffer, size_t bufferSize);
 unsigned int hodr_getNumberNewImages(int32_t *firstNewImageIndex, int32_t *lastNewImageIndex);
+unsigned int hodr_getTotalNumberImagesAcquired(int32_t *index);
 unsigned int hodr_getImages(int32_t firstNewImageIndex, int32_t lastNewImageIndex, int32_t *data, size_t size, int32_t *validFirst, int32_t *validLast);
 unsigned int hodr_getMostRecentImage(int32_t *data, size_t size);
 unsigned int hodr_getAcquisitionTimings(float *exposureTime, float *kineticCycleTime, float *readoutTime);
@@ -65,8 +67,10 @@ unsigned int hodr_getAcqFlag();
 unsigned int hodr_getNumberAcquisitions();
 
 unsigned int hodr_getAcquisitionMode();
+int hodr_getNumberKinetics();
 unsigned int hodr_getReadMode();
 unsigned int hodr_getShutterType();
+unsigned int hodr_getShutterMode();
 unsigned int hodr_setKineticCycleTime(float time);
 unsigned int hodr_getOutFile(char *outFile, size_t size);
 unsigned int hodr_setFIFOPath(const char *fifoPath);
@@ -0,0 +1,981 @@
+#include "kernels.h"
+#include "log.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KERNELS_X86 1
+#endif
+
+#define KERNELS_CHECK_LENGTH 1031 // Odd, so every version also runs its scalar tail
+
+typedef struct {
+    const char *name;
+    int32_t (*max)(const int32_t *data, size_t npixels);
+    void (*minMax)(const int32_t *data, size_t npixels, int32_t *min, int32_t *max);
+    int64_t (*sum)(const int32_t *data, size_t npixels);
+    size_t (*countAtLeast)(const int32_t *data, size_t npixels, int32_t threshold);
+    void (*to16)(const int32_t *in, uint16_t *out, size_t npixels);
+    void (*from16)(const uint16_t *in, int32_t *out, size_t npixels);
+    void (*add)(int32_t *out, const int32_t *a, const int32_t *b, size_t npixels);
+    void (*subtract)(int32_t *out, const int32_t *a, const int32_t *b, size_t npixels);
+    void (*accumulate)(int64_t *sums, uint64_t *sumSquares, const int32_t *data, size_t npixels);
+    void (*correct)(int32_t *out, const int32_t *in, const float *dark, const float *gain, size_t npixels);
+    void (*resample)(float *out, const int32_t *data, const uint32_t *index, const float *weightLeft, const float *weightRight, size_t npoints);
+    void (*pack)(void *out, const uint32_t *in, unsigned bits);
+    void (*unpack)(uint32_t *out, const void *in, unsigned bits);
+} Kernels_t;
+
+// Scalar versions, the reference for the others and their tails
+
+static int32_t maxScalar(const int32_t *data, size_t npixels)
+{
+    int32_t max = INT32_MIN;
+    for (size_t i = 0; i < npixels; i++)
+    {
+        max = data[i] > max ? data[i] : max;
+    }
+    return max;
+}
+
+static void minMaxScalar(const int32_t *data, size_t npixels, int32_t *min, int32_t *max)
+{
+    int32_t low = INT32_MAX, high = INT32_MIN;
+    for (size_t i = 0; i < npixels; i++)
+    {
+        low = data[i] < low ? data[i] : low;
+        high = data[i] > high ? data[i] : high;
+    }
+    *min = low;
+    *max = high;
+}
+
+static int64_t sumScalar(const int32_t *data, size_t npixels)
+{
+    int64_t sum = 0;
+    for (size_t i = 0; i < npixels; i++)
+    {
+        sum += data[i];
+    }
+    return sum;
+}
+
+static size_t countAtLeastScalar(const int32_t *data, size_t npixels, int32_t threshold)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < npixels; i++)
+    {
+        count += data[i] >= threshold;
+    }
+    return count;
+}
+
+static void to16Scalar(const int32_t *in, uint16_t *out, size_t npixels)
+{
+    for (size_t i = 0; i < npixels; i++)
+    {
+        out[i] = (uint16_t)(in[i] < 0 ? 0 : in[i] > UINT16_MAX ? UINT16_MAX : in[i]);
+    }
+}
+
+static void from16Scalar(const uint16_t *in, int32_t *out, size_t npixels)
+{
+    for (size_t i = 0; i < npixels; i++)
+    {
+        out[i] = in[i];
+    }
+}
+
+static void addScalar(int32_t *out, const int32_t *a, const int32_t *b, size_t npixels)
+{
+    for (size_t i = 0; i < npixels; i++)
+    {
+        out[i] = (int32_t)((uint32_t)a[i] + (uint32_t)b[i]);
+    }
+}
+
+static void subtractScalar(int32_t *out, const int32_t *a, const int32_t *b, size_t npixels)
+{
+    for (size_t i = 0; i < npixels; i++)
+    {
+        out[i] = (int32_t)((uint32_t)a[i] - (uint32_t)b[i]);
+    }
+}
+
+static void accumulateScalar(int64_t *sums, uint64_t *sumSquares, const int32_t *data, size_t npixels)
+{
+    for (size_t i = 0; i < npixels; i++)
+    {
+        sums[i] += data[i];
+        sumSquares[i] += (uint64_t)((int64_t)data[i] * data[i]);
+    }
+}
+
+static void correctScalar(int32_t *out, const int32_t *in, const float *dark, const float *gain, size_t npixels)
+{
+    for (size_t i = 0; i < npixels; i++)
+    {
+        out[i] = (int32_t)lrintf(((float)in[i] - dark[i]) * gain[i]); // Rounds to even, like the vector conversions
+    }
+}
+
+static void resampleScalar(float *out, const int32_t *data, const uint32_t *index, const float *weightLeft, const float *weightRight, size_t npoints)
+{
+    for (size_t i = 0; i < npoints; i++)
+    {
+        float left = (float)data[index[i]] * weightLeft[i];
+        float right = (float)data[index[i] + 1] * weightRight[i];
+        out[i] = left + right; // Not fused, like the vector versions
+    }
+}
+
+// Value i of a block is bit field i / 4 of lane i % 4, each lane a run of
+// bits 32-bit words interleaved with the other three: the layout a 128-bit
+// vector packs four values at a time into
+static void packScalar(void *out, const uint32_t *in, unsigned bits)
+{
+    uint32_t words[4 * 32] = {0};
+    for (unsigned i = 0; i < KERNELS_PACK_VALUES; i++)
+    {
+        unsigned lane = i % 4, position = (i / 4) * bits;
+        uint64_t value = (uint64_t)in[i] << (position % 32);
+        words[position / 32 * 4 + lane] |= (uint32_t)value;
+        if (position % 32 + bits > 32)
+        {
+            words[(position / 32 + 1) * 4 + lane] |= (uint32_t)(value >> 32);
+        }
+    }
+    memcpy(out, words, KERNELS_PACKED_BYTES(bits));
+}
+
+static void unpackScalar(uint32_t *out, const void *in, unsigned bits)
+{
+    uint32_t words[4 * 33] = {0}; // A spare word per lane for the fields that end a lane
+    memcpy(words, in, KERNELS_PACKED_BYTES(bits));
+    uint32_t mask = bits == 32 ? UINT32_MAX : (1u << bits) - 1;
+    for (unsigned i = 0; i < KERNELS_PACK_VALUES; i++)
+    {
+        unsigned lane = i % 4, position = (i / 4) * bits;
+        uint64_t pair = words[position / 32 * 4 + lane] | (uint64_t)words[(position / 32 + 1) * 4 + lane] << 32;
+        out[i] = (uint32_t)(pair >> (position % 32)) & mask;
+    }
+}
+
+static const Kernels_t scalarKernels = {
+    "scalar", maxScalar, minMaxScalar, sumScalar, countAtLeastScalar, to16Scalar, from16Scalar, addScalar, subtractScalar,
+    accumulateScalar, correctScalar, resampleScalar, packScalar, unpackScalar,
+};
+
+#ifdef KERNELS_X86
+
+// SSE2, four pixels at a time. SSE2 has no 32-bit min/max, so they are built
+// from a compare and a select.
+
+#define SSE2_SELECT(mask, a, b) _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b))
+
+__attribute__((target("sse2"))) static int32_t horizontalMaxSse2(__m128i v)
+{
+    int32_t lanes[4];
+    _mm_storeu_si128((__m128i *)lanes, v);
+    return maxScalar(lanes, 4);
+}
+
+__attribute__((target("sse2"))) static int32_t maxSse2(const int32_t *data, size_t npixels)
+{
+    __m128i max = _mm_set1_epi32(INT32_MIN);
+    size_t i = 0;
+    for (; i + 4 <= npixels; i += 4)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        max = SSE2_SELECT(_mm_cmpgt_epi32(v, max), v, max);
+    }
+    int32_t result = horizontalMaxSse2(max);
+    int32_t tail = maxScalar(data + i, npixels - i);
+    return tail > result ? tail : result;
+}
+
+__attribute__((target("sse2"))) static void minMaxSse2(const int32_t *data, size_t npixels, int32_t *min, int32_t *max)
+{
+    __m128i low = _mm_set1_epi32(INT32_MAX), high = _mm_set1_epi32(INT32_MIN);
+    size_t i = 0;
+    for (; i + 4 <= npixels; i += 4)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        low = SSE2_SELECT(_mm_cmplt_epi32(v, low), v, low);
+        high = SSE2_SELECT(_mm_cmpgt_epi32(v, high), v, high);
+    }
+    int32_t lanes[8], tailMin, tailMax;
+    _mm_storeu_si128((__m128i *)lanes, low);
+    _mm_storeu_si128((__m128i *)(lanes + 4), high);
+    minMaxScalar(data + i, npixels - i, &tailMin, &tailMax);
+    int32_t lowest = lanes[0], highest = lanes[4];
+    for (int lane = 1; lane < 4; lane++)
+    {
+        lowest = lanes[lane] < lowest ? lanes[lane] : lowest;
+        highest = lanes[lane + 4] > highest ? lanes[lane + 4] : highest;
+    }
+    *min = tailMin < lowest ? tailMin : lowest;
+    *max = tailMax > highest ? tailMax : highest;
+}
+
+__attribute__((target("sse2"))) static int64_t sumSse2(const int32_t *data, size_t npixels)
+{
+    __m128i sum = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 4 <= npixels; i += 4)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i sign = _mm_cmpgt_epi32(_mm_setzero_si128(), v); // Sign extension to 64 bits
+        sum = _mm_add_epi64(sum, _mm_unpacklo_epi32(v, sign));
+        sum = _mm_add_epi64(sum, _mm_unpackhi_epi32(v, sign));
+    }
+    int64_t lanes[2];
+    _mm_storeu_si128((__m128i *)lanes, sum);
+    return lanes[0] + lanes[1] + sumScalar(data + i, npixels - i);
+}
+
+__attribute__((target("sse2"))) static size_t countAtLeastSse2(const int32_t *data, size_t npixels, int32_t threshold)
+{
+    if (threshold == INT32_MIN)
+    {
+        return npixels;
+    }
+    __m128i below = _mm_set1_epi32(threshold - 1);
+    __m128i count = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 4 <= npixels; i += 4)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        count = _mm_sub_epi32(count, _mm_cmpgt_epi32(v, below)); // A match is -1
+    }
+    uint32_t lanes[4];
+    _mm_storeu_si128((__m128i *)lanes, count);
+    return (size_t)lanes[0] + lanes[1] + lanes[2] + lanes[3] + countAtLeastScalar(data + i, npixels - i, threshold);
+}
+
+__attribute__((target("sse2"))) static void to16Sse2(const int32_t *in, uint16_t *out, size_t npixels)
+{
+    __m128i zero = _mm_setzero_si128(), top = _mm_set1_epi32(UINT16_MAX), bias = _mm_set1_epi32(0x8000);
+    size_t i = 0;
+    for (; i + 8 <= npixels; i += 8)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(in + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(in + i + 4));
+        a = _mm_and_si128(a, _mm_cmpgt_epi32(a, zero)); // Negative to 0
+        b = _mm_and_si128(b, _mm_cmpgt_epi32(b, zero));
+        a = SSE2_SELECT(_mm_cmpgt_epi32(a, top), top, a);
+        b = SSE2_SELECT(_mm_cmpgt_epi32(b, top), top, b);
+        // Only a signed pack in SSE2: shift into its range and back
+        __m128i packed = _mm_packs_epi32(_mm_sub_epi32(a, bias), _mm_sub_epi32(b, bias));
+        _mm_storeu_si128((__m128i *)(out + i), _mm_xor_si128(packed, _mm_set1_epi16((short)0x8000)));
+    }
+    to16Scalar(in + i, out + i, npixels - i);
+}
+
+__attribute__((target("sse2"))) static void from16Sse2(const uint16_t *in, int32_t *out, size_t npixels)
+{
+    __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 8 <= npixels; i += 8)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+        _mm_storeu_si128((__m128i *)(out + i), _mm_unpacklo_epi16(v, zero));
+        _mm_storeu_si128((__m128i *)(out + i + 4), _mm_unpackhi_epi16(v, zero));
+    }
+    from16Scalar(in + i, out + i, npixels - i);
+}
+
+__attribute__((target("sse2"))) static void addSse2(int32_t *out, const int32_t *a, const int32_t *b, size_t npixels)
+{
+    size_t i = 0;
+    for (; i + 4 <= npixels; i += 4)
+    {
+        __m128i sum = _mm_add_epi32(_mm_loadu_si128((const __m128i *)(a + i)), _mm_loadu_si128((const __m128i *)(b + i)));
+        _mm_storeu_si128((__m128i *)(out + i), sum);
+    }
+    addScalar(out + i, a + i, b + i, npixels - i);
+}
+
+__attribute__((target("sse2"))) static void subtractSse2(int32_t *out, const int32_t *a, const int32_t *b, size_t npixels)
+{
+    size_t i = 0;
+    for (; i + 4 <= npixels; i += 4)
+    {
+        __m128i difference = _mm_sub_epi32(_mm_loadu_si128((const __m128i *)(a + i)), _mm_loadu_si128((const __m128i *)(b + i)));
+        _mm_storeu_si128((__m128i *)(out + i), difference);
+    }
+    subtractScalar(out + i, a + i, b + i, npixels - i);
+}
+
+__attribute__((target("sse2"))) static void accumulateSse2(int64_t *sums, uint64_t *sumSquares, const int32_t *data, size_t npixels)
+{
+    __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 4 <= npixels; i += 4)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i sign = _mm_cmpgt_epi32(zero, v);
+        __m128i magnitude = _mm_sub_epi32(_mm_xor_si128(v, sign), sign); // Only an unsigned multiply in SSE2
+        __m128i low = _mm_unpacklo_epi32(magnitude, zero), high = _mm_unpackhi_epi32(magnitude, zero);
+        __m128i *sum = (__m128i *)(sums + i), *squares = (__m128i *)(sumSquares + i);
+        _mm_storeu_si128(sum, _mm_add_epi64(_mm_loadu_si128(sum), _mm_unpacklo_epi32(v, sign)));
+        _mm_storeu_si128(sum + 1, _mm_add_epi64(_mm_loadu_si128(sum + 1), _mm_unpackhi_epi32(v, sign)));
+        _mm_storeu_si128(squares, _mm_add_epi64(_mm_loadu_si128(squares), _mm_mul_epu32(low, low)));
+        _mm_storeu_si128(squares + 1, _mm_add_epi64(_mm_loadu_si128(squares + 1), _mm_mul_epu32(high, high)));
+    }
+    accumulateScalar(sums + i, sumSquares + i, data + i, npixels - i);
+}
+
+__attribute__((target("sse2"))) static void correctSse2(int32_t *out, const int32_t *in, const float *dark, const float *gain, size_t npixels)
+{
+    size_t i = 0;
+    for (; i + 4 <= npixels; i += 4)
+    {
+        __m128 v = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)(in + i)));
+        v = _mm_mul_ps(_mm_sub_ps(v, _mm_loadu_ps(dark + i)), _mm_loadu_ps(gain + i));
+        _mm_storeu_si128((__m128i *)(out + i), _mm_cvtps_epi32(v));
+    }
+    correctScalar(out + i, in + i, dark + i, gain + i, npixels - i);
+}
+
+// Four lanes at a time. Wider vectors would need a wider layout, so the AVX2
+// and AVX-512 versions use these too.
+__attribute__((target("sse2"))) static void packSse2(void *out, const uint32_t *in, unsigned bits)
+{
+    __m128i *words = out;
+    __m128i current = _mm_setzero_si128();
+    unsigned filled = 0;
+    for (unsigned i = 0; i < KERNELS_PACK_VALUES; i += 4)
+    {
+        __m128i value = _mm_loadu_si128((const __m128i *)(in + i));
+        current = _mm_or_si128(current, _mm_sll_epi32(value, _mm_cvtsi32_si128((int)filled)));
+        filled += bits;
+        if (filled >= 32)
+        {
+            _mm_storeu_si128(words++, current);
+            filled -= 32;
+            current = filled > 0 ? _mm_srl_epi32(value, _mm_cvtsi32_si128((int)(bits - filled))) : _mm_setzero_si128();
+        }
+    }
+}
+
+__attribute__((target("sse2"))) static void unpackSse2(uint32_t *out, const void *in, unsigned bits)
+{
+    const __m128i *words = in, *end = words + bits;
+    __m128i mask = _mm_set1_epi32(bits == 32 ? -1 : (int)((1u << bits) - 1));
+    __m128i current = bits > 0 ? _mm_loadu_si128(words) : _mm_setzero_si128();
+    unsigned consumed = 0;
+    for (unsigned i = 0; i < KERNELS_PACK_VALUES; i += 4)
+    {
+        __m128i value = _mm_srl_epi32(current, _mm_cvtsi32_si128((int)consumed));
+        consumed += bits;
+        if (consumed >= 32)
+        {
+            consumed -= 32;
+            if (++words < end)
+            {
+                current = _mm_loadu_si128(words);
+                value = consumed > 0 ? _mm_or_si128(value, _mm_sll_epi32(current, _mm_cvtsi32_si128((int)(bits - consumed)))) : value;
+            }
+        }
+        _mm_storeu_si128((__m128i *)(out + i), _mm_and_si128(value, mask));
+    }
+}
+
+static const Kernels_t sse2Kernels = {
+    "sse2", maxSse2, minMaxSse2, sumSse2, countAtLeastSse2, to16Sse2, from16Sse2, addSse2, subtractSse2,
+    accumulateSse2, correctSse2, resampleScalar, packSse2, unpackSse2, // SSE2 has no gather
+};
+
+// AVX2, eight pixels at a time
+
+__attribute__((target("avx2"))) static int32_t horizontalMaxAvx2(__m256i v)
+{
+    __m128i max = _mm_max_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    max = _mm_max_epi32(max, _mm_shuffle_epi32(max, _MM_SHUFFLE(1, 0, 3, 2)));
+    max = _mm_max_epi32(max, _mm_shuffle_epi32(max, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(max);
+}
+
+__attribute__((target("avx2"))) static int32_t horizontalMinAvx2(__m256i v)
+{
+    __m128i min = _mm_min_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    min = _mm_min_epi32(min, _mm_shuffle_epi32(min, _MM_SHUFFLE(1, 0, 3, 2)));
+    min = _mm_min_epi32(min, _mm_shuffle_epi32(min, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(min);
+}
+
+__attribute__((target("avx2"))) static int32_t maxAvx2(const int32_t *data, size_t npixels)
+{
+    __m256i max = _mm256_set1_epi32(INT32_MIN);
+    size_t i = 0;
+    for (; i + 8 <= npixels; i += 8)
+    {
+        max = _mm256_max_epi32(max, _mm256_loadu_si256((const __m256i *)(data + i)));
+    }
+    int32_t result = horizontalMaxAvx2(max);
+    int32_t tail = maxScalar(data + i, npixels - i);
+    return tail > result ? tail : result;
+}
+
+__attribute__((target("avx2"))) static void minMaxAvx2(const int32_t *data, size_t npixels, int32_t *min, int32_t *max)
+{
+    __m256i low = _mm256_set1_epi32(INT32_MAX), high = _mm256_set1_epi32(INT32_MIN);
+    size_t i = 0;
+    for (; i + 8 <= npixels; i += 8)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+        low = _mm256_min_epi32(low, v);
+        high = _mm256_max_epi32(high, v);
+    }
+    int32_t tailMin, tailMax;
+    minMaxScalar(data + i, npixels - i, &tailMin, &tailMax);
+    int32_t lowest = horizontalMinAvx2(low), highest = horizontalMaxAvx2(high);
+    *min = tailMin < lowest ? tailMin : lowest;
+    *max = tailMax > highest ? tailMax : highest;
+}
+
+__attribute__((target("avx2"))) static int64_t sumAvx2(const int32_t *data, size_t npixels)
+{
+    __m256i sum = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 8 <= npixels; i += 8)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+        sum = _mm256_add_epi64(sum, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(v)));
+        sum = _mm256_add_epi64(sum, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(v, 1)));
+    }
+    int64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, sum);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + sumScalar(data + i, npixels - i);
+}
+
+__attribute__((target("avx2"))) static size_t countAtLeastAvx2(const int32_t *data, size_t npixels, int32_t threshold)
+{
+    if (threshold == INT32_MIN)
+    {
+        return npixels;
+    }
+    __m256i below = _mm256_set1_epi32(threshold - 1);
+    __m256i count = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 8 <= npixels; i += 8)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+        count = _mm256_sub_epi32(count, _mm256_cmpgt_epi32(v, below)); // A match is -1
+    }
+    uint32_t lanes[8];
+    _mm256_storeu_si256((__m256i *)lanes, count);
+    size_t total = countAtLeastScalar(data + i, npixels - i, threshold);
+    for (int lane = 0; lane < 8; lane++)
+    {
+        total += lanes[lane];
+    }
+    return total;
+}
+
+__attribute__((target("avx2"))) static void to16Avx2(const int32_t *in, uint16_t *out, size_t npixels)
+{
+    size_t i = 0;
+    for (; i + 16 <= npixels; i += 16)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(in + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(in + i + 8));
+        __m256i packed = _mm256_packus_epi32(a, b);                  // Saturates, but interleaves the 128-bit halves
+        packed = _mm256_permute4x64_epi64(packed, _MM_SHUFFLE(3, 1, 2, 0)); // Put them back in order
+        _mm256_storeu_si256((__m256i *)(out + i), packed);
+    }
+    to16Scalar(in + i, out + i, npixels - i);
+}
+
+__attribute__((target("avx2"))) static void from16Avx2(const uint16_t *in, int32_t *out, size_t npixels)
+{
+    size_t i = 0;
+    for (; i + 8 <= npixels; i += 8)
+    {
+        __m256i v = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(in + i)));
+        _mm256_storeu_si256((__m256i *)(out + i), v);
+    }
+    from16Scalar(in + i, out + i, npixels - i);
+}
+
+__attribute__((target("avx2"))) static void addAvx2(int32_t *out, const int32_t *a, const int32_t *b, size_t npixels)
+{
+    size_t i = 0;
+    for (; i + 8 <= npixels; i += 8)
+    {
+        __m256i sum = _mm256_add_epi32(_mm256_loadu_si256((const __m256i *)(a + i)), _mm256_loadu_si256((const __m256i *)(b + i)));
+        _mm256_storeu_si256((__m256i *)(out + i), sum);
+    }
+    addScalar(out + i, a + i, b + i, npixels - i);
+}
+
+__attribute__((target("avx2"))) static void subtractAvx2(int32_t *out, const int32_t *a, const int32_t *b, size_t npixels)
+{
+    size_t i = 0;
+    for (; i + 8 <= npixels; i += 8)
+    {
+        __m256i difference = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i *)(a + i)), _mm256_loadu_si256((const __m256i *)(b + i)));
+        _mm256_storeu_si256((__m256i *)(out + i), difference);
+    }
+    subtractScalar(out + i, a + i, b + i, npixels - i);
+}
+
+__attribute__((target("avx2"))) static void accumulateAvx2(int64_t *sums, uint64_t *sumSquares, const int32_t *data, size_t npixels)
+{
+    size_t i = 0;
+    for (; i + 4 <= npixels; i += 4)
+    {
+        __m256i v = _mm256_cvtepi32_epi64(_mm_loadu_si128((const __m128i *)(data + i)));
+        __m256i *sum = (__m256i *)(sums + i), *squares = (__m256i *)(sumSquares + i);
+        _mm256_storeu_si256(sum, _mm256_add_epi64(_mm256_loadu_si256(sum), v));
+        _mm256_storeu_si256(squares, _mm256_add_epi64(_mm256_loadu_si256(squares), _mm256_mul_epi32(v, v)));
+    }
+    accumulateScalar(sums + i, sumSquares + i, data + i, npixels - i);
+}
+
+__attribute__((target("avx2"))) static void correctAvx2(int32_t *out, const int32_t *in, const float *dark, const float *gain, size_t npixels)
+{
+    size_t i = 0;
+    for (; i + 8 <= npixels; i += 8)
+    {
+        __m256 v = _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i *)(in + i)));
+        v = _mm256_mul_ps(_mm256_sub_ps(v, _mm256_loadu_ps(dark + i)), _mm256_loadu_ps(gain + i));
+        _mm256_storeu_si256((__m256i *)(out + i), _mm256_cvtps_epi32(v));
+    }
+    correctScalar(out + i, in + i, dark + i, gain + i, npixels - i);
+}
+
+__attribute__((target("avx2"))) static void resampleAvx2(float *out, const int32_t *data, const uint32_t *index, const float *weightLeft, const float *weightRight, size_t npoints)
+{
+    size_t i = 0;
+    for (; i + 8 <= npoints; i += 8)
+    {
+        __m256i at = _mm256_loadu_si256((const __m256i *)(index + i));
+        __m256 left = _mm256_cvtepi32_ps(_mm256_i32gather_epi32((const int *)data, at, 4));
+        __m256 right = _mm256_cvtepi32_ps(_mm256_i32gather_epi32((const int *)(data + 1), at, 4));
+        left = _mm256_mul_ps(left, _mm256_loadu_ps(weightLeft + i));
+        right = _mm256_mul_ps(right, _mm256_loadu_ps(weightRight + i));
+        _mm256_storeu_ps(out + i, _mm256_add_ps(left, right));
+    }
+    resampleScalar(out + i, data, index + i, weightLeft + i, weightRight + i, npoints - i);
+}
+
+static const Kernels_t avx2Kernels = {
+    "avx2", maxAvx2, minMaxAvx2, sumAvx2, countAtLeastAvx2, to16Avx2, from16Avx2, addAvx2, subtractAvx2,
+    accumulateAvx2, correctAvx2, resampleAvx2, packSse2, unpackSse2,
+};
+
+// AVX-512, sixteen pixels at a time
+
+__attribute__((target("avx512f"))) static int32_t maxAvx512(const int32_t *data, size_t npixels)
+{
+    __m512i max = _mm512_set1_epi32(INT32_MIN);
+    size_t i = 0;
+    for (; i + 16 <= npixels; i += 16)
+    {
+        max = _mm512_max_epi32(max, _mm512_loadu_si512(data + i));
+    }
+    int32_t result = _mm512_reduce_max_epi32(max);
+    int32_t tail = maxScalar(data + i, npixels - i);
+    return tail > result ? tail : result;
+}
+
+__attribute__((target("avx512f"))) static void minMaxAvx512(const int32_t *data, size_t npixels, int32_t *min, int32_t *max)
+{
+    __m512i low = _mm512_set1_epi32(INT32_MAX), high = _mm512_set1_epi32(INT32_MIN);
+    size_t i = 0;
+    for (; i + 16 <= npixels; i += 16)
+    {
+        __m512i v = _mm512_loadu_si512(data + i);
+        low = _mm512_min_epi32(low, v);
+        high = _mm512_max_epi32(high, v);
+    }
+    int32_t tailMin, tailMax;
+    minMaxScalar(data + i, npixels - i, &tailMin, &tailMax);
+    int32_t lowest = _mm512_reduce_min_epi32(low), highest = _mm512_reduce_max_epi32(high);
+    *min = tailMin < lowest ? tailMin : lowest;
+    *max = tailMax > highest ? tailMax : highest;
+}
+
+__attribute__((target("avx512f"))) static int64_t sumAvx512(const int32_t *data, size_t npixels)
+{
+    __m512i sum = _mm512_setzero_si512();
+    size_t i = 0;
+    for (; i + 16 <= npixels; i += 16)
+    {
+        __m512i v = _mm512_loadu_si512(data + i);
+        sum = _mm512_add_epi64(sum, _mm512_cvtepi32_epi64(_mm512_castsi512_si256(v)));
+        sum = _mm512_add_epi64(sum, _mm512_cvtepi32_epi64(_mm512_extracti64x4_epi64(v, 1)));
+    }
+    return _mm512_reduce_add_epi64(sum) + sumScalar(data + i, npixels - i);
+}
+
+__attribute__((target("avx512f,popcnt"))) static size_t countAtLeastAvx512(const int32_t *data, size_t npixels, int32_t threshold)
+{
+    __m512i limit = _mm512_set1_epi32(threshold);
+    size_t count = 0;
+    size_t i = 0;
+    for (; i + 16 <= npixels; i += 16)
+    {
+        count += (size_t)_mm_popcnt_u32(_mm512_cmpge_epi32_mask(_mm512_loadu_si512(data + i), limit));
+    }
+    return count + countAtLeastScalar(data + i, npixels - i, threshold);
+}
+
+__attribute__((target("avx512f"))) static void to16Avx512(const int32_t *in, uint16_t *out, size_t npixels)
+{
+    __m512i zero = _mm512_setzero_si512();
+    size_t i = 0;
+    for (; i + 16 <= npixels; i += 16)
+    {
+        __m512i v = _mm512_max_epi32(_mm512_loadu_si512(in + i), zero); // Unsigned saturation would take negatives as large
+        _mm256_storeu_si256((__m256i *)(out + i), _mm512_cvtusepi32_epi16(v));
+    }
+    to16Scalar(in + i, out + i, npixels - i);
+}
+
+__attribute__((target("avx512f"))) static void from16Avx512(const uint16_t *in, int32_t *out, size_t npixels)
+{
+    size_t i = 0;
+    for (; i + 16 <= npixels; i += 16)
+    {
+        _mm512_storeu_si512(out + i, _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *)(in + i))));
+    }
+    from16Scalar(in + i, out + i, npixels - i);
+}
+
+__attribute__((target("avx512f"))) static void addAvx512(int32_t *out, const int32_t *a, const int32_t *b, size_t npixels)
+{
+    size_t i = 0;
+    for (; i + 16 <= npixels; i += 16)
+    {
+        _mm512_storeu_si512(out + i, _mm512_add_epi32(_mm512_loadu_si512(a + i), _mm512_loadu_si512(b + i)));
+    }
+    addScalar(out + i, a + i, b + i, npixels - i);
+}
+
+__attribute__((target("avx512f"))) static void subtractAvx512(int32_t *out, const int32_t *a, const int32_t *b, size_t npixels)
+{
+    size_t i = 0;
+    for (; i + 16 <= npixels; i += 16)
+    {
+        _mm512_storeu_si512(out + i, _mm512_sub_epi32(_mm512_loadu_si512(a + i), _mm512_loadu_si512(b + i)));
+    }
+    subtractScalar(out + i, a + i, b + i, npixels - i);
+}
+
+__attribute__((target("avx512f"))) static void accumulateAvx512(int64_t *sums, uint64_t *sumSquares, const int32_t *data, size_t npixels)
+{
+    size_t i = 0;
+    for (; i + 8 <= npixels; i += 8)
+    {
+        __m512i v = _mm512_cvtepi32_epi64(_mm256_loadu_si256((const __m256i *)(data + i)));
+        _mm512_storeu_si512(sums + i, _mm512_add_epi64(_mm512_loadu_si512(sums + i), v));
+        _mm512_storeu_si512(sumSquares + i, _mm512_add_epi64(_mm512_loadu_si512(sumSquares + i), _mm512_mul_epi32(v, v)));
+    }
+    accumulateScalar(sums + i, sumSquares + i, data + i, npixels - i);
+}
+
+__attribute__((target("avx512f"))) static void correctAvx512(int32_t *out, const int32_t *in, const float *dark, const float *gain, size_t npixels)
+{
+    size_t i = 0;
+    for (; i + 16 <= npixels; i += 16)
+    {
+        __m512 v = _mm512_cvtepi32_ps(_mm512_loadu_si512(in + i));
+        v = _mm512_mul_ps(_mm512_sub_ps(v, _mm512_loadu_ps(dark + i)), _mm512_loadu_ps(gain + i));
+        _mm512_storeu_si512(out + i, _mm512_cvtps_epi32(v));
+    }
+    correctScalar(out + i, in + i, dark + i, gain + i, npixels - i);
+}
+
+__attribute__((target("avx512f"))) static void resampleAvx512(float *out, const int32_t *data, const uint32_t *index, const float *weightLeft, const float *weightRight, size_t npoints)
+{
+    size_t i = 0;
+    for (; i + 16 <= npoints; i += 16)
+    {
+        __m512i at = _mm512_loadu_si512(index + i);
+        __m512 left = _mm512_cvtepi32_ps(_mm512_i32gather_epi32(at, data, 4));
+        __m512 right = _mm512_cvtepi32_ps(_mm512_i32gather_epi32(at, data + 1, 4));
+        // Explicit rounding keeps the compiler from fusing the multiplies and
+        // the add, which AVX-512 machines can, so the sums match the scalar ones
+        left = _mm512_mul_round_ps(left, _mm512_loadu_ps(weightLeft + i), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        right = _mm512_mul_round_ps(right, _mm512_loadu_ps(weightRight + i), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        _mm512_storeu_ps(out + i, _mm512_add_ps(left, right));
+    }
+    resampleScalar(out + i, data, index + i, weightLeft + i, weightRight + i, npoints - i);
+}
+
+static const Kernels_t avx512Kernels = {
+    "avx512", maxAvx512, minMaxAvx512, sumAvx512, countAtLeastAvx512, to16Avx512, from16Avx512, addAvx512, subtractAvx512,
+    accumulateAvx512, correctAvx512, resampleAvx512, packSse2, unpackSse2,
+};
+
+#endif
+
+static const Kernels_t *kernels = &scalarKernels;
+static pthread_once_t kernelsOnce = PTHREAD_ONCE_INIT;
+static int kernelsResult = 0;
+
+// Run every kernel of a version on the same data as the scalar ones
+static bool kernelsAgree(const Kernels_t *candidate)
+{
+    const size_t n = KERNELS_CHECK_LENGTH;
+    int32_t *a = malloc(n * sizeof(int32_t)), *b = malloc(n * sizeof(int32_t));
+    int32_t *expected = malloc(n * sizeof(int32_t)), *actual = malloc(n * sizeof(int32_t));
+    uint16_t *expected16 = malloc(n * sizeof(uint16_t)), *actual16 = malloc(n * sizeof(uint16_t));
+    int64_t *sums = calloc(2 * n, sizeof(int64_t));
+    uint64_t *squares = calloc(2 * n, sizeof(uint64_t));
+    float *dark = malloc(n * sizeof(float)), *gain = malloc(n * sizeof(float));
+    float *expectedFloat = malloc(n * sizeof(float)), *actualFloat = malloc(n * sizeof(float));
+    uint32_t *index = malloc(n * sizeof(uint32_t));
+    bool agree = a != NULL && b != NULL && expected != NULL && actual != NULL && expected16 != NULL && actual16 != NULL &&
+                 sums != NULL && squares != NULL && dark != NULL && gain != NULL && expectedFloat != NULL && actualFloat != NULL && index != NULL;
+
+    uint32_t state = 12345;
+    for (size_t i = 0; agree && i < n; i++)
+    {
+        state = state * 1664525u + 1013904223u;
+        a[i] = (int32_t)state >> (i % 15); // Every magnitude, both signs, some beyond 16 bits
+        b[i] = (int32_t)(state >> 8) - 1000;
+        dark[i] = (float)(state % 4000) / 7.0f;
+        gain[i] = 0.5f + (float)(i % 97) / 64.0f;
+        index[i] = state % (uint32_t)(n - 1);
+    }
+    if (agree)
+    {
+        a[n / 3] = INT32_MAX;
+        a[n / 2] = INT32_MIN;
+        int32_t min, max, checkMin, checkMax;
+        scalarKernels.minMax(a, n, &min, &max);
+        candidate->minMax(a, n, &checkMin, &checkMax);
+        agree = checkMin == min && checkMax == max &&
+                candidate->max(a, n) == scalarKernels.max(a, n) &&
+                candidate->sum(a, n) == scalarKernels.sum(a, n) &&
+                candidate->countAtLeast(a, n, 0) == scalarKernels.countAtLeast(a, n, 0) &&
+                candidate->countAtLeast(a, n, 65534) == scalarKernels.countAtLeast(a, n, 65534) &&
+                candidate->countAtLeast(a, n, INT32_MIN) == n;
+
+        scalarKernels.to16(a, expected16, n);
+        candidate->to16(a, actual16, n);
+        agree = agree && memcmp(expected16, actual16, n * sizeof(uint16_t)) == 0;
+        scalarKernels.from16(expected16, expected, n);
+        candidate->from16(expected16, actual, n);
+        agree = agree && memcmp(expected, actual, n * sizeof(int32_t)) == 0;
+        scalarKernels.add(expected, a, b, n);
+        candidate->add(actual, a, b, n);
+        agree = agree && memcmp(expected, actual, n * sizeof(int32_t)) == 0;
+        scalarKernels.subtract(expected, a, b, n);
+        candidate->subtract(actual, a, b, n);
+        agree = agree && memcmp(expected, actual, n * sizeof(int32_t)) == 0;
+        for (int frame = 0; frame < 2; frame++) // Twice, so the sums already hold something
+        {
+            scalarKernels.accumulate(sums, squares, frame == 0 ? a : b, n);
+            candidate->accumulate(sums + n, squares + n, frame == 0 ? a : b, n);
+        }
+        agree = agree && memcmp(sums, sums + n, n * sizeof(int64_t)) == 0 && memcmp(squares, squares + n, n * sizeof(uint64_t)) == 0;
+        scalarKernels.correct(expected, b, dark, gain, n); // b fits the 24 bits a float holds exactly
+        candidate->correct(actual, b, dark, gain, n);
+        agree = agree && memcmp(expected, actual, n * sizeof(int32_t)) == 0;
+        scalarKernels.resample(expectedFloat, b, index, gain, dark, n);
+        candidate->resample(actualFloat, b, index, gain, dark, n);
+        agree = agree && memcmp(expectedFloat, actualFloat, n * sizeof(float)) == 0;
+        for (unsigned bits = 0; agree && bits <= 32; bits++)
+        {
+            uint32_t *values = (uint32_t *)index, mask = bits == 32 ? UINT32_MAX : (1u << bits) - 1;
+            for (size_t i = 0; i < KERNELS_PACK_VALUES; i++)
+            {
+                values[i] = (uint32_t)a[i] & mask;
+            }
+            scalarKernels.pack(expected, values, bits);
+            candidate->pack(actual, values, bits);
+            agree = memcmp(expected, actual, KERNELS_PACKED_BYTES(bits)) == 0;
+            candidate->unpack((uint32_t *)actual, expected, bits);
+            agree = agree && memcmp(values, actual, KERNELS_PACK_VALUES * sizeof(uint32_t)) == 0;
+        }
+    }
+    free(a);
+    free(b);
+    free(expected);
+    free(actual);
+    free(expected16);
+    free(actual16);
+    free(sums);
+    free(squares);
+    free(dark);
+    free(gain);
+    free(expectedFloat);
+    free(actualFloat);
+    free(index);
+    return agree;
+}
+
+static void selectKernels()
+{
+    const Kernels_t *candidates[4];
+    int count = 0;
+#ifdef KERNELS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+    {
+        candidates[count++] = &avx512Kernels;
+    }
+    if (__builtin_cpu_supports("avx2"))
+    {
+        candidates[count++] = &avx2Kernels;
+    }
+    if (__builtin_cpu_supports("sse2"))
+    {
+        candidates[count++] = &sse2Kernels;
+    }
+#endif
+    candidates[count++] = &scalarKernels;
+
+    const char *forced = getenv("HODR_KERNELS");
+    int first = 0;
+    if (forced != NULL && forced[0] != '\0')
+    {
+        while (first < count && strcmp(candidates[first]->name, forced) != 0)
+        {
+            first++;
+        }
+        if (first == count)
+        {
+            log_warn("Kernels \"%s\" not available on this CPU, choosing automatically.", forced);
+            first = 0;
+        }
+    }
+
+    for (int i = first; i < count; i++)
+    {
+        if (candidates[i] == &scalarKernels || kernelsAgree(candidates[i]))
+        {
+            kernels = candidates[i];
+            break;
+        }
+        log_error("%s kernels disagree with the scalar ones, not using them.", candidates[i]->name);
+        kernelsResult = -1;
+    }
+    log_info("Using %s frame kernels.", kernels->name);
+}
+
+// Choose the kernels for this CPU. Returns 0, or -1 if a faster version had
+// to be passed over because it gave wrong results.
+int kernels_init()
+{
+    pthread_once(&kernelsOnce, selectKernels);
+    return kernelsResult;
+}
+
+const char *kernels_name()
+{
+    kernels_init();
+    return kernels->name;
+}
+
+int32_t kernels_max(const int32_t *data, size_t npixels)
+{
+    kernels_init();
+    return kernels->max(data, npixels);
+}
+
+// Index of the first pixel holding the maximum, 0 for an empty frame
+size_t kernels_argmax(const int32_t *data, size_t npixels)
+{
+    int32_t max = kernels_max(data, npixels);
+    for (size_t i = 0; i < npixels; i++)
+    {
+        if (data[i] == max)
+        {
+            return i;
+        }
+    }
+    return 0;
+}
+
+// INT32_MAX and INT32_MIN for an empty frame
+void kernels_minMax(const int32_t *data, size_t npixels, int32_t *min, int32_t *max)
+{
+    kernels_init();
+    kernels->minMax(data, npixels, min, max);
+}
+
+int64_t kernels_sum(const int32_t *data, size_t npixels)
+{
+    kernels_init();
+    return kernels->sum(data, npixels);
+}
+
+size_t kernels_countAtLeast(const int32_t *data, size_t npixels, int32_t threshold)
+{
+    kernels_init();
+    return kernels->countAtLeast(data, npixels, threshold);
+}
+
+void kernels_to16(const int32_t *in, uint16_t *out, size_t npixels)
+{
+    kernels_init();
+    kernels->to16(in, out, npixels);
+}
+
+void kernels_from16(const uint16_t *in, int32_t *out, size_t npixels)
+{
+    kernels_init();
+    kernels->from16(in, out, npixels);
+}
+
+// out = a + b, out may be either of them
+void kernels_add(int32_t *out, const int32_t *a, const int32_t *b, size_t npixels)
+{
+    kernels_init();
+    kernels->add(out, a, b, npixels);
+}
+
+// sums += data and sumSquares += data * data, pixel by pixel, for co-adding
+void kernels_accumulate(int64_t *sums, uint64_t *sumSquares, const int32_t *data, size_t npixels)
+{
+    kernels_init();
+    kernels->accumulate(sums, sumSquares, data, npixels);
+}
+
+// out = (in - dark) * gain, rounded to the nearest integer, for dark and
+// flat-field correction. out may be in. Pixels must stay within int32 range.
+void kernels_correct(int32_t *out, const int32_t *in, const float *dark, const float *gain, size_t npixels)
+{
+    kernels_init();
+    kernels->correct(out, in, dark, gain, npixels);
+}
+
+// out[i] = data[index[i]] * weightLeft[i] + data[index[i] + 1] * weightRight[i],
+// linear interpolation through a precomputed table. index[i] + 1 must be a pixel.
+void kernels_resample(float *out, const int32_t *data, const uint32_t *index, const float *weightLeft, const float *weightRight, size_t npoints)
+{
+    kernels_init();
+    kernels->resample(out, data, index, weightLeft, weightRight, npoints);
+}
+
+// Pack KERNELS_PACK_VALUES values of at most bits bits each into
+// KERNELS_PACKED_BYTES(bits) bytes of out
+void kernels_pack(void *out, const uint32_t *in, unsigned bits)
+{
+    kernels_init();
+    kernels->pack(out, in, bits);
+}
+
+// Unpack KERNELS_PACK_VALUES values packed by kernels_pack
+void kernels_unpack(uint32_t *out, const void *in, unsigned bits)
+{
+    kernels_init();
+    kernels->unpack(out, in, bits);
+}
+
+// out = a - b, out may be either of them
+void kernels_subtract(int32_t *out, const int32_t *a, const int32_t *b, size_t npixels)
+{
+    kernels_init();
+    kernels->subtract(out, a, b, npixels);
+}
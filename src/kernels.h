@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Per-frame arithmetic.
+//
+// Reductions, conversions and element-wise operations over whole frames,
+// with SSE2, AVX2 and AVX-512 versions picked at runtime for the CPU the
+// daemon runs on and a scalar version everywhere else. The choice is made
+// on first use, or by kernels_init(); HODR_KERNELS=scalar|sse2|avx2|avx512
+// forces one, as long as the CPU has it. The selected version is checked
+// against the scalar one at startup and abandoned if they disagree; make test
+// tests every version in depth (tests/kernels_test.c).
+//
+// Integer arithmetic wraps like the hardware does; to16 saturates to
+// [0, 65535].
+
+#define KERNELS_PACK_VALUES 128               // Values per pack or unpack
+#define KERNELS_PACKED_BYTES(bits) (16 * (bits)) // Bytes of KERNELS_PACK_VALUES packed values
+
+int kernels_init();
+const char *kernels_name();
+
+int32_t kernels_max(const int32_t *data, size_t npixels);
+size_t kernels_argmax(const int32_t *data, size_t npixels);
+void kernels_minMax(const int32_t *data, size_t npixels, int32_t *min, int32_t *max);
+int64_t kernels_sum(const int32_t *data, size_t npixels);
+size_t kernels_countAtLeast(const int32_t *data, size_t npixels, int32_t threshold);
+void kernels_to16(const int32_t *in, uint16_t *out, size_t npixels);
+void kernels_from16(const uint16_t *in, int32_t *out, size_t npixels);
+void kernels_add(int32_t *out, const int32_t *a, const int32_t *b, size_t npixels);
+void kernels_subtract(int32_t *out, const int32_t *a, const int32_t *b, size_t npixels);
+void kernels_accumulate(int64_t *sums, uint64_t *sumSquares, const int32_t *data, size_t npixels);
+void kernels_correct(int32_t *out, const int32_t *in, const float *dark, const float *gain, size_t npixels);
+void kernels_resample(float *out, const int32_t *data, const uint32_t *index, const float *weightLeft, const float *weightRight, size_t npoints);
+void kernels_pack(void *out, const uint32_t *in, unsigned bits);
+void kernels_unpack(uint32_t *out, const void *in, unsigned bits);
@@ -0,0 +1,277 @@
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#define LOG_MAX_THREADS 32      // Threads that can log through a ring at the same time
+#define LOG_BUFFER_LENGTH 64    // Messages each thread can have waiting
+#define LOG_MESSAGE_LENGTH 240  // Longer messages are truncated
+
+typedef struct {
+    int64_t timeNs; // CLOCK_REALTIME when logged
+    int level;
+    char text[LOG_MESSAGE_LENGTH];
+} LogMessage_t;
+
+// Single-producer, single-consumer ring of one thread's messages
+typedef struct {
+    atomic_bool owned;         // Claimed by a live thread
+    atomic_uint_fast64_t head; // Next message the thread writes
+    atomic_uint_fast64_t tail; // Next message the drain thread writes out
+    atomic_uint dropped;       // Messages lost because the ring was full
+    LogMessage_t messages[LOG_BUFFER_LENGTH];
+} LogBuffer_t;
+
+atomic_int log_level = LOG_LEVEL_INFO;
+
+static LogBuffer_t buffers[LOG_MAX_THREADS];
+static _Thread_local LogBuffer_t *threadBuffer = NULL;
+static pthread_key_t bufferKey;
+static pthread_once_t bufferKeyOnce = PTHREAD_ONCE_INIT;
+
+static atomic_bool running = false;
+static atomic_bool wakePending = false;
+static sem_t wake;
+static pthread_t drainThread;
+static bool journal = false; // stdout and stderr go to journald, which adds its own timestamps
+
+static const char *levelNames[] = {"ERROR", "WARN", "INFO", "DEBUG"};
+static const int syslogPriorities[] = {3, 4, 6, 7}; // LOG_ERR, LOG_WARNING, LOG_INFO, LOG_DEBUG
+
+static int64_t logNowNs(clockid_t clock)
+{
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// Format a message into text, without the trailing newline the printf-style
+// callers may have left in
+static void formatMessage(char *text, size_t size, const char *format, va_list args)
+{
+    vsnprintf(text, size, format, args);
+    size_t length = strlen(text);
+    if (length > 0 && text[length - 1] == '\n')
+    {
+        text[length - 1] = '\0'; // Each message is one line
+    }
+}
+
+static void writeMessage(int64_t timeNs, int level, const char *text)
+{
+    FILE *out = level <= LOG_LEVEL_WARN ? stderr : stdout;
+    if (journal)
+    {
+        fprintf(out, "<%d>%s\n", syslogPriorities[level], text);
+        return;
+    }
+    time_t seconds = (time_t)(timeNs / 1000000000LL);
+    struct tm local;
+    localtime_r(&seconds, &local);
+    char timeString[32];
+    strftime(timeString, sizeof(timeString), "%H:%M:%S", &local);
+    fprintf(out, "%s.%03d %-5s %s\n", timeString, (int)(timeNs / 1000000 % 1000), levelNames[level], text);
+}
+
+// Hand a thread's ring back once the thread exits, the drain thread still
+// writes out what it left
+static void releaseBuffer(void *buffer)
+{
+    atomic_store(&((LogBuffer_t *)buffer)->owned, false);
+}
+
+static void createBufferKey()
+{
+    pthread_key_create(&bufferKey, releaseBuffer);
+}
+
+static LogBuffer_t *claimBuffer()
+{
+    pthread_once(&bufferKeyOnce, createBufferKey);
+    for (int i = 0; i < LOG_MAX_THREADS; i++)
+    {
+        LogBuffer_t *buffer = &buffers[i];
+        bool expected = false;
+        if (atomic_load(&buffer->head) == atomic_load(&buffer->tail) &&
+            atomic_compare_exchange_strong(&buffer->owned, &expected, true))
+        {
+            pthread_setspecific(bufferKey, buffer);
+            return buffer;
+        }
+    }
+    return NULL;
+}
+
+// Write out everything waiting in the rings, oldest first. Drain thread only.
+static void drainBuffers()
+{
+    while (true)
+    {
+        LogBuffer_t *oldest = NULL;
+        LogMessage_t *next = NULL;
+        for (int i = 0; i < LOG_MAX_THREADS; i++)
+        {
+            LogBuffer_t *buffer = &buffers[i];
+            uint64_t tail = atomic_load_explicit(&buffer->tail, memory_order_relaxed);
+            if (atomic_load_explicit(&buffer->head, memory_order_acquire) == tail)
+            {
+                continue;
+            }
+            LogMessage_t *message = &buffer->messages[tail % LOG_BUFFER_LENGTH];
+            if (next == NULL || message->timeNs < next->timeNs)
+            {
+                oldest = buffer;
+                next = message;
+            }
+        }
+        if (oldest == NULL)
+        {
+            break;
+        }
+        writeMessage(next->timeNs, next->level, next->text);
+        atomic_fetch_add_explicit(&oldest->tail, 1, memory_order_release);
+    }
+
+    for (int i = 0; i < LOG_MAX_THREADS; i++)
+    {
+        unsigned int dropped = atomic_exchange(&buffers[i].dropped, 0);
+        if (dropped > 0)
+        {
+            char text[64];
+            snprintf(text, sizeof(text), "%u log messages dropped", dropped);
+            writeMessage(logNowNs(CLOCK_REALTIME), LOG_LEVEL_WARN, text);
+        }
+    }
+    fflush(stdout);
+    fflush(stderr);
+}
+
+static void *logDrainThread(void *arg)
+{
+    (void)arg;
+    while (atomic_load(&running))
+    {
+        while (sem_wait(&wake) != 0 && errno == EINTR)
+        {
+        }
+        atomic_store(&wakePending, false); // Messages logged from here on post again
+        drainBuffers();
+    }
+    drainBuffers();
+    return NULL;
+}
+
+// Start the drain thread. The runtime level comes from HODR_LOG_LEVEL, as a
+// number or a level name, if it is set. Returns 0 or -1 on error.
+int log_init()
+{
+    const char *level = getenv("HODR_LOG_LEVEL");
+    if (level != NULL)
+    {
+        for (int i = 0; i <= LOG_LEVEL_DEBUG; i++)
+        {
+            if (strcasecmp(level, levelNames[i]) == 0)
+            {
+                log_setLevel(i);
+            }
+        }
+        if (level[0] >= '0' && level[0] <= '9')
+        {
+            log_setLevel(atoi(level));
+        }
+    }
+    journal = getenv("JOURNAL_STREAM") != NULL;
+
+    sem_init(&wake, 0, 0);
+    atomic_store(&running, true);
+    if (pthread_create(&drainThread, NULL, logDrainThread, NULL) != 0)
+    {
+        atomic_store(&running, false);
+        fprintf(stderr, "Failed to start log thread, logging synchronously.\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Write out whatever is still waiting and stop the drain thread
+void log_stop()
+{
+    if (!atomic_exchange(&running, false))
+    {
+        return;
+    }
+    sem_post(&wake);
+    pthread_join(drainThread, NULL);
+    sem_destroy(&wake);
+}
+
+void log_setLevel(int level)
+{
+    if (level < LOG_LEVEL_ERROR)
+    {
+        level = LOG_LEVEL_ERROR;
+    }
+    if (level > LOG_LEVEL_DEBUG)
+    {
+        level = LOG_LEVEL_DEBUG;
+    }
+    atomic_store(&log_level, level);
+}
+
+void log_write(int level, const char *format, ...)
+{
+    va_list args;
+    if (!atomic_load_explicit(&running, memory_order_relaxed) ||
+        (threadBuffer == NULL && (threadBuffer = claimBuffer()) == NULL))
+    {
+        char text[LOG_MESSAGE_LENGTH];
+        va_start(args, format);
+        formatMessage(text, sizeof(text), format, args);
+        va_end(args);
+        writeMessage(logNowNs(CLOCK_REALTIME), level, text);
+        return;
+    }
+
+    LogBuffer_t *buffer = threadBuffer;
+    uint64_t head = atomic_load_explicit(&buffer->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&buffer->tail, memory_order_acquire) >= LOG_BUFFER_LENGTH)
+    {
+        atomic_fetch_add_explicit(&buffer->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    LogMessage_t *message = &buffer->messages[head % LOG_BUFFER_LENGTH];
+    message->timeNs = logNowNs(CLOCK_REALTIME);
+    message->level = level;
+    va_start(args, format);
+    formatMessage(message->text, sizeof(message->text), format, args);
+    va_end(args);
+    atomic_store_explicit(&buffer->head, head + 1, memory_order_release);
+
+    if (!atomic_exchange_explicit(&wakePending, true, memory_order_acq_rel))
+    {
+        sem_post(&wake);
+    }
+}
+
+// Decide whether a rate-limited call site logs now. Returns true at most
+// once per intervalMs, with the number of calls suppressed since the last
+// time in skipped.
+bool log_rateLimit(atomic_int_least64_t *last, atomic_uint *suppressed, int64_t intervalMs, unsigned int *skipped)
+{
+    int64_t now = logNowNs(CLOCK_MONOTONIC);
+    int64_t previous = atomic_load_explicit(last, memory_order_relaxed);
+    if ((previous != 0 && now - previous < intervalMs * 1000000LL) ||
+        !atomic_compare_exchange_strong_explicit(last, &previous, now, memory_order_relaxed, memory_order_relaxed))
+    {
+        atomic_fetch_add_explicit(suppressed, 1, memory_order_relaxed);
+        return false;
+    }
+    *skipped = atomic_exchange_explicit(suppressed, 0, memory_order_relaxed);
+    return true;
+}
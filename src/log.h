@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+// Logging.
+//
+// Every thread formats its messages into its own preallocated ring, which a
+// background thread drains to stdout (info, debug) and stderr (warnings,
+// errors). Logging never blocks on the terminal or journald: when a thread's
+// ring is full its messages are dropped and counted. Before log_init() and
+// after log_stop() messages are written straight away.
+//
+// Messages below HODR_LOG_LEVEL are compiled out, the runtime level is set
+// with log_setLevel() or the HODR_LOG_LEVEL environment variable. The
+// log_*Every() forms log at most once per interval from each call site and
+// are meant for anything that can happen once per frame.
+
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+
+#ifndef HODR_LOG_LEVEL
+#define HODR_LOG_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+extern atomic_int log_level; // Runtime level, messages above it are skipped
+
+int log_init();
+void log_stop();
+void log_setLevel(int level);
+void log_write(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+bool log_rateLimit(atomic_int_least64_t *last, atomic_uint *suppressed, int64_t intervalMs, unsigned int *skipped);
+
+#define log_enabled(level) ((level) <= HODR_LOG_LEVEL && (level) <= atomic_load_explicit(&log_level, memory_order_relaxed))
+
+#define LOG_AT(level, ...)                  \
+    do                                      \
+    {                                       \
+        if (log_enabled(level))             \
+        {                                   \
+            log_write((level), __VA_ARGS__); \
+        }                                   \
+    } while (0)
+
+#define LOG_EVERY(level, intervalMs, ...)                                                      \
+    do                                                                                         \
+    {                                                                                          \
+        static atomic_int_least64_t logLast_;                                                  \
+        static atomic_uint logSuppressed_;                                                     \
+        unsigned int logSkipped_;                                                              \
+        if (log_enabled(level) && log_rateLimit(&logLast_, &logSuppressed_, (intervalMs), &logSkipped_)) \
+        {                                                                                      \
+            if (logSkipped_ > 0)                                                               \
+            {                                                                                  \
+                log_write((level), "(%u similar messages suppressed)", logSkipped_);           \
+            }                                                                                  \
+            log_write((level), __VA_ARGS__);                                                   \
+        }                                                                                      \
+    } while (0)
+
+#define log_error(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_warn(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_info(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+#define log_errorEvery(intervalMs, ...) LOG_EVERY(LOG_LEVEL_ERROR, intervalMs, __VA_ARGS__)
+#define log_warnEvery(intervalMs, ...) LOG_EVERY(LOG_LEVEL_WARN, intervalMs, __VA_ARGS__)
+#define log_debugEvery(intervalMs, ...) LOG_EVERY(LOG_LEVEL_DEBUG, intervalMs, __VA_ARGS__)
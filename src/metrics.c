@@ -0,0 +1,107 @@
+#include "metrics.h"
+
+HODR_Histogram_t metrics_histograms[METRIC_COUNT] = {
+    [METRIC_WAIT] = {.name = "wait"},
+    [METRIC_READOUT] = {.name = "readout"},
+    [METRIC_TIMINGS] = {.name = "timings"},
+    [METRIC_FRAME] = {.name = "frame"},
+    [METRIC_AUTO_EXPOSURE] = {.name = "auto_exposure"},
+    [METRIC_CORRECTION] = {.name = "correction"},
+    [METRIC_RESAMPLE] = {.name = "resample"},
+    [METRIC_WRITE] = {.name = "write"},
+    [METRIC_LOCK_WAIT] = {.name = "lock"},
+    [METRIC_DATA_FILE_LOCK_WAIT] = {.name = "data_file_lock"},
+};
+
+// Values below METRICS_SUB_BUCKETS ns have a bucket each. Above that,
+// bucket (bits - METRICS_SUB_BUCKET_BITS + 1) * METRICS_SUB_BUCKETS + n
+// holds the n-th sixteenth of [2^(bits - 1), 2^bits).
+static int bucketIndex(uint64_t ns)
+{
+    if (ns < METRICS_SUB_BUCKETS)
+    {
+        return (int)ns;
+    }
+    int bits = 64 - __builtin_clzll(ns); // ns < 2^bits
+    if (bits > METRICS_MAX_BITS)
+    {
+        return METRICS_BUCKETS - 1;
+    }
+    int shift = bits - 1 - METRICS_SUB_BUCKET_BITS;
+    return (bits - METRICS_SUB_BUCKET_BITS) * METRICS_SUB_BUCKETS + (int)((ns >> shift) & (METRICS_SUB_BUCKETS - 1));
+}
+
+// Largest value that falls into a bucket
+static uint64_t bucketLimit(int index)
+{
+    if (index < METRICS_SUB_BUCKETS)
+    {
+        return (uint64_t)index;
+    }
+    if (index == METRICS_BUCKETS - 1)
+    {
+        return UINT64_MAX; // Also holds everything too large for the table
+    }
+    int bits = index / METRICS_SUB_BUCKETS + METRICS_SUB_BUCKET_BITS;
+    int shift = bits - 1 - METRICS_SUB_BUCKET_BITS;
+    uint64_t sub = (uint64_t)(index % METRICS_SUB_BUCKETS) + METRICS_SUB_BUCKETS;
+    return ((sub + 1) << shift) - 1;
+}
+
+void metrics_record(HODR_Metric_t metric, uint64_t ns)
+{
+    HODR_Histogram_t *histogram = &metrics_histograms[metric];
+    atomic_fetch_add_explicit(&histogram->buckets[bucketIndex(ns)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->sumNs, ns, memory_order_relaxed);
+    uint64_t max = atomic_load_explicit(&histogram->maxNs, memory_order_relaxed);
+    while (ns > max && !atomic_compare_exchange_weak_explicit(&histogram->maxNs, &max, ns, memory_order_relaxed, memory_order_relaxed))
+    {
+    }
+}
+
+// Value below which the given fraction of the recorded values fall, to
+// the resolution of the buckets. 0 if nothing was recorded.
+uint64_t metrics_percentile(HODR_Metric_t metric, double quantile)
+{
+    HODR_Histogram_t *histogram = &metrics_histograms[metric];
+    uint64_t total = 0;
+    uint64_t counts[METRICS_BUCKETS];
+    for (int i = 0; i < METRICS_BUCKETS; i++)
+    {
+        counts[i] = atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+        total += counts[i];
+    }
+    if (total == 0)
+    {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t)(quantile * (double)total + 0.5);
+    rank = rank < 1 ? 1 : rank > total ? total : rank;
+    uint64_t seen = 0;
+    for (int i = 0; i < METRICS_BUCKETS; i++)
+    {
+        seen += counts[i];
+        if (seen >= rank)
+        {
+            uint64_t limit = bucketLimit(i);
+            uint64_t max = atomic_load_explicit(&histogram->maxNs, memory_order_relaxed);
+            return limit < max ? limit : max;
+        }
+    }
+    return atomic_load_explicit(&histogram->maxNs, memory_order_relaxed);
+}
+
+// Lock a mutex, recording how long it took to get it
+void metrics_lock(pthread_mutex_t *mutex, HODR_Metric_t metric)
+{
+    if (pthread_mutex_trylock(mutex) == 0)
+    {
+        metrics_record(metric, 0); // Uncontended
+        return;
+    }
+    uint64_t start = metrics_nowNs();
+    pthread_mutex_lock(mutex);
+    metrics_since(metric, start);
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+
+// Latency metrics.
+//
+// One log-linear histogram per stage of frame handling and per contended
+// lock, in the style of HdrHistogram: every power of two of nanoseconds is
+// split into METRICS_SUB_BUCKETS linear buckets, so any value is kept to
+// within about 6% with a fixed, small table. Recording is a handful of
+// relaxed atomic increments and never blocks, so it is safe in the readout
+// path. Histograms accumulate from daemon start.
+
+#define METRICS_SUB_BUCKET_BITS 4
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BUCKET_BITS)
+#define METRICS_MAX_BITS 42 // Values up to 2^42 ns (about 73 minutes), larger ones go in the last bucket
+#define METRICS_BUCKETS ((METRICS_MAX_BITS - METRICS_SUB_BUCKET_BITS + 1) * METRICS_SUB_BUCKETS)
+
+typedef enum {
+    METRIC_WAIT,          // Blocked in WaitForAcquisition
+    METRIC_READOUT,       // GetImages or GetMostRecentImage
+    METRIC_TIMINGS,       // GetAcquisitionTimings
+    METRIC_FRAME,         // Everything readout does with lock held after a wait
+    METRIC_AUTO_EXPOSURE, // One auto-exposure step
+    METRIC_CORRECTION,    // Dark, flat-field and hot-pixel correction of one spectrum
+    METRIC_RESAMPLE,      // Resampling of one spectrum to the wavelength grid
+    METRIC_WRITE,         // One writer batch, data and index
+    METRIC_LOCK_WAIT,     // Waiting for lock
+    METRIC_DATA_FILE_LOCK_WAIT, // Waiting for the writer's filesLock
+    METRIC_COUNT
+} HODR_Metric_t;
+
+typedef struct {
+    const char *name;
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t sumNs;
+    atomic_uint_fast64_t maxNs;
+    atomic_uint_fast64_t buckets[METRICS_BUCKETS];
+} HODR_Histogram_t;
+
+extern HODR_Histogram_t metrics_histograms[METRIC_COUNT];
+
+void metrics_record(HODR_Metric_t metric, uint64_t ns);
+uint64_t metrics_percentile(HODR_Metric_t metric, double quantile);
+void metrics_lock(pthread_mutex_t *mutex, HODR_Metric_t metric);
+
+static inline uint64_t metrics_nowNs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+// Record the time since start, a metrics_nowNs() value
+static inline void metrics_since(HODR_Metric_t metric, uint64_t start)
+{
+    metrics_record(metric, metrics_nowNs() - start);
+}
@@ -0,0 +1,88 @@
+#include "query.h"
+#include "writer.h"
+#include "log.h"
+#include <string.h>
+
+// Position a query at its first spectrum, or at fromID if that is later, to
+// resume a query a previous one stopped. Returns 0 or -1 if the data files
+// cannot be read.
+int query_begin(HODR_Query_t *query, uint32_t fromID)
+{
+    long first = writer_findTime(query->startNs);
+    if (first < 0)
+    {
+        return -1;
+    }
+    query->nextID = fromID > (uint32_t)first ? fromID : (uint32_t)first;
+    query->done = query->startNs >= query->endNs;
+    return 0;
+}
+
+bool query_matches(const HODR_Query_t *query, const HODR_RecordHeader_t *header)
+{
+    if (header->timestampNs < query->startNs || header->timestampNs >= query->endNs)
+    {
+        return false;
+    }
+    if (header->exposureTime < query->minExposure || (query->maxExposure > 0 && header->exposureTime > query->maxExposure))
+    {
+        return false;
+    }
+    return !query->stabilizedOnly || header->flags & HODR_RECORD_TEMP_STABILIZED;
+}
+
+// Read the next spectra of a query, up to count of them, into headers and
+// data, npixels per spectrum as for writer_readSpectra(). The spectra are
+// read straight into the caller's buffers and those filtered out are
+// overwritten, so a call needs no memory of its own. Returns the number of
+// spectra matched, which may be 0 before the query is done if none of those
+// scanned passed the filters.
+long query_run(HODR_Query_t *query, size_t count, HODR_RecordHeader_t *headers, int32_t *data, size_t npixels)
+{
+    size_t matched = 0, scanned = 0;
+    while (!query->done && matched < count && scanned < QUERY_MAX_SCAN)
+    {
+        size_t base = matched;
+        long n = writer_readSpectra(query->nextID, count - matched, headers + base, data + base * npixels, npixels);
+        if (n < 0)
+        {
+            if (query->nextID < writer_committedSpectra())
+            {
+                log_warn("Query stopped at spectrum %u, its data file cannot be read.", query->nextID);
+            }
+            query->done = true; // Past the last committed spectrum
+            break;
+        }
+        if (n == 0)
+        {
+            log_warnEvery(1000, "Query skipped corrupt spectrum %u.", query->nextID);
+            query->nextID++;
+            scanned++;
+            continue;
+        }
+
+        long i;
+        for (i = 0; i < n; i++)
+        {
+            const HODR_RecordHeader_t *header = &headers[base + i];
+            if (header->timestampNs >= query->endNs)
+            {
+                query->done = true; // Spectra are stored in capture order
+                break;
+            }
+            if (!query_matches(query, header))
+            {
+                continue;
+            }
+            if (matched != base + (size_t)i)
+            {
+                headers[matched] = *header;
+                memmove(data + matched * npixels, data + (base + (size_t)i) * npixels, npixels * sizeof(int32_t));
+            }
+            matched++;
+        }
+        query->nextID += (uint32_t)i;
+        scanned += (size_t)i;
+    }
+    return (long)matched;
+}
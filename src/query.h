@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "store.h"
+
+// Time-range queries over the stored spectra.
+//
+// A query starts at the first spectrum taken at startNs, found by binary
+// search of the manifest and then of one partition index, and reads the
+// spectra from there on in batches through the writer until endNs. Only the
+// spectra passing the filters are returned. Each query_run() call returns at
+// most a caller-sized batch and scans at most QUERY_MAX_SCAN spectra, so
+// memory and time per call stay bounded however long the range is; the query
+// picks up where it stopped on the next call.
+
+#define QUERY_MAX_SCAN 16384 // Most spectra read by one query_run() call
+
+typedef struct {
+    int64_t startNs;      // Capture time range, ns since the Unix epoch
+    int64_t endNs;        // Exclusive
+    float minExposure;    // Seconds
+    float maxExposure;    // Seconds, 0 for no limit
+    bool stabilizedOnly;  // Only spectra taken with the temperature stabilized
+
+    uint32_t nextID; // Spectrum the next query_run() reads first
+    bool done;       // The range has been read up to endNs or the last committed spectrum
+} HODR_Query_t;
+
+int query_begin(HODR_Query_t *query, uint32_t fromID);
+bool query_matches(const HODR_Query_t *query, const HODR_RecordHeader_t *header);
+long query_run(HODR_Query_t *query, size_t count, HODR_RecordHeader_t *headers, int32_t *data, size_t npixels);
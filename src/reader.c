@@ -0,0 +1,207 @@
+#include "reader.h"
+#include "log.h"
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Map a whole file read-only. Returns NULL if it cannot be mapped or is empty.
+static const uint8_t *mapFile(const char *path, size_t *size)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd); // The mapping keeps the file
+    if (map == MAP_FAILED)
+    {
+        return NULL;
+    }
+    *size = (size_t)st.st_size;
+    return map;
+}
+
+// Read the file header of a mapped data file. Returns 0 or -1 if it is not one.
+static int readHeader(HODR_Reader_t *reader)
+{
+    if (reader->size < sizeof(reader->header))
+    {
+        return -1;
+    }
+    memcpy(&reader->header, reader->map, sizeof(reader->header));
+    if (memcmp(reader->header.magic, HODR_STORE_MAGIC, sizeof(reader->header.magic)) != 0 || reader->header.headerSize < sizeof(reader->header))
+    {
+        return -1; // Not a spectrum store
+    }
+    if (reader->header.version > HODR_STORE_VERSION)
+    {
+        log_error("Unsupported data file version %u", reader->header.version);
+        return -1;
+    }
+    return 0;
+}
+
+// Map a data file and its index. Returns 0 or -1 on error.
+int reader_open(HODR_Reader_t *reader, const char *path)
+{
+    memset(reader, 0, sizeof(*reader));
+    reader->map = mapFile(path, &reader->size);
+    reader->owned = true;
+    if (reader->map == NULL || readHeader(reader) != 0)
+    {
+        log_error("%s is not a HODR data file", path);
+        reader_close(reader);
+        return -1;
+    }
+
+    char indexPath[4096];
+    store_indexPath(path, indexPath, sizeof(indexPath));
+    reader->indexMap = mapFile(indexPath, &reader->indexSize);
+    HODR_IndexHeader_t indexHeader;
+    if (reader->indexMap != NULL && reader->indexSize >= sizeof(indexHeader))
+    {
+        memcpy(&indexHeader, reader->indexMap, sizeof(indexHeader));
+        if (memcmp(indexHeader.magic, HODR_INDEX_MAGIC, sizeof(indexHeader.magic)) == 0 && indexHeader.entrySize == sizeof(HODR_IndexEntry_t))
+        {
+            reader->firstSpectrumID = indexHeader.firstSpectrumID;
+            reader->indexCount = (uint32_t)((reader->indexSize - sizeof(indexHeader)) / sizeof(HODR_IndexEntry_t));
+            return 0;
+        }
+    }
+    if (reader->indexMap != NULL)
+    {
+        munmap((void *)reader->indexMap, reader->indexSize);
+        reader->indexMap = NULL;
+    }
+    return 0; // Still readable from start to end
+}
+
+// Read a data file the caller has mapped, size bytes of it at map, without
+// an index. The mapping must outlive the reader. Returns 0 or -1 if it is not
+// a data file.
+int reader_attach(HODR_Reader_t *reader, const void *map, size_t size)
+{
+    memset(reader, 0, sizeof(*reader));
+    reader->map = map;
+    reader->size = size;
+    return readHeader(reader);
+}
+
+void reader_close(HODR_Reader_t *reader)
+{
+    if (reader->owned && reader->map != NULL)
+    {
+        munmap((void *)reader->map, reader->size);
+    }
+    if (reader->indexMap != NULL)
+    {
+        munmap((void *)reader->indexMap, reader->indexSize);
+    }
+    memset(reader, 0, sizeof(*reader));
+}
+
+// Step to the record at *cursor, 0 for the first, and move the cursor past it.
+// Gap markers are records too. A record returned has a payload that holds its
+// pixels, see store_checkRecord(). Returns 1 for a record, 0 at the end of
+// the mapping or at a partially written record, -1 at a corrupt one.
+int reader_next(const HODR_Reader_t *reader, uint64_t *cursor, HODR_Record_t *record)
+{
+    uint64_t offset = *cursor == 0 ? reader->header.headerSize : *cursor;
+    if (offset + sizeof(HODR_RecordHeader_t) > reader->size)
+    {
+        return 0;
+    }
+    HODR_RecordHeader_t header;
+    memcpy(&header, reader->map + offset, sizeof(header));
+    if (header.magic != HODR_RECORD_MAGIC || store_checkRecord(&header) != 0)
+    {
+        log_warnEvery(1000, "Corrupt record header at offset %llu", (unsigned long long)offset);
+        return -1;
+    }
+    uint64_t next = offset + sizeof(header) + header.payloadBytes;
+    if (next > reader->size)
+    {
+        return 0;
+    }
+    const void *payload = reader->map + offset + sizeof(header);
+    if (store_crc32(0, payload, header.payloadBytes) != header.checksum)
+    {
+        log_warnEvery(1000, "Corrupt spectrum %u at offset %llu", header.spectrumID, (unsigned long long)offset);
+        return -1;
+    }
+    *record = (HODR_Record_t){.header = header, .payload = payload, .offset = offset};
+    *cursor = next;
+    return 1;
+}
+
+// Set the cursor to a spectrum through the index, so that reader_next()
+// returns it. Returns 0, or -1 if the spectrum is not in the index or beyond
+// the mapping.
+int reader_seek(const HODR_Reader_t *reader, uint32_t spectrumID, uint64_t *cursor)
+{
+    if (reader->indexMap == NULL || spectrumID < reader->firstSpectrumID || spectrumID - reader->firstSpectrumID >= reader->indexCount)
+    {
+        return -1;
+    }
+    const HODR_IndexEntry_t *entries = (const HODR_IndexEntry_t *)(reader->indexMap + sizeof(HODR_IndexHeader_t));
+    uint64_t offset = entries[spectrumID - reader->firstSpectrumID].offset;
+    if (offset < reader->header.headerSize || offset + sizeof(HODR_RecordHeader_t) > reader->size)
+    {
+        return -1;
+    }
+    *cursor = offset;
+    return 0;
+}
+
+// First spectrum ID taken at or after timestampNs, one past the last indexed
+// spectrum if there is none. Spectra are indexed in capture order, so this is
+// a binary search of the index.
+uint32_t reader_findTime(const HODR_Reader_t *reader, int64_t timestampNs)
+{
+    const HODR_IndexEntry_t *entries = (const HODR_IndexEntry_t *)(reader->indexMap + sizeof(HODR_IndexHeader_t));
+    uint32_t low = 0, high = reader->indexMap != NULL ? reader->indexCount : 0;
+    while (low < high)
+    {
+        uint32_t middle = low + (high - low) / 2;
+        if (entries[middle].timestampNs < timestampNs)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return reader->firstSpectrumID + low;
+}
+
+// The pixels of a spectrum where they lie in the mapping, int32 or uint16 as
+// its header's encoding says, and not necessarily aligned to it. NULL for a
+// packed spectrum, which has to be decoded, or for a gap marker.
+const void *reader_pixels(const HODR_Record_t *record)
+{
+    const HODR_RecordHeader_t *header = &record->header;
+    if (header->flags & HODR_RECORD_GAP || (header->encoding != HODR_ENCODING_INT32 && header->encoding != HODR_ENCODING_UINT16))
+    {
+        return NULL;
+    }
+    return record->payload;
+}
+
+// Decode the pixels of a spectrum, see store_decodePayload().
+int reader_decode(const HODR_Record_t *record, int32_t *data, size_t maxPixels)
+{
+    if (record->header.flags & HODR_RECORD_GAP)
+    {
+        return -1;
+    }
+    return store_decodePayload(&record->header, record->payload, data, maxPixels);
+}
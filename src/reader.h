@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "store.h"
+
+// Zero-copy reader of data files, the read side of libhodr-store.
+//
+// A data file, and its index if it has one, is mapped read-only and walked in
+// place: a HODR_Record_t points into the mapping, so iterating a file copies
+// nothing and only touches the pages of the records read. Pixels stored as
+// HODR_ENCODING_INT32 or HODR_ENCODING_UINT16 can be used where they lie,
+// reader_pixels(); packed ones are decoded with reader_decode(). A record is
+// only valid until its reader is closed.
+//
+// The mapping covers the file as it was when opened. Records appended after
+// that are not seen; a reader of a file being written opens it again.
+
+typedef struct {
+    const uint8_t *map;        // The data file
+    size_t size;               // Bytes of it mapped
+    HODR_FileHeader_t header;
+    const uint8_t *indexMap;   // The index, NULL if there is none or it is unusable
+    size_t indexSize;
+    uint32_t firstSpectrumID;  // Of the index
+    uint32_t indexCount;       // Entries in the index
+    bool owned;                // Mapped by reader_open(), unmapped by reader_close()
+} HODR_Reader_t;
+
+typedef struct {
+    HODR_RecordHeader_t header; // Copied, records are not aligned in the file
+    const void *payload;        // header.payloadBytes in the mapping, checksum verified
+    uint64_t offset;            // Of the record in the data file
+} HODR_Record_t;
+
+int reader_open(HODR_Reader_t *reader, const char *path);
+int reader_attach(HODR_Reader_t *reader, const void *map, size_t size);
+void reader_close(HODR_Reader_t *reader);
+
+int reader_next(const HODR_Reader_t *reader, uint64_t *cursor, HODR_Record_t *record);
+int reader_seek(const HODR_Reader_t *reader, uint32_t spectrumID, uint64_t *cursor);
+uint32_t reader_findTime(const HODR_Reader_t *reader, int64_t timestampNs);
+
+const void *reader_pixels(const HODR_Record_t *record);
+int reader_decode(const HODR_Record_t *record, int32_t *data, size_t maxPixels);
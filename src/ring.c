@@ -0,0 +1,315 @@
+#include "ring.h"
+#include "store.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+int ring_init(HODR_Ring_t *ring, size_t capacity, size_t npixels)
+{
+    memset(ring, 0, sizeof(*ring));
+    ring->capacity = capacity;
+    ring->npixels = npixels;
+    ring->slots = calloc(capacity, sizeof(HODR_FrameSlot_t));
+    ring->pixels = calloc(capacity * npixels, sizeof(int32_t));
+    ring->noise = calloc(capacity * npixels, sizeof(float));
+    ring->raw = calloc(capacity * npixels, sizeof(int32_t));
+    ring->resampled = calloc(capacity * HODR_RECORD_MAX_POINTS(npixels), sizeof(float));
+    if (ring->slots == NULL || ring->pixels == NULL || ring->noise == NULL || ring->raw == NULL || ring->resampled == NULL)
+    {
+        log_error("Failed to allocate frame ring of %zu x %zu pixels", capacity, npixels);
+        ring_destroy(ring);
+        return -1;
+    }
+    for (size_t i = 0; i < capacity; i++)
+    {
+        ring->slots[i].data = ring->pixels + i * npixels;
+        ring->slots[i].noise = ring->noise + i * npixels;
+        ring->slots[i].raw = ring->raw + i * npixels;
+        ring->slots[i].resampled = ring->resampled + i * HODR_RECORD_MAX_POINTS(npixels);
+        ring->slots[i].npixels = (uint32_t)npixels;
+        atomic_init(&ring->slots[i].sequence, 0);
+    }
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->failedClaims, 0);
+    atomic_init(&ring->highWater, 0);
+    atomic_init(&ring->closed, false);
+    atomic_init(&ring->nconsumers, 0);
+    return 0;
+}
+
+void ring_destroy(HODR_Ring_t *ring)
+{
+    int n = atomic_load(&ring->nconsumers);
+    for (int i = 0; i < n; i++)
+    {
+        sem_destroy(&ring->consumers[i].ready);
+    }
+    free(ring->slots);
+    free(ring->pixels);
+    free(ring->noise);
+    free(ring->raw);
+    free(ring->resampled);
+    ring->slots = NULL;
+    ring->pixels = NULL;
+    ring->noise = NULL;
+    ring->raw = NULL;
+    ring->resampled = NULL;
+    atomic_store(&ring->nconsumers, 0);
+}
+
+// Wake every consumer and make ring_wait() return 0 once drained
+void ring_close(HODR_Ring_t *ring)
+{
+    atomic_store(&ring->closed, true);
+    int n = atomic_load(&ring->nconsumers);
+    for (int i = 0; i < n; i++)
+    {
+        sem_post(&ring->consumers[i].ready);
+    }
+}
+
+bool ring_closed(HODR_Ring_t *ring)
+{
+    return atomic_load(&ring->closed);
+}
+
+// Register a consumer. Consumers must be added before the producer starts.
+HODR_RingConsumer_t *ring_addConsumer(HODR_Ring_t *ring, const char *name, bool lossy)
+{
+    int n = atomic_load(&ring->nconsumers);
+    if (n >= RING_MAX_CONSUMERS)
+    {
+        return NULL;
+    }
+    HODR_RingConsumer_t *consumer = &ring->consumers[n];
+    consumer->name = name;
+    consumer->lossy = lossy;
+    atomic_init(&consumer->cursor, atomic_load(&ring->head));
+    atomic_init(&consumer->overruns, 0);
+    sem_init(&consumer->ready, 0, 0);
+    atomic_store(&ring->nconsumers, n + 1);
+    return consumer;
+}
+
+// Oldest frame still held by a lossless consumer
+static uint64_t ringTail(HODR_Ring_t *ring, uint64_t head)
+{
+    uint64_t tail = head;
+    int n = atomic_load_explicit(&ring->nconsumers, memory_order_acquire);
+    for (int i = 0; i < n; i++)
+    {
+        if (!ring->consumers[i].lossy)
+        {
+            uint64_t cursor = atomic_load_explicit(&ring->consumers[i].cursor, memory_order_acquire);
+            if (cursor < tail)
+            {
+                tail = cursor;
+            }
+        }
+    }
+    return tail;
+}
+
+// Claim the next slot for writing. Returns NULL, and counts a failed claim, if
+// a lossless consumer still holds it, or if the ring is closed. Producer only.
+HODR_FrameSlot_t *ring_claim(HODR_Ring_t *ring)
+{
+    size_t count;
+    return ring_claimMany(ring, 1, &count);
+}
+
+// Claim up to max consecutive slots for writing. The claimed slots never wrap
+// around the end of the ring, so their pixels are contiguous and several
+// frames can be read into them with one call. Slots are published one by one
+// in order with ring_publish(). Returns NULL, and counts a failed claim, if no
+// slot is free. Producer only.
+HODR_FrameSlot_t *ring_claimMany(HODR_Ring_t *ring, size_t max, size_t *count)
+{
+    *count = 0;
+    if (atomic_load_explicit(&ring->closed, memory_order_relaxed))
+    {
+        return NULL;
+    }
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t space = ring->capacity - (size_t)(head - ringTail(ring, head));
+    size_t untilWrap = ring->capacity - (size_t)(head % ring->capacity);
+    size_t n = max < space ? max : space;
+    n = n < untilWrap ? n : untilWrap;
+    if (n == 0)
+    {
+        atomic_fetch_add_explicit(&ring->failedClaims, 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    HODR_FrameSlot_t *first = &ring->slots[head % ring->capacity];
+    for (size_t i = 0; i < n; i++)
+    {
+        atomic_store_explicit(&first[i].sequence, 2 * (head + i) + 1, memory_order_relaxed); // Lossy readers now see it as changing
+        first[i].frame = head + i;
+    }
+    atomic_thread_fence(memory_order_release);
+    *count = n;
+    return first;
+}
+
+// Publish a claimed slot to every consumer. Producer only.
+void ring_publish(HODR_Ring_t *ring, HODR_FrameSlot_t *slot)
+{
+    uint64_t head = slot->frame + 1;
+    atomic_store_explicit(&slot->sequence, 2 * head, memory_order_release);
+    atomic_store_explicit(&ring->head, head, memory_order_release);
+
+    uint64_t waiting = head - ringTail(ring, head);
+    if (waiting > atomic_load_explicit(&ring->highWater, memory_order_relaxed))
+    {
+        atomic_store_explicit(&ring->highWater, waiting, memory_order_relaxed);
+    }
+
+    int n = atomic_load_explicit(&ring->nconsumers, memory_order_acquire);
+    for (int i = 0; i < n; i++)
+    {
+        // One pending post is enough to wake a consumer, it drains everything available
+        int pending = 0;
+        sem_getvalue(&ring->consumers[i].ready, &pending);
+        if (pending <= 0)
+        {
+            sem_post(&ring->consumers[i].ready);
+        }
+    }
+}
+
+// Block until frames are available to a consumer. Returns the number of
+// frames available, or 0 once the ring is closed.
+size_t ring_wait(HODR_Ring_t *ring, HODR_RingConsumer_t *consumer)
+{
+    while (true)
+    {
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        uint64_t cursor = atomic_load_explicit(&consumer->cursor, memory_order_relaxed);
+        if (head > cursor)
+        {
+            return (size_t)(head - cursor);
+        }
+        if (atomic_load(&ring->closed))
+        {
+            return 0;
+        }
+        while (sem_wait(&consumer->ready) != 0 && errno == EINTR)
+        {
+        }
+    }
+}
+
+// Slot of the n-th unreleased frame of a lossless consumer. The slot stays
+// valid until it is released.
+HODR_FrameSlot_t *ring_peek(HODR_Ring_t *ring, HODR_RingConsumer_t *consumer, size_t n)
+{
+    uint64_t cursor = atomic_load_explicit(&consumer->cursor, memory_order_relaxed);
+    return &ring->slots[(cursor + n) % ring->capacity];
+}
+
+// Hand n frames back to the producer
+void ring_release(HODR_Ring_t *ring, HODR_RingConsumer_t *consumer, size_t n)
+{
+    (void)ring;
+    atomic_fetch_add_explicit(&consumer->cursor, n, memory_order_release);
+}
+
+// Copy the newest frame for a lossy consumer, skipping anything older.
+// copy->data must hold the ring's npixels. Returns false if there is no new frame.
+bool ring_readLatest(HODR_Ring_t *ring, HODR_RingConsumer_t *consumer, HODR_FrameSlot_t *copy)
+{
+    while (true)
+    {
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        uint64_t cursor = atomic_load_explicit(&consumer->cursor, memory_order_relaxed);
+        if (head <= cursor)
+        {
+            return false;
+        }
+
+        HODR_FrameSlot_t *slot = &ring->slots[(head - 1) % ring->capacity];
+        uint64_t before = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        if (before != 2 * head)
+        {
+            continue; // Overwritten since head was read, try the newer frame
+        }
+
+        int32_t *data = copy->data;
+        memcpy(copy, slot, offsetof(HODR_FrameSlot_t, data));
+        memcpy(data, slot->data, sizeof(int32_t) * slot->npixels);
+        copy->data = data;
+
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&slot->sequence, memory_order_relaxed) != before)
+        {
+            continue; // Torn read
+        }
+
+        atomic_fetch_add_explicit(&consumer->overruns, head - 1 - cursor, memory_order_relaxed);
+        atomic_store_explicit(&consumer->cursor, head, memory_order_release);
+        return true;
+    }
+}
+
+// Copy the next frame in order for a lossy consumer. A consumer that has
+// fallen behind skips the frames that were overwritten before it got to them,
+// counting them as overruns. copy->data must hold the ring's npixels. Returns
+// false if there is no new frame.
+bool ring_readNext(HODR_Ring_t *ring, HODR_RingConsumer_t *consumer, HODR_FrameSlot_t *copy)
+{
+    while (true)
+    {
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        uint64_t cursor = atomic_load_explicit(&consumer->cursor, memory_order_relaxed);
+        if (head <= cursor)
+        {
+            return false;
+        }
+        if (head - cursor > ring->capacity)
+        {
+            atomic_fetch_add_explicit(&consumer->overruns, head - ring->capacity - cursor, memory_order_relaxed);
+            cursor = head - ring->capacity; // Oldest frame that may still be in the ring
+            atomic_store_explicit(&consumer->cursor, cursor, memory_order_relaxed);
+        }
+
+        HODR_FrameSlot_t *slot = &ring->slots[cursor % ring->capacity];
+        uint64_t before = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        bool good = before == 2 * (cursor + 1);
+        if (good)
+        {
+            int32_t *data = copy->data;
+            memcpy(copy, slot, offsetof(HODR_FrameSlot_t, data));
+            memcpy(data, slot->data, sizeof(int32_t) * slot->npixels);
+            copy->data = data;
+            atomic_thread_fence(memory_order_acquire);
+            good = atomic_load_explicit(&slot->sequence, memory_order_relaxed) == before;
+        }
+
+        atomic_store_explicit(&consumer->cursor, cursor + 1, memory_order_release);
+        if (good)
+        {
+            return true;
+        }
+        atomic_fetch_add_explicit(&consumer->overruns, 1, memory_order_relaxed); // Overwritten while we were behind
+    }
+}
+
+uint64_t ring_head(HODR_Ring_t *ring)
+{
+    return atomic_load_explicit(&ring->head, memory_order_acquire);
+}
+
+// Claims that found the ring full. Frames that were really lost are counted
+// by the producer.
+uint64_t ring_failedClaims(HODR_Ring_t *ring)
+{
+    return atomic_load_explicit(&ring->failedClaims, memory_order_relaxed);
+}
+
+uint64_t ring_highWater(HODR_Ring_t *ring)
+{
+    return atomic_load_explicit(&ring->highWater, memory_order_relaxed);
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <semaphore.h>
+
+// Frame ring.
+//
+// A preallocated single-producer, multi-consumer ring of frame slots between
+// the thread that makes frames and everything that uses them: readout hands
+// raw frames to processing through one, processing hands spectra to storage
+// and the rest through another. The producer never blocks: it claims a slot,
+// copies the pixels in and publishes it.
+//
+// Lossless consumers (storage) hold on to the frames they have not released
+// yet, and the producer gets no slot rather than overwrite them; every such
+// failed claim is counted, whatever the producer then does with its frames.
+// Lossy consumers (D-Bus, auto-exposure)
+// never hold the producer back, they skip ahead when they fall behind and
+// copy slots out under a per-slot sequence check.
+
+#define RING_MAX_CONSUMERS 8
+
+typedef struct {
+    atomic_uint_fast64_t sequence; // 2 * frame + 1 while being written, 2 * (frame + 1) once published
+    uint64_t frame;                // Frame number since the ring was created
+    uint32_t spectrumID;           // ID the frame is stored under
+    int64_t timestampNs;           // Readout time, ns since the Unix epoch
+    float exposureTime;            // Seconds
+    float temperature;             // Degrees Celsius
+    uint8_t flags;                 // HODR_RECORD_*
+    uint32_t gapBefore;            // Frames the camera took since the previous slot that never reached the ring
+    uint16_t coadded;              // Frames averaged into the slot when flags has HODR_RECORD_COADDED
+    uint32_t gridPoints;           // Points of resampled when flags has HODR_RECORD_RESAMPLED
+    double gridStart;              // Wavelength of the first grid point, nm
+    double gridStep;               // nm between grid points
+    uint32_t npixels;
+    int32_t *data;
+    float *noise;                  // Standard error of each pixel of a co-added slot, not copied by lossy reads
+    int32_t *raw;                  // Uncorrected pixels when flags has HODR_RECORD_WITH_RAW, not copied by lossy reads
+    float *resampled;              // Spectrum on the wavelength grid when flags has HODR_RECORD_RESAMPLED, not copied by lossy reads
+} HODR_FrameSlot_t;
+
+typedef struct {
+    const char *name;
+    bool lossy;
+    atomic_uint_fast64_t cursor;   // Next frame this consumer will read
+    atomic_uint_fast64_t overruns; // Frames a lossy consumer skipped
+    sem_t ready;                   // Posted for every published frame
+} HODR_RingConsumer_t;
+
+typedef struct {
+    size_t capacity;
+    size_t npixels;
+    HODR_FrameSlot_t *slots;
+    int32_t *pixels;
+    float *noise;
+    int32_t *raw;
+    float *resampled;
+
+    atomic_uint_fast64_t head;      // Next frame the producer will publish
+    atomic_uint_fast64_t failedClaims; // Claims that found no free slot, not frames lost
+    atomic_uint_fast64_t highWater; // Most frames ever waiting for a lossless consumer
+    atomic_bool closed;
+
+    HODR_RingConsumer_t consumers[RING_MAX_CONSUMERS];
+    atomic_int nconsumers;
+} HODR_Ring_t;
+
+int ring_init(HODR_Ring_t *ring, size_t capacity, size_t npixels);
+void ring_destroy(HODR_Ring_t *ring);
+void ring_close(HODR_Ring_t *ring);
+bool ring_closed(HODR_Ring_t *ring);
+
+HODR_FrameSlot_t *ring_claim(HODR_Ring_t *ring);
+HODR_FrameSlot_t *ring_claimMany(HODR_Ring_t *ring, size_t max, size_t *count);
+void ring_publish(HODR_Ring_t *ring, HODR_FrameSlot_t *slot);
+
+HODR_RingConsumer_t *ring_addConsumer(HODR_Ring_t *ring, const char *name, bool lossy);
+size_t ring_wait(HODR_Ring_t *ring, HODR_RingConsumer_t *consumer);
+HODR_FrameSlot_t *ring_peek(HODR_Ring_t *ring, HODR_RingConsumer_t *consumer, size_t n);
+void ring_release(HODR_Ring_t *ring, HODR_RingConsumer_t *consumer, size_t n);
+bool ring_readLatest(HODR_Ring_t *ring, HODR_RingConsumer_t *consumer, HODR_FrameSlot_t *copy);
+bool ring_readNext(HODR_Ring_t *ring, HODR_RingConsumer_t *consumer, HODR_FrameSlot_t *copy);
+
+uint64_t ring_head(HODR_Ring_t *ring);
+uint64_t ring_failedClaims(HODR_Ring_t *ring);
+uint64_t ring_highWater(HODR_Ring_t *ring);
@@ -0,0 +1,123 @@
+#define _GNU_SOURCE // memfd_create
+#include "shm.h"
+#include "log.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+static HODR_ShmSlot_t *shmSlot(HODR_Shm_t *shm, uint64_t frame)
+{
+    HODR_ShmHeader_t *header = shm->header;
+    return (HODR_ShmSlot_t *)((char *)shm->base + header->headerSize + (size_t)(frame % header->slotCount) * header->slotSize);
+}
+
+// Create and map the memfd. Returns 0 or -1 on error.
+int shm_create(HODR_Shm_t *shm, uint32_t slotCount, uint32_t npixels)
+{
+    memset(shm, 0, sizeof(*shm));
+    shm->fd = -1;
+
+    size_t slotSize = (sizeof(HODR_ShmSlot_t) + npixels * sizeof(int32_t) + 63) & ~(size_t)63; // Slots start on cache lines
+    shm->size = sizeof(HODR_ShmHeader_t) + slotCount * slotSize;
+
+    shm->fd = memfd_create("hodr-spectra", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (shm->fd < 0 || ftruncate(shm->fd, (off_t)shm->size) != 0)
+    {
+        log_error("Error creating shared spectrum ring: %s", strerror(errno));
+        shm_destroy(shm);
+        return -1;
+    }
+    shm->base = mmap(NULL, shm->size, PROT_READ | PROT_WRITE, MAP_SHARED, shm->fd, 0);
+    if (shm->base == MAP_FAILED)
+    {
+        log_error("Error mapping shared spectrum ring: %s", strerror(errno));
+        shm->base = NULL;
+        shm_destroy(shm);
+        return -1;
+    }
+
+    shm->header = shm->base;
+    memcpy(shm->header->magic, HODR_SHM_MAGIC, sizeof(shm->header->magic));
+    shm->header->version = HODR_SHM_VERSION;
+    shm->header->headerSize = sizeof(HODR_ShmHeader_t);
+    shm->header->slotCount = slotCount;
+    shm->header->slotSize = (uint32_t)slotSize;
+    shm->header->npixels = npixels;
+    atomic_store(&shm->header->head, 0);
+
+    // Clients can rely on the size, and cannot map it writable
+    int seals = F_SEAL_SHRINK | F_SEAL_GROW;
+#ifdef F_SEAL_FUTURE_WRITE
+    seals |= F_SEAL_FUTURE_WRITE;
+#endif
+    if (fcntl(shm->fd, F_ADD_SEALS, seals | F_SEAL_SEAL) != 0)
+    {
+        log_error("Could not seal shared spectrum ring: %s", strerror(errno));
+    }
+    return 0;
+}
+
+void shm_destroy(HODR_Shm_t *shm)
+{
+    if (shm->base != NULL)
+    {
+        munmap(shm->base, shm->size);
+        shm->base = NULL;
+        shm->header = NULL;
+    }
+    if (shm->fd >= 0)
+    {
+        close(shm->fd);
+        shm->fd = -1;
+    }
+}
+
+// Start writing a frame. Returns where its pixels go. Frames are written in
+// increasing order by a single writer.
+int32_t *shm_beginWrite(HODR_Shm_t *shm, uint64_t frame)
+{
+    HODR_ShmSlot_t *slot = shmSlot(shm, frame);
+    shm->writing = frame;
+    atomic_store_explicit(&slot->sequence, 2 * frame + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    return (int32_t *)(slot + 1);
+}
+
+// Fill in the metadata of the frame started with shm_beginWrite() and publish
+// it. If the frame turned out to be a later one than was started, its pixels
+// are moved to the right slot; the started slot stays marked as being written.
+void shm_publish(HODR_Shm_t *shm, const HODR_FrameSlot_t *frame)
+{
+    uint64_t n = frame->frame;
+    HODR_ShmSlot_t *slot = shmSlot(shm, n);
+    if (shm->writing != n)
+    {
+        const int32_t *pixels = (const int32_t *)(shmSlot(shm, shm->writing) + 1);
+        memmove(shm_beginWrite(shm, n), pixels, sizeof(int32_t) * frame->npixels);
+    }
+    slot->frame = n;
+    slot->spectrumID = frame->spectrumID;
+    slot->npixels = frame->npixels;
+    slot->timestampNs = frame->timestampNs;
+    slot->exposureTime = frame->exposureTime;
+    slot->temperature = frame->temperature;
+    slot->flags = frame->flags;
+    atomic_store_explicit(&slot->sequence, 2 * (n + 1), memory_order_release);
+    atomic_store_explicit(&shm->header->head, n + 1, memory_order_release);
+}
+
+// A new read-only descriptor of the memfd for a client. The caller owns it.
+int shm_clientFd(HODR_Shm_t *shm)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", shm->fd);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        log_error("Error reopening shared spectrum ring read-only: %s", strerror(errno));
+    }
+    return fd;
+}
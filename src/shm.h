@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include "ring.h"
+
+// Shared-memory spectrum ring.
+//
+// The daemon copies every frame it can into a memfd that local clients map
+// read-only, after fetching the descriptor with the get_shared_ring D-Bus
+// method. The memfd is a HODR_ShmHeader_t followed by slotCount slots of
+// slotSize bytes, each a HODR_ShmSlot_t followed by npixels int32 pixels.
+//
+// Frames are numbered as in the frame ring, so frame n is the spectrum with
+// ID firstSpectrumID + n and goes into slot n % slotCount; frames the daemon
+// could not keep up with never appear. A reader loads the slot sequence,
+// copies the slot and loads the sequence again: the copy is good if both
+// loads gave 2 * (n + 1). An odd sequence means the slot is being written.
+// All fields are little-endian.
+
+#define HODR_SHM_MAGIC "HODRSHM"
+#define HODR_SHM_VERSION 1
+
+typedef struct {
+    char magic[8];         // HODR_SHM_MAGIC
+    uint32_t version;      // HODR_SHM_VERSION
+    uint32_t headerSize;   // Offset of the first slot
+    uint32_t slotCount;
+    uint32_t slotSize;     // Bytes from one slot to the next
+    uint32_t npixels;      // Pixels each slot has room for
+    uint32_t reserved;
+    atomic_uint_least64_t head; // One past the newest frame published
+    uint64_t reserved2[3];
+} HODR_ShmHeader_t;
+
+typedef struct {
+    atomic_uint_least64_t sequence; // 2 * frame + 1 while being written, 2 * (frame + 1) once published
+    uint64_t frame;
+    uint32_t spectrumID;
+    uint32_t npixels;
+    int64_t timestampNs;   // Readout time, ns since the Unix epoch
+    float exposureTime;    // Seconds
+    float temperature;     // Degrees Celsius
+    uint8_t flags;         // HODR_RECORD_*
+    uint8_t reserved[23];
+} HODR_ShmSlot_t;
+
+_Static_assert(sizeof(HODR_ShmHeader_t) == 64, "HODR_ShmHeader_t must be 64 bytes");
+_Static_assert(sizeof(HODR_ShmSlot_t) == 64, "HODR_ShmSlot_t must be 64 bytes");
+
+typedef struct {
+    int fd;
+    void *base;
+    size_t size;
+    HODR_ShmHeader_t *header;
+    uint64_t writing; // Frame started by shm_beginWrite()
+} HODR_Shm_t;
+
+int shm_create(HODR_Shm_t *shm, uint32_t slotCount, uint32_t npixels);
+void shm_destroy(HODR_Shm_t *shm);
+
+int32_t *shm_beginWrite(HODR_Shm_t *shm, uint64_t frame);
+void shm_publish(HODR_Shm_t *shm, const HODR_FrameSlot_t *frame);
+
+int shm_clientFd(HODR_Shm_t *shm);
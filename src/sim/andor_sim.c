@@ -0,0 +1,747 @@
+#include "atmcdLXd.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+
+// Simulated Andor camera.
+//
+// Implements the subset of the Andor SDK used by HODR so the daemon can be
+// built and benchmarked without a spectrometer attached (`make sim`). Frames
+// are synthetic FVB spectra generated by a background thread at the
+// configured exposure/kinetic cycle, and are kept in a circular buffer with
+// the same 1-based image indexing as the real SDK. The sensor temperature
+// follows a first order model towards the target while the cooler is on.
+//
+// The simulated detector is configured from the environment at Initialize():
+//   HODR_SIM_WIDTH      detector width in pixels           (default 1024)
+//   HODR_SIM_READOUT_MS FVB readout time in milliseconds   (default 1.0)
+//   HODR_SIM_BUFFER     circular buffer size in images     (default 256)
+//   HODR_SIM_PEAK_RATE  peak line intensity in counts/s    (default 300000)
+//   HODR_SIM_COOL_TAU   cooler time constant in seconds    (default 20)
+
+#define SIM_AMBIENT_TEMPERATURE 20.0f
+#define SIM_MIN_TEMPERATURE -100
+#define SIM_MAX_TEMPERATURE 20
+#define SIM_BIAS_LEVEL 300.0f
+#define SIM_SATURATION 65535
+#define SIM_STABLE_BAND 0.5f   // Degrees from target counted as reached
+#define SIM_STABLE_SECONDS 5.0 // Time within band before reporting stabilized
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t frameCond;  // Signalled for every new frame, abort and CancelWait
+    pthread_cond_t timerCond;  // Used by the frame thread to sleep until the next frame
+    bool initialized;
+
+    int width;
+    float readoutTime;  // Seconds
+    float peakRate;     // Counts per second at the strongest line
+    float coolTau;      // Seconds
+    float *profile;     // Signal rate per pixel in counts per second
+    uint64_t rng;
+
+    int acquisitionMode;
+    int readMode;
+    int numberAccumulations;
+    int numberKinetics;
+    float exposureTime;
+    float kineticCycleTime;
+    bool shutterClosed; // Frames are dark
+
+    bool acquiring;
+    bool abortRequested;
+    pthread_t frameThread;
+    bool frameThreadRunning;
+
+    at_32 *buffer;      // Circular buffer of bufferImages frames
+    long bufferImages;
+    long totalImages;   // Index of the most recent image, 1-based, 0 when none
+    long lastRetrieved; // Index of the last image returned by GetImages
+    long lastWaited;    // Index of the last image that released WaitForAcquisition
+    bool cancelWait;
+
+    bool coolerOn;
+    int targetTemperature;
+    float temperature;
+    double lastTemperatureUpdate;
+    double stableSince;
+} SimCamera_t;
+
+static SimCamera_t sim = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .temperature = SIM_AMBIENT_TEMPERATURE,
+};
+
+static double simNow()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static double envDouble(const char *name, double defaultValue)
+{
+    const char *value = getenv(name);
+    if (value == NULL || *value == '\0')
+    {
+        return defaultValue;
+    }
+    char *end;
+    double parsed = strtod(value, &end);
+    if (end == value || parsed <= 0)
+    {
+        fprintf(stderr, "Ignoring invalid %s=%s\n", name, value);
+        return defaultValue;
+    }
+    return parsed;
+}
+
+static uint32_t simRandom()
+{
+    // xorshift64*, plenty for synthetic noise
+    sim.rng ^= sim.rng >> 12;
+    sim.rng ^= sim.rng << 25;
+    sim.rng ^= sim.rng >> 27;
+    return (uint32_t)((sim.rng * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+static float simGaussianNoise()
+{
+    // Irwin-Hall approximation of a unit normal from four uniforms
+    uint32_t a = simRandom(), b = simRandom();
+    float sum = (float)(a & 0xFFFF) + (float)(a >> 16) + (float)(b & 0xFFFF) + (float)(b >> 16);
+    return (sum / 65535.0f - 2.0f) * 1.7320508f;
+}
+
+static void simBuildProfile()
+{
+    // A handful of emission lines on a weak continuum
+    static const float lines[][3] = {
+        // centre (fraction of width), width (fraction), relative height
+        {0.18f, 0.004f, 0.35f},
+        {0.37f, 0.006f, 1.00f},
+        {0.52f, 0.003f, 0.55f},
+        {0.71f, 0.008f, 0.20f},
+        {0.86f, 0.005f, 0.45f},
+    };
+
+    free(sim.profile);
+    sim.profile = malloc(sizeof(float) * sim.width);
+    for (int i = 0; i < sim.width; i++)
+    {
+        float x = (float)i / (float)sim.width;
+        float value = 0.02f * sinf(x * 3.14159265f); // Continuum
+        for (size_t l = 0; l < sizeof(lines) / sizeof(lines[0]); l++)
+        {
+            float d = (x - lines[l][0]) / lines[l][1];
+            value += lines[l][2] * expf(-0.5f * d * d);
+        }
+        sim.profile[i] = value * sim.peakRate;
+    }
+}
+
+static void simUpdateTemperature()
+{
+    double now = simNow();
+    double dt = now - sim.lastTemperatureUpdate;
+    sim.lastTemperatureUpdate = now;
+
+    float goal = sim.coolerOn ? (float)sim.targetTemperature : SIM_AMBIENT_TEMPERATURE;
+    sim.temperature = goal + (sim.temperature - goal) * (float)exp(-dt / sim.coolTau);
+
+    if (sim.coolerOn && fabsf(sim.temperature - goal) <= SIM_STABLE_BAND)
+    {
+        if (sim.stableSince == 0)
+        {
+            sim.stableSince = now;
+        }
+    }
+    else
+    {
+        sim.stableSince = 0;
+    }
+}
+
+static unsigned int simTemperatureStatus()
+{
+    if (!sim.coolerOn)
+    {
+        return DRV_TEMP_OFF;
+    }
+    if (sim.stableSince == 0)
+    {
+        return DRV_TEMP_NOT_REACHED;
+    }
+    if (simNow() - sim.stableSince < SIM_STABLE_SECONDS)
+    {
+        return DRV_TEMP_NOT_STABILIZED;
+    }
+    return DRV_TEMP_STABILIZED;
+}
+
+static float simCycleTime()
+{
+    float frameTime = sim.exposureTime + sim.readoutTime;
+    if (sim.acquisitionMode == 3 || sim.acquisitionMode == 5)
+    {
+        return sim.kineticCycleTime > frameTime ? sim.kineticCycleTime : frameTime;
+    }
+    return frameTime;
+}
+
+// Render one frame into the next slot of the circular buffer. Called with the mutex held.
+static void simRenderFrame()
+{
+    long slot = sim.totalImages % sim.bufferImages;
+    at_32 *frame = sim.buffer + slot * sim.width;
+    int accumulations = sim.acquisitionMode == 2 ? sim.numberAccumulations : 1;
+
+    for (int i = 0; i < sim.width; i++)
+    {
+        float signal = sim.shutterClosed ? 0.0f : sim.profile[i] * sim.exposureTime;
+        int64_t sum = 0;
+        for (int a = 0; a < accumulations; a++)
+        {
+            float value = SIM_BIAS_LEVEL + signal + simGaussianNoise() * sqrtf(signal + 25.0f);
+            if (value < 0)
+            {
+                value = 0;
+            }
+            sum += value > SIM_SATURATION ? SIM_SATURATION : (int64_t)value;
+        }
+        frame[i] = (at_32)sum;
+    }
+    sim.totalImages++;
+}
+
+static void *simFrameThread(void *arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&sim.mutex);
+
+    long framesInAcquisition = 1;
+    if (sim.acquisitionMode == 3)
+    {
+        framesInAcquisition = sim.numberKinetics;
+    }
+    else if (sim.acquisitionMode == 5)
+    {
+        framesInAcquisition = -1; // Run till abort
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+    for (long n = 0; framesInAcquisition < 0 || n < framesInAcquisition; n++)
+    {
+        // Exposure and readout of the first frame, then one kinetic cycle per frame
+        double wait = n == 0 ? sim.exposureTime + sim.readoutTime : simCycleTime();
+        if (sim.acquisitionMode == 2)
+        {
+            wait *= sim.numberAccumulations;
+        }
+        long ns = deadline.tv_nsec + (long)(wait * 1e9);
+        deadline.tv_sec += ns / 1000000000L;
+        deadline.tv_nsec = ns % 1000000000L;
+
+        while (!sim.abortRequested)
+        {
+            if (pthread_cond_timedwait(&sim.timerCond, &sim.mutex, &deadline) == ETIMEDOUT)
+            {
+                break;
+            }
+        }
+        if (sim.abortRequested)
+        {
+            break;
+        }
+
+        simRenderFrame();
+        pthread_cond_broadcast(&sim.frameCond);
+    }
+
+    sim.acquiring = false;
+    pthread_cond_broadcast(&sim.frameCond);
+    pthread_mutex_unlock(&sim.mutex);
+    return NULL;
+}
+
+// Join a finished or aborted frame thread. Called with the mutex held.
+static void simJoinFrameThread()
+{
+    if (!sim.frameThreadRunning)
+    {
+        return;
+    }
+    sim.abortRequested = true;
+    pthread_cond_broadcast(&sim.timerCond);
+    pthread_mutex_unlock(&sim.mutex);
+    pthread_join(sim.frameThread, NULL);
+    pthread_mutex_lock(&sim.mutex);
+    sim.frameThreadRunning = false;
+    sim.abortRequested = false;
+}
+
+unsigned int Initialize(char *dir)
+{
+    (void)dir;
+    pthread_mutex_lock(&sim.mutex);
+    if (!sim.initialized)
+    {
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&sim.timerCond, &attr);
+        pthread_cond_init(&sim.frameCond, &attr);
+        pthread_condattr_destroy(&attr);
+    }
+
+    sim.width = (int)envDouble("HODR_SIM_WIDTH", 1024);
+    sim.readoutTime = (float)envDouble("HODR_SIM_READOUT_MS", 1.0) / 1000.0f;
+    sim.bufferImages = (long)envDouble("HODR_SIM_BUFFER", 256);
+    sim.peakRate = (float)envDouble("HODR_SIM_PEAK_RATE", 300000);
+    sim.coolTau = (float)envDouble("HODR_SIM_COOL_TAU", 20);
+    sim.rng = 0x9E3779B97F4A7C15ULL ^ (uint64_t)time(NULL);
+
+    free(sim.buffer);
+    sim.buffer = calloc((size_t)sim.bufferImages * sim.width, sizeof(at_32));
+    if (sim.buffer == NULL)
+    {
+        pthread_mutex_unlock(&sim.mutex);
+        return DRV_ERROR_ACK;
+    }
+    simBuildProfile();
+
+    sim.acquisitionMode = 1;
+    sim.numberAccumulations = 1;
+    sim.numberKinetics = 1;
+    sim.exposureTime = 0.01f;
+    sim.kineticCycleTime = 0;
+    sim.totalImages = sim.lastRetrieved = sim.lastWaited = 0;
+    sim.lastTemperatureUpdate = simNow();
+    sim.initialized = true;
+    printf("Simulated Andor camera: %d pixels, %.3f ms readout, %ld image buffer\n",
+           sim.width, sim.readoutTime * 1000.0f, sim.bufferImages);
+    pthread_mutex_unlock(&sim.mutex);
+    return DRV_SUCCESS;
+}
+
+unsigned int ShutDown(void)
+{
+    pthread_mutex_lock(&sim.mutex);
+    simJoinFrameThread();
+    sim.acquiring = false;
+    sim.coolerOn = false;
+    sim.initialized = false;
+    free(sim.buffer);
+    sim.buffer = NULL;
+    free(sim.profile);
+    sim.profile = NULL;
+    pthread_cond_broadcast(&sim.frameCond);
+    pthread_mutex_unlock(&sim.mutex);
+    return DRV_SUCCESS;
+}
+
+unsigned int GetDetector(int *xpixels, int *ypixels)
+{
+    if (!sim.initialized)
+    {
+        return DRV_NOT_INITIALIZED;
+    }
+    *xpixels = sim.width;
+    *ypixels = 1;
+    return DRV_SUCCESS;
+}
+
+unsigned int CoolerON(void)
+{
+    pthread_mutex_lock(&sim.mutex);
+    simUpdateTemperature();
+    sim.coolerOn = true;
+    pthread_mutex_unlock(&sim.mutex);
+    return sim.initialized ? DRV_SUCCESS : DRV_NOT_INITIALIZED;
+}
+
+unsigned int CoolerOFF(void)
+{
+    pthread_mutex_lock(&sim.mutex);
+    simUpdateTemperature();
+    sim.coolerOn = false;
+    pthread_mutex_unlock(&sim.mutex);
+    return sim.initialized ? DRV_SUCCESS : DRV_NOT_INITIALIZED;
+}
+
+unsigned int GetTemperature(int *temperature)
+{
+    if (!sim.initialized)
+    {
+        return DRV_NOT_INITIALIZED;
+    }
+    pthread_mutex_lock(&sim.mutex);
+    simUpdateTemperature();
+    *temperature = (int)lroundf(sim.temperature);
+    unsigned int status = simTemperatureStatus();
+    pthread_mutex_unlock(&sim.mutex);
+    return status;
+}
+
+unsigned int GetTemperatureF(float *temperature)
+{
+    if (!sim.initialized)
+    {
+        return DRV_NOT_INITIALIZED;
+    }
+    pthread_mutex_lock(&sim.mutex);
+    simUpdateTemperature();
+    *temperature = sim.temperature;
+    unsigned int status = simTemperatureStatus();
+    pthread_mutex_unlock(&sim.mutex);
+    return status;
+}
+
+unsigned int GetTemperatureStatus(float *SensorTemp, float *TargetTemp, float *AmbientTemp, float *CoolerVolts)
+{
+    if (!sim.initialized)
+    {
+        return DRV_NOT_INITIALIZED;
+    }
+    pthread_mutex_lock(&sim.mutex);
+    simUpdateTemperature();
+    *SensorTemp = sim.temperature;
+    *TargetTemp = (float)sim.targetTemperature;
+    *AmbientTemp = SIM_AMBIENT_TEMPERATURE;
+    *CoolerVolts = sim.coolerOn ? 0.1f * (SIM_AMBIENT_TEMPERATURE - sim.temperature) : 0.0f;
+    pthread_mutex_unlock(&sim.mutex);
+    return DRV_SUCCESS;
+}
+
+unsigned int GetTemperatureRange(int *mintemp, int *maxtemp)
+{
+    *mintemp = SIM_MIN_TEMPERATURE;
+    *maxtemp = SIM_MAX_TEMPERATURE;
+    return sim.initialized ? DRV_SUCCESS : DRV_NOT_INITIALIZED;
+}
+
+unsigned int SetTemperature(int temperature)
+{
+    if (temperature < SIM_MIN_TEMPERATURE || temperature > SIM_MAX_TEMPERATURE)
+    {
+        return DRV_P1INVALID;
+    }
+    pthread_mutex_lock(&sim.mutex);
+    simUpdateTemperature();
+    sim.targetTemperature = temperature;
+    sim.stableSince = 0;
+    pthread_mutex_unlock(&sim.mutex);
+    return DRV_SUCCESS;
+}
+
+// Setters that are only valid while the camera is idle
+#define SIM_SET_WHEN_IDLE(field, value, valid)  \
+    do                                          \
+    {                                           \
+        if (!sim.initialized)                   \
+            return DRV_NOT_INITIALIZED;         \
+        if (!(valid))                           \
+            return DRV_P1INVALID;               \
+        pthread_mutex_lock(&sim.mutex);         \
+        if (sim.acquiring)                      \
+        {                                       \
+            pthread_mutex_unlock(&sim.mutex);   \
+            return DRV_ACQUIRING;               \
+        }                                       \
+        sim.field = (value);                    \
+        pthread_mutex_unlock(&sim.mutex);       \
+        return DRV_SUCCESS;                     \
+    } while (0)
+
+unsigned int SetAcquisitionMode(int mode)
+{
+    SIM_SET_WHEN_IDLE(acquisitionMode, mode, mode >= 1 && mode <= 5 && mode != 4);
+}
+
+unsigned int SetReadMode(int mode)
+{
+    SIM_SET_WHEN_IDLE(readMode, mode, mode >= 0 && mode <= 4);
+}
+
+unsigned int SetShutter(int typ, int mode, int closingtime, int openingtime)
+{
+    (void)typ;
+    (void)closingtime;
+    (void)openingtime;
+    pthread_mutex_lock(&sim.mutex);
+    sim.shutterClosed = mode == 2; // Permanently closed
+    unsigned int result = sim.initialized ? DRV_SUCCESS : DRV_NOT_INITIALIZED;
+    pthread_mutex_unlock(&sim.mutex);
+    return result;
+}
+
+unsigned int SetNumberAccumulations(int number)
+{
+    SIM_SET_WHEN_IDLE(numberAccumulations, number, number >= 1);
+}
+
+unsigned int SetNumberKinetics(int number)
+{
+    SIM_SET_WHEN_IDLE(numberKinetics, number, number >= 1);
+}
+
+unsigned int SetKineticCycleTime(float time)
+{
+    SIM_SET_WHEN_IDLE(kineticCycleTime, time, time >= 0);
+}
+
+unsigned int SetExposureTime(float time)
+{
+    SIM_SET_WHEN_IDLE(exposureTime, time, time >= 0);
+}
+
+unsigned int GetAcquisitionTimings(float *exposure, float *accumulate, float *kinetic)
+{
+    if (!sim.initialized)
+    {
+        return DRV_NOT_INITIALIZED;
+    }
+    pthread_mutex_lock(&sim.mutex);
+    *exposure = sim.exposureTime;
+    *accumulate = sim.exposureTime + sim.readoutTime;
+    *kinetic = simCycleTime();
+    pthread_mutex_unlock(&sim.mutex);
+    return DRV_SUCCESS;
+}
+
+unsigned int StartAcquisition(void)
+{
+    if (!sim.initialized)
+    {
+        return DRV_NOT_INITIALIZED;
+    }
+    pthread_mutex_lock(&sim.mutex);
+    if (sim.acquiring)
+    {
+        pthread_mutex_unlock(&sim.mutex);
+        return DRV_ACQUIRING;
+    }
+    simJoinFrameThread(); // Reap the thread of the previous, completed acquisition
+
+    sim.totalImages = sim.lastRetrieved = sim.lastWaited = 0;
+    sim.acquiring = true;
+    if (pthread_create(&sim.frameThread, NULL, simFrameThread, NULL) != 0)
+    {
+        sim.acquiring = false;
+        pthread_mutex_unlock(&sim.mutex);
+        return DRV_ERROR_ACK;
+    }
+    sim.frameThreadRunning = true;
+    pthread_mutex_unlock(&sim.mutex);
+    return DRV_SUCCESS;
+}
+
+unsigned int AbortAcquisition(void)
+{
+    if (!sim.initialized)
+    {
+        return DRV_NOT_INITIALIZED;
+    }
+    pthread_mutex_lock(&sim.mutex);
+    if (!sim.acquiring)
+    {
+        simJoinFrameThread();
+        pthread_mutex_unlock(&sim.mutex);
+        return DRV_IDLE;
+    }
+    simJoinFrameThread();
+    sim.acquiring = false;
+    pthread_mutex_unlock(&sim.mutex);
+    return DRV_SUCCESS;
+}
+
+unsigned int GetStatus(int *status)
+{
+    if (!sim.initialized)
+    {
+        return DRV_NOT_INITIALIZED;
+    }
+    pthread_mutex_lock(&sim.mutex);
+    *status = sim.acquiring ? DRV_ACQUIRING : DRV_IDLE;
+    pthread_mutex_unlock(&sim.mutex);
+    return DRV_SUCCESS;
+}
+
+unsigned int WaitForAcquisition(void)
+{
+    pthread_mutex_lock(&sim.mutex);
+    while (sim.initialized && !sim.cancelWait && sim.totalImages <= sim.lastWaited)
+    {
+        pthread_cond_wait(&sim.frameCond, &sim.mutex);
+    }
+
+    unsigned int result = DRV_SUCCESS;
+    if (!sim.initialized || sim.cancelWait)
+    {
+        result = DRV_NO_NEW_DATA;
+    }
+    else
+    {
+        sim.lastWaited = sim.totalImages;
+    }
+    sim.cancelWait = false;
+    pthread_mutex_unlock(&sim.mutex);
+    return result;
+}
+
+unsigned int CancelWait(void)
+{
+    pthread_mutex_lock(&sim.mutex);
+    sim.cancelWait = true;
+    pthread_cond_broadcast(&sim.frameCond);
+    pthread_mutex_unlock(&sim.mutex);
+    return DRV_SUCCESS;
+}
+
+// Oldest image index still held in the circular buffer. Called with the mutex held.
+static long simOldestImage()
+{
+    long oldest = sim.totalImages - sim.bufferImages + 1;
+    return oldest < 1 ? 1 : oldest;
+}
+
+static void simCopyImage(long index, at_32 *dest)
+{
+    long slot = (index - 1) % sim.bufferImages;
+    memcpy(dest, sim.buffer + slot * sim.width, sizeof(at_32) * sim.width);
+}
+
+unsigned int GetAcquiredData(at_32 *arr, at_u32 size)
+{
+    if (!sim.initialized)
+    {
+        return DRV_NOT_INITIALIZED;
+    }
+    pthread_mutex_lock(&sim.mutex);
+    unsigned int result = DRV_SUCCESS;
+    long first = simOldestImage();
+    long count = sim.totalImages - first + 1;
+    if (sim.acquiring)
+    {
+        result = DRV_ACQUIRING;
+    }
+    else if (sim.totalImages == 0)
+    {
+        result = DRV_NO_NEW_DATA;
+    }
+    else if ((long)size < count * sim.width)
+    {
+        result = DRV_P2INVALID;
+    }
+    else
+    {
+        for (long i = 0; i < count; i++)
+        {
+            simCopyImage(first + i, arr + i * sim.width);
+        }
+    }
+    pthread_mutex_unlock(&sim.mutex);
+    return result;
+}
+
+unsigned int GetMostRecentImage(at_32 *arr, at_u32 size)
+{
+    if (!sim.initialized)
+    {
+        return DRV_NOT_INITIALIZED;
+    }
+    if ((long)size < sim.width)
+    {
+        return DRV_P2INVALID;
+    }
+    pthread_mutex_lock(&sim.mutex);
+    unsigned int result = DRV_NO_NEW_DATA;
+    if (sim.totalImages > 0)
+    {
+        simCopyImage(sim.totalImages, arr);
+        result = DRV_SUCCESS;
+    }
+    pthread_mutex_unlock(&sim.mutex);
+    return result;
+}
+
+unsigned int GetNumberNewImages(long *first, long *last)
+{
+    if (!sim.initialized)
+    {
+        return DRV_NOT_INITIALIZED;
+    }
+    pthread_mutex_lock(&sim.mutex);
+    unsigned int result = DRV_NO_NEW_DATA;
+    if (sim.totalImages > sim.lastRetrieved)
+    {
+        long oldest = simOldestImage();
+        *first = sim.lastRetrieved + 1 > oldest ? sim.lastRetrieved + 1 : oldest;
+        *last = sim.totalImages;
+        result = DRV_SUCCESS;
+    }
+    pthread_mutex_unlock(&sim.mutex);
+    return result;
+}
+
+unsigned int GetImages(long first, long last, at_32 *arr, at_u32 size, long *validfirst, long *validlast)
+{
+    if (!sim.initialized)
+    {
+        return DRV_NOT_INITIALIZED;
+    }
+    pthread_mutex_lock(&sim.mutex);
+    unsigned int result = DRV_SUCCESS;
+    long oldest = simOldestImage();
+    if (sim.totalImages == 0 || last < first)
+    {
+        result = DRV_NO_NEW_DATA;
+    }
+    else if (first < oldest || first > sim.totalImages)
+    {
+        result = DRV_P1INVALID;
+    }
+    else if (last > sim.totalImages)
+    {
+        result = DRV_P2INVALID;
+    }
+    else if ((long)size != (last - first + 1) * sim.width)
+    {
+        result = DRV_P4INVALID;
+    }
+    else
+    {
+        for (long i = first; i <= last; i++)
+        {
+            simCopyImage(i, arr + (i - first) * sim.width);
+        }
+        *validfirst = first;
+        *validlast = last;
+        if (last > sim.lastRetrieved)
+        {
+            sim.lastRetrieved = last;
+        }
+    }
+    pthread_mutex_unlock(&sim.mutex);
+    return result;
+}
+
+unsigned int GetTotalNumberImagesAcquired(long *index)
+{
+    if (!sim.initialized)
+    {
+        return DRV_NOT_INITIALIZED;
+    }
+    pthread_mutex_lock(&sim.mutex);
+    *index = sim.totalImages;
+    pthread_mutex_unlock(&sim.mutex);
+    return DRV_SUCCESS;
+}
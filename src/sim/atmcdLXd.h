@@ -0,0 +1,70 @@
+#pragma once
+
+// Simulated stand-in for the Andor SDK header. Only the subset of the SDK
+// used by HODR is declared here; the return codes match the real SDK so the
+// rest of the daemon can be built unchanged against andor_sim.c.
+
+#if defined(__LP64__)
+typedef int at_32;
+typedef unsigned int at_u32;
+#else
+typedef long at_32;
+typedef unsigned long at_u32;
+#endif
+
+#define DRV_ERROR_CODES 20001
+#define DRV_SUCCESS 20002
+#define DRV_VXDNOTINSTALLED 20003
+#define DRV_ERROR_ACK 20013
+#define DRV_NO_NEW_DATA 20024
+#define DRV_SPOOLERROR 20026
+#define DRV_TEMP_CODES 20033
+#define DRV_TEMP_OFF 20034
+#define DRV_TEMP_NOT_STABILIZED 20035
+#define DRV_TEMP_STABILIZED 20036
+#define DRV_TEMP_NOT_REACHED 20037
+#define DRV_TEMP_OUT_RANGE 20038
+#define DRV_TEMP_NOT_SUPPORTED 20039
+#define DRV_TEMP_DRIFT 20040
+#define DRV_P1INVALID 20066
+#define DRV_P2INVALID 20067
+#define DRV_P3INVALID 20068
+#define DRV_P4INVALID 20069
+#define DRV_INIERROR 20070
+#define DRV_ACQUIRING 20072
+#define DRV_IDLE 20073
+#define DRV_TEMPCYCLE 20074
+#define DRV_NOT_INITIALIZED 20075
+
+unsigned int Initialize(char *dir);
+unsigned int ShutDown(void);
+unsigned int GetDetector(int *xpixels, int *ypixels);
+
+unsigned int CoolerON(void);
+unsigned int CoolerOFF(void);
+unsigned int GetTemperature(int *temperature);
+unsigned int GetTemperatureF(float *temperature);
+unsigned int GetTemperatureStatus(float *SensorTemp, float *TargetTemp, float *AmbientTemp, float *CoolerVolts);
+unsigned int GetTemperatureRange(int *mintemp, int *maxtemp);
+unsigned int SetTemperature(int temperature);
+
+unsigned int SetAcquisitionMode(int mode);
+unsigned int SetReadMode(int mode);
+unsigned int SetShutter(int typ, int mode, int closingtime, int openingtime);
+unsigned int SetNumberAccumulations(int number);
+unsigned int SetNumberKinetics(int number);
+unsigned int SetKineticCycleTime(float time);
+unsigned int SetExposureTime(float time);
+unsigned int GetAcquisitionTimings(float *exposure, float *accumulate, float *kinetic);
+
+unsigned int StartAcquisition(void);
+unsigned int AbortAcquisition(void);
+unsigned int GetStatus(int *status);
+unsigned int WaitForAcquisition(void);
+unsigned int CancelWait(void);
+
+unsigned int GetAcquiredData(at_32 *arr, at_u32 size);
+unsigned int GetMostRecentImage(at_32 *arr, at_u32 size);
+unsigned int GetNumberNewImages(long *first, long *last);
+unsigned int GetImages(long first, long last, at_32 *arr, at_u32 size, long *validfirst, long *validlast);
+unsigned int GetTotalNumberImagesAcquired(long *index);
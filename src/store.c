@@ -0,0 +1,1036 @@
+#include "store.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <stddef.h>
+
+static uint32_t crcTable[256];
+static pthread_once_t crcTableOnce = PTHREAD_ONCE_INIT;
+
+static void buildCrcTable()
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+        {
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        crcTable[i] = c;
+    }
+}
+
+uint32_t store_crc32(uint32_t crc, const void *data, size_t size)
+{
+    pthread_once(&crcTableOnce, buildCrcTable);
+    const uint8_t *bytes = data;
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++)
+    {
+        crc = crcTable[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+int store_readFileHeader(int fd, HODR_FileHeader_t *header)
+{
+    ssize_t n = pread(fd, header, sizeof(*header), 0);
+    if (n != (ssize_t)sizeof(*header) || memcmp(header->magic, HODR_STORE_MAGIC, sizeof(header->magic)) != 0)
+    {
+        return -1; // Not a spectrum store
+    }
+    if (header->version > HODR_STORE_VERSION)
+    {
+        log_error("Unsupported data file version %u", header->version);
+        return -1;
+    }
+    return 0;
+}
+
+// Open a data file for appending, writing the file header with flags if it
+// is new. An existing file keeps its own flags. Returns the file descriptor or
+// -1 on error.
+int store_openDataFile(const char *path, uint32_t xpixels, uint32_t flags)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        log_error("Error opening data file %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    if (st.st_size == 0)
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+
+        HODR_FileHeader_t header = {0};
+        memcpy(header.magic, HODR_STORE_MAGIC, sizeof(header.magic));
+        header.version = flags & HODR_FILE_PACKED ? HODR_STORE_VERSION : 1; // Readers that predate packing can still read the rest
+        header.headerSize = sizeof(HODR_FileHeader_t);
+        header.xpixels = xpixels;
+        header.flags = flags;
+        header.createdNs = (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+        if (write(fd, &header, sizeof(header)) != (ssize_t)sizeof(header))
+        {
+            log_error("Error writing header to %s: %s", path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    HODR_FileHeader_t header;
+    if (store_readFileHeader(fd, &header) != 0)
+    {
+        log_error("%s is not a HODR data file.", path);
+        close(fd);
+        return -1;
+    }
+    if (header.xpixels != xpixels)
+    {
+        log_error("Data file %s was created for %u pixels, detector has %u.", path, header.xpixels, xpixels);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Encode pixels into payload, which must hold npixels * sizeof(int32_t) bytes.
+// Fills in the encoding, size and checksum fields of header and returns the payload size.
+size_t store_encodeSpectrum(HODR_RecordHeader_t *header, void *payload, const int32_t *data, size_t npixels)
+{
+    bool fits16 = true;
+    for (size_t i = 0; i < npixels; i++)
+    {
+        if ((uint32_t)data[i] > UINT16_MAX)
+        {
+            fits16 = false;
+            break;
+        }
+    }
+
+    size_t payloadBytes;
+    if (fits16)
+    {
+        uint16_t *out = payload;
+        for (size_t i = 0; i < npixels; i++)
+        {
+            out[i] = (uint16_t)data[i];
+        }
+        header->encoding = HODR_ENCODING_UINT16;
+        payloadBytes = npixels * sizeof(uint16_t);
+    }
+    else
+    {
+        memcpy(payload, data, npixels * sizeof(int32_t));
+        header->encoding = HODR_ENCODING_INT32;
+        payloadBytes = npixels * sizeof(int32_t);
+    }
+
+    header->magic = HODR_RECORD_MAGIC;
+    header->npixels = (uint32_t)npixels;
+    header->payloadBytes = (uint32_t)payloadBytes;
+    header->checksum = store_crc32(0, payload, payloadBytes);
+    return payloadBytes;
+}
+
+// Encode pixels with the spectrum codec into payload, which must hold
+// CODEC_MAX_BYTES(npixels). Same contract as store_encodeSpectrum.
+size_t store_encodePacked(HODR_RecordHeader_t *header, void *payload, const int32_t *data, size_t npixels)
+{
+    size_t payloadBytes = codec_encode(payload, data, npixels);
+    header->magic = HODR_RECORD_MAGIC;
+    header->encoding = HODR_ENCODING_PACKED;
+    header->npixels = (uint32_t)npixels;
+    header->payloadBytes = (uint32_t)payloadBytes;
+    header->checksum = store_crc32(0, payload, payloadBytes);
+    return payloadBytes;
+}
+
+// Fill in a gap marker for missingFrames lost before spectrumID. Returns the payload size.
+size_t store_encodeGap(HODR_RecordHeader_t *header, HODR_GapPayload_t *payload, uint32_t spectrumID, int64_t timestampNs, uint64_t missingFrames)
+{
+    memset(header, 0, sizeof(*header));
+    payload->missingFrames = missingFrames;
+    header->magic = HODR_RECORD_MAGIC;
+    header->spectrumID = spectrumID;
+    header->timestampNs = timestampNs;
+    header->flags = HODR_RECORD_GAP;
+    header->payloadBytes = sizeof(*payload);
+    header->checksum = store_crc32(0, payload, sizeof(*payload));
+    return sizeof(*payload);
+}
+
+static size_t appendPayload(HODR_RecordHeader_t *header, void *payload, const void *data, size_t size, uint8_t flag)
+{
+    char *end = (char *)payload + header->payloadBytes;
+    memcpy(end, data, size);
+    header->checksum = store_crc32(header->checksum, end, size);
+    header->payloadBytes += (uint32_t)size;
+    header->flags |= flag;
+    return header->payloadBytes;
+}
+
+// Append the noise estimate of a co-added spectrum to a payload filled in by
+// store_encodeSpectrum, which must have room for npixels more floats. Updates
+// the size and checksum fields of header and returns the new payload size.
+size_t store_appendNoise(HODR_RecordHeader_t *header, void *payload, const float *noise, size_t npixels)
+{
+    return appendPayload(header, payload, noise, npixels * sizeof(float), HODR_RECORD_COADDED);
+}
+
+// Append the uncorrected pixels of a corrected spectrum, after any noise
+// estimate. Same contract as store_appendNoise.
+size_t store_appendRaw(HODR_RecordHeader_t *header, void *payload, const int32_t *raw, size_t npixels)
+{
+    return appendPayload(header, payload, raw, npixels * sizeof(int32_t), HODR_RECORD_WITH_RAW);
+}
+
+// Append a spectrum resampled to grid, after everything else, with room for
+// HODR_RECORD_MAX_PAYLOAD bytes in all. Same contract as store_appendNoise.
+size_t store_appendResampled(HODR_RecordHeader_t *header, void *payload, const HODR_GridHeader_t *grid, const float *values)
+{
+    appendPayload(header, payload, grid, sizeof(*grid), HODR_RECORD_RESAMPLED);
+    return appendPayload(header, payload, values, grid->points * sizeof(float), HODR_RECORD_RESAMPLED);
+}
+
+// Check that the sizes a record header gives agree: the payload holds at
+// least the pixels of its encoding and at most what a record of npixels can
+// have, a gap marker's holds its HODR_GapPayload_t. The checksum only covers
+// the payload, so this is what keeps a damaged header from being read past
+// its payload. Returns 0 or -1 if the header is inconsistent.
+int store_checkRecord(const HODR_RecordHeader_t *header)
+{
+    if (header->flags & HODR_RECORD_GAP)
+    {
+        return header->payloadBytes == sizeof(HODR_GapPayload_t) ? 0 : -1;
+    }
+    size_t pixelBytes;
+    switch (header->encoding)
+    {
+    case HODR_ENCODING_INT32:
+        pixelBytes = (size_t)header->npixels * sizeof(int32_t);
+        break;
+    case HODR_ENCODING_UINT16:
+        pixelBytes = (size_t)header->npixels * sizeof(uint16_t);
+        break;
+    case HODR_ENCODING_PACKED:
+        pixelBytes = CODEC_BLOCKS(header->npixels); // The bit widths, codec_decode() checks the rest
+        break;
+    default:
+        return -1;
+    }
+    return header->payloadBytes >= pixelBytes && header->payloadBytes <= HODR_RECORD_MAX_PAYLOAD(header->npixels) ? 0 : -1;
+}
+
+// Decode a record payload into int32 pixels. Returns the number of pixels or -1 on error.
+int store_decodePayload(const HODR_RecordHeader_t *header, const void *payload, int32_t *data, size_t maxPixels)
+{
+    if (header->npixels > maxPixels || store_checkRecord(header) != 0)
+    {
+        return -1;
+    }
+    switch (header->encoding)
+    {
+    case HODR_ENCODING_INT32:
+        memcpy(data, payload, header->npixels * sizeof(int32_t));
+        break;
+    case HODR_ENCODING_UINT16:
+    {
+        const uint16_t *in = payload;
+        for (uint32_t i = 0; i < header->npixels; i++)
+        {
+            data[i] = in[i];
+        }
+        break;
+    }
+    case HODR_ENCODING_PACKED:
+        if (codec_decode(data, header->npixels, payload, header->payloadBytes) < 0)
+        {
+            log_warnEvery(1000, "Corrupt packed spectrum %u", header->spectrumID);
+            return -1;
+        }
+        break;
+    default:
+        log_warnEvery(1000, "Unknown spectrum encoding %u", header->encoding);
+        return -1;
+    }
+    return (int)header->npixels;
+}
+
+// Offset of the optional section flag in a record payload: after the pixels
+// and whichever of the sections before it the record has. -1 if the pixels
+// are corrupt.
+static ssize_t sectionOffset(const HODR_RecordHeader_t *header, const void *payload, uint8_t flag)
+{
+    ssize_t offset;
+    switch (header->encoding)
+    {
+    case HODR_ENCODING_PACKED:
+        offset = codec_size(payload, header->payloadBytes, header->npixels);
+        break;
+    case HODR_ENCODING_UINT16:
+        offset = (ssize_t)(header->npixels * sizeof(uint16_t));
+        break;
+    default:
+        offset = (ssize_t)(header->npixels * sizeof(int32_t));
+        break;
+    }
+    if (offset < 0)
+    {
+        return -1;
+    }
+    if (flag != HODR_RECORD_COADDED && (header->flags & HODR_RECORD_COADDED))
+    {
+        offset += (ssize_t)(header->npixels * sizeof(float));
+    }
+    if (flag == HODR_RECORD_RESAMPLED && (header->flags & HODR_RECORD_WITH_RAW))
+    {
+        offset += (ssize_t)(header->npixels * sizeof(int32_t));
+    }
+    return offset;
+}
+
+// Decode the noise estimate of a co-added record. Returns the number of
+// pixels, 0 if the record has no noise estimate, or -1 on error.
+int store_decodeNoise(const HODR_RecordHeader_t *header, const void *payload, float *noise, size_t maxPixels)
+{
+    if (!(header->flags & HODR_RECORD_COADDED))
+    {
+        return 0;
+    }
+    ssize_t offset = sectionOffset(header, payload, HODR_RECORD_COADDED);
+    size_t noiseBytes = header->npixels * sizeof(float);
+    if (offset < 0 || header->npixels > maxPixels || header->payloadBytes < (size_t)offset + noiseBytes)
+    {
+        return -1;
+    }
+    memcpy(noise, (const char *)payload + offset, noiseBytes);
+    return (int)header->npixels;
+}
+
+// Decode the uncorrected pixels kept with a corrected record. Returns the
+// number of pixels, 0 if the record has none, or -1 on error.
+int store_decodeRaw(const HODR_RecordHeader_t *header, const void *payload, int32_t *raw, size_t maxPixels)
+{
+    if (!(header->flags & HODR_RECORD_WITH_RAW))
+    {
+        return 0;
+    }
+    ssize_t offset = sectionOffset(header, payload, HODR_RECORD_WITH_RAW);
+    size_t rawBytes = header->npixels * sizeof(int32_t);
+    if (offset < 0 || header->npixels > maxPixels || header->payloadBytes < (size_t)offset + rawBytes)
+    {
+        return -1;
+    }
+    memcpy(raw, (const char *)payload + offset, rawBytes);
+    return (int)header->npixels;
+}
+
+// Decode the resampled spectrum of a record into grid and values. Returns the
+// number of grid points, 0 if the record has none, or -1 on error.
+int store_decodeResampled(const HODR_RecordHeader_t *header, const void *payload, HODR_GridHeader_t *grid, float *values, size_t maxPoints)
+{
+    if (!(header->flags & HODR_RECORD_RESAMPLED))
+    {
+        return 0;
+    }
+    ssize_t offset = sectionOffset(header, payload, HODR_RECORD_RESAMPLED);
+    if (offset < 0 || header->payloadBytes < (size_t)offset + sizeof(*grid))
+    {
+        return -1;
+    }
+    memcpy(grid, (const char *)payload + offset, sizeof(*grid));
+    size_t valueBytes = grid->points * sizeof(float);
+    if (grid->points > maxPoints || header->payloadBytes < (size_t)offset + sizeof(*grid) + valueBytes)
+    {
+        return -1;
+    }
+    memcpy(values, (const char *)payload + offset + sizeof(*grid), valueBytes);
+    return (int)grid->points;
+}
+
+// Append one spectrum to an open data file. The caller fills in the spectrum
+// ID, timestamp, exposure, temperature and flags of header. Returns the
+// offset of the new record or -1 on error.
+off_t store_appendSpectrum(int fd, HODR_RecordHeader_t *header, const int32_t *data, size_t npixels)
+{
+    off_t offset = lseek(fd, 0, SEEK_END); // Appends land at the end, the caller serialises writers
+    void *payload = malloc(npixels * sizeof(int32_t));
+    if (offset < 0 || payload == NULL)
+    {
+        free(payload);
+        return -1;
+    }
+    size_t payloadBytes = store_encodeSpectrum(header, payload, data, npixels);
+
+    struct iovec iov[2] = {
+        {.iov_base = header, .iov_len = sizeof(*header)},
+        {.iov_base = payload, .iov_len = payloadBytes},
+    };
+    ssize_t expected = (ssize_t)(sizeof(*header) + payloadBytes);
+    ssize_t written = writev(fd, iov, 2);
+    free(payload);
+    if (written != expected)
+    {
+        log_error("Error appending spectrum %u: %s", header->spectrumID, written < 0 ? strerror(errno) : "short write");
+        return -1;
+    }
+    return offset;
+}
+
+int store_readRecordHeader(int fd, off_t offset, HODR_RecordHeader_t *header)
+{
+    if (pread(fd, header, sizeof(*header), offset) != (ssize_t)sizeof(*header))
+    {
+        return -1;
+    }
+    if (header->magic != HODR_RECORD_MAGIC || store_checkRecord(header) != 0)
+    {
+        log_warnEvery(1000, "Corrupt record header at offset %lld", (long long)offset);
+        return -1;
+    }
+    return 0;
+}
+
+// Read and decode the record at offset. Returns the number of pixels or -1 on error.
+int store_readSpectrum(int fd, off_t offset, HODR_RecordHeader_t *header, int32_t *data, size_t maxPixels)
+{
+    if (store_readRecordHeader(fd, offset, header) != 0 || header->npixels > maxPixels)
+    {
+        return -1; // Checked before the payload is allocated
+    }
+    void *payload = malloc(header->payloadBytes);
+    if (payload == NULL)
+    {
+        return -1;
+    }
+    ssize_t n = pread(fd, payload, header->payloadBytes, offset + (off_t)sizeof(*header));
+    int result = -1;
+    if (n == (ssize_t)header->payloadBytes && store_crc32(0, payload, header->payloadBytes) == header->checksum)
+    {
+        result = store_decodePayload(header, payload, data, maxPixels);
+    }
+    else
+    {
+        log_warnEvery(1000, "Truncated or corrupt spectrum %u at offset %lld", header->spectrumID, (long long)offset);
+    }
+    free(payload);
+    return result;
+}
+
+// Walk the record headers of a data file. Returns the number of complete
+// spectra, the offset of the last record and the offset just past it. Gap
+// markers are skipped.
+long store_countRecords(int fd, off_t *lastRecord, off_t *endOffset)
+{
+    HODR_FileHeader_t fileHeader;
+    if (store_readFileHeader(fd, &fileHeader) != 0)
+    {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        return -1;
+    }
+
+    long count = 0;
+    off_t offset = fileHeader.headerSize;
+    off_t last = -1;
+    HODR_RecordHeader_t header;
+    while (offset + (off_t)sizeof(header) <= st.st_size && store_readRecordHeader(fd, offset, &header) == 0)
+    {
+        off_t next = offset + (off_t)sizeof(header) + header.payloadBytes;
+        if (next > st.st_size)
+        {
+            break; // Partially written record
+        }
+        last = offset;
+        offset = next;
+        if (!(header.flags & HODR_RECORD_GAP))
+        {
+            count++;
+        }
+    }
+
+    if (lastRecord)
+    {
+        *lastRecord = last;
+    }
+    if (endOffset)
+    {
+        *endOffset = offset;
+    }
+    return count;
+}
+
+void store_indexPath(const char *dataPath, char *buffer, size_t bufferSize)
+{
+    snprintf(buffer, bufferSize, "%s.idx", dataPath);
+}
+
+// Open or create the index sidecar of a data file. Returns the file descriptor or -1 on error.
+int store_openIndex(const char *path, uint32_t firstSpectrumID)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        log_error("Error opening index %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    HODR_IndexHeader_t header;
+    ssize_t n = pread(fd, &header, sizeof(header), 0);
+    if (n == (ssize_t)sizeof(header) && memcmp(header.magic, HODR_INDEX_MAGIC, sizeof(header.magic)) == 0 &&
+        header.entrySize == sizeof(HODR_IndexEntry_t))
+    {
+        return fd;
+    }
+
+    // New or unreadable index, start it again. store_rebuildIndex fills it from the data file.
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, HODR_INDEX_MAGIC, sizeof(header.magic));
+    header.version = HODR_INDEX_VERSION;
+    header.entrySize = sizeof(HODR_IndexEntry_t);
+    header.firstSpectrumID = firstSpectrumID;
+    if (ftruncate(fd, 0) != 0 || pwrite(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header))
+    {
+        log_error("Error writing index header to %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int store_readIndexHeader(int indexFd, HODR_IndexHeader_t *header)
+{
+    if (pread(indexFd, header, sizeof(*header), 0) != (ssize_t)sizeof(*header) ||
+        memcmp(header->magic, HODR_INDEX_MAGIC, sizeof(header->magic)) != 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+// Number of complete entries in an index
+long store_indexCount(int indexFd)
+{
+    struct stat st;
+    if (fstat(indexFd, &st) != 0 || st.st_size < (off_t)sizeof(HODR_IndexHeader_t))
+    {
+        return -1;
+    }
+    return (long)((st.st_size - sizeof(HODR_IndexHeader_t)) / sizeof(HODR_IndexEntry_t));
+}
+
+int store_appendIndex(int indexFd, off_t offset, int64_t timestampNs)
+{
+    long count = store_indexCount(indexFd);
+    if (count < 0)
+    {
+        return -1;
+    }
+    HODR_IndexEntry_t entry = {.offset = (uint64_t)offset, .timestampNs = timestampNs};
+    off_t position = (off_t)(sizeof(HODR_IndexHeader_t) + (size_t)count * sizeof(entry));
+    if (pwrite(indexFd, &entry, sizeof(entry), position) != (ssize_t)sizeof(entry))
+    {
+        log_errorEvery(1000, "Error appending index entry: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Find the index entry of a spectrum with a single read. Returns -1 if the
+// spectrum is not in this index.
+int store_lookupIndex(int indexFd, uint32_t spectrumID, HODR_IndexEntry_t *entry)
+{
+    HODR_IndexHeader_t header;
+    if (pread(indexFd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) || spectrumID < header.firstSpectrumID)
+    {
+        return -1;
+    }
+    off_t position = (off_t)(sizeof(header) + (size_t)(spectrumID - header.firstSpectrumID) * sizeof(*entry));
+    if (pread(indexFd, entry, sizeof(*entry), position) != (ssize_t)sizeof(*entry))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+// First spectrum ID taken at or after timestampNs, one past the last indexed
+// spectrum if there is none, by binary search of the index. Spectra are
+// indexed in capture order. Returns -1 on error.
+long store_findTime(int indexFd, int64_t timestampNs)
+{
+    HODR_IndexHeader_t header;
+    long high = store_indexCount(indexFd);
+    if (high < 0 || pread(indexFd, &header, sizeof(header), 0) != (ssize_t)sizeof(header))
+    {
+        return -1;
+    }
+    long low = 0;
+    while (low < high)
+    {
+        long middle = low + (high - low) / 2;
+        HODR_IndexEntry_t entry;
+        off_t position = (off_t)(sizeof(header) + (size_t)middle * sizeof(entry));
+        if (pread(indexFd, &entry, sizeof(entry), position) != (ssize_t)sizeof(entry))
+        {
+            return -1;
+        }
+        if (entry.timestampNs < timestampNs)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return (long)header.firstSpectrumID + low;
+}
+
+// Read count consecutive spectra starting at firstID with one index read and
+// one data read. Spectrum n is decoded into data + n * npixels; shorter
+// spectra are zero padded. Returns the number of spectra read, which stops
+// early at the end of the index or at a corrupt record, or -1 on error.
+long store_readSpectra(int dataFd, int indexFd, uint32_t firstID, size_t count, HODR_RecordHeader_t *headers, int32_t *data, size_t npixels)
+{
+    HODR_IndexHeader_t indexHeader;
+    if (count == 0 || pread(indexFd, &indexHeader, sizeof(indexHeader), 0) != (ssize_t)sizeof(indexHeader) ||
+        firstID < indexHeader.firstSpectrumID)
+    {
+        return -1;
+    }
+
+    HODR_IndexEntry_t *entries = malloc(count * sizeof(*entries));
+    if (entries == NULL)
+    {
+        return -1;
+    }
+    off_t position = (off_t)(sizeof(indexHeader) + (size_t)(firstID - indexHeader.firstSpectrumID) * sizeof(*entries));
+    ssize_t n = pread(indexFd, entries, count * sizeof(*entries), position);
+    count = n > 0 ? (size_t)n / sizeof(*entries) : 0;
+    if (count == 0)
+    {
+        free(entries);
+        return -1;
+    }
+
+    // Records are stored in ID order, so the whole range is one span of the
+    // data file. The last record is at most a header and the largest payload
+    // a spectrum of npixels can have, each record before it that and a gap
+    // marker at most; wider apart entries are a corrupt index.
+    off_t start = (off_t)entries[0].offset;
+    size_t recordBytes = 2 * sizeof(HODR_RecordHeader_t) + sizeof(HODR_GapPayload_t) + HODR_RECORD_MAX_PAYLOAD(npixels);
+    if (entries[count - 1].offset < entries[0].offset || entries[count - 1].offset - entries[0].offset > (count - 1) * recordBytes)
+    {
+        log_warnEvery(1000, "Corrupt index entries for spectra %u to %zu", firstID, firstID + count - 1);
+        free(entries);
+        return -1;
+    }
+    size_t span = (size_t)((off_t)entries[count - 1].offset - start) + sizeof(HODR_RecordHeader_t) + HODR_RECORD_MAX_PAYLOAD(npixels);
+    char *buffer = malloc(span);
+    if (buffer == NULL)
+    {
+        free(entries);
+        return -1;
+    }
+    n = pread(dataFd, buffer, span, start);
+    size_t available = n > 0 ? (size_t)n : 0;
+
+    long result = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t at = (size_t)((off_t)entries[i].offset - start);
+        if (at + sizeof(HODR_RecordHeader_t) > available)
+        {
+            break;
+        }
+        HODR_RecordHeader_t *header = &headers[i];
+        memcpy(header, buffer + at, sizeof(*header));
+        const char *payload = buffer + at + sizeof(*header);
+        if (header->magic != HODR_RECORD_MAGIC || header->spectrumID != firstID + i ||
+            at + sizeof(*header) + header->payloadBytes > available ||
+            store_crc32(0, payload, header->payloadBytes) != header->checksum)
+        {
+            log_warnEvery(1000, "Truncated or corrupt spectrum %lu at offset %llu", (unsigned long)(firstID + i), (unsigned long long)entries[i].offset);
+            break;
+        }
+        int32_t *out = data + i * npixels;
+        int pixels = store_decodePayload(header, payload, out, npixels);
+        if (pixels < 0)
+        {
+            break;
+        }
+        memset(out + pixels, 0, (npixels - (size_t)pixels) * sizeof(int32_t));
+        result++;
+    }
+    free(buffer);
+    free(entries);
+    return result;
+}
+
+// Rebuild the entries of an index from the record headers of its data file.
+// Returns the number of entries written or -1 on error.
+long store_rebuildIndex(int dataFd, int indexFd)
+{
+    HODR_FileHeader_t fileHeader;
+    struct stat st;
+    if (store_readFileHeader(dataFd, &fileHeader) != 0 || fstat(dataFd, &st) != 0)
+    {
+        return -1;
+    }
+    if (ftruncate(indexFd, sizeof(HODR_IndexHeader_t)) != 0)
+    {
+        return -1;
+    }
+
+    HODR_RecordHeader_t header;
+    off_t offset = fileHeader.headerSize;
+    long count = 0;
+    bool first = true;
+    while (offset + (off_t)sizeof(header) <= st.st_size && store_readRecordHeader(dataFd, offset, &header) == 0)
+    {
+        off_t next = offset + (off_t)sizeof(header) + header.payloadBytes;
+        if (next > st.st_size)
+        {
+            break; // Partially written record
+        }
+        if (header.flags & HODR_RECORD_GAP)
+        {
+            offset = next; // Gap markers have no index entry
+            continue;
+        }
+        if (first)
+        {
+            // Spectrum IDs continue from the first record of the file
+            if (pwrite(indexFd, &header.spectrumID, sizeof(header.spectrumID), offsetof(HODR_IndexHeader_t, firstSpectrumID)) < 0)
+            {
+                return -1;
+            }
+            first = false;
+        }
+        if (store_appendIndex(indexFd, offset, header.timestampNs) != 0)
+        {
+            return -1;
+        }
+        offset = next;
+        count++;
+    }
+    return count;
+}
+
+void store_statePath(const char *dataPath, char *buffer, size_t bufferSize)
+{
+    snprintf(buffer, bufferSize, "%s.state", dataPath);
+}
+
+// Open or create the state sidecar of a data file. Returns the file descriptor or -1 on error.
+int store_openState(const char *path)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        log_error("Error opening state %s: %s", path, strerror(errno));
+    }
+    return fd;
+}
+
+static int readState(int stateFd, HODR_StateHeader_t *state)
+{
+    if (pread(stateFd, state, sizeof(*state), 0) != (ssize_t)sizeof(*state) ||
+        memcmp(state->magic, HODR_STATE_MAGIC, sizeof(state->magic)) != 0 || state->version != HODR_STATE_VERSION ||
+        store_crc32(0, state, offsetof(HODR_StateHeader_t, checksum)) != state->checksum)
+    {
+        return -1; // Missing, or torn by a crash during the write
+    }
+    return 0;
+}
+
+// Record that a data file holds count spectra and ends with the record at
+// lastRecord, which has lastChecksum and ends at endOffset. One write.
+int store_writeState(int stateFd, uint32_t count, off_t lastRecord, off_t endOffset, uint32_t lastChecksum)
+{
+    HODR_StateHeader_t state = {
+        .magic = HODR_STATE_MAGIC,
+        .version = HODR_STATE_VERSION,
+        .count = count,
+        .lastRecord = (uint64_t)lastRecord,
+        .endOffset = (uint64_t)endOffset,
+        .lastChecksum = lastChecksum,
+    };
+    state.checksum = store_crc32(0, &state, offsetof(HODR_StateHeader_t, checksum));
+    if (pwrite(stateFd, &state, sizeof(state), 0) != (ssize_t)sizeof(state))
+    {
+        log_errorEvery(1000, "Error writing state: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Work out the spectra of a data file and where its records end, and bring
+// its index and state up to date. With a usable state, one whose last record
+// is where it says, only the records written after it are walked and indexed.
+// Without one every record header is walked, and the index is rebuilt if its
+// count is wrong. A partially written record at the end is cut off. Returns
+// the number of spectra, and the offset new records are written at, or -1
+// on error.
+long store_recover(int dataFd, int indexFd, int stateFd, off_t *endOffset)
+{
+    HODR_FileHeader_t fileHeader;
+    struct stat st;
+    if (store_readFileHeader(dataFd, &fileHeader) != 0 || fstat(dataFd, &st) != 0)
+    {
+        return -1;
+    }
+
+    HODR_StateHeader_t state;
+    HODR_RecordHeader_t header;
+    bool fromState = readState(stateFd, &state) == 0 && state.endOffset >= fileHeader.headerSize && (off_t)state.endOffset <= st.st_size;
+    if (fromState && state.lastRecord != 0)
+    {
+        fromState = store_readRecordHeader(dataFd, (off_t)state.lastRecord, &header) == 0 && header.checksum == state.lastChecksum &&
+                    state.lastRecord + sizeof(header) + header.payloadBytes == state.endOffset;
+    }
+    long count = fromState ? (long)state.count : 0;
+    off_t last = fromState ? (off_t)state.lastRecord : 0;
+    off_t offset = fromState ? (off_t)state.endOffset : (off_t)fileHeader.headerSize;
+    uint32_t lastChecksum = fromState ? state.lastChecksum : 0;
+
+    // Index entries past the state are dropped and written again by the
+    // walk. An index behind the state, or walked without one, is checked after.
+    bool checkIndex = !fromState || store_indexCount(indexFd) < count ||
+                      ftruncate(indexFd, (off_t)(sizeof(HODR_IndexHeader_t) + (size_t)count * sizeof(HODR_IndexEntry_t))) != 0;
+    bool partial = false;
+    while (offset < st.st_size)
+    {
+        if (offset + (off_t)sizeof(header) > st.st_size)
+        {
+            partial = true;
+            break;
+        }
+        if (store_readRecordHeader(dataFd, offset, &header) != 0)
+        {
+            break;
+        }
+        off_t next = offset + (off_t)sizeof(header) + header.payloadBytes;
+        if (next > st.st_size)
+        {
+            partial = true;
+            break;
+        }
+        if (!(header.flags & HODR_RECORD_GAP))
+        {
+            if (!checkIndex && store_appendIndex(indexFd, offset, header.timestampNs) != 0)
+            {
+                checkIndex = true;
+            }
+            count++;
+        }
+        last = offset;
+        lastChecksum = header.checksum;
+        offset = next;
+    }
+    if (checkIndex && store_indexCount(indexFd) != count)
+    {
+        log_warn("Index is out of date, rebuilding");
+        store_rebuildIndex(dataFd, indexFd);
+    }
+
+    if (partial)
+    {
+        log_warn("Cutting off a partially written record at offset %lld", (long long)offset);
+        if (ftruncate(dataFd, offset) != 0)
+        {
+            return -1;
+        }
+    }
+    else if (offset < st.st_size)
+    {
+        // A corrupt record. Nothing after it is counted, new records are
+        // still appended at the end of the file.
+        *endOffset = st.st_size;
+        return count;
+    }
+    *endOffset = offset;
+    store_writeState(stateFd, (uint32_t)count, last, offset, lastChecksum);
+    return count;
+}
+
+void store_manifestPath(const char *directory, char *buffer, size_t bufferSize)
+{
+    snprintf(buffer, bufferSize, "%s/%s", directory, HODR_MANIFEST_NAME);
+}
+
+// Open or create a partition manifest. Returns the file descriptor or -1 on error.
+int store_openManifest(const char *path)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        log_error("Error opening manifest %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    HODR_ManifestHeader_t header;
+    ssize_t n = pread(fd, &header, sizeof(header), 0);
+    if (n == (ssize_t)sizeof(header) && memcmp(header.magic, HODR_MANIFEST_MAGIC, sizeof(header.magic)) == 0 &&
+        header.entrySize == sizeof(HODR_ManifestEntry_t))
+    {
+        return fd;
+    }
+    if (n != 0)
+    {
+        // Unlike an index the manifest cannot be rebuilt from one data file
+        log_error("%s is not a partition manifest", path);
+        close(fd);
+        return -1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, HODR_MANIFEST_MAGIC, sizeof(header.magic));
+    header.version = HODR_MANIFEST_VERSION;
+    header.entrySize = sizeof(HODR_ManifestEntry_t);
+    if (pwrite(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header))
+    {
+        log_error("Error writing manifest header to %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Number of partitions in a manifest
+long store_manifestCount(int manifestFd)
+{
+    struct stat st;
+    if (fstat(manifestFd, &st) != 0 || st.st_size < (off_t)sizeof(HODR_ManifestHeader_t))
+    {
+        return -1;
+    }
+    return (long)((st.st_size - sizeof(HODR_ManifestHeader_t)) / sizeof(HODR_ManifestEntry_t));
+}
+
+int store_readManifest(int manifestFd, long n, HODR_ManifestEntry_t *entry)
+{
+    off_t position = (off_t)(sizeof(HODR_ManifestHeader_t) + (size_t)n * sizeof(*entry));
+    if (n < 0 || pread(manifestFd, entry, sizeof(*entry), position) != (ssize_t)sizeof(*entry))
+    {
+        return -1;
+    }
+    entry->name[sizeof(entry->name) - 1] = '\0';
+    return 0;
+}
+
+// Write entry n of a manifest, n == store_manifestCount() to add a partition.
+// A single write, so readers see the old entry or the new one.
+int store_writeManifest(int manifestFd, long n, const HODR_ManifestEntry_t *entry)
+{
+    off_t position = (off_t)(sizeof(HODR_ManifestHeader_t) + (size_t)n * sizeof(*entry));
+    if (n < 0 || pwrite(manifestFd, entry, sizeof(*entry), position) != (ssize_t)sizeof(*entry))
+    {
+        log_errorEvery(1000, "Error writing manifest entry %ld: %s", n, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Find the partition holding a spectrum by binary search of the manifest.
+// Returns its entry number, or -1 if no partition holds it.
+long store_findPartition(int manifestFd, uint32_t spectrumID, HODR_ManifestEntry_t *entry)
+{
+    long low = 0, high = store_manifestCount(manifestFd); // Partitions before low start at or before the ID
+    while (low < high)
+    {
+        long middle = low + (high - low) / 2;
+        if (store_readManifest(manifestFd, middle, entry) != 0)
+        {
+            return -1;
+        }
+        if (entry->firstSpectrumID <= spectrumID)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    if (low == 0 || store_readManifest(manifestFd, low - 1, entry) != 0 || spectrumID >= entry->endSpectrumID)
+    {
+        return -1;
+    }
+    return low - 1;
+}
+
+// Find the first partition with a spectrum taken at or after timestampNs by
+// binary search of the manifest, partitions being in capture order. Returns
+// its entry number, or -1 if there is none.
+long store_findPartitionTime(int manifestFd, int64_t timestampNs, HODR_ManifestEntry_t *entry)
+{
+    long count = store_manifestCount(manifestFd);
+    long low = 0, high = count; // Partitions before low end before timestampNs
+    while (low < high)
+    {
+        long middle = low + (high - low) / 2;
+        if (store_readManifest(manifestFd, middle, entry) != 0)
+        {
+            return -1;
+        }
+        if (entry->endSpectrumID > entry->firstSpectrumID && entry->lastTimestampNs < timestampNs)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    if (low == count || store_readManifest(manifestFd, low, entry) != 0)
+    {
+        return -1;
+    }
+    return low;
+}
+
+void store_formatTimestamp(int64_t timestampNs, char *buffer, size_t bufferSize)
+{
+    time_t seconds = (time_t)(timestampNs / 1000000000LL);
+    struct tm timeInfo;
+    localtime_r(&seconds, &timeInfo);
+    strftime(buffer, bufferSize, "%Y-%m-%dT%H:%M:%S", &timeInfo);
+}
+
+// Write a spectrum as a line of the legacy CSV format:
+// timestamp,exposure,temperature,pixel0,pixel1,...
+int store_writeCsvLine(FILE *file, const HODR_RecordHeader_t *header, const int32_t *data)
+{
+    char timeString[64];
+    store_formatTimestamp(header->timestampNs, timeString, sizeof(timeString));
+    fprintf(file, "%s,%.9f,%.2f", timeString, header->exposureTime, header->temperature);
+    for (uint32_t i = 0; i < header->npixels; i++)
+    {
+        fprintf(file, ",%d", data[i]);
+    }
+    fputc('\n', file);
+    return ferror(file) ? -1 : 0;
+}
@@ -0,0 +1,215 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include "codec.h"
+
+// Binary spectrum store.
+//
+// A data file is a HODR_FileHeader_t followed by append-only records. Each
+// record is a HODR_RecordHeader_t followed by payloadBytes of pixel data in
+// the encoding given by the header. All fields are little-endian.
+//
+// Spectra in a file created with HODR_FILE_PACKED are written with
+// HODR_ENCODING_PACKED, so their pixels take a variable part of the payload,
+// codec_size() bytes. Every other section is stored as in any file.
+
+#define HODR_STORE_MAGIC "HODRSPEC"
+#define HODR_STORE_VERSION 2 // 2 adds HODR_FILE_PACKED, files without it are still written as 1
+#define HODR_RECORD_MAGIC 0x43455053u // "SPEC"
+
+#define HODR_ENCODING_INT32 0  // Raw int32 pixels
+#define HODR_ENCODING_UINT16 1 // Raw uint16 pixels, used when every pixel fits
+#define HODR_ENCODING_PACKED 2 // Delta, zigzag and bit-packed by the spectrum codec, see codec.h
+
+#define HODR_FILE_PACKED 0x01 // File header flag: spectra are written with HODR_ENCODING_PACKED
+
+#define HODR_RECORD_TEMP_STABILIZED 0x01 // Detector temperature was stabilized
+#define HODR_RECORD_GAP 0x02             // Gap marker, frames were lost before spectrumID
+#define HODR_RECORD_COADDED 0x04         // Mean of coadded frames, the pixels are followed by a noise estimate
+#define HODR_RECORD_DARK_SUBTRACTED 0x08 // A master dark was subtracted from the pixels
+#define HODR_RECORD_FLAT_FIELDED 0x10    // The pixels were divided by the flat field
+#define HODR_RECORD_HOT_PIXELS 0x20      // Hot pixels were replaced by their neighbours
+#define HODR_RECORD_WITH_RAW 0x40        // The payload carries the uncorrected pixels
+#define HODR_RECORD_RESAMPLED 0x80       // The payload ends with the spectrum resampled to a wavelength grid
+
+// A gap marker is a record with no pixels whose payload is a HODR_GapPayload_t.
+// Its spectrumID is that of the spectrum stored after the gap. Gap markers
+// are not spectra: they are not counted and have no index entry.
+
+// A co-added spectrum is the rounded mean of coadded consecutive frames. Its
+// payload is the pixels, in the encoding of the header, followed by npixels
+// float32 of the standard error of that mean. The timestamp is that of the
+// first frame.
+
+// A corrected spectrum has at least HODR_RECORD_DARK_SUBTRACTED set. With
+// HODR_RECORD_WITH_RAW its payload ends, after any noise estimate, with the
+// pixels as read from the camera, npixels of int32.
+
+// With HODR_RECORD_RESAMPLED the payload ends, after everything else, with a
+// HODR_GridHeader_t and the spectrum interpolated to that wavelength grid,
+// points of float32. Points beyond the detector's wavelength range are NaN.
+// A grid has at most HODR_RECORD_MAX_POINTS(npixels) points.
+#define HODR_RECORD_MAX_POINTS(npixels) (2 * (size_t)(npixels))
+
+// Most payload bytes a record of npixels can have
+#define HODR_RECORD_MAX_PAYLOAD(npixels)                                                                 \
+    (CODEC_MAX_BYTES(npixels) + (size_t)(npixels) * (sizeof(int32_t) + sizeof(float)) + sizeof(HODR_GridHeader_t) + \
+     HODR_RECORD_MAX_POINTS(npixels) * sizeof(float))
+
+// Index sidecar, "<data file>.idx". A HODR_IndexHeader_t followed by one
+// HODR_IndexEntry_t per spectrum, so spectrum firstSpectrumID + n is found
+// at a fixed offset in the index.
+#define HODR_INDEX_MAGIC "HODRIDX"
+#define HODR_INDEX_VERSION 1
+
+// State sidecar, "<data file>.state". A single HODR_StateHeader_t rewritten
+// after every write, so that opening a data file takes a constant number of
+// reads: the spectrum count and the end of the last complete record are read
+// from it and checked against that record. Only the records written after it,
+// by a writer that stopped before updating it, are walked.
+#define HODR_STATE_MAGIC "HODRSTA"
+#define HODR_STATE_VERSION 1
+
+// Partition manifest, HODR_MANIFEST_NAME in the data directory. The archive
+// is a series of data files, partitions, each with its own index, holding
+// consecutive spectrum IDs. The manifest is a HODR_ManifestHeader_t followed
+// by one HODR_ManifestEntry_t per partition in ID order, so a reader finds
+// the partitions of an ID or time range without opening the others. The
+// entry of the partition being written is brought up to date after every
+// write, its data file and index may briefly be ahead of it.
+#define HODR_MANIFEST_MAGIC "HODRMAN"
+#define HODR_MANIFEST_VERSION 1
+#define HODR_MANIFEST_NAME "partitions.manifest"
+
+typedef struct {
+    char magic[8];      // HODR_STORE_MAGIC
+    uint32_t version;   // HODR_STORE_VERSION
+    uint32_t headerSize; // Offset of the first record
+    uint32_t xpixels;   // Detector width the file was created for
+    uint32_t flags;
+    int64_t createdNs;  // Creation time, ns since the Unix epoch
+} HODR_FileHeader_t;
+
+typedef struct {
+    uint32_t magic;       // HODR_RECORD_MAGIC
+    uint32_t spectrumID;
+    int64_t timestampNs;  // Capture time, ns since the Unix epoch
+    float exposureTime;   // Seconds
+    float temperature;    // Degrees Celsius
+    uint32_t npixels;
+    uint8_t encoding;     // HODR_ENCODING_*
+    uint8_t flags;        // HODR_RECORD_*
+    uint16_t coadded;     // Frames averaged into the spectrum, 0 unless HODR_RECORD_COADDED
+    uint32_t payloadBytes;
+    uint32_t checksum;    // CRC-32 of the payload
+} HODR_RecordHeader_t;
+
+typedef struct {
+    char magic[8];         // HODR_INDEX_MAGIC
+    uint32_t version;      // HODR_INDEX_VERSION
+    uint32_t entrySize;    // sizeof(HODR_IndexEntry_t)
+    uint32_t firstSpectrumID;
+    uint32_t reserved[3];
+} HODR_IndexHeader_t;
+
+typedef struct {
+    uint64_t offset;      // Offset of the record in the data file
+    int64_t timestampNs;  // Copy of the record timestamp
+} HODR_IndexEntry_t;
+
+typedef struct {
+    uint64_t missingFrames; // Frames the camera took that were never stored
+} HODR_GapPayload_t;
+
+typedef struct {
+    double start;    // Wavelength of the first point, nm
+    double step;     // nm between points
+    uint32_t points;
+    uint32_t reserved;
+} HODR_GridHeader_t;
+
+typedef struct {
+    char magic[8];         // HODR_STATE_MAGIC
+    uint32_t version;      // HODR_STATE_VERSION
+    uint32_t count;        // Spectra in the data file
+    uint64_t lastRecord;   // Offset of the last record, 0 for none
+    uint64_t endOffset;    // Offset just past it
+    uint32_t lastChecksum; // Payload checksum of the last record
+    uint32_t checksum;     // CRC-32 of the fields above
+} HODR_StateHeader_t;
+
+typedef struct {
+    char magic[8];      // HODR_MANIFEST_MAGIC
+    uint32_t version;   // HODR_MANIFEST_VERSION
+    uint32_t entrySize; // sizeof(HODR_ManifestEntry_t)
+    uint32_t reserved[4];
+} HODR_ManifestHeader_t;
+
+typedef struct {
+    char name[64];             // Data file name, in the manifest's directory
+    uint32_t firstSpectrumID;
+    uint32_t endSpectrumID;    // One past the last spectrum
+    int64_t firstTimestampNs;  // Of the first spectrum, 0 while there is none
+    int64_t lastTimestampNs;   // Of the last spectrum
+    uint64_t bytes;            // Size of the data file
+} HODR_ManifestEntry_t;
+
+_Static_assert(sizeof(HODR_FileHeader_t) == 32, "HODR_FileHeader_t must be 32 bytes");
+_Static_assert(sizeof(HODR_RecordHeader_t) == 40, "HODR_RecordHeader_t must be 40 bytes");
+_Static_assert(sizeof(HODR_IndexHeader_t) == 32, "HODR_IndexHeader_t must be 32 bytes");
+_Static_assert(sizeof(HODR_IndexEntry_t) == 16, "HODR_IndexEntry_t must be 16 bytes");
+_Static_assert(sizeof(HODR_GridHeader_t) == 24, "HODR_GridHeader_t must be 24 bytes");
+_Static_assert(sizeof(HODR_StateHeader_t) == 40, "HODR_StateHeader_t must be 40 bytes");
+_Static_assert(sizeof(HODR_ManifestHeader_t) == 32, "HODR_ManifestHeader_t must be 32 bytes");
+_Static_assert(sizeof(HODR_ManifestEntry_t) == 96, "HODR_ManifestEntry_t must be 96 bytes");
+
+uint32_t store_crc32(uint32_t crc, const void *data, size_t size);
+
+int store_openDataFile(const char *path, uint32_t xpixels, uint32_t flags);
+int store_readFileHeader(int fd, HODR_FileHeader_t *header);
+
+size_t store_encodeSpectrum(HODR_RecordHeader_t *header, void *payload, const int32_t *data, size_t npixels);
+size_t store_encodePacked(HODR_RecordHeader_t *header, void *payload, const int32_t *data, size_t npixels);
+size_t store_encodeGap(HODR_RecordHeader_t *header, HODR_GapPayload_t *payload, uint32_t spectrumID, int64_t timestampNs, uint64_t missingFrames);
+size_t store_appendNoise(HODR_RecordHeader_t *header, void *payload, const float *noise, size_t npixels);
+size_t store_appendRaw(HODR_RecordHeader_t *header, void *payload, const int32_t *raw, size_t npixels);
+size_t store_appendResampled(HODR_RecordHeader_t *header, void *payload, const HODR_GridHeader_t *grid, const float *values);
+int store_checkRecord(const HODR_RecordHeader_t *header);
+int store_decodePayload(const HODR_RecordHeader_t *header, const void *payload, int32_t *data, size_t maxPixels);
+int store_decodeNoise(const HODR_RecordHeader_t *header, const void *payload, float *noise, size_t maxPixels);
+int store_decodeRaw(const HODR_RecordHeader_t *header, const void *payload, int32_t *raw, size_t maxPixels);
+int store_decodeResampled(const HODR_RecordHeader_t *header, const void *payload, HODR_GridHeader_t *grid, float *values, size_t maxPoints);
+
+off_t store_appendSpectrum(int fd, HODR_RecordHeader_t *header, const int32_t *data, size_t npixels);
+int store_readRecordHeader(int fd, off_t offset, HODR_RecordHeader_t *header);
+int store_readSpectrum(int fd, off_t offset, HODR_RecordHeader_t *header, int32_t *data, size_t maxPixels);
+long store_countRecords(int fd, off_t *lastRecord, off_t *endOffset);
+
+void store_indexPath(const char *dataPath, char *buffer, size_t bufferSize);
+int store_openIndex(const char *path, uint32_t firstSpectrumID);
+int store_readIndexHeader(int indexFd, HODR_IndexHeader_t *header);
+long store_indexCount(int indexFd);
+int store_appendIndex(int indexFd, off_t offset, int64_t timestampNs);
+int store_lookupIndex(int indexFd, uint32_t spectrumID, HODR_IndexEntry_t *entry);
+long store_findTime(int indexFd, int64_t timestampNs);
+long store_readSpectra(int dataFd, int indexFd, uint32_t firstID, size_t count, HODR_RecordHeader_t *headers, int32_t *data, size_t npixels);
+long store_rebuildIndex(int dataFd, int indexFd);
+
+void store_statePath(const char *dataPath, char *buffer, size_t bufferSize);
+int store_openState(const char *path);
+int store_writeState(int stateFd, uint32_t count, off_t lastRecord, off_t endOffset, uint32_t lastChecksum);
+long store_recover(int dataFd, int indexFd, int stateFd, off_t *endOffset);
+
+void store_manifestPath(const char *directory, char *buffer, size_t bufferSize);
+int store_openManifest(const char *path);
+long store_manifestCount(int manifestFd);
+int store_readManifest(int manifestFd, long n, HODR_ManifestEntry_t *entry);
+int store_writeManifest(int manifestFd, long n, const HODR_ManifestEntry_t *entry);
+long store_findPartition(int manifestFd, uint32_t spectrumID, HODR_ManifestEntry_t *entry);
+long store_findPartitionTime(int manifestFd, int64_t timestampNs, HODR_ManifestEntry_t *entry);
+
+void store_formatTimestamp(int64_t timestampNs, char *buffer, size_t bufferSize);
+int store_writeCsvLine(FILE *file, const HODR_RecordHeader_t *header, const int32_t *data);
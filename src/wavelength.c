@@ -0,0 +1,209 @@
+#include "wavelength.h"
+#include "correction.h"
+#include "kernels.h"
+#include "store.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+double wavelength_at(const HODR_Wavelength_t *wavelength, double pixel)
+{
+    double nm = 0;
+    for (size_t k = wavelength->ncoefficients; k-- > 0;)
+    {
+        nm = nm * pixel + wavelength->coefficients[k];
+    }
+    return nm;
+}
+
+// Work out the interpolation table for the current calibration and grid
+static int buildTable(HODR_Wavelength_t *wavelength)
+{
+    wavelength->first = 0;
+    wavelength->covered = 0;
+    if (wavelength->ncoefficients == 0 || wavelength->gridPoints == 0)
+    {
+        return 0;
+    }
+    size_t n = wavelength->npixels;
+    double *position = malloc(n * sizeof(double));
+    if (position == NULL)
+    {
+        return -1;
+    }
+    // Search in the direction the wavelength grows, so one search serves a
+    // calibration that rises across the detector and one that falls
+    double sign = wavelength_at(wavelength, (double)(n - 1)) > wavelength_at(wavelength, 0) ? 1.0 : -1.0;
+    for (size_t i = 0; i < n; i++)
+    {
+        position[i] = sign * wavelength_at(wavelength, (double)i);
+    }
+
+    for (uint32_t point = 0; point < wavelength->gridPoints; point++)
+    {
+        double target = sign * (wavelength->gridStart + point * wavelength->gridStep);
+        if (!(target >= position[0] && target <= position[n - 1]))
+        {
+            continue; // Beyond the detector, NaN
+        }
+        size_t low = 0, high = n - 1; // position[low] <= target <= position[high]
+        while (high - low > 1)
+        {
+            size_t middle = low + (high - low) / 2;
+            if (position[middle] <= target)
+            {
+                low = middle;
+            }
+            else
+            {
+                high = middle;
+            }
+        }
+        double right = (target - position[low]) / (position[high] - position[low]);
+        if (wavelength->covered == 0)
+        {
+            wavelength->first = point;
+        }
+        wavelength->index[wavelength->covered] = (uint32_t)low;
+        wavelength->weightLeft[wavelength->covered] = (float)(1.0 - right);
+        wavelength->weightRight[wavelength->covered] = (float)right;
+        wavelength->covered++;
+    }
+    free(position);
+    return 0;
+}
+
+// Use coefficients if they describe a wavelength that changes monotonically
+// across the detector. Returns 0, or -1 and keeps the calibration there was.
+static int useCoefficients(HODR_Wavelength_t *wavelength, const double *coefficients, size_t ncoefficients)
+{
+    if (ncoefficients == 0 || ncoefficients > WAVELENGTH_MAX_COEFFICIENTS)
+    {
+        log_warn("Wavelength calibration needs 1 to %d coefficients, got %zu.", WAVELENGTH_MAX_COEFFICIENTS, ncoefficients);
+        return -1;
+    }
+    HODR_Wavelength_t candidate = *wavelength;
+    memcpy(candidate.coefficients, coefficients, ncoefficients * sizeof(double));
+    candidate.ncoefficients = ncoefficients;
+
+    double previous = wavelength_at(&candidate, 0);
+    double direction = wavelength_at(&candidate, 1) - previous;
+    for (size_t i = 1; i < wavelength->npixels; i++)
+    {
+        double nm = wavelength_at(&candidate, (double)i);
+        if (!isfinite(nm) || !((nm - previous) * direction > 0))
+        {
+            log_warn("Wavelength calibration is not monotonic across the detector, at pixel %zu.", i);
+            return -1;
+        }
+        previous = nm;
+    }
+
+    memcpy(wavelength->coefficients, coefficients, ncoefficients * sizeof(double));
+    wavelength->ncoefficients = ncoefficients;
+    return buildTable(wavelength);
+}
+
+// Set up an uncalibrated wavelength model for npixels and load the
+// calibration kept in directory. Returns 0 or -1 on error.
+int wavelength_init(HODR_Wavelength_t *wavelength, size_t npixels, const char *directory)
+{
+    memset(wavelength, 0, sizeof(*wavelength));
+    wavelength->npixels = npixels;
+    snprintf(wavelength->path, sizeof(wavelength->path), "%s/wavelength.cal", directory);
+    size_t maxPoints = HODR_RECORD_MAX_POINTS(npixels);
+    wavelength->index = malloc(maxPoints * sizeof(uint32_t));
+    wavelength->weightLeft = malloc(maxPoints * sizeof(float));
+    wavelength->weightRight = malloc(maxPoints * sizeof(float));
+    if (npixels < 2 || wavelength->index == NULL || wavelength->weightLeft == NULL || wavelength->weightRight == NULL)
+    {
+        log_error("Failed to allocate wavelength table for %zu pixels.", npixels);
+        wavelength_free(wavelength);
+        return -1;
+    }
+
+    HODR_CalibrationHeader_t header;
+    double *coefficients = correction_readCalibration(wavelength->path, CORRECTION_WAVELENGTH, npixels, &header, sizeof(double));
+    if (coefficients != NULL)
+    {
+        if (useCoefficients(wavelength, coefficients, header.count) == 0)
+        {
+            log_info("Loaded wavelength calibration: %.3f to %.3f nm.", wavelength_at(wavelength, 0), wavelength_at(wavelength, (double)(npixels - 1)));
+        }
+        free(coefficients);
+    }
+    return 0;
+}
+
+void wavelength_free(HODR_Wavelength_t *wavelength)
+{
+    free(wavelength->index);
+    free(wavelength->weightLeft);
+    free(wavelength->weightRight);
+    wavelength->index = NULL;
+    wavelength->weightLeft = NULL;
+    wavelength->weightRight = NULL;
+    wavelength->gridPoints = 0;
+    wavelength->covered = 0;
+}
+
+// Set the pixel to wavelength polynomial, lowest order first, and save it.
+// Returns 0, or -1 if it is not monotonic or cannot be saved.
+int wavelength_setCalibration(HODR_Wavelength_t *wavelength, const double *coefficients, size_t ncoefficients)
+{
+    if (useCoefficients(wavelength, coefficients, ncoefficients) != 0)
+    {
+        return -1;
+    }
+    HODR_CalibrationHeader_t header = {
+        .kind = CORRECTION_WAVELENGTH,
+        .npixels = (uint32_t)wavelength->npixels,
+        .count = (uint32_t)ncoefficients,
+    };
+    return correction_writeCalibration(wavelength->path, &header, wavelength->coefficients, sizeof(double));
+}
+
+// Set the grid spectra are resampled to, points of step nm from start nm. No
+// points turns resampling off. Returns 0, or -1 if the grid is unusable.
+int wavelength_setGrid(HODR_Wavelength_t *wavelength, double start, double step, uint32_t points)
+{
+    if (points > 0 && (!isfinite(start) || !isfinite(step) || step <= 0 || points > HODR_RECORD_MAX_POINTS(wavelength->npixels)))
+    {
+        log_warn("Unusable wavelength grid: %u points of %g nm from %g nm, at most %zu points.", points, step, start,
+                 HODR_RECORD_MAX_POINTS(wavelength->npixels));
+        return -1;
+    }
+    wavelength->gridStart = start;
+    wavelength->gridStep = step;
+    wavelength->gridPoints = points;
+    return buildTable(wavelength);
+}
+
+// True if spectra are to be resampled: there is a calibration and a grid
+bool wavelength_resampling(const HODR_Wavelength_t *wavelength)
+{
+    return wavelength->ncoefficients > 0 && wavelength->gridPoints > 0;
+}
+
+// Resample one spectrum onto the grid. out must hold gridPoints values.
+// Returns the number of grid points, 0 if spectra are not resampled.
+uint32_t wavelength_resample(const HODR_Wavelength_t *wavelength, const int32_t *data, float *out)
+{
+    if (!wavelength_resampling(wavelength))
+    {
+        return 0;
+    }
+    uint32_t end = wavelength->first + wavelength->covered;
+    for (uint32_t i = 0; i < wavelength->first; i++)
+    {
+        out[i] = NAN;
+    }
+    kernels_resample(out + wavelength->first, data, wavelength->index, wavelength->weightLeft, wavelength->weightRight, wavelength->covered);
+    for (uint32_t i = end; i < wavelength->gridPoints; i++)
+    {
+        out[i] = NAN;
+    }
+    return wavelength->gridPoints;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// Wavelength calibration and resampling.
+//
+// The wavelength of pixel p is a polynomial in p, nm = sum of c[k] * p^k,
+// which must be monotonic across the detector. Spectra can be resampled onto
+// a fixed wavelength grid, each grid point interpolated linearly between the
+// two pixels whose wavelengths bracket it. The pixel and the two weights of
+// every point are worked out once whenever the calibration or the grid
+// changes, so resampling a spectrum is a gather, two multiplies and an add per
+// point. Grid points beyond the detector's wavelength range are NaN.
+//
+// The coefficients are kept as wavelength.cal beside the correction masters,
+// a HODR_CalibrationHeader_t followed by count float64 coefficients, and
+// loaded at startup. The grid is not kept. Callers serialise every call.
+
+#define WAVELENGTH_MAX_COEFFICIENTS 6 // Up to a fifth order polynomial
+
+typedef struct {
+    size_t npixels;
+    char path[300];
+    size_t ncoefficients; // 0 until calibrated
+    double coefficients[WAVELENGTH_MAX_COEFFICIENTS];
+    double gridStart;     // nm
+    double gridStep;      // nm
+    uint32_t gridPoints;  // 0 for no grid, spectra are not resampled
+    uint32_t first;       // First grid point within the detector's range
+    uint32_t covered;     // Grid points within the detector's range, from first
+    uint32_t *index;      // Pixel left of each grid point
+    float *weightLeft;    // Weight of that pixel
+    float *weightRight;   // Weight of the pixel after it
+} HODR_Wavelength_t;
+
+int wavelength_init(HODR_Wavelength_t *wavelength, size_t npixels, const char *directory);
+void wavelength_free(HODR_Wavelength_t *wavelength);
+
+int wavelength_setCalibration(HODR_Wavelength_t *wavelength, const double *coefficients, size_t ncoefficients);
+int wavelength_setGrid(HODR_Wavelength_t *wavelength, double start, double step, uint32_t points);
+double wavelength_at(const HODR_Wavelength_t *wavelength, double pixel);
+bool wavelength_resampling(const HODR_Wavelength_t *wavelength);
+uint32_t wavelength_resample(const HODR_Wavelength_t *wavelength, const int32_t *data, float *out);
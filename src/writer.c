@@ -0,0 +1,784 @@
+#include "writer.h"
+#include "log.h"
+#include "metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024 // Linux UIO_MAXIOV
+#endif
+
+typedef struct {
+    pthread_t thread;
+    bool running;
+
+    HODR_Ring_t *ring;
+    HODR_RingConsumer_t *consumer;
+
+    char directory[256];
+    int manifestFd;
+    long partition;               // Manifest entry of the current partition
+    HODR_ManifestEntry_t current; // That entry as last written, changed under currentLock
+    uint32_t fileFlags;           // HODR_FILE_* of a new partition
+    uint64_t maxBytes;            // Size at which a new partition is started, 0 for no limit
+    int64_t rotateAtNs;           // Spectra from this local midnight on go to a new partition
+    pthread_mutex_t filesLock;    // Held while the current partition is swapped or its descriptors duplicated
+    pthread_mutex_t currentLock;  // Held only to copy current in or out
+
+    int dataFd;
+    int indexFd;
+    int stateFd;
+    char dataPath[256 + 64]; // directory, '/' and a manifest entry name
+    off_t endOffset;   // End of the last complete record
+    long indexEntries; // Entries already in the index
+    bool indexDirty;   // Entries of a batch could not be written, the index is rebuilt
+    uint32_t xpixels;
+    bool packed;       // Spectra are encoded with the spectrum codec
+
+    char csvPath[256 + 64];
+    FILE *csvFile;
+    atomic_bool csvExport;
+
+    HODR_RecordHeader_t headers[WRITER_BATCH_LENGTH];
+    HODR_RecordHeader_t gapHeaders[WRITER_BATCH_LENGTH]; // Gap markers written before a spectrum
+    HODR_GapPayload_t gaps[WRITER_BATCH_LENGTH];
+    void *payloads; // WRITER_BATCH_LENGTH encoded spectra of xpixels, HODR_RECORD_MAX_PAYLOAD each
+    atomic_uint committed;
+
+    pthread_mutex_t lastLock;
+    HODR_RecordHeader_t last; // Header of the newest committed spectrum
+    void (*onCommit)(uint32_t committed);
+} Writer_t;
+
+static Writer_t writer = {
+    .manifestFd = -1,
+    .dataFd = -1,
+    .indexFd = -1,
+    .stateFd = -1,
+    .filesLock = PTHREAD_MUTEX_INITIALIZER,
+    .currentLock = PTHREAD_MUTEX_INITIALIZER,
+    .lastLock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+// writev until everything is written, continuing after short writes
+static int writeVectors(int fd, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0)
+    {
+        int n = iovcnt > IOV_MAX ? IOV_MAX : iovcnt;
+        ssize_t written = writev(fd, iov, n);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t)written >= iov->iov_len)
+        {
+            written -= (ssize_t)iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= (size_t)written;
+        }
+    }
+    return 0;
+}
+
+static void writerExportCsv(const HODR_RecordHeader_t *header, const int32_t *data)
+{
+    bool enabled = atomic_load(&writer.csvExport);
+    if (enabled && writer.csvFile == NULL)
+    {
+        writer.csvFile = fopen(writer.csvPath, "a");
+        if (writer.csvFile == NULL)
+        {
+            log_error("Error opening CSV export %s: %s", writer.csvPath, strerror(errno));
+            atomic_store(&writer.csvExport, false);
+            return;
+        }
+    }
+    else if (!enabled && writer.csvFile != NULL)
+    {
+        fclose(writer.csvFile);
+        writer.csvFile = NULL;
+    }
+
+    if (writer.csvFile != NULL && store_writeCsvLine(writer.csvFile, header, data) != 0)
+    {
+        log_error("Error exporting spectrum %u to %s", header->spectrumID, writer.csvPath);
+    }
+}
+
+// Rebuild the index of the current partition from its records, after index
+// entries could not be written. New readers of the partition wait meanwhile.
+// Returns 0, or -1 if the index is still incomplete and is retried with the
+// next batch.
+static int writerRepairIndex()
+{
+    metrics_lock(&writer.filesLock, METRIC_DATA_FILE_LOCK_WAIT);
+    long rebuilt = store_rebuildIndex(writer.dataFd, writer.indexFd);
+    pthread_mutex_unlock(&writer.filesLock);
+    if (rebuilt < 0)
+    {
+        log_errorEvery(60000, "Failed to rebuild the index of %s, retrying with the next batch.", writer.current.name);
+        return -1;
+    }
+    writer.indexEntries = rebuilt;
+    writer.indexDirty = false;
+    log_warn("Rebuilt the index of %s, %ld spectra.", writer.current.name, rebuilt);
+    return 0;
+}
+
+// Encode the oldest count frames held in the ring and append them with one
+// vectored write to the data file and one write to the index. A frame that
+// follows lost frames is preceded by a gap marker.
+static int writerWriteBatch(size_t count)
+{
+    struct iovec iov[4 * WRITER_BATCH_LENGTH];
+    int iovcnt = 0;
+    HODR_IndexEntry_t entries[WRITER_BATCH_LENGTH];
+    off_t offset = writer.endOffset;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        HODR_FrameSlot_t *slot = ring_peek(writer.ring, writer.consumer, i);
+        if (slot->gapBefore > 0)
+        {
+            HODR_RecordHeader_t *gapHeader = &writer.gapHeaders[i];
+            size_t gapBytes = store_encodeGap(gapHeader, &writer.gaps[i], slot->spectrumID, slot->timestampNs, slot->gapBefore);
+            iov[iovcnt++] = (struct iovec){.iov_base = gapHeader, .iov_len = sizeof(*gapHeader)};
+            iov[iovcnt++] = (struct iovec){.iov_base = &writer.gaps[i], .iov_len = gapBytes};
+            offset += (off_t)(sizeof(*gapHeader) + gapBytes);
+        }
+
+        HODR_RecordHeader_t *header = &writer.headers[i];
+        void *payload = (char *)writer.payloads + i * HODR_RECORD_MAX_PAYLOAD(writer.xpixels);
+        *header = (HODR_RecordHeader_t){
+            .spectrumID = slot->spectrumID,
+            .timestampNs = slot->timestampNs,
+            .exposureTime = slot->exposureTime,
+            .temperature = slot->temperature,
+            .flags = slot->flags,
+            .coadded = slot->coadded,
+        };
+        size_t payloadBytes = writer.packed ? store_encodePacked(header, payload, slot->data, slot->npixels)
+                                            : store_encodeSpectrum(header, payload, slot->data, slot->npixels);
+        if (slot->flags & HODR_RECORD_COADDED)
+        {
+            payloadBytes = store_appendNoise(header, payload, slot->noise, slot->npixels);
+        }
+        if (slot->flags & HODR_RECORD_WITH_RAW)
+        {
+            payloadBytes = store_appendRaw(header, payload, slot->raw, slot->npixels);
+        }
+        if (slot->flags & HODR_RECORD_RESAMPLED)
+        {
+            HODR_GridHeader_t grid = {.start = slot->gridStart, .step = slot->gridStep, .points = slot->gridPoints};
+            payloadBytes = store_appendResampled(header, payload, &grid, slot->resampled);
+        }
+        iov[iovcnt++] = (struct iovec){.iov_base = header, .iov_len = sizeof(*header)};
+        iov[iovcnt++] = (struct iovec){.iov_base = payload, .iov_len = payloadBytes};
+        entries[i] = (HODR_IndexEntry_t){.offset = (uint64_t)offset, .timestampNs = header->timestampNs};
+        offset += (off_t)(sizeof(*header) + payloadBytes);
+    }
+
+    if (writeVectors(writer.dataFd, iov, iovcnt) != 0)
+    {
+        log_error("Error writing %zu spectra to data file: %s", count, strerror(errno));
+        if (ftruncate(writer.dataFd, writer.endOffset) != 0) // Drop any partial record so the batch can be retried
+        {
+            log_error("Error truncating data file: %s", strerror(errno));
+        }
+        return -1;
+    }
+
+    writer.endOffset = offset;
+    off_t indexPosition = (off_t)(sizeof(HODR_IndexHeader_t) + (size_t)writer.indexEntries * sizeof(HODR_IndexEntry_t));
+    if (!writer.indexDirty && pwrite(writer.indexFd, entries, count * sizeof(entries[0]), indexPosition) != (ssize_t)(count * sizeof(entries[0])))
+    {
+        // The records are safe in the data file, the index is rebuilt from them
+        log_error("Error writing index entries: %s", strerror(errno));
+        writer.indexDirty = true;
+    }
+    if (!writer.indexDirty)
+    {
+        writer.indexEntries += (long)count;
+        // A stale state only costs a longer walk at the next start
+        store_writeState(writer.stateFd, (uint32_t)writer.indexEntries, (off_t)entries[count - 1].offset, offset, writer.headers[count - 1].checksum);
+    }
+    else
+    {
+        writerRepairIndex(); // Until it succeeds the state is left behind, so a restart rebuilds the index too
+    }
+
+    // Readers search the current entry by time. Its lock is never held across
+    // file operations, so storage does not wait on readers here.
+    pthread_mutex_lock(&writer.currentLock);
+    HODR_ManifestEntry_t *entry = &writer.current;
+    if (entry->endSpectrumID == entry->firstSpectrumID)
+    {
+        entry->firstTimestampNs = writer.headers[0].timestampNs;
+    }
+    entry->endSpectrumID = writer.headers[count - 1].spectrumID + 1;
+    entry->lastTimestampNs = writer.headers[count - 1].timestampNs;
+    entry->bytes = (uint64_t)offset;
+    HODR_ManifestEntry_t written = *entry;
+    pthread_mutex_unlock(&writer.currentLock);
+    store_writeManifest(writer.manifestFd, writer.partition, &written); // Logged, the entry is rewritten with the next batch
+
+    for (size_t i = 0; i < count; i++)
+    {
+        writerExportCsv(&writer.headers[i], ring_peek(writer.ring, writer.consumer, i)->data);
+    }
+    if (writer.csvFile != NULL)
+    {
+        fflush(writer.csvFile);
+    }
+    return 0;
+}
+
+// Local midnight after timestampNs
+static int64_t nextMidnightNs(int64_t timestampNs)
+{
+    time_t seconds = (time_t)(timestampNs / 1000000000LL);
+    struct tm day;
+    localtime_r(&seconds, &day);
+    day.tm_mday++; // mktime carries it into the next month
+    day.tm_hour = 0;
+    day.tm_min = 0;
+    day.tm_sec = 0;
+    day.tm_isdst = -1;
+    return (int64_t)mktime(&day) * 1000000000LL;
+}
+
+// Name a new partition for spectra from timestampNs on: the day's first
+// "YYYY-MM-DD_andor.hodr", or after that the next free "YYYY-MM-DD_andor.N.hodr"
+static void partitionName(char *name, size_t size, int64_t timestampNs)
+{
+    time_t seconds = (time_t)(timestampNs / 1000000000LL);
+    struct tm day;
+    char date[32];
+    char path[sizeof(writer.directory) + sizeof(writer.current.name) + 1];
+    localtime_r(&seconds, &day);
+    strftime(date, sizeof(date), "%Y-%m-%d_andor", &day);
+    for (int n = 0;; n++)
+    {
+        if (n == 0)
+        {
+            snprintf(name, size, "%s.hodr", date);
+        }
+        else
+        {
+            snprintf(name, size, "%s.%d.hodr", date, n);
+        }
+        snprintf(path, sizeof(path), "%s/%s", writer.directory, name);
+        if (access(path, F_OK) != 0)
+        {
+            return;
+        }
+    }
+}
+
+typedef struct {
+    int dataFd;
+    int indexFd;
+    int stateFd;
+    off_t endOffset; // Where the next record goes
+    bool packed;
+} PartitionFiles_t;
+
+static void closeFiles(PartitionFiles_t *files)
+{
+    if (files->dataFd >= 0)
+        close(files->dataFd);
+    if (files->indexFd >= 0)
+        close(files->indexFd);
+    if (files->stateFd >= 0)
+        close(files->stateFd);
+}
+
+// Open the files of a partition, creating them if they are new, and bring its
+// manifest entry up to date with them. Returns 0 or -1 on error.
+static int openPartition(HODR_ManifestEntry_t *entry, PartitionFiles_t *files)
+{
+    char dataPath[sizeof(writer.dataPath)];
+    char indexPath[sizeof(writer.dataPath) + 6];
+    char statePath[sizeof(writer.dataPath) + 6];
+    snprintf(dataPath, sizeof(dataPath), "%s/%s", writer.directory, entry->name);
+    store_indexPath(dataPath, indexPath, sizeof(indexPath));
+    store_statePath(dataPath, statePath, sizeof(statePath));
+
+    HODR_FileHeader_t fileHeader;
+    HODR_IndexHeader_t indexHeader;
+    files->dataFd = store_openDataFile(dataPath, writer.xpixels, writer.fileFlags);
+    files->indexFd = store_openIndex(indexPath, entry->firstSpectrumID);
+    files->stateFd = store_openState(statePath);
+    long count = -1;
+    if (files->dataFd >= 0 && files->indexFd >= 0 && files->stateFd >= 0 && store_readFileHeader(files->dataFd, &fileHeader) == 0)
+    {
+        count = store_recover(files->dataFd, files->indexFd, files->stateFd, &files->endOffset); // Reads the state, walks only what came after it
+    }
+    if (count < 0 || store_readIndexHeader(files->indexFd, &indexHeader) != 0)
+    {
+        log_error("Failed to open partition %s.", dataPath);
+        closeFiles(files);
+        return -1;
+    }
+
+    entry->firstSpectrumID = indexHeader.firstSpectrumID;
+    entry->endSpectrumID = indexHeader.firstSpectrumID + (uint32_t)count;
+    entry->bytes = (uint64_t)files->endOffset;
+    HODR_IndexEntry_t first, last;
+    if (count > 0 && store_lookupIndex(files->indexFd, entry->firstSpectrumID, &first) == 0 &&
+        store_lookupIndex(files->indexFd, entry->endSpectrumID - 1, &last) == 0)
+    {
+        entry->firstTimestampNs = first.timestampNs;
+        entry->lastTimestampNs = last.timestampNs;
+    }
+    files->packed = fileHeader.flags & HODR_FILE_PACKED; // An existing file is written the way it was created
+    return 0;
+}
+
+// Make manifest entry n the partition written to, opening its files. The
+// previous partition's files are closed. Returns 0 or -1 on error, which
+// leaves the previous partition in place.
+static int usePartition(long n, HODR_ManifestEntry_t *entry)
+{
+    PartitionFiles_t files;
+    if (openPartition(entry, &files) != 0)
+    {
+        return -1;
+    }
+    if (store_writeManifest(writer.manifestFd, n, entry) != 0)
+    {
+        closeFiles(&files);
+        return -1;
+    }
+
+    metrics_lock(&writer.filesLock, METRIC_DATA_FILE_LOCK_WAIT);
+    PartitionFiles_t old = {.dataFd = writer.dataFd, .indexFd = writer.indexFd, .stateFd = writer.stateFd};
+    writer.dataFd = files.dataFd;
+    writer.indexFd = files.indexFd;
+    writer.stateFd = files.stateFd;
+    writer.partition = n;
+    pthread_mutex_lock(&writer.currentLock);
+    writer.current = *entry;
+    pthread_mutex_unlock(&writer.currentLock);
+    writer.packed = files.packed;
+    writer.endOffset = files.endOffset;
+    writer.indexEntries = (long)(entry->endSpectrumID - entry->firstSpectrumID);
+    writer.indexDirty = false;
+    snprintf(writer.dataPath, sizeof(writer.dataPath), "%s/%s", writer.directory, entry->name);
+    pthread_mutex_unlock(&writer.filesLock);
+
+    // The CSV export follows the data file, "name.hodr" to "name.csv"
+    snprintf(writer.csvPath, sizeof(writer.csvPath), "%.*s.csv", (int)(strlen(writer.dataPath) - strlen(".hodr")), writer.dataPath);
+    if (writer.csvFile != NULL)
+    {
+        fclose(writer.csvFile); // Reopened on the new path by the next export
+        writer.csvFile = NULL;
+    }
+    closeFiles(&old);
+    return 0;
+}
+
+// Start a new partition with the spectrum of slot if the day has changed or
+// the current partition is full. A failure is logged and writing carries on
+// in the current partition.
+static void writerRotate(const HODR_FrameSlot_t *slot)
+{
+    bool full = writer.maxBytes > 0 && (uint64_t)writer.endOffset >= writer.maxBytes && writer.indexEntries > 0;
+    if (slot->timestampNs < writer.rotateAtNs && !full)
+    {
+        return;
+    }
+    if (writer.indexDirty)
+    {
+        return; // The partition is not left with an incomplete index
+    }
+    HODR_ManifestEntry_t entry = {.firstSpectrumID = slot->spectrumID};
+    partitionName(entry.name, sizeof(entry.name), slot->timestampNs);
+    if (usePartition(writer.partition + 1, &entry) != 0)
+    {
+        log_errorEvery(60000, "Failed to start partition %s, carrying on in %s.", entry.name, writer.current.name);
+        return;
+    }
+    writer.rotateAtNs = nextMidnightNs(slot->timestampNs);
+    log_info("Started partition %s at spectrum %u.", entry.name, slot->spectrumID);
+}
+
+static void *writerThread(void *arg)
+{
+    (void)arg;
+    size_t available;
+    while ((available = ring_wait(writer.ring, writer.consumer)) > 0) // Returns 0 once the ring is closed and drained
+    {
+        size_t count = available > WRITER_BATCH_LENGTH ? WRITER_BATCH_LENGTH : available;
+        writerRotate(ring_peek(writer.ring, writer.consumer, 0));
+        for (size_t i = 1; i < count; i++)
+        {
+            if (ring_peek(writer.ring, writer.consumer, i)->timestampNs >= writer.rotateAtNs)
+            {
+                count = i; // The rest goes to the next day's partition
+                break;
+            }
+        }
+        uint64_t start = metrics_nowNs();
+        int result = writerWriteBatch(count);
+        metrics_since(METRIC_WRITE, start);
+        if (result != 0)
+        {
+            if (ring_closed(writer.ring))
+            {
+                log_error("Discarding %zu unwritten spectra.", available);
+                break;
+            }
+            // Keep the frames in the ring and retry, readout carries on until the ring fills
+            struct timespec retry = {.tv_sec = 1};
+            nanosleep(&retry, NULL);
+            continue;
+        }
+        HODR_FrameSlot_t *last = ring_peek(writer.ring, writer.consumer, count - 1);
+        uint32_t committed = last->spectrumID + 1;
+        pthread_mutex_lock(&writer.lastLock);
+        writer.last = writer.headers[count - 1];
+        pthread_mutex_unlock(&writer.lastLock);
+        atomic_store(&writer.committed, committed);
+        ring_release(writer.ring, writer.consumer, count); // Hand the slots back to readout
+        if (writer.onCommit != NULL)
+        {
+            writer.onCommit(committed);
+        }
+    }
+    return NULL;
+}
+
+// Start writing to the partitions in directory. The newest partition is
+// carried on if it is today's, or if there is no manifest yet today's file
+// from before partitioning is taken over; otherwise a new one is started.
+// Spectrum IDs continue from the newest partition.
+int writer_start(HODR_Ring_t *ring, const char *directory, uint32_t xpixels, uint32_t fileFlags, uint64_t maxPartitionBytes)
+{
+    char manifestPath[sizeof(writer.directory) + sizeof(HODR_MANIFEST_NAME) + 1];
+    snprintf(writer.directory, sizeof(writer.directory), "%s", directory);
+    store_manifestPath(writer.directory, manifestPath, sizeof(manifestPath));
+    writer.xpixels = xpixels;
+    writer.fileFlags = fileFlags;
+    writer.maxBytes = maxPartitionBytes;
+    writer.manifestFd = store_openManifest(manifestPath);
+    long partitions = writer.manifestFd >= 0 ? store_manifestCount(writer.manifestFd) : -1;
+    HODR_ManifestEntry_t entry = {0};
+    if (partitions < 0 || (partitions > 0 && store_readManifest(writer.manifestFd, partitions - 1, &entry) != 0))
+    {
+        writer_stop();
+        return -1;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    int64_t nowNs = (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+    char today[sizeof(entry.name)];
+    partitionName(today, sizeof(today), nowNs);
+    size_t dateLength = strlen("YYYY-MM-DD_andor");
+
+    long n = partitions;
+    if (partitions > 0 && strncmp(entry.name, today, dateLength) == 0)
+    {
+        n = partitions - 1; // Carry on with today's newest partition
+    }
+    else if (partitions > 0)
+    {
+        entry = (HODR_ManifestEntry_t){.firstSpectrumID = entry.endSpectrumID};
+        snprintf(entry.name, sizeof(entry.name), "%s", today);
+    }
+    else
+    {
+        // No manifest yet. Today's file, if there is one, was named without
+        // a number and continues its own spectrum IDs.
+        snprintf(entry.name, sizeof(entry.name), "%.*s.hodr", (int)dateLength, today);
+    }
+    if (usePartition(n, &entry) != 0)
+    {
+        writer_stop();
+        return -1;
+    }
+    writer.rotateAtNs = nextMidnightNs(nowNs);
+
+    writer.payloads = malloc(WRITER_BATCH_LENGTH * HODR_RECORD_MAX_PAYLOAD(xpixels));
+    writer.ring = ring;
+    writer.consumer = ring_addConsumer(ring, "storage", false);
+    if (writer.payloads == NULL || writer.consumer == NULL)
+    {
+        writer_stop();
+        return -1;
+    }
+
+    atomic_store(&writer.committed, entry.endSpectrumID);
+    if (pthread_create(&writer.thread, NULL, writerThread, NULL) != 0)
+    {
+        writer_stop();
+        return -1;
+    }
+    writer.running = true;
+    log_info("Writer started for %s, partition %ld, next spectrum ID %u.", writer.dataPath, writer.partition, entry.endSpectrumID);
+    return 0;
+}
+
+// Flush the frames still in the ring and close the data file. The ring must
+// have been closed so that the writer thread finishes.
+void writer_stop()
+{
+    if (writer.running)
+    {
+        pthread_join(writer.thread, NULL);
+        writer.running = false;
+    }
+
+    if (writer.csvFile != NULL)
+    {
+        fclose(writer.csvFile);
+        writer.csvFile = NULL;
+    }
+    if (writer.dataFd >= 0)
+    {
+        close(writer.dataFd);
+        writer.dataFd = -1;
+    }
+    if (writer.indexFd >= 0)
+    {
+        close(writer.indexFd);
+        writer.indexFd = -1;
+    }
+    if (writer.stateFd >= 0)
+    {
+        close(writer.stateFd);
+        writer.stateFd = -1;
+    }
+    if (writer.manifestFd >= 0)
+    {
+        close(writer.manifestFd);
+        writer.manifestFd = -1;
+    }
+    free(writer.payloads);
+    writer.payloads = NULL;
+}
+
+typedef struct {
+    int dataFd;
+    int indexFd;
+    uint32_t endSpectrumID; // One past the partition's last committed spectrum
+} Partition_t;
+
+static void closePartition(Partition_t *partition)
+{
+    if (partition->dataFd >= 0)
+    {
+        close(partition->dataFd);
+    }
+    if (partition->indexFd >= 0)
+    {
+        close(partition->indexFd);
+    }
+}
+
+// Find the partition holding a committed spectrum. The current partition is
+// read through duplicates of the writer's descriptors, so the reads happen
+// without filesLock and never hold up storage; an older one is looked up in
+// the manifest and opened. Returns 0, or -1 if the spectrum is not on disk.
+// Every partition found is handed back to closePartition().
+static int openPartitionOf(uint32_t spectrumID, Partition_t *partition)
+{
+    uint32_t committed = atomic_load(&writer.committed);
+    if (spectrumID >= committed)
+    {
+        return -1;
+    }
+    metrics_lock(&writer.filesLock, METRIC_DATA_FILE_LOCK_WAIT);
+    if (writer.indexFd >= 0 && spectrumID >= writer.current.firstSpectrumID) // Only changes under filesLock
+    {
+        *partition = (Partition_t){.dataFd = dup(writer.dataFd), .indexFd = dup(writer.indexFd), .endSpectrumID = committed};
+        pthread_mutex_unlock(&writer.filesLock);
+        if (partition->dataFd < 0 || partition->indexFd < 0)
+        {
+            log_warnEvery(1000, "Failed to duplicate the data file descriptors: %s", strerror(errno));
+            closePartition(partition);
+            return -1;
+        }
+        return 0;
+    }
+    pthread_mutex_unlock(&writer.filesLock);
+    HODR_ManifestEntry_t entry;
+    long n = writer.manifestFd >= 0 ? store_findPartition(writer.manifestFd, spectrumID, &entry) : -1;
+    if (n < 0)
+    {
+        return -1;
+    }
+
+    char dataPath[sizeof(writer.dataPath)];
+    char indexPath[sizeof(writer.dataPath) + 4];
+    snprintf(dataPath, sizeof(dataPath), "%s/%s", writer.directory, entry.name);
+    store_indexPath(dataPath, indexPath, sizeof(indexPath));
+    *partition = (Partition_t){
+        .dataFd = open(dataPath, O_RDONLY | O_CLOEXEC),
+        .indexFd = open(indexPath, O_RDONLY | O_CLOEXEC),
+        .endSpectrumID = entry.endSpectrumID,
+    };
+    if (partition->dataFd < 0 || partition->indexFd < 0)
+    {
+        log_warn("Failed to open partition %s: %s", entry.name, strerror(errno));
+        closePartition(partition);
+        return -1;
+    }
+    return 0;
+}
+
+// Read a committed spectrum back from its partition.
+// Returns the number of pixels or -1 if the spectrum is not on disk.
+int writer_readSpectrum(uint32_t spectrumID, HODR_RecordHeader_t *header, int32_t *data, size_t maxPixels)
+{
+    Partition_t partition;
+    if (openPartitionOf(spectrumID, &partition) != 0)
+    {
+        return -1;
+    }
+    HODR_IndexEntry_t entry;
+    int result = -1;
+    if (store_lookupIndex(partition.indexFd, spectrumID, &entry) == 0)
+    {
+        result = store_readSpectrum(partition.dataFd, (off_t)entry.offset, header, data, maxPixels);
+    }
+    closePartition(&partition);
+    if (result >= 0 && header->spectrumID != spectrumID)
+    {
+        return -1;
+    }
+    return result;
+}
+
+// Read up to count committed spectra from firstID on, see store_readSpectra().
+// The spectra all come from the partition of firstID, so fewer may be read
+// where a partition ends. Returns the number read or -1 if none of them are
+// on disk.
+long writer_readSpectra(uint32_t firstID, size_t count, HODR_RecordHeader_t *headers, int32_t *data, size_t npixels)
+{
+    Partition_t partition;
+    if (openPartitionOf(firstID, &partition) != 0)
+    {
+        return -1;
+    }
+    if (count > partition.endSpectrumID - firstID)
+    {
+        count = partition.endSpectrumID - firstID;
+    }
+    long result = store_readSpectra(partition.dataFd, partition.indexFd, firstID, count, headers, data, npixels);
+    closePartition(&partition);
+    return result;
+}
+
+// First committed spectrum ID taken at or after timestampNs, writer_committedSpectra()
+// if there is none. The manifest gives the partition, its index the spectrum.
+// Returns -1 if the partitions cannot be read.
+long writer_findTime(int64_t timestampNs)
+{
+    uint32_t committed = atomic_load(&writer.committed);
+    metrics_lock(&writer.filesLock, METRIC_DATA_FILE_LOCK_WAIT);
+    if (writer.indexFd < 0)
+    {
+        pthread_mutex_unlock(&writer.filesLock);
+        return -1;
+    }
+    long partition = writer.partition;
+    int currentIndexFd = dup(writer.indexFd); // Searched without filesLock
+    pthread_mutex_lock(&writer.currentLock);
+    HODR_ManifestEntry_t current = writer.current;
+    pthread_mutex_unlock(&writer.currentLock);
+    pthread_mutex_unlock(&writer.filesLock);
+    if (currentIndexFd < 0)
+    {
+        log_warnEvery(1000, "Failed to duplicate the index descriptor: %s", strerror(errno));
+        return -1;
+    }
+
+    HODR_ManifestEntry_t entry;
+    long n = writer.manifestFd >= 0 ? store_findPartitionTime(writer.manifestFd, timestampNs, &entry) : -1;
+    if (n < 0 || n >= partition)
+    {
+        // The current partition, whose manifest entry may lag its index
+        long found = timestampNs <= current.firstTimestampNs ? (long)current.firstSpectrumID : store_findTime(currentIndexFd, timestampNs);
+        close(currentIndexFd);
+        return found < 0 || found > (long)committed ? (long)committed : found;
+    }
+    close(currentIndexFd);
+
+    char dataPath[sizeof(writer.dataPath)];
+    char indexPath[sizeof(writer.dataPath) + 4];
+    snprintf(dataPath, sizeof(dataPath), "%s/%s", writer.directory, entry.name);
+    store_indexPath(dataPath, indexPath, sizeof(indexPath));
+    int indexFd = open(indexPath, O_RDONLY | O_CLOEXEC);
+    if (indexFd < 0)
+    {
+        log_warn("Failed to open partition index %s: %s", indexPath, strerror(errno));
+        return -1;
+    }
+    long found = store_findTime(indexFd, timestampNs);
+    close(indexFd);
+    return found;
+}
+
+// Path of the data file being written
+void writer_dataPath(char *buffer, size_t bufferSize)
+{
+    metrics_lock(&writer.filesLock, METRIC_DATA_FILE_LOCK_WAIT);
+    snprintf(buffer, bufferSize, "%s", writer.dataPath);
+    pthread_mutex_unlock(&writer.filesLock);
+}
+
+// Spectra written to the data file, which is also the ID after the last one
+uint32_t writer_committedSpectra()
+{
+    return atomic_load(&writer.committed);
+}
+
+// Header of the newest spectrum committed since the writer started. Returns
+// false if there is none yet.
+bool writer_lastCommitted(HODR_RecordHeader_t *header)
+{
+    pthread_mutex_lock(&writer.lastLock);
+    *header = writer.last;
+    pthread_mutex_unlock(&writer.lastLock);
+    return header->magic == HODR_RECORD_MAGIC;
+}
+
+// Called from the writer thread after every batch that reaches the disk, with
+// one past the newest committed spectrum ID. Must be set before writer_start()
+// and must not block.
+void writer_setCommitCallback(void (*callback)(uint32_t committed))
+{
+    writer.onCommit = callback;
+}
+
+void writer_setCsvExport(bool enable)
+{
+    atomic_store(&writer.csvExport, enable);
+}
+
+bool writer_getCsvExport()
+{
+    return atomic_load(&writer.csvExport);
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "store.h"
+#include "ring.h"
+
+// Data file writer.
+//
+// A dedicated thread owns the open descriptors of the data file and its
+// index. It is the lossless consumer of the frame ring: it encodes whatever
+// frames readout has published and appends them with one vectored write, so
+// readout never waits on the filesystem. Frames stay in the ring until they
+// are on disk.
+//
+// The archive is partitioned, see HODR_MANIFEST_NAME. The writer starts a new
+// partition, "YYYY-MM-DD_andor.hodr" or "YYYY-MM-DD_andor.N.hodr", with the
+// first spectrum taken after local midnight and, if a size is set, once the
+// current one has grown past it. Rotating only swaps descriptors between two
+// batches, frames keep queueing in the ring meanwhile. Spectrum IDs continue
+// across partitions.
+
+#define WRITER_BATCH_LENGTH 256 // Most spectra coalesced into one write
+
+int writer_start(HODR_Ring_t *ring, const char *directory, uint32_t xpixels, uint32_t fileFlags, uint64_t maxPartitionBytes);
+void writer_stop();
+void writer_dataPath(char *buffer, size_t bufferSize);
+
+int writer_readSpectrum(uint32_t spectrumID, HODR_RecordHeader_t *header, int32_t *data, size_t maxPixels);
+long writer_readSpectra(uint32_t firstID, size_t count, HODR_RecordHeader_t *headers, int32_t *data, size_t npixels);
+long writer_findTime(int64_t timestampNs);
+
+uint32_t writer_committedSpectra();
+bool writer_lastCommitted(HODR_RecordHeader_t *header);
+void writer_setCommitCallback(void (*callback)(uint32_t committed));
+void writer_setCsvExport(bool enable);
+bool writer_getCsvExport();
@@ -0,0 +1,352 @@
+// Tests of the frame kernels against plain reference loops.
+//
+// Tests the version HODR_KERNELS picks, over every length up to
+// SHORT_LENGTHS and a few long ones, from aligned and unaligned pointers,
+// with edge values and the maximum at the start, in the tail and repeated.
+// Checks that nothing is written past the end. A version this CPU does not
+// have is skipped. make test runs it for every version:
+//
+//     make test
+
+#include "kernels.h"
+#include "log.h"
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SHORT_LENGTHS 160 // Every length up to this, ten AVX-512 vectors
+#define LONG_LENGTH 4099  // Longest tested, the last also odd so every version runs its tail
+#define GUARD 32          // Elements after the end that must stay untouched
+#define PATTERNS 8
+
+static const size_t longLengths[] = {255, 256, 257, 1031, 2048, LONG_LENGTH};
+static const int32_t edgeValues[] = {INT32_MIN, INT32_MIN + 1, -65536, -1, 0, 1, 65534, 65535, 65536, INT32_MAX - 1, INT32_MAX};
+static const int32_t thresholds[] = {INT32_MIN, -1, 0, 1, 65534, 65535, INT32_MAX};
+
+static long checks = 0;
+static long failures = 0;
+
+static void check(bool passed, const char *what, size_t npixels, int pattern, size_t offset)
+{
+    checks++;
+    if (!passed)
+    {
+        if (failures < 20) // Enough to see what broke
+        {
+            fprintf(stderr, "%s kernels: %s wrong for %zu pixels, pattern %d, offset %zu.\n", kernels_name(), what, npixels, pattern, offset);
+        }
+        failures++;
+    }
+}
+
+static uint32_t nextRandom(uint32_t *state)
+{
+    *state = *state * 1664525u + 1013904223u;
+    return *state;
+}
+
+// Fill data with one of the test patterns
+static void fill(int32_t *data, size_t npixels, int pattern, uint32_t *state)
+{
+    size_t edges = sizeof(edgeValues) / sizeof(edgeValues[0]);
+    for (size_t i = 0; i < npixels; i++)
+    {
+        uint32_t random = nextRandom(state);
+        switch (pattern)
+        {
+        case 0: // Every magnitude, both signs
+            data[i] = (int32_t)random >> (i % 31);
+            break;
+        case 1:
+            data[i] = INT32_MIN;
+            break;
+        case 2:
+            data[i] = INT32_MAX;
+            break;
+        case 3:
+            data[i] = 7;
+            break;
+        case 4: // Edge values in every lane position
+            data[i] = edgeValues[(i + random % 3) % edges];
+            break;
+        default: // Camera-like counts, the maximum placed below
+            data[i] = (int32_t)(random >> 16);
+            break;
+        }
+    }
+    if (npixels > 0 && pattern == 5)
+    {
+        data[npixels - 1] = 70000; // Maximum in the tail
+    }
+    else if (npixels > 0 && pattern == 6)
+    {
+        data[0] = 70000; // Maximum first and again at the end, the first counts
+        data[npixels - 1] = 70000;
+    }
+    else if (npixels > 0 && pattern == 7)
+    {
+        data[npixels / 2] = INT32_MAX;
+        data[(npixels - 1) / 3] = INT32_MIN;
+    }
+}
+
+static bool untouched(const void *end, size_t bytes)
+{
+    const unsigned char *guard = end;
+    for (size_t i = 0; i < bytes; i++)
+    {
+        if (guard[i] != 0xA5)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The reductions
+static void testReductions(const int32_t *data, size_t n, int pattern, size_t offset)
+{
+    int32_t max = INT32_MIN, min = INT32_MAX;
+    size_t argmax = 0;
+    int64_t sum = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (data[i] > max || i == 0)
+        {
+            max = data[i];
+            argmax = i;
+        }
+        min = data[i] < min ? data[i] : min;
+        sum += data[i];
+    }
+    check(kernels_max(data, n) == max, "max", n, pattern, offset);
+    check(kernels_argmax(data, n) == argmax, "argmax", n, pattern, offset);
+    int32_t checkMin = 0, checkMax = 0;
+    kernels_minMax(data, n, &checkMin, &checkMax);
+    check(checkMin == min && checkMax == max, "minMax", n, pattern, offset);
+    check(kernels_sum(data, n) == sum, "sum", n, pattern, offset);
+
+    for (size_t t = 0; t <= sizeof(thresholds) / sizeof(thresholds[0]); t++)
+    {
+        int32_t threshold = t < sizeof(thresholds) / sizeof(thresholds[0]) ? thresholds[t] : n > 0 ? data[n / 2] : 0;
+        size_t count = 0;
+        for (size_t i = 0; i < n; i++)
+        {
+            count += data[i] >= threshold;
+        }
+        check(kernels_countAtLeast(data, n, threshold) == count, "countAtLeast", n, pattern, offset);
+    }
+}
+
+// The element-wise kernels, writing into out and out16 which have GUARD
+// elements to spare
+static void testElementWise(const int32_t *a, const int32_t *b, size_t n, int pattern, size_t offset,
+                            int32_t *out, int32_t *expected, uint16_t *out16, uint16_t *expected16, float *dark, float *gain)
+{
+    memset(out16, 0xA5, (n + GUARD) * sizeof(uint16_t));
+    kernels_to16(a, out16, n);
+    for (size_t i = 0; i < n; i++)
+    {
+        expected16[i] = (uint16_t)(a[i] < 0 ? 0 : a[i] > UINT16_MAX ? UINT16_MAX : a[i]);
+    }
+    check(memcmp(out16, expected16, n * sizeof(uint16_t)) == 0 && untouched(out16 + n, GUARD * sizeof(uint16_t)), "to16", n, pattern, offset);
+
+    memset(out, 0xA5, (n + GUARD) * sizeof(int32_t));
+    kernels_from16(expected16, out, n);
+    bool same = untouched(out + n, GUARD * sizeof(int32_t));
+    for (size_t i = 0; i < n; i++)
+    {
+        same = same && out[i] == expected16[i];
+    }
+    check(same, "from16", n, pattern, offset);
+
+    for (size_t i = 0; i < n; i++)
+    {
+        expected[i] = (int32_t)((uint32_t)a[i] + (uint32_t)b[i]);
+    }
+    memset(out, 0xA5, (n + GUARD) * sizeof(int32_t));
+    kernels_add(out, a, b, n);
+    check(memcmp(out, expected, n * sizeof(int32_t)) == 0 && untouched(out + n, GUARD * sizeof(int32_t)), "add", n, pattern, offset);
+    memcpy(out, a, n * sizeof(int32_t));
+    kernels_add(out, out, b, n); // In place
+    check(memcmp(out, expected, n * sizeof(int32_t)) == 0, "add in place", n, pattern, offset);
+
+    for (size_t i = 0; i < n; i++)
+    {
+        expected[i] = (int32_t)((uint32_t)a[i] - (uint32_t)b[i]);
+    }
+    memset(out, 0xA5, (n + GUARD) * sizeof(int32_t));
+    kernels_subtract(out, a, b, n);
+    check(memcmp(out, expected, n * sizeof(int32_t)) == 0 && untouched(out + n, GUARD * sizeof(int32_t)), "subtract", n, pattern, offset);
+
+    // Correction needs pixels a float holds exactly and results within int32
+    uint32_t state = (uint32_t)n;
+    int32_t *counts = expected + n + GUARD; // Scratch space past the expected pixels
+    for (size_t i = 0; i < n; i++)
+    {
+        counts[i] = a[i] >> 8;
+        dark[i] = (float)(nextRandom(&state) % 4000) / 7.0f;
+        gain[i] = 0.5f + (float)(i % 97) / 64.0f;
+        expected[i] = (int32_t)lrintf(((float)counts[i] - dark[i]) * gain[i]);
+    }
+    memset(out, 0xA5, (n + GUARD) * sizeof(int32_t));
+    kernels_correct(out, counts, dark, gain, n);
+    check(memcmp(out, expected, n * sizeof(int32_t)) == 0 && untouched(out + n, GUARD * sizeof(int32_t)), "correct", n, pattern, offset);
+    memcpy(out, counts, n * sizeof(int32_t));
+    kernels_correct(out, out, dark, gain, n); // In place
+    check(memcmp(out, expected, n * sizeof(int32_t)) == 0, "correct in place", n, pattern, offset);
+}
+
+static void testAccumulate(const int32_t *a, const int32_t *b, size_t n, int pattern, size_t offset, int64_t *sums, uint64_t *squares)
+{
+    int64_t *expectedSums = sums + n + GUARD;
+    uint64_t *expectedSquares = squares + n + GUARD;
+    memset(sums, 0xA5, (n + GUARD) * sizeof(int64_t));
+    memset(squares, 0xA5, (n + GUARD) * sizeof(uint64_t));
+    memcpy(expectedSums, sums, n * sizeof(int64_t));
+    memcpy(expectedSquares, squares, n * sizeof(uint64_t));
+    for (int frame = 0; frame < 2; frame++) // Twice, onto sums already holding something
+    {
+        const int32_t *data = frame == 0 ? a : b;
+        kernels_accumulate(sums, squares, data, n);
+        for (size_t i = 0; i < n; i++)
+        {
+            expectedSums[i] += data[i];
+            expectedSquares[i] += (uint64_t)((int64_t)data[i] * data[i]);
+        }
+    }
+    check(memcmp(sums, expectedSums, n * sizeof(int64_t)) == 0 && memcmp(squares, expectedSquares, n * sizeof(uint64_t)) == 0 &&
+              untouched(sums + n, GUARD * sizeof(int64_t)) && untouched(squares + n, GUARD * sizeof(uint64_t)),
+          "accumulate", n, pattern, offset);
+}
+
+// Resample npoints points from data of npixels pixels, including the first
+// and last pixel pairs
+static void testResample(const int32_t *data, size_t npixels, size_t npoints, int pattern, size_t offset,
+                         uint32_t *index, float *weightLeft, float *weightRight, float *out, float *expected)
+{
+    if (npixels < 2)
+    {
+        return;
+    }
+    uint32_t state = (uint32_t)npoints + 1;
+    for (size_t i = 0; i < npoints; i++)
+    {
+        index[i] = i == 0 ? 0 : i == npoints - 1 ? (uint32_t)(npixels - 2) : nextRandom(&state) % (uint32_t)(npixels - 1);
+        weightRight[i] = (float)(nextRandom(&state) % 1024) / 1024.0f;
+        weightLeft[i] = 1.0f - weightRight[i];
+        float left = (float)data[index[i]] * weightLeft[i];
+        float right = (float)data[index[i] + 1] * weightRight[i];
+        expected[i] = left + right;
+    }
+    memset(out, 0xA5, (npoints + GUARD) * sizeof(float));
+    kernels_resample(out, data, index, weightLeft, weightRight, npoints);
+    check(memcmp(out, expected, npoints * sizeof(float)) == 0 && untouched(out + npoints, GUARD * sizeof(float)), "resample", npoints, pattern, offset);
+}
+
+// Every bit width, against the layout of kernels_pack() built bit by bit:
+// value i is bit field i / 4 of lane i % 4, lane words interleaved four apart
+static void testPack(const int32_t *data, int pattern)
+{
+    uint32_t values[KERNELS_PACK_VALUES], unpacked[KERNELS_PACK_VALUES];
+    uint32_t expected[4 * 32 + GUARD], packed[4 * 32 + GUARD];
+    for (unsigned bits = 0; bits <= 32; bits++)
+    {
+        uint32_t mask = bits == 32 ? UINT32_MAX : (1u << bits) - 1;
+        memset(expected, 0, sizeof(expected));
+        for (unsigned i = 0; i < KERNELS_PACK_VALUES; i++)
+        {
+            values[i] = (uint32_t)data[i] & mask;
+            for (unsigned bit = 0; bit < bits; bit++)
+            {
+                unsigned position = (i / 4) * bits + bit;
+                expected[position / 32 * 4 + i % 4] |= (values[i] >> bit & 1u) << (position % 32);
+            }
+        }
+        memset(packed, 0xA5, sizeof(packed));
+        kernels_pack(packed, values, bits);
+        check(memcmp(packed, expected, KERNELS_PACKED_BYTES(bits)) == 0 &&
+                  untouched((unsigned char *)packed + KERNELS_PACKED_BYTES(bits), sizeof(packed) - KERNELS_PACKED_BYTES(bits)),
+              "pack", bits, pattern, 0);
+        kernels_unpack(unpacked, expected, bits);
+        check(memcmp(unpacked, values, sizeof(values)) == 0, "unpack", bits, pattern, 0);
+    }
+}
+
+static void testLength(size_t n, int pattern, size_t offset, int32_t *a, int32_t *b, int32_t *out, int32_t *expected,
+                       uint16_t *out16, uint16_t *expected16, float *dark, float *gain, int64_t *sums, uint64_t *squares, uint32_t *index)
+{
+    uint32_t state = (uint32_t)(n * PATTERNS + (size_t)pattern);
+    const int32_t *data = a + offset; // Unaligned for an odd offset
+    fill(a + offset, n, pattern, &state);
+    fill(b, n, 0, &state);
+    testReductions(data, n, pattern, offset);
+    testElementWise(data, b, n, pattern, offset, out + offset, expected, out16 + offset, expected16, dark, gain);
+    testAccumulate(data, b, n, pattern, offset, sums + offset, squares);
+    testResample(data, n, n, pattern, offset, index, gain, dark, (float *)out + offset, (float *)expected);
+}
+
+int main()
+{
+    log_setLevel(LOG_LEVEL_ERROR); // A missing version is reported below
+    const char *wanted = getenv("HODR_KERNELS");
+    if (kernels_init() != 0)
+    {
+        fprintf(stderr, "%s kernels: a faster version disagreed with the scalar ones at startup.\n", kernels_name());
+        return EXIT_FAILURE;
+    }
+    if (wanted != NULL && wanted[0] != '\0' && strcmp(wanted, kernels_name()) != 0)
+    {
+        printf("%s kernels: not available on this CPU, skipped.\n", wanted);
+        return EXIT_SUCCESS;
+    }
+
+    size_t size = 2 * (LONG_LENGTH + 2 * GUARD); // Room for the pixels, an offset and scratch space past the guard
+    int32_t *a = malloc(size * sizeof(int32_t)), *b = malloc(size * sizeof(int32_t));
+    int32_t *out = malloc(size * sizeof(int32_t)), *expected = malloc(size * sizeof(int32_t));
+    uint16_t *out16 = malloc(size * sizeof(uint16_t)), *expected16 = malloc(size * sizeof(uint16_t));
+    float *dark = malloc(size * sizeof(float)), *gain = malloc(size * sizeof(float));
+    int64_t *sums = malloc(size * sizeof(int64_t));
+    uint64_t *squares = malloc(size * sizeof(uint64_t));
+    uint32_t *index = malloc(size * sizeof(uint32_t));
+    if (a == NULL || b == NULL || out == NULL || expected == NULL || out16 == NULL || expected16 == NULL || dark == NULL || gain == NULL ||
+        sums == NULL || squares == NULL || index == NULL)
+    {
+        fprintf(stderr, "Out of memory.\n");
+        return EXIT_FAILURE;
+    }
+
+    for (int pattern = 0; pattern < PATTERNS; pattern++)
+    {
+        for (size_t offset = 0; offset < 2; offset++)
+        {
+            for (size_t n = 0; n <= SHORT_LENGTHS; n++)
+            {
+                testLength(n, pattern, offset, a, b, out, expected, out16, expected16, dark, gain, sums, squares, index);
+            }
+            for (size_t i = 0; i < sizeof(longLengths) / sizeof(longLengths[0]); i++)
+            {
+                testLength(longLengths[i], pattern, offset, a, b, out, expected, out16, expected16, dark, gain, sums, squares, index);
+            }
+        }
+        uint32_t state = (uint32_t)pattern;
+        fill(a, KERNELS_PACK_VALUES, pattern, &state);
+        testPack(a, pattern);
+    }
+
+    printf("%s kernels: %ld checks, %ld failed.\n", kernels_name(), checks, failures);
+    free(a);
+    free(b);
+    free(out);
+    free(expected);
+    free(out16);
+    free(expected16);
+    free(dark);
+    free(gain);
+    free(sums);
+    free(squares);
+    free(index);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
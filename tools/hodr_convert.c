@@ -0,0 +1,316 @@
+// Converter of legacy CSV archives to HODR data files.
+//
+// Every CSV file, one spectrum per line in the legacy format, becomes a data
+// file in OUTPUT_DIR named after it, "name.csv" to "name.hodr", with its index
+// and state. Files are converted in parallel, one per thread. Spectrum IDs
+// start at 0 in every file, as they did in the daily CSV files. An existing
+// data file is never overwritten.
+//
+//     make tools && tools/hodr_convert [-j THREADS] [-p] OUTPUT_DIR FILE.csv...
+//
+// -p packs the spectra with the spectrum codec.
+
+#define _GNU_SOURCE // strptime
+#include "store.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#define CONVERT_BUFFER_BYTES (4 << 20) // Records gathered into one write
+#define CONVERT_INDEX_ENTRIES 4096     // Index entries gathered into one write
+
+typedef struct {
+    char **files;
+    int nfiles;
+    const char *outputDir;
+    uint32_t fileFlags;
+    atomic_int next;   // Next file to convert
+    atomic_int failed; // Files that could not be converted
+} Convert_t;
+
+typedef struct {
+    int dataFd;
+    int indexFd;
+    char *buffer;      // Records not written yet
+    size_t buffered;
+    HODR_IndexEntry_t entries[CONVERT_INDEX_ENTRIES];
+    size_t nentries;   // Index entries not written yet
+    long indexed;      // Index entries written
+    off_t endOffset;   // Of the data file, with the buffered records
+} Output_t;
+
+// Parse a line of the legacy CSV format, store_writeCsvLine(), into header and
+// data, which holds maxPixels. Returns the number of pixels, or -1 if the line
+// is not a spectrum.
+static long parseLine(char *line, HODR_RecordHeader_t *header, int32_t *data, size_t maxPixels)
+{
+    struct tm timeInfo = {0};
+    char *p = strptime(line, "%Y-%m-%dT%H:%M:%S", &timeInfo);
+    if (p == NULL || *p != ',')
+    {
+        return -1;
+    }
+    timeInfo.tm_isdst = -1; // Local time, as it was written
+    header->timestampNs = (int64_t)mktime(&timeInfo) * 1000000000LL;
+
+    char *end;
+    header->exposureTime = strtof(p + 1, &end);
+    if (end == p + 1 || *end != ',')
+    {
+        return -1;
+    }
+    p = end;
+    header->temperature = strtof(p + 1, &end);
+    if (end == p + 1 || *end != ',')
+    {
+        return -1;
+    }
+    p = end;
+
+    size_t npixels = 0;
+    while (*p == ',' && npixels < maxPixels)
+    {
+        long value = strtol(p + 1, &end, 10);
+        if (end == p + 1)
+        {
+            return -1;
+        }
+        data[npixels++] = (int32_t)value;
+        p = end;
+    }
+    return *p == '\n' || *p == '\r' || *p == '\0' ? (long)npixels : -1;
+}
+
+static int flushOutput(Output_t *out)
+{
+    if (out->buffered > 0 && write(out->dataFd, out->buffer, out->buffered) != (ssize_t)out->buffered)
+    {
+        return -1;
+    }
+    off_t position = (off_t)(sizeof(HODR_IndexHeader_t) + (size_t)out->indexed * sizeof(HODR_IndexEntry_t));
+    size_t bytes = out->nentries * sizeof(HODR_IndexEntry_t);
+    if (out->nentries > 0 && pwrite(out->indexFd, out->entries, bytes, position) != (ssize_t)bytes)
+    {
+        return -1;
+    }
+    out->indexed += (long)out->nentries;
+    out->buffered = 0;
+    out->nentries = 0;
+    return 0;
+}
+
+// Convert one CSV file. Returns 0 or -1 on error.
+static int convertFile(const char *csvPath, const char *outputDir, uint32_t fileFlags)
+{
+    char name[4096];
+    char dataPath[8192], indexPath[8200], statePath[8200];
+    const char *base = strrchr(csvPath, '/');
+    snprintf(name, sizeof(name), "%s", base != NULL ? base + 1 : csvPath);
+    char *extension = strrchr(name, '.');
+    if (extension != NULL && strcmp(extension, ".csv") == 0)
+    {
+        *extension = '\0';
+    }
+    snprintf(dataPath, sizeof(dataPath), "%s/%s.hodr", outputDir, name);
+    store_indexPath(dataPath, indexPath, sizeof(indexPath));
+    store_statePath(dataPath, statePath, sizeof(statePath));
+
+    FILE *in = fopen(csvPath, "r");
+    if (in == NULL)
+    {
+        fprintf(stderr, "%s: %s\n", csvPath, strerror(errno));
+        return -1;
+    }
+
+    Output_t out = {.dataFd = -1, .indexFd = -1};
+    int stateFd = -1;
+    size_t bufferSize = 0;
+    char *line = NULL;
+    size_t lineSize = 0;
+    size_t capacity = 0; // Pixels data holds
+    size_t npixels = 0;  // Of every spectrum of the file, those of the first
+    int32_t *data = NULL;
+    void *payload = NULL;
+    HODR_RecordHeader_t header;
+    HODR_RecordHeader_t last = {0};
+    off_t lastRecord = 0;
+    long spectra = 0, skipped = 0;
+    bool created = false; // The data file is this conversion's
+    int result = -1;
+
+    ssize_t length;
+    while ((length = getline(&line, &lineSize, in)) > 0)
+    {
+        if ((size_t)length / 2 + 1 > capacity)
+        {
+            // A line has at most one pixel per two characters
+            capacity = (size_t)length / 2 + 1;
+            free(data);
+            data = malloc(capacity * sizeof(int32_t));
+            if (data == NULL)
+            {
+                goto done;
+            }
+        }
+        memset(&header, 0, sizeof(header));
+        long parsed = parseLine(line, &header, data, capacity);
+        if (parsed <= 0 || (npixels > 0 && (size_t)parsed != npixels))
+        {
+            skipped++; // Not a spectrum, or not one of this file's size
+            continue;
+        }
+
+        if (out.dataFd < 0)
+        {
+            npixels = (size_t)parsed;
+            // Created exclusively, so that neither an existing file nor that of
+            // another input with the same name, converted meanwhile, is written to
+            int fd = open(dataPath, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+            if (fd < 0)
+            {
+                fprintf(stderr, "%s: %s, not converting %s\n", dataPath, errno == EEXIST ? "already exists" : strerror(errno), csvPath);
+                goto done;
+            }
+            close(fd);
+            created = true;
+            out.dataFd = store_openDataFile(dataPath, (uint32_t)npixels, fileFlags);
+            out.indexFd = store_openIndex(indexPath, 0);
+            stateFd = store_openState(statePath);
+            payload = malloc(HODR_RECORD_MAX_PAYLOAD(npixels));
+            bufferSize = sizeof(header) + HODR_RECORD_MAX_PAYLOAD(npixels);
+            bufferSize = bufferSize > CONVERT_BUFFER_BYTES ? bufferSize : CONVERT_BUFFER_BYTES;
+            out.buffer = malloc(bufferSize);
+            if (out.dataFd < 0 || out.indexFd < 0 || stateFd < 0 || payload == NULL || out.buffer == NULL)
+            {
+                goto done;
+            }
+            out.endOffset = lseek(out.dataFd, 0, SEEK_END);
+        }
+        header.spectrumID = (uint32_t)spectra;
+        size_t payloadBytes = fileFlags & HODR_FILE_PACKED ? store_encodePacked(&header, payload, data, npixels)
+                                                            : store_encodeSpectrum(&header, payload, data, npixels);
+        size_t recordBytes = sizeof(header) + payloadBytes;
+        if ((out.buffered + recordBytes > bufferSize || out.nentries == CONVERT_INDEX_ENTRIES) && flushOutput(&out) != 0)
+        {
+            fprintf(stderr, "Error writing %s: %s\n", dataPath, strerror(errno));
+            goto done;
+        }
+        memcpy(out.buffer + out.buffered, &header, sizeof(header));
+        memcpy(out.buffer + out.buffered + sizeof(header), payload, payloadBytes);
+        out.buffered += recordBytes;
+        out.entries[out.nentries++] = (HODR_IndexEntry_t){.offset = (uint64_t)out.endOffset, .timestampNs = header.timestampNs};
+        lastRecord = out.endOffset;
+        last = header;
+        out.endOffset += (off_t)recordBytes;
+        spectra++;
+    }
+
+    if (out.dataFd < 0)
+    {
+        fprintf(stderr, "%s: no spectra\n", csvPath);
+        goto done;
+    }
+    if (flushOutput(&out) != 0 || store_writeState(stateFd, (uint32_t)spectra, lastRecord, out.endOffset, last.checksum) != 0)
+    {
+        fprintf(stderr, "Error writing %s: %s\n", dataPath, strerror(errno));
+        goto done;
+    }
+    fprintf(stderr, "%s: %ld spectra of %zu pixels, %.1f MB to %.1f MB in %s\n", csvPath, spectra, npixels, (double)ftello(in) / 1e6,
+            (double)out.endOffset / 1e6, dataPath);
+    if (skipped > 0)
+    {
+        fprintf(stderr, "%s: skipped %ld lines that are not spectra of %zu pixels\n", csvPath, skipped, npixels);
+    }
+    result = 0;
+
+done:
+    if (result != 0 && created)
+    {
+        unlink(dataPath); // Not half a conversion, and only this one's
+        unlink(indexPath);
+        unlink(statePath);
+    }
+    if (out.dataFd >= 0)
+        close(out.dataFd);
+    if (out.indexFd >= 0)
+        close(out.indexFd);
+    if (stateFd >= 0)
+        close(stateFd);
+    fclose(in);
+    free(line);
+    free(data);
+    free(payload);
+    free(out.buffer);
+    return result;
+}
+
+static void *convertThread(void *arg)
+{
+    Convert_t *convert = arg;
+    int n;
+    while ((n = atomic_fetch_add(&convert->next, 1)) < convert->nfiles)
+    {
+        if (convertFile(convert->files[n], convert->outputDir, convert->fileFlags) != 0)
+        {
+            atomic_fetch_add(&convert->failed, 1);
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t fileFlags = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "j:p")) != -1)
+    {
+        switch (opt)
+        {
+        case 'j':
+            threads = strtol(optarg, NULL, 10);
+            break;
+        case 'p':
+            fileFlags |= HODR_FILE_PACKED;
+            break;
+        default:
+            optind = argc; // Usage
+        }
+    }
+    if (argc - optind < 2 || threads < 1)
+    {
+        fprintf(stderr, "Usage: %s [-j THREADS] [-p] OUTPUT_DIR FILE.csv...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    log_setLevel(LOG_LEVEL_WARN); // Only the summary of every file
+
+    Convert_t convert = {.files = argv + optind + 1, .nfiles = argc - optind - 1, .outputDir = argv[optind], .fileFlags = fileFlags};
+    if (threads > convert.nfiles)
+    {
+        threads = convert.nfiles;
+    }
+    pthread_t *workers = malloc((size_t)threads * sizeof(pthread_t));
+    if (workers == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+    long started = 0;
+    while (started < threads - 1 && pthread_create(&workers[started], NULL, convertThread, &convert) == 0)
+    {
+        started++;
+    }
+    convertThread(&convert); // The last of the threads, and all of them if no other started
+    for (long i = 0; i < started; i++)
+    {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    return atomic_load(&convert.failed) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
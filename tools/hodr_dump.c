@@ -0,0 +1,72 @@
+// Standalone reader for HODR data files.
+//
+// Writes every spectrum of a data file, plain or packed, in the legacy CSV
+// format, one spectrum per line. Needs nothing of the daemon but the store
+// and the codec:
+//
+//     make tools && tools/hodr_dump DATA_FILE > data.csv
+
+#include "store.h"
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+int main(int argc, char **argv)
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "Usage: %s DATA_FILE > data.csv\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    log_setLevel(LOG_LEVEL_WARN); // Only the CSV on stdout
+
+    FILE *file = fopen(argv[1], "rb");
+    HODR_FileHeader_t fileHeader;
+    if (file == NULL || fread(&fileHeader, sizeof(fileHeader), 1, file) != 1 || store_readFileHeader(fileno(file), &fileHeader) != 0)
+    {
+        fprintf(stderr, "%s is not a HODR data file.\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    fseek(file, fileHeader.headerSize, SEEK_SET);
+
+    size_t npixels = fileHeader.xpixels;
+    void *payload = malloc(HODR_RECORD_MAX_PAYLOAD(npixels));
+    int32_t *data = malloc(npixels * sizeof(int32_t));
+    if (payload == NULL || data == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+
+    HODR_RecordHeader_t header;
+    long spectra = 0;
+    while (fread(&header, sizeof(header), 1, file) == 1)
+    {
+        if (header.magic != HODR_RECORD_MAGIC || header.payloadBytes > HODR_RECORD_MAX_PAYLOAD(npixels))
+        {
+            fprintf(stderr, "Corrupt record header after spectrum %ld.\n", spectra);
+            return EXIT_FAILURE;
+        }
+        if (fread(payload, 1, header.payloadBytes, file) != header.payloadBytes)
+        {
+            break; // Partially written record
+        }
+        if (header.flags & HODR_RECORD_GAP)
+        {
+            continue;
+        }
+        if (store_crc32(0, payload, header.payloadBytes) != header.checksum || store_decodePayload(&header, payload, data, npixels) < 0)
+        {
+            fprintf(stderr, "Corrupt spectrum %u.\n", header.spectrumID);
+            return EXIT_FAILURE;
+        }
+        if (store_writeCsvLine(stdout, &header, data) != 0)
+        {
+            return EXIT_FAILURE;
+        }
+        spectra++;
+    }
+    fclose(file);
+    free(payload);
+    free(data);
+    return EXIT_SUCCESS;
+}